@@ -19,6 +19,10 @@
 #define mDNS_InstantiateInlines 1
 #include "DNSCommon.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>		// For comparing domain names sixteen bytes at a time
+#endif
+
 // Disable certain benign warnings with Microsoft compilers
 #if (defined(_MSC_VER))
 	// Disable "conditional expression is constant" warning for debug macros.
@@ -329,40 +333,64 @@ mDNSexport mDNSBool mDNSAddrIsDNSMulticast(const mDNSAddr *ip)
 #pragma mark - Domain Name Utility Functions
 #endif
 
+#if defined(__SSE2__)
+mDNSlocal __m128i FoldCase16(const __m128i x)
+	{
+	const __m128i d     = _mm_sub_epi8(x, _mm_set1_epi8('A'));
+	const __m128i upper = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(25)), d);	// 0xFF where x is 'A'-'Z'
+	return(_mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20))));
+	}
+#endif
+
 mDNSexport mDNSBool SameDomainLabel(const mDNSu8 *a, const mDNSu8 *b)
 	{
-	int i;
+	int i = 0;
 	const int len = *a++;
 
 	if (len > MAX_DOMAIN_LABEL)
 		{ debugf("Malformed label (too long)"); return(mDNSfalse); }
 
 	if (len != *b++) return(mDNSfalse);
-	for (i=0; i<len; i++)
-		{
-		mDNSu8 ac = *a++;
-		mDNSu8 bc = *b++;
-		if (mDNSIsUpperCase(ac)) ac += 'a' - 'A';
-		if (mDNSIsUpperCase(bc)) bc += 'a' - 'A';
-		if (ac != bc) return(mDNSfalse);
-		}
+
+	// Most bytes we compare are identical, so only fold case when they're not
+	for (; i<len; i++)
+		if (a[i] != b[i] && mDNSFoldCase(a[i]) != mDNSFoldCase(b[i])) return(mDNSfalse);
+
 	return(mDNStrue);
 	}
 
+// Label length bytes are at most 63, so folding case never changes one, nor makes one equal to a letter. Two
+// names of the same length whose bytes all match after folding therefore have the same labels, and we can
+// compare them as flat strings, which lets us do sixteen bytes at a time however short the labels are.
 mDNSexport mDNSBool SameDomainName(const domainname *const d1, const domainname *const d2)
 	{
-	const mDNSu8 *      a   = d1->c;
-	const mDNSu8 *      b   = d2->c;
-	const mDNSu8 *const max = d1->c + MAX_DOMAIN_NAME;			// Maximum that's valid
+	const mDNSu8 *const a   = d1->c;
+	const mDNSu8 *const b   = d2->c;
+	const mDNSu16       len = DomainNameLength(d1);
+	int i = 0;
 
-	while (*a || *b)
-		{
-		if (a + 1 + *a >= max)
-			{ debugf("Malformed domain name (more than 256 characters)"); return(mDNSfalse); }
-		if (!SameDomainLabel(a, b)) return(mDNSfalse);
-		a += 1 + *a;
-		b += 1 + *b;
-		}
+	if (len > MAX_DOMAIN_NAME)
+		{ debugf("Malformed domain name (more than 256 characters)"); return(mDNSfalse); }
+	if (DomainNameLength(d2) != len) return(mDNSfalse);
+
+#if defined(__SSE2__)
+	// We only load bytes within the two names; a final partial chunk overlaps the one before it instead
+	if (len >= 16)
+		for (;;)
+			{
+			const __m128i av = _mm_loadu_si128((const __m128i *)(a + i));
+			const __m128i bv = _mm_loadu_si128((const __m128i *)(b + i));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(av, bv)) != 0xFFFF &&
+				_mm_movemask_epi8(_mm_cmpeq_epi8(FoldCase16(av), FoldCase16(bv))) != 0xFFFF)
+				return(mDNSfalse);
+			if (i + 16 == len) return(mDNStrue);
+			i = (i + 32 <= len) ? i + 16 : len - 16;
+			}
+#endif
+
+	// Most bytes we compare are identical, so only fold case when they're not
+	for (; i<len; i++)
+		if (a[i] != b[i] && mDNSFoldCase(a[i]) != mDNSFoldCase(b[i])) return(mDNSfalse);
 
 	return(mDNStrue);
 	}
@@ -1370,8 +1398,30 @@ mDNSexport mDNSBool ValidateRData(const mDNSu16 rrtype, const mDNSu16 rdlength,
 #pragma mark - DNS Message Creation Functions
 #endif
 
+// The message (if any) for which putDomainNameAsLabels maintains a name compression dictionary.
+// The core builds nearly all of its outgoing packets in m->omsg, and registers that buffer via SetCompressionDict()
+// at init time; names written into any other message buffer fall back to the FindCompressionPointer() scan.
+mDNSlocal DNSCompressionDict *CompressionDict = mDNSNULL;
+
+#define CompressionDictSlot(H) (((H) ^ ((H) >> 11)) % COMPRESSION_HASH_SLOTS)
+
+mDNSlocal void ResetCompressionDict(DNSCompressionDict *const dict)
+	{
+	dict->count    = 0;
+	dict->overflow = mDNSfalse;
+	mDNSPlatformMemZero(dict->head, sizeof(dict->head));
+	}
+
+mDNSexport void SetCompressionDict(DNSCompressionDict *const dict, const DNSMessage *const msg)
+	{
+	CompressionDict = dict;
+	if (dict) { dict->msg = msg; ResetCompressionDict(dict); }
+	}
+
 mDNSexport void InitializeDNSMessage(DNSMessageHeader *h, mDNSOpaque16 id, mDNSOpaque16 flags)
 	{
+	// Starting a new message in the registered buffer invalidates everything the dictionary knows about it
+	if (CompressionDict && h == &CompressionDict->msg->h) ResetCompressionDict(CompressionDict);
 	h->id             = id;
 	h->flags          = flags;
 	h->numQuestions   = 0;
@@ -1380,6 +1430,34 @@ mDNSexport void InitializeDNSMessage(DNSMessageHeader *h, mDNSOpaque16 id, mDNSO
 	h->numAdditionals = 0;
 	}
 
+// Returns true if the name found at position targ in the message (following any compression pointers) is domname
+mDNSlocal mDNSBool CompressionTargetMatches(const mDNSu8 *const base, const mDNSu8 *const end, const mDNSu8 *targ, const mDNSu8 *const domname)
+	{
+	const mDNSu8 *name = domname;
+	while (targ + *name < end)
+		{
+		// First see if this label matches
+		int i;
+		const mDNSu8 *pointertarget;
+		for (i=0; i <= *name; i++) if (targ[i] != name[i]) break;
+		if (i <= *name) return(mDNSfalse);				// If label did not match, bail out
+		targ += 1 + *name;								// Else, did match, so advance target pointer
+		name += 1 + *name;								// and proceed to check next label
+		if (*name == 0 && *targ == 0) return(mDNStrue);	// If no more labels, we found a match!
+		if (*name == 0) return(mDNSfalse);				// If no more labels to match, we failed, so bail out
+
+		// The label matched, so now follow the pointer (if appropriate) and then see if the next label matches
+		if (targ[0] < 0x40) continue;					// If length value, continue to check next label
+		if (targ[0] < 0xC0) return(mDNSfalse);			// If 40-BF, not valid
+		if (targ+1 >= end) return(mDNSfalse);			// Second byte not present!
+		pointertarget = base + (((mDNSu16)(targ[0] & 0x3F)) << 8) + targ[1];
+		if (targ < pointertarget) return(mDNSfalse);	// Pointertarget must point *backwards* in the packet
+		if (pointertarget[0] >= 0x40) return(mDNSfalse);	// Pointertarget must point to a valid length byte
+		targ = pointertarget;
+		}
+	return(mDNSfalse);
+	}
+
 mDNSexport const mDNSu8 *FindCompressionPointer(const mDNSu8 *const base, const mDNSu8 *const end, const mDNSu8 *const domname)
 	{
 	const mDNSu8 *result = end - *domname - 1;
@@ -1391,37 +1469,77 @@ mDNSexport const mDNSu8 *FindCompressionPointer(const mDNSu8 *const base, const
 		{
 		// If the length byte and first character of the label match, then check further to see
 		// if this location in the packet will yield a useful name compression pointer.
-		if (result[0] == domname[0] && result[1] == domname[1])
-			{
-			const mDNSu8 *name = domname;
-			const mDNSu8 *targ = result;
-			while (targ + *name < end)
-				{
-				// First see if this label matches
-				int i;
-				const mDNSu8 *pointertarget;
-				for (i=0; i <= *name; i++) if (targ[i] != name[i]) break;
-				if (i <= *name) break;							// If label did not match, bail out
-				targ += 1 + *name;								// Else, did match, so advance target pointer
-				name += 1 + *name;								// and proceed to check next label
-				if (*name == 0 && *targ == 0) return(result);	// If no more labels, we found a match!
-				if (*name == 0) break;							// If no more labels to match, we failed, so bail out
-
-				// The label matched, so now follow the pointer (if appropriate) and then see if the next label matches
-				if (targ[0] < 0x40) continue;					// If length value, continue to check next label
-				if (targ[0] < 0xC0) break;						// If 40-BF, not valid
-				if (targ+1 >= end) break;						// Second byte not present!
-				pointertarget = base + (((mDNSu16)(targ[0] & 0x3F)) << 8) + targ[1];
-				if (targ < pointertarget) break;				// Pointertarget must point *backwards* in the packet
-				if (pointertarget[0] >= 0x40) break;			// Pointertarget must point to a valid length byte
-				targ = pointertarget;
-				}
-			}
+		if (result[0] == domname[0] && result[1] == domname[1] && CompressionTargetMatches(base, end, result, domname))
+			return(result);
 		result--;	// We failed to match at this search position, so back up the tentative result pointer and try again
 		}
 	return(mDNSNULL);
 	}
 
+// Computes, for each label i of name, a hash of the suffix of name starting at that label, so that the
+// dictionary can be probed for "a.b.local", "b.local" and "local" without rehashing each one from scratch.
+// Stops at the first malformed label; putDomainNameAsLabels rejects the name before reaching that point.
+mDNSlocal void CompressionSuffixHashes(const domainname *const name, mDNSu32 *const hash)
+	{
+	mDNSu8 labeloffset[MAX_DOMAIN_NAME/2];
+	const mDNSu8 *const max = name->c + MAX_DOMAIN_NAME;
+	const mDNSu8 *p = name->c;
+	mDNSu32 h = 0;
+	int n = 0;
+
+	while (*p && *p <= MAX_DOMAIN_LABEL && p + 1 + *p < max && n < (int)sizeof(labeloffset))
+		{ labeloffset[n++] = (mDNSu8)(p - name->c); p += 1 + *p; }
+
+	while (n--)
+		{
+		const mDNSu8 *const label = name->c + labeloffset[n];
+		int i;
+		for (i=0; i <= *label; i++) h = h * 37 + label[i];
+		hash[n] = h;
+		}
+	}
+
+// Returns the latest position in the message before end at which the name domname can be found,
+// or mDNSNULL if there is none. Every hit is verified against the message bytes, so entries left over
+// from labels that were later rolled back (e.g. a record that didn't fit) can never yield a bad pointer.
+mDNSlocal const mDNSu8 *FindCompressionDictEntry(const DNSCompressionDict *const dict, const mDNSu8 *const end,
+	const mDNSu8 *const domname, const mDNSu32 hash)
+	{
+	const mDNSu8 *const base = (const mDNSu8 *)dict->msg;
+	const mDNSu8 *result = mDNSNULL;
+	mDNSu16 e;
+
+	if (*domname == 0) return(mDNSNULL);	// There's no point trying to match just the root label
+
+	for (e = dict->head[CompressionDictSlot(hash)]; e; e = dict->next[e-1])
+		{
+		const mDNSu8 *const targ = base + dict->offset[e-1];
+		if (dict->hash[e-1] == hash && targ + *domname < end && (!result || targ > result) &&
+			CompressionTargetMatches(base, end, targ, domname))
+			result = targ;
+		}
+
+	// If we ran out of entries, names written after that point are only findable by scanning
+	if (!result && dict->overflow) result = FindCompressionPointer(base, end, domname);
+	return(result);
+	}
+
+mDNSlocal void AddCompressionDictEntry(DNSCompressionDict *const dict, const mDNSu8 *const where, const mDNSu32 hash)
+	{
+	const mDNSu32 offset = (mDNSu32)(where - (const mDNSu8 *)dict->msg);
+	const mDNSu32 slot   = CompressionDictSlot(hash);
+	const mDNSu16 n      = dict->count;
+
+	// Offsets beyond 0x3FFF can't be the target of a compression pointer anyway
+	if (n >= COMPRESSION_MAX_ENTRIES || offset > 0x3FFF) { dict->overflow = mDNStrue; return; }
+
+	dict->hash  [n]    = hash;
+	dict->offset[n]    = (mDNSu16)offset;
+	dict->next  [n]    = dict->head[slot];
+	dict->head  [slot] = (mDNSu16)(n + 1);
+	dict->count++;
+	}
+
 // Put a string of dot-separated labels as length-prefixed labels
 // domainname is a fully-qualified name (i.e. assumed to be ending in a dot, even if it doesn't)
 // msg points to the message we're building (pass mDNSNULL if we don't want to use compression pointers)
@@ -1437,9 +1555,14 @@ mDNSexport mDNSu8 *putDomainNameAsLabels(const DNSMessage *const msg,
 	const mDNSu8 *const max         = name->c + MAX_DOMAIN_NAME;	// Maximum that's valid
 	const mDNSu8 *      pointer     = mDNSNULL;
 	const mDNSu8 *const searchlimit = ptr;
+	DNSCompressionDict *const dict  = (base && CompressionDict && CompressionDict->msg == msg) ? CompressionDict : mDNSNULL;
+	mDNSu32 suffixhash[MAX_DOMAIN_NAME/2];
+	int label = 0;
 
 	if (!ptr) { LogMsg("putDomainNameAsLabels %##s ptr is null", name->c); return(mDNSNULL); }
 
+	if (dict) CompressionSuffixHashes(name, suffixhash);
+
 	if (!*np)		// If just writing one-byte root label, make sure we have space for that
 		{
 		if (ptr >= limit) return(mDNSNULL);
@@ -1462,7 +1585,8 @@ mDNSexport mDNSu8 *putDomainNameAsLabels(const DNSMessage *const msg,
 			if (np + 1 + *np >= max)
 				{ LogMsg("Malformed domain name %##s (more than 256 bytes)", name->c); return(mDNSNULL); }
 	
-			if (base) pointer = FindCompressionPointer(base, searchlimit, np);
+			if (dict) pointer = FindCompressionDictEntry(dict, searchlimit, np, suffixhash[label]);
+			else if (base) pointer = FindCompressionPointer(base, searchlimit, np);
 			if (pointer)					// Use a compression pointer if we can
 				{
 				const mDNSu16 offset = (mDNSu16)(pointer - base);
@@ -1477,6 +1601,8 @@ mDNSexport mDNSu8 *putDomainNameAsLabels(const DNSMessage *const msg,
 				mDNSu8 len = *np++;
 				// If we don't at least have enough space for this label *plus* a terminating zero on the end, give up
 				if (ptr + 1 + len >= limit) return(mDNSNULL);
+				if (dict) AddCompressionDictEntry(dict, ptr, suffixhash[label]);
+				label++;
 				*ptr++ = len;
 				for (i=0; i<len; i++) *ptr++ = *np++;
 				}
@@ -1841,11 +1967,10 @@ mDNSexport mDNSu32 DomainNameHashValue(const domainname *const name)
 
 	for (c = name->c; c[0] != 0 && c[1] != 0; c += 2)
 		{
-		sum += ((mDNSIsUpperCase(c[0]) ? c[0] + 'a' - 'A' : c[0]) << 8) |
-				(mDNSIsUpperCase(c[1]) ? c[1] + 'a' - 'A' : c[1]);
+		sum += ((mDNSu32)mDNSFoldCase(c[0]) << 8) | mDNSFoldCase(c[1]);
 		sum = (sum<<3) | (sum>>29);
 		}
-	if (c[0]) sum += ((mDNSIsUpperCase(c[0]) ? c[0] + 'a' - 'A' : c[0]) << 8);
+	if (c[0]) sum += ((mDNSu32)mDNSFoldCase(c[0]) << 8);
 	return(sum);
 	}
 
@@ -1958,6 +2083,75 @@ mDNSexport const mDNSu8 *skipResourceRecord(const DNSMessage *msg, const mDNSu8
 	return(ptr + pktrdlength);
 	}
 
+// Walks the record's name in place, following compression pointers, and computes the same hash that
+// DomainNameHashValue() would give for the decompressed name, but without copying it anywhere.
+// Accepts and rejects exactly the names getDomainName() does. Returns the first byte after the record.
+mDNSexport const mDNSu8 *PeekResourceRecord(const DNSMessage *const msg, const mDNSu8 *ptr, const mDNSu8 *const end, PacketRRView *const view)
+	{
+	const mDNSu8 *nextbyte = mDNSNULL;		// Record where we got to before we started following pointers
+	mDNSu16 total = 0;						// Length the decompressed name would have, not counting the root label
+	mDNSu32 sum = 0;
+	mDNSu8  pending = 0;					// DomainNameHashValue() consumes the name in pairs of bytes;
+	mDNSBool hashdone = mDNSfalse;			// this holds the first byte of a pair until we see the second
+
+	if (ptr < (mDNSu8*)msg || ptr >= end)
+		{ debugf("PeekResourceRecord: Illegal ptr not within packet boundaries"); return(mDNSNULL); }
+
+	view->start = ptr;
+
+	while (1)						// Read sequence of labels
+		{
+		const mDNSu8 len = *ptr++;	// Read length of this label
+		int i;
+		if (len == 0) break;		// If length is zero, that means this name is complete
+		switch (len & 0xC0)
+			{
+			case 0x00:	if (ptr + len >= end)					// Remember: expect at least one more byte for the root label
+							{ debugf("PeekResourceRecord: Malformed domain name (overruns packet end)"); return(mDNSNULL); }
+						if (total + 1 + len >= MAX_DOMAIN_NAME)	// Remember: expect at least one more byte for the root label
+							{ debugf("PeekResourceRecord: Malformed domain name (more than 256 characters)"); return(mDNSNULL); }
+						total += 1 + len;
+						for (i = -1; i < len && !hashdone; i++)	// i == -1 is the length byte itself
+							{
+							const mDNSu8 c = (i < 0) ? len : ptr[i];
+							const mDNSu8 l = mDNSFoldCase(c);
+							if (!pending) { if (c) pending = l; else hashdone = mDNStrue; }
+							else if (!c) { sum += ((mDNSu32)pending << 8); pending = 0; hashdone = mDNStrue; }
+							else { sum += ((mDNSu32)pending << 8) | l; sum = (sum<<3) | (sum>>29); pending = 0; }
+							}
+						ptr += len;
+						break;
+
+			case 0x40:	debugf("PeekResourceRecord: Extended EDNS0 label types 0x%X not supported", len); return(mDNSNULL);
+			case 0x80:	debugf("PeekResourceRecord: Illegal label length 0x%X", len); return(mDNSNULL);
+
+			case 0xC0:	{
+						const mDNSu16 offset = (mDNSu16)((((mDNSu16)(len & 0x3F)) << 8) | *ptr++);
+						if (!nextbyte) nextbyte = ptr;	// Record where we got to before we started following pointers
+						ptr = (mDNSu8 *)msg + offset;
+						if (ptr < (mDNSu8*)msg || ptr >= end)
+							{ debugf("PeekResourceRecord: Illegal compression pointer not within packet boundaries"); return(mDNSNULL); }
+						if (*ptr & 0xC0)
+							{ debugf("PeekResourceRecord: Compression pointer must point to real label"); return(mDNSNULL); }
+						}
+						break;
+			}
+		}
+	if (pending && !hashdone) sum += ((mDNSu32)pending << 8);	// Odd byte left over when we reached the root label
+	if (nextbyte) ptr = nextbyte;
+
+	if (ptr + 10 > end) { debugf("PeekResourceRecord: Malformed RR -- no type/class/ttl/len!"); return(mDNSNULL); }
+	view->namehash      = sum;
+	view->rrtype        = (mDNSu16) ((mDNSu16)ptr[0] <<  8 | ptr[1]);
+	view->rrclass       = (mDNSu16)(((mDNSu16)ptr[2] <<  8 | ptr[3]) & kDNSClass_Mask);
+	view->rroriginalttl = (mDNSu32) ((mDNSu32)ptr[4] << 24 | (mDNSu32)ptr[5] << 16 | (mDNSu32)ptr[6] << 8 | ptr[7]);
+	view->rdlength      = (mDNSu16) ((mDNSu16)ptr[8] <<  8 | ptr[9]);
+	view->rdata         = ptr + 10;
+	if (view->rdata + view->rdlength > end) { debugf("PeekResourceRecord: RDATA exceeds end of packet"); return(mDNSNULL); }
+
+	return(view->rdata + view->rdlength);
+	}
+
 mDNSexport const mDNSu8 *GetLargeResourceRecord(mDNS *const m, const DNSMessage *const msg, const mDNSu8 *ptr,
     const mDNSu8 *end, const mDNSInterfaceID InterfaceID, mDNSu8 RecordType, LargeCacheRecord *const largecr)
 	{
@@ -2536,6 +2730,7 @@ mDNSlocal mDNSs32 GetNextScheduledEvent(const mDNS *const m)
 	if (m->NewLocalRecords && LocalRecordReady(m->NewLocalRecords)) return(m->timenow);
 	if (m->SPSProxyListChanged)                                     return(m->timenow);
 	if (m->LocalRemoveEvents)                                       return(m->timenow);
+	if (m->rrcache_oldhashslots)                                    return(m->timenow);
 #ifndef UNICAST_DISABLED
 	if (e - m->NextuDNSEvent         > 0) e = m->NextuDNSEvent;
 	if (e - m->NextScheduledNATOp    > 0) e = m->NextScheduledNATOp;
@@ -2581,6 +2776,8 @@ mDNSexport void ShowTaskSchedulingError(mDNS *const m)
 
 	if (m->SPSProxyListChanged) LogMsg("Task Scheduling Error: SPSProxyListChanged");
 	if (m->LocalRemoveEvents)   LogMsg("Task Scheduling Error: LocalRemoveEvents");
+	if (m->rrcache_oldhashslots)
+		LogMsg("Task Scheduling Error: Cache hash resize %lu/%lu", m->rrcache_rehashslot, m->rrcache_oldhashslots);
 
 	if (m->timenow - m->NextScheduledEvent    >= 0)
 		LogMsg("Task Scheduling Error: m->NextScheduledEvent %d",    m->timenow - m->NextScheduledEvent);
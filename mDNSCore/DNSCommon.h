@@ -106,6 +106,9 @@ extern mDNSu32 mDNSRandom(mDNSu32 max);		// Returns pseudo-random result from ze
 #define mDNSIsLowerCase(X) ((X) >= 'a' && (X) <= 'z')
 #define mDNSIsLetter(X)    (mDNSIsUpperCase(X) || mDNSIsLowerCase(X))
 
+// Lower-cases an ASCII letter without branching ('A'-'Z' differ from 'a'-'z' only in bit 5), leaving any other byte alone
+#define mDNSFoldCase(X)    ((mDNSu8)((X) | (((mDNSu8)((X) - 'A') < 26) << 5)))
+
 #define mDNSValidHostChar(X, notfirst, notlast) (mDNSIsLetter(X) || mDNSIsDigit(X) || ((notfirst) && (notlast) && (X) == '-') )
 
 extern mDNSu16 CompressedDomainNameLength(const domainname *const name, const domainname *parent);
@@ -182,6 +185,7 @@ extern mDNSBool ValidateRData(const mDNSu16 rrtype, const mDNSu16 rdlength, cons
 #endif
 
 extern void InitializeDNSMessage(DNSMessageHeader *h, mDNSOpaque16 id, mDNSOpaque16 flags);
+extern void SetCompressionDict(DNSCompressionDict *const dict, const DNSMessage *const msg);
 extern const mDNSu8 *FindCompressionPointer(const mDNSu8 *const base, const mDNSu8 *const end, const mDNSu8 *const domname);
 extern mDNSu8 *putDomainNameAsLabels(const DNSMessage *const msg, mDNSu8 *ptr, const mDNSu8 *const limit, const domainname *const name);
 extern mDNSu8 *putRData(const DNSMessage *const msg, mDNSu8 *ptr, const mDNSu8 *const limit, const ResourceRecord *const rr);
@@ -224,13 +228,19 @@ extern mDNSu8 *putHINFO(const mDNS *const m, DNSMessage *const msg, mDNSu8 *end,
 #pragma mark - DNS Message Parsing Functions
 #endif
 
-#define HashSlot(X) (DomainNameHashValue(X) % CACHE_HASH_SLOTS)
+// HashSlot assumes a local variable 'm' pointing to the mDNS object whose cache is being indexed
+#define HashSlot(X) CacheHashSlot(m, DomainNameHashValue(X))
+extern mDNSu32 CacheHashSlot(const mDNS *const m, const mDNSu32 namehash);
+#define QuestionHashSlot(H) ((H) % QUESTION_HASH_SLOTS)
+#define QuestionQIDSlot(ID) (mDNSVal16(ID) % QUESTION_QID_SLOTS)
 extern mDNSu32 DomainNameHashValue(const domainname *const name);
 extern void SetNewRData(ResourceRecord *const rr, RData *NewRData, mDNSu16 rdlength);
 extern const mDNSu8 *skipDomainName(const DNSMessage *const msg, const mDNSu8 *ptr, const mDNSu8 *const end);
 extern const mDNSu8 *getDomainName(const DNSMessage *const msg, const mDNSu8 *ptr, const mDNSu8 *const end,
 	domainname *const name);
 extern const mDNSu8 *skipResourceRecord(const DNSMessage *msg, const mDNSu8 *ptr, const mDNSu8 *end);
+
+extern const mDNSu8 *PeekResourceRecord(const DNSMessage *const msg, const mDNSu8 *ptr, const mDNSu8 *const end, PacketRRView *const view);
 extern const mDNSu8 *GetLargeResourceRecord(mDNS *const m, const DNSMessage * const msg, const mDNSu8 *ptr,
     const mDNSu8 * end, const mDNSInterfaceID InterfaceID, mDNSu8 RecordType, LargeCacheRecord *const largecr);
 extern const mDNSu8 *skipQuestion(const DNSMessage *msg, const mDNSu8 *ptr, const mDNSu8 *end);
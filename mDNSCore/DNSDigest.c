@@ -1129,6 +1129,238 @@ void md5_block_data_order (MD5_CTX *c, const void *data_, int num)
 #endif
 
 
+ // ***************************************************************************
+#if COMPILER_LIKES_PRAGMA_MARK
+#pragma mark - SHA-256 Hash Functions
+#endif
+
+// SHA-256 (FIPS 180-2), used for HMAC-SHA256 TSIG (RFC 4635).
+// On x86 built with GCC or clang we also compile a block function using the SHA extensions, and use it if
+// the processor supports them; everywhere else (or with -DSHA256_NO_SHANI) the portable block function is used.
+
+#define SHA256_CBLOCK 64
+
+typedef void SHA256BlockFunction(mDNSu32 h[8], const mDNSu8 *data, mDNSu32 num);
+
+typedef struct
+	{
+	mDNSu32 h[8];
+	mDNSu32 Nl, Nh;						// Message length in bits, low and high words
+	mDNSu8  data[SHA256_CBLOCK];
+	mDNSu32 num;						// Number of bytes in data
+	SHA256BlockFunction *block;			// Set by SHA256_Init; DNSDigest_SelfTest substitutes each block function in turn
+	} SHA256_CTX;
+
+static const mDNSu32 SHA256_K[64] =
+	{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+	};
+
+#define SHA256_ROTR(x,n)  (((x) >> (n)) | ((x) << (32 - (n))))
+#define SHA256_S0(x)      (SHA256_ROTR((x),  2) ^ SHA256_ROTR((x), 13) ^ SHA256_ROTR((x), 22))
+#define SHA256_S1(x)      (SHA256_ROTR((x),  6) ^ SHA256_ROTR((x), 11) ^ SHA256_ROTR((x), 25))
+#define SHA256_s0(x)      (SHA256_ROTR((x),  7) ^ SHA256_ROTR((x), 18) ^ ((x) >>  3))
+#define SHA256_s1(x)      (SHA256_ROTR((x), 17) ^ SHA256_ROTR((x), 19) ^ ((x) >> 10))
+#define SHA256_Ch(x,y,z)  (((x) & (y)) ^ (~(x) & (z)))
+#define SHA256_Maj(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+// One round, with the working variables named by position rather than shuffled on every round
+#define SHA256_ROUND(a,b,c,d,e,f,g,h,i) do { \
+	mDNSu32 t1 = (h) + SHA256_S1(e) + SHA256_Ch((e),(f),(g)) + SHA256_K[(i)] + W[(i) & 15]; \
+	(d) += t1; \
+	(h)  = t1 + SHA256_S0(a) + SHA256_Maj((a),(b),(c)); \
+	} while (0)
+
+mDNSlocal void sha256_block_portable(mDNSu32 state[8], const mDNSu8 *data, mDNSu32 num)
+	{
+	mDNSu32 W[16];
+	int i;
+
+	while (num--)
+		{
+		mDNSu32 a = state[0], b = state[1], c = state[2], d = state[3];
+		mDNSu32 e = state[4], f = state[5], g = state[6], h = state[7];
+
+		for (i = 0; i < 64; i += 8)
+			{
+			int j;
+			for (j = i; j < i + 8; j++)
+				{
+				if (j < 16) W[j] = NToH32((mDNSu8 *)data + 4 * j);
+				else W[j & 15] += SHA256_s1(W[(j - 2) & 15]) + W[(j - 7) & 15] + SHA256_s0(W[(j - 15) & 15]);
+				}
+			SHA256_ROUND(a,b,c,d,e,f,g,h,i  );
+			SHA256_ROUND(h,a,b,c,d,e,f,g,i+1);
+			SHA256_ROUND(g,h,a,b,c,d,e,f,i+2);
+			SHA256_ROUND(f,g,h,a,b,c,d,e,i+3);
+			SHA256_ROUND(e,f,g,h,a,b,c,d,i+4);
+			SHA256_ROUND(d,e,f,g,h,a,b,c,i+5);
+			SHA256_ROUND(c,d,e,f,g,h,a,b,i+6);
+			SHA256_ROUND(b,c,d,e,f,g,h,a,i+7);
+			}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+		data += SHA256_CBLOCK;
+		}
+	}
+
+#if !defined(SHA256_NO_SHANI) && (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || __GNUC__ >= 5)
+#define SHA256_SHANI 1
+#include <immintrin.h>
+#include <cpuid.h>
+
+// Processes four rounds per step with the SHA-NI instructions. The state is kept in the ABEF/CDGH
+// register layout the instructions expect, and converted back to A..H when we're done.
+__attribute__((target("sha,sse4.1,ssse3")))
+mDNSlocal void sha256_block_shani(mDNSu32 state[8], const mDNSu8 *data, mDNSu32 num)
+	{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+	__m128i w[4], msg, tmp, abef, cdgh, abef_save, cdgh_save;
+	int i;
+
+	tmp  = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);	// CDAB
+	cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);	// EFGH
+	abef = _mm_alignr_epi8(tmp, cdgh, 8);											// ABEF
+	cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);										// CDGH
+
+	while (num--)
+		{
+		abef_save = abef;
+		cdgh_save = cdgh;
+		for (i = 0; i < 16; i++)
+			{
+			if (i < 4) w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), bswap);
+			else w[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]),
+				_mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4)), w[(i + 3) & 3]);
+			msg  = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&SHA256_K[4 * i]));
+			cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+			abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0E));
+			}
+		abef = _mm_add_epi32(abef, abef_save);
+		cdgh = _mm_add_epi32(cdgh, cdgh_save);
+		data += SHA256_CBLOCK;
+		}
+
+	tmp  = _mm_shuffle_epi32(abef, 0x1B);		// FEBA
+	cdgh = _mm_shuffle_epi32(cdgh, 0xB1);		// DCHG
+	_mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, cdgh, 0xF0));	// DCBA
+	_mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(cdgh, tmp, 8));		// HGFE
+	}
+
+mDNSlocal mDNSBool SHA256_CPUHasSHANI(void)
+	{
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid_max(0, mDNSNULL) < 7) return(mDNSfalse);
+	__cpuid(1, eax, ebx, ecx, edx);
+	if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) return(mDNSfalse);
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return((ebx & (1U << 29)) != 0);			// CPUID.(EAX=7,ECX=0):EBX.SHA[bit 29]
+	}
+#endif
+
+// Chosen on first use. Several dnsextd worker threads may race to set this, but they all store the same value.
+// A broken SHA-NI path would only show up on hardware that has the instructions, so before using it we check that
+// it computes the same state as the portable function (which DNSDigest_SelfTest checks against the FIPS vectors).
+mDNSlocal SHA256BlockFunction *SHA256_Block(void)
+	{
+	static SHA256BlockFunction *block = mDNSNULL;
+	if (!block)
+		{
+#ifdef SHA256_SHANI
+		if (SHA256_CPUHasSHANI())
+			{
+			mDNSu32 a[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+			mDNSu32 b[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+			sha256_block_portable(a, (const mDNSu8 *)SHA256_K, sizeof(SHA256_K) / SHA256_CBLOCK);
+			sha256_block_shani  (b, (const mDNSu8 *)SHA256_K, sizeof(SHA256_K) / SHA256_CBLOCK);
+			if (mDNSPlatformMemSame(a, b, sizeof(a))) block = sha256_block_shani;
+			else LogMsg("SHA256_Block: SHA-NI block function gives the wrong answer; using the portable one");
+			}
+		if (!block)
+#endif
+		block = sha256_block_portable;
+		}
+	return(block);
+	}
+
+mDNSlocal void SHA256_Init(SHA256_CTX *c)
+	{
+	c->h[0] = 0x6a09e667; c->h[1] = 0xbb67ae85; c->h[2] = 0x3c6ef372; c->h[3] = 0xa54ff53a;
+	c->h[4] = 0x510e527f; c->h[5] = 0x9b05688c; c->h[6] = 0x1f83d9ab; c->h[7] = 0x5be0cd19;
+	c->Nl = c->Nh = 0;
+	c->num = 0;
+	c->block = SHA256_Block();
+	}
+
+mDNSlocal void SHA256_Update(SHA256_CTX *c, const void *data_, unsigned long len)
+	{
+	const mDNSu8 *data = (const mDNSu8 *)data_;
+	SHA256BlockFunction *block = c->block;
+	mDNSu32 l = c->Nl + (((mDNSu32)len) << 3);
+
+	if (l < c->Nl) c->Nh++;
+	c->Nh += (mDNSu32)(len >> 29);
+	c->Nl = l;
+
+	if (c->num)
+		{
+		mDNSu32 n = SHA256_CBLOCK - c->num;
+		if (len < n) { mDNSPlatformMemCopy(c->data + c->num, data, len); c->num += (mDNSu32)len; return; }
+		mDNSPlatformMemCopy(c->data + c->num, data, n);
+		block(c->h, c->data, 1);
+		data += n;
+		len  -= n;
+		c->num = 0;
+		}
+	if (len >= SHA256_CBLOCK)
+		{
+		mDNSu32 blocks = (mDNSu32)(len / SHA256_CBLOCK);
+		block(c->h, data, blocks);
+		data += blocks * SHA256_CBLOCK;
+		len  -= blocks * SHA256_CBLOCK;
+		}
+	if (len) { mDNSPlatformMemCopy(c->data, data, len); c->num = (mDNSu32)len; }
+	}
+
+mDNSlocal void SHA256_Final(mDNSu8 *md, SHA256_CTX *c)
+	{
+	SHA256BlockFunction *block = c->block;
+	mDNSu32 n = c->num;
+	int i;
+
+	c->data[n++] = 0x80;
+	if (n > SHA256_CBLOCK - 8)
+		{
+		mDNSPlatformMemZero(c->data + n, SHA256_CBLOCK - n);
+		block(c->h, c->data, 1);
+		n = 0;
+		}
+	mDNSPlatformMemZero(c->data + n, SHA256_CBLOCK - 8 - n);
+	for (i = 0; i < 4; i++)
+		{
+		c->data[SHA256_CBLOCK - 8 + i] = (mDNSu8)(c->Nh >> (24 - 8 * i));
+		c->data[SHA256_CBLOCK - 4 + i] = (mDNSu8)(c->Nl >> (24 - 8 * i));
+		}
+	block(c->h, c->data, 1);
+
+	for (i = 0; i < 8; i++)
+		{
+		md[4 * i    ] = (mDNSu8)(c->h[i] >> 24);
+		md[4 * i + 1] = (mDNSu8)(c->h[i] >> 16);
+		md[4 * i + 2] = (mDNSu8)(c->h[i] >>  8);
+		md[4 * i + 3] = (mDNSu8)(c->h[i]      );
+		}
+	}
+
+
  // ***************************************************************************
 #if COMPILER_LIKES_PRAGMA_MARK
 #pragma mark - base64 -> binary conversion
@@ -1283,88 +1515,196 @@ mDNSlocal mDNSs32 DNSDigest_Base64ToBin(const char *src, mDNSu8 *target, mDNSu32
 #define HMAC_OPAD   0x5c
 #define MD5_LEN     16
 
-#define HMAC_MD5_AlgName (*(const domainname*) "\010" "hmac-md5" "\007" "sig-alg" "\003" "reg" "\003" "int")
+#define HMAC_MD5_AlgName    (*(const domainname*) "\010" "hmac-md5" "\007" "sig-alg" "\003" "reg" "\003" "int")
+#define HMAC_MD5_ShortName  (*(const domainname*) "\010" "hmac-md5")
+#define HMAC_SHA256_AlgName (*(const domainname*) "\013" "hmac-sha256")
+
+// The hash behind a DomainAuthInfo's HMAC. Both MD5 and SHA-256 use 64-byte blocks, so after the key pad
+// has been digested the context is fully described by its chaining state plus a byte count of HMAC_LEN.
+typedef struct
+	{
+	mDNSu8 algorithm;
+	union { MD5_CTX md5; SHA256_CTX sha256; } u;
+	} DigestContext;
+
+// Start a hash, either from the algorithm's initial value, or (if state is non-NULL) from a saved key pad midstate
+mDNSlocal void Digest_Init(DigestContext *c, mDNSu8 algorithm, const mDNSu32 *state)
+	{
+	c->algorithm = algorithm;
+	if (algorithm == TSIG_HMAC_SHA256)
+		{
+		SHA256_Init(&c->u.sha256);
+		if (state)
+			{
+			mDNSPlatformMemCopy(c->u.sha256.h, state, sizeof(c->u.sha256.h));
+			c->u.sha256.Nl = HMAC_LEN << 3;
+			}
+		}
+	else
+		{
+		MD5_Init(&c->u.md5);
+		if (state)
+			{
+			c->u.md5.A = state[0];
+			c->u.md5.B = state[1];
+			c->u.md5.C = state[2];
+			c->u.md5.D = state[3];
+			c->u.md5.Nl = HMAC_LEN << 3;
+			}
+		}
+	}
+
+mDNSlocal void Digest_Update(DigestContext *c, const void *data, mDNSu32 len)
+	{
+	if (c->algorithm == TSIG_HMAC_SHA256) SHA256_Update(&c->u.sha256, data, len);
+	else                                  MD5_Update(&c->u.md5, data, len);
+	}
+
+// Returns the digest length
+mDNSlocal mDNSu32 Digest_Final(mDNSu8 *md, DigestContext *c)
+	{
+	if (c->algorithm == TSIG_HMAC_SHA256) { SHA256_Final(md, &c->u.sha256); return(SHA256_LEN); }
+	else                                  { MD5_Final(md, &c->u.md5);       return(MD5_LEN);    }
+	}
+
+// Save the chaining state of a context that has digested exactly one key pad block
+mDNSlocal void Digest_SaveState(const DigestContext *c, mDNSu32 *state)
+	{
+	mDNSPlatformMemZero(state, 8 * sizeof(mDNSu32));
+	if (c->algorithm == TSIG_HMAC_SHA256) mDNSPlatformMemCopy(state, c->u.sha256.h, sizeof(c->u.sha256.h));
+	else { state[0] = c->u.md5.A; state[1] = c->u.md5.B; state[2] = c->u.md5.C; state[3] = c->u.md5.D; }
+	}
+
+mDNSlocal void HMAC_Init(DigestContext *c, const DomainAuthInfo *info)
+	{
+	Digest_Init(c, info->algorithm, info->ipad_state);
+	}
+
+// Finish the inner hash, then perform the outer hash (outer key pad, inner digest). Returns the digest length.
+mDNSlocal mDNSu32 HMAC_Final(mDNSu8 *digest, DigestContext *c, const DomainAuthInfo *info)
+	{
+	mDNSu32 len = Digest_Final(digest, c);
+	Digest_Init(c, info->algorithm, info->opad_state);
+	Digest_Update(c, digest, len);
+	return(Digest_Final(digest, c));
+	}
 
 // Adapted from Appendix, RFC 2104
-mDNSlocal void DNSDigest_ConstructHMACKey(DomainAuthInfo *info, const mDNSu8 *key, mDNSu32 len)		
+// The padded keys are only needed to compute the inner and outer midstates; we keep those rather than the pads,
+// so signing or verifying a message doesn't have to digest the two 64-byte key pads again
+mDNSlocal void DNSDigest_ConstructHMACKey(DomainAuthInfo *info, mDNSu8 algorithm, const mDNSu8 *key, mDNSu32 len)
 	{
-	MD5_CTX k;
-	mDNSu8 buf[MD5_LEN];
+	DigestContext k;
+	mDNSu8 buf[SHA256_LEN];
+	mDNSu8 ipad[HMAC_LEN];
+	mDNSu8 opad[HMAC_LEN];
 	int i;
 	
-	// If key is longer than HMAC_LEN reset it to MD5(key)
+	// If key is longer than HMAC_LEN reset it to H(key)
 	if (len > HMAC_LEN)
 		{
-		MD5_Init(&k);
-		MD5_Update(&k, key, len);
-		MD5_Final(buf, &k);
+		Digest_Init(&k, algorithm, mDNSNULL);
+		Digest_Update(&k, key, len);
+		len = Digest_Final(buf, &k);
 		key = buf;
-		len = MD5_LEN;
 		}
 
 	// store key in pads
-	mDNSPlatformMemZero(info->keydata_ipad, HMAC_LEN);
-	mDNSPlatformMemZero(info->keydata_opad, HMAC_LEN);
-	mDNSPlatformMemCopy(info->keydata_ipad, key, len);
-	mDNSPlatformMemCopy(info->keydata_opad, key, len);
+	mDNSPlatformMemZero(ipad, HMAC_LEN);
+	mDNSPlatformMemZero(opad, HMAC_LEN);
+	mDNSPlatformMemCopy(ipad, key, len);
+	mDNSPlatformMemCopy(opad, key, len);
 
 	// XOR key with ipad and opad values
 	for (i = 0; i < HMAC_LEN; i++)
 		{
-		info->keydata_ipad[i] ^= HMAC_IPAD;
-		info->keydata_opad[i] ^= HMAC_OPAD;
+		ipad[i] ^= HMAC_IPAD;
+		opad[i] ^= HMAC_OPAD;
 		}
 
+	// digest each pad and keep the resulting hash state
+	info->algorithm = algorithm;
+	Digest_Init(&k, algorithm, mDNSNULL);
+	Digest_Update(&k, ipad, HMAC_LEN);
+	Digest_SaveState(&k, info->ipad_state);
+	Digest_Init(&k, algorithm, mDNSNULL);
+	Digest_Update(&k, opad, HMAC_LEN);
+	Digest_SaveState(&k, info->opad_state);
+
+	mDNSPlatformMemZero(ipad, HMAC_LEN);
+	mDNSPlatformMemZero(opad, HMAC_LEN);
 	}
 
-mDNSexport mDNSs32 DNSDigest_ConstructHMACKeyfromBase64(DomainAuthInfo *info, const char *b64key)
+// Returns the TSIG_HMAC_* value for a TSIG algorithm name, or -1 if we don't support it
+mDNSlocal int DNSDigest_AlgorithmForName(const domainname *alg)
+	{
+	if (SameDomainName(alg, &HMAC_MD5_AlgName) || SameDomainName(alg, &HMAC_MD5_ShortName)) return(TSIG_HMAC_MD5);
+	if (SameDomainName(alg, &HMAC_SHA256_AlgName)) return(TSIG_HMAC_SHA256);
+	return(-1);
+	}
+
+mDNSlocal const domainname *DNSDigest_AlgorithmName(mDNSu8 algorithm)
+	{
+	return(algorithm == TSIG_HMAC_SHA256 ? &HMAC_SHA256_AlgName : &HMAC_MD5_AlgName);
+	}
+
+mDNSexport mDNSs32 DNSDigest_ConstructHMACKeyWithAlgorithm(DomainAuthInfo *info, const domainname *alg, const char *b64key)
 	{
 	mDNSu8 keybuf[1024];
-	mDNSs32 keylen = DNSDigest_Base64ToBin(b64key, keybuf, sizeof(keybuf));
+	mDNSs32 keylen;
+	int algorithm = DNSDigest_AlgorithmForName(alg);
+	if (algorithm < 0) { LogMsg("DNSDigest_ConstructHMACKeyWithAlgorithm: TSIG algorithm not supported: %##s", alg->c); return(-1); }
+	keylen = DNSDigest_Base64ToBin(b64key, keybuf, sizeof(keybuf));
 	if (keylen < 0) return(keylen);
-	DNSDigest_ConstructHMACKey(info, keybuf, (mDNSu32)keylen);
+	DNSDigest_ConstructHMACKey(info, (mDNSu8)algorithm, keybuf, (mDNSu32)keylen);
+	mDNSPlatformMemZero(keybuf, sizeof(keybuf));
 	return(keylen);
 	}
 
+mDNSexport mDNSs32 DNSDigest_ConstructHMACKeyfromBase64(DomainAuthInfo *info, const char *b64key)
+	{
+	return(DNSDigest_ConstructHMACKeyWithAlgorithm(info, &HMAC_MD5_AlgName, b64key));
+	}
+
 mDNSexport void DNSDigest_SignMessage(DNSMessage *msg, mDNSu8 **end, DomainAuthInfo *info, mDNSu16 tcode)
 	{
 	AuthRecord tsig;
 	mDNSu8  *rdata, *const countPtr = (mDNSu8 *)&msg->h.numAdditionals;	// Get existing numAdditionals value
 	mDNSu32 utc32;
 	mDNSu8 utc48[6];
-	mDNSu8 digest[MD5_LEN];
+	mDNSu8 digest[SHA256_LEN];
 	mDNSu8 *ptr = *end;
-	mDNSu32 len;
+	mDNSu32 len, digestlen;
 	mDNSOpaque16 buf;
-	MD5_CTX c;
+	DigestContext c;
+	const domainname *const algname = DNSDigest_AlgorithmName(info->algorithm);
 	mDNSu16 numAdditionals = (mDNSu16)((mDNSu16)countPtr[0] << 8 | countPtr[1]);
 	
-	// Init MD5 context, digest inner key pad and message
-    MD5_Init(&c);
-    MD5_Update(&c, info->keydata_ipad, HMAC_LEN);
-	MD5_Update(&c, (mDNSu8 *)msg, (unsigned long)(*end - (mDNSu8 *)msg));
+	// Start from the inner key pad midstate, and digest message
+	HMAC_Init(&c, info);
+	Digest_Update(&c, (mDNSu8 *)msg, (mDNSu32)(*end - (mDNSu8 *)msg));
 	   
 	// Construct TSIG RR, digesting variables as apporpriate
 	mDNS_SetupResourceRecord(&tsig, mDNSNULL, 0, kDNSType_TSIG, 0, kDNSRecordTypeKnownUnique, mDNSNULL, mDNSNULL);
 
 	// key name
 	AssignDomainName(&tsig.namestorage, &info->keyname);
-	MD5_Update(&c, info->keyname.c, DomainNameLength(&info->keyname));
+	Digest_Update(&c, info->keyname.c, DomainNameLength(&info->keyname));
 
 	// class
 	tsig.resrec.rrclass = kDNSQClass_ANY;
 	buf = mDNSOpaque16fromIntVal(kDNSQClass_ANY);
-	MD5_Update(&c, buf.b, sizeof(mDNSOpaque16));
+	Digest_Update(&c, buf.b, sizeof(mDNSOpaque16));
 
 	// ttl
 	tsig.resrec.rroriginalttl = 0;
-	MD5_Update(&c, (mDNSu8 *)&tsig.resrec.rroriginalttl, sizeof(tsig.resrec.rroriginalttl));
+	Digest_Update(&c, (mDNSu8 *)&tsig.resrec.rroriginalttl, sizeof(tsig.resrec.rroriginalttl));
 	
 	// alg name
-	AssignDomainName(&tsig.resrec.rdata->u.name, &HMAC_MD5_AlgName);
-	len = DomainNameLength(&HMAC_MD5_AlgName);
+	AssignDomainName(&tsig.resrec.rdata->u.name, algname);
+	len = DomainNameLength(algname);
 	rdata = tsig.resrec.rdata->u.data + len;
-	MD5_Update(&c, HMAC_MD5_AlgName.c, len);
+	Digest_Update(&c, algname->c, len);
 
 	// time
 	// get UTC (universal time), convert to 48-bit unsigned in network byte order
@@ -1379,36 +1719,30 @@ mDNSexport void DNSDigest_SignMessage(DNSMessage *msg, mDNSu8 **end, DomainAuthI
 
 	mDNSPlatformMemCopy(rdata, utc48, 6);
 	rdata += 6;              	
-	MD5_Update(&c, utc48, 6);
+	Digest_Update(&c, utc48, 6);
 
 	// 300 sec is fudge recommended in RFC 2485
 	rdata[0] = (mDNSu8)((300 >> 8)  & 0xff);
 	rdata[1] = (mDNSu8)( 300        & 0xff);
-	MD5_Update(&c, rdata, sizeof(mDNSOpaque16));
+	Digest_Update(&c, rdata, sizeof(mDNSOpaque16));
 	rdata += sizeof(mDNSOpaque16);
 
 	// digest error (tcode) and other data len (zero) - we'll add them to the rdata later
 	buf.b[0] = (mDNSu8)((tcode >> 8) & 0xff);
 	buf.b[1] = (mDNSu8)( tcode       & 0xff);
-	MD5_Update(&c, buf.b, sizeof(mDNSOpaque16));  // error
+	Digest_Update(&c, buf.b, sizeof(mDNSOpaque16));  // error
 	buf.NotAnInteger = 0;
-	MD5_Update(&c, buf.b, sizeof(mDNSOpaque16));  // other data len
+	Digest_Update(&c, buf.b, sizeof(mDNSOpaque16));  // other data len
 
-	// finish the message & tsig var hash
-    MD5_Final(digest, &c);
-	
-	// perform outer MD5 (outer key pad, inner digest)
-	MD5_Init(&c);
-	MD5_Update(&c, info->keydata_opad, HMAC_LEN);
-	MD5_Update(&c, digest, MD5_LEN);
-	MD5_Final(digest, &c);
+	// finish the message & tsig var hash, and perform the outer hash from the outer key pad midstate
+	digestlen = HMAC_Final(digest, &c, info);
 
 	// set remaining rdata fields
-	rdata[0] = (mDNSu8)((MD5_LEN >> 8)  & 0xff);
-	rdata[1] = (mDNSu8)( MD5_LEN        & 0xff);
+	rdata[0] = (mDNSu8)((digestlen >> 8)  & 0xff);
+	rdata[1] = (mDNSu8)( digestlen        & 0xff);
 	rdata += sizeof(mDNSOpaque16);
-	mDNSPlatformMemCopy(rdata, digest, MD5_LEN);                          // MAC
-	rdata += MD5_LEN;
+	mDNSPlatformMemCopy(rdata, digest, digestlen);                        // MAC
+	rdata += digestlen;
 	rdata[0] = msg->h.id.b[0];                                            // original ID
 	rdata[1] = msg->h.id.b[1];
 	rdata[2] = (mDNSu8)((tcode >> 8) & 0xff);
@@ -1431,22 +1765,23 @@ mDNSexport mDNSBool DNSDigest_VerifyMessage(DNSMessage *msg, mDNSu8 *end, LargeC
 	mDNSu8			*	ptr = (mDNSu8*) &lcr->r.resrec.rdata->u.data;
 	mDNSs32				now;
 	mDNSs32				then;
-	mDNSu8				thisDigest[MD5_LEN];
-	mDNSu8				thatDigest[MD5_LEN];
+	mDNSu8				thisDigest[SHA256_LEN];
+	mDNSu8				thatDigest[SHA256_LEN];
 	mDNSu32				macsize;
+	mDNSu32				digestlen;
 	mDNSOpaque16 		buf;
 	mDNSu8				utc48[6];
 	mDNSs32				delta;
 	mDNSu16				fudge;
 	domainname		*	algo;
-	MD5_CTX				c;
+	DigestContext		c;
 	mDNSBool			ok = mDNSfalse;
 
-	// We only support HMAC-MD5 for now
+	// The algorithm has to be the one this key was configured for
 
 	algo = (domainname*) ptr;
 
-	if (!SameDomainName(algo, &HMAC_MD5_AlgName))
+	if (DNSDigest_AlgorithmForName(algo) != info->algorithm)
 		{
 		LogMsg("ERROR: DNSDigest_VerifyMessage - TSIG algorithm not supported: %##s", algo->c);
 		*rcode = kDNSFlag1_RC_NotAuth;
@@ -1501,60 +1836,61 @@ mDNSexport mDNSBool DNSDigest_VerifyMessage(DNSMessage *msg, mDNSu8 *end, LargeC
 	
 	ptr += sizeof(mDNSu16);
 
+	if (macsize != (info->algorithm == TSIG_HMAC_SHA256 ? SHA256_LEN : MD5_LEN))
+		{
+		LogMsg("ERROR: DNSDigest_VerifyMessage - bad MAC size %d", macsize);
+		*rcode = kDNSFlag1_RC_NotAuth;
+		*tcode = TSIG_ErrBadSig;
+		ok = mDNSfalse;
+		goto exit;
+		}
+
 	// MAC
 
-	mDNSPlatformMemCopy(thatDigest, ptr, MD5_LEN);
+	mDNSPlatformMemCopy(thatDigest, ptr, macsize);
 
-	// Init MD5 context, digest inner key pad and message
+	// Start from the inner key pad midstate, and digest message
 
-	MD5_Init(&c);
-	MD5_Update(&c, info->keydata_ipad, HMAC_LEN);
-	MD5_Update(&c, (mDNSu8*) msg, (unsigned long)(end - (mDNSu8*) msg));
+	HMAC_Init(&c, info);
+	Digest_Update(&c, (mDNSu8*) msg, (mDNSu32)(end - (mDNSu8*) msg));
 	   
 	// Key name
 
-	MD5_Update(&c, lcr->r.resrec.name->c, DomainNameLength(lcr->r.resrec.name));
+	Digest_Update(&c, lcr->r.resrec.name->c, DomainNameLength(lcr->r.resrec.name));
 
 	// Class name
 
 	buf = mDNSOpaque16fromIntVal(lcr->r.resrec.rrclass);
-	MD5_Update(&c, buf.b, sizeof(mDNSOpaque16));
+	Digest_Update(&c, buf.b, sizeof(mDNSOpaque16));
 
 	// TTL
 
-	MD5_Update(&c, (mDNSu8*) &lcr->r.resrec.rroriginalttl, sizeof(lcr->r.resrec.rroriginalttl));
+	Digest_Update(&c, (mDNSu8*) &lcr->r.resrec.rroriginalttl, sizeof(lcr->r.resrec.rroriginalttl));
 	
 	// Algorithm
  
-	MD5_Update(&c, algo->c, DomainNameLength(algo));
+	Digest_Update(&c, algo->c, DomainNameLength(algo));
 
 	// Time
 
-	MD5_Update(&c, utc48, 6);
+	Digest_Update(&c, utc48, 6);
 
 	// Fudge
 
 	buf = mDNSOpaque16fromIntVal(fudge);
-	MD5_Update(&c, buf.b, sizeof(mDNSOpaque16));
+	Digest_Update(&c, buf.b, sizeof(mDNSOpaque16));
 
 	// Digest error and other data len (both zero) - we'll add them to the rdata later
 
 	buf.NotAnInteger = 0;
-	MD5_Update(&c, buf.b, sizeof(mDNSOpaque16));  // error
-	MD5_Update(&c, buf.b, sizeof(mDNSOpaque16));  // other data len
+	Digest_Update(&c, buf.b, sizeof(mDNSOpaque16));  // error
+	Digest_Update(&c, buf.b, sizeof(mDNSOpaque16));  // other data len
 
-	// Finish the message & tsig var hash
+	// Finish the message & tsig var hash, and perform the outer hash from the outer key pad midstate
 
-    MD5_Final(thisDigest, &c);
-	
-	// perform outer MD5 (outer key pad, inner digest)
+	digestlen = HMAC_Final(thisDigest, &c, info);
 
-	MD5_Init(&c);
-	MD5_Update(&c, info->keydata_opad, HMAC_LEN);
-	MD5_Update(&c, thisDigest, MD5_LEN);
-	MD5_Final(thisDigest, &c);
-
-	if (!mDNSPlatformMemSame(thisDigest, thatDigest, MD5_LEN))
+	if (!mDNSPlatformMemSame(thisDigest, thatDigest, digestlen))
 		{
 		LogMsg("ERROR: DNSDigest_VerifyMessage - bad signature");
 		*rcode = kDNSFlag1_RC_NotAuth;
@@ -1571,6 +1907,127 @@ exit:
 	return ok;
 	}
 
+// Known-answer tests: MD5 (RFC 1321) and SHA-256 (FIPS 180-2) with every block function this build and processor
+// can use, then HMAC-MD5 (RFC 2202) and HMAC-SHA256 (RFC 4231) through the key midstate code the TSIG routines use
+typedef struct { const char *data; mDNSu32 len, repeat; const char *digest; } DigestVector;
+typedef struct { const char *key; mDNSu32 keylen; const char *data; mDNSu32 datalen; const char *digest; } HMACVector;
+
+static const DigestVector MD5Vectors[] =
+	{
+	{ "abc", 3, 1, "\x90\x01\x50\x98\x3c\xd2\x4f\xb0\xd6\x96\x3f\x7d\x28\xe1\x7f\x72" },
+	{ "1234567890", 10, 8, "\x57\xed\xf4\xa2\x2b\xe3\xc9\x55\xac\x49\xda\x2e\x21\x07\xb6\x7a" },
+	};
+
+static const DigestVector SHA256Vectors[] =
+	{
+	{ "abc", 3, 1,
+	  "\xba\x78\x16\xbf\x8f\x01\xcf\xea\x41\x41\x40\xde\x5d\xae\x22\x23\xb0\x03\x61\xa3\x96\x17\x7a\x9c\xb4\x10\xff\x61\xf2\x00\x15\xad" },
+	{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 56, 1,
+	  "\x24\x8d\x6a\x61\xd2\x06\x38\xb8\xe5\xc0\x26\x93\x0c\x3e\x60\x39\xa3\x3c\xe4\x59\x64\xff\x21\x67\xf6\xec\xed\xd4\x19\xdb\x06\xc1" },
+	{ "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 100, 10000,
+	  "\xcd\xc7\x6e\x5c\x99\x14\xfb\x92\x81\xa1\xc7\xe2\x84\xd7\x3e\x67\xf1\x80\x9a\x48\xa4\x97\x20\x0e\x04\x6d\x39\xcc\xc7\x11\x2c\xd0" },
+	};
+
+#define HMACVectorKeyAA80  "\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa" \
+                           "\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa" \
+                           "\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa" \
+                           "\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa"
+#define HMACVectorDataDD50 "\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd" \
+                           "\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd"
+#define HMACVectorLongKey  "Test Using Larger Than Block-Size Key - Hash Key First"
+
+// RFC 2202 test cases 1, 2, 3 and 6
+static const HMACVector HMACMD5Vectors[] =
+	{
+	{ "\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b", 16, "Hi There", 8,
+	  "\x92\x94\x72\x7a\x36\x38\xbb\x1c\x13\xf4\x8e\xf8\x15\x8b\xfc\x9d" },
+	{ "Jefe", 4, "what do ya want for nothing?", 28,
+	  "\x75\x0c\x78\x3e\x6a\xb0\xb5\x03\xea\xa8\x6e\x31\x0a\x5d\xb7\x38" },
+	{ HMACVectorKeyAA80, 16, HMACVectorDataDD50, 50,
+	  "\x56\xbe\x34\x52\x1d\x14\x4c\x88\xdb\xb8\xc7\x33\xf0\xe8\xb3\xf6" },
+	{ HMACVectorKeyAA80, 80, HMACVectorLongKey, 54,
+	  "\x6b\x1a\xb7\xfe\x4b\xd7\xbf\x8f\x0b\x62\xe6\xce\x61\xb9\xd0\xcd" },
+	};
+
+// RFC 4231 test cases 1, 2, 3 and 6
+static const HMACVector HMACSHA256Vectors[] =
+	{
+	{ "\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b", 20, "Hi There", 8,
+	  "\xb0\x34\x4c\x61\xd8\xdb\x38\x53\x5c\xa8\xaf\xce\xaf\x0b\xf1\x2b\x88\x1d\xc2\x00\xc9\x83\x3d\xa7\x26\xe9\x37\x6c\x2e\x32\xcf\xf7" },
+	{ "Jefe", 4, "what do ya want for nothing?", 28,
+	  "\x5b\xdc\xc1\x46\xbf\x60\x75\x4e\x6a\x04\x24\x26\x08\x95\x75\xc7\x5a\x00\x3f\x08\x9d\x27\x39\x83\x9d\xec\x58\xb9\x64\xec\x38\x43" },
+	{ HMACVectorKeyAA80, 20, HMACVectorDataDD50, 50,
+	  "\x77\x3e\xa9\x1e\x36\x80\x0e\x46\x85\x4d\xb8\xeb\xd0\x91\x81\xa7\x29\x59\x09\x8b\x3e\xf8\xc1\x22\xd9\x63\x55\x14\xce\xd5\x65\xfe" },
+	{ HMACVectorKeyAA80 HMACVectorKeyAA80, 131, HMACVectorLongKey, 54,
+	  "\x60\xe4\x31\x59\x1e\xe0\xb6\x7f\x0d\x8a\x26\xaa\xcb\xf5\xb7\x7f\x8e\x0b\xc6\x21\x37\x28\xc5\x14\x05\x46\x04\x0f\x0e\xe3\x7f\x54" },
+	};
+
+#define DigestVectorCount(V) ((int)(sizeof(V) / sizeof((V)[0])))
+
+// Hashes each vector with the given SHA-256 block function, or with MD5 if block is NULL
+mDNSlocal mDNSBool DNSDigest_CheckVectors(const char *name, SHA256BlockFunction *block, const DigestVector *v, int count)
+	{
+	mDNSBool ok = mDNStrue;
+	mDNSu8 md[SHA256_LEN];
+	int i;
+	mDNSu32 r;
+	for (i = 0; i < count; i++)
+		{
+		if (block)
+			{
+			SHA256_CTX c;
+			SHA256_Init(&c);
+			c.block = block;
+			for (r = 0; r < v[i].repeat; r++) SHA256_Update(&c, v[i].data, v[i].len);
+			SHA256_Final(md, &c);
+			}
+		else
+			{
+			MD5_CTX c;
+			MD5_Init(&c);
+			for (r = 0; r < v[i].repeat; r++) MD5_Update(&c, v[i].data, v[i].len);
+			MD5_Final(md, &c);
+			}
+		if (!mDNSPlatformMemSame(md, v[i].digest, block ? SHA256_LEN : MD5_LEN))
+			{ LogMsg("DNSDigest_SelfTest: %s vector %d FAILED", name, i + 1); ok = mDNSfalse; }
+		}
+	return(ok);
+	}
+
+mDNSlocal mDNSBool DNSDigest_CheckHMACVectors(const char *name, mDNSu8 algorithm, const HMACVector *v, int count)
+	{
+	mDNSBool ok = mDNStrue;
+	mDNSu8 md[SHA256_LEN];
+	int i;
+	for (i = 0; i < count; i++)
+		{
+		DomainAuthInfo info;
+		DigestContext c;
+		mDNSu32 len;
+		DNSDigest_ConstructHMACKey(&info, algorithm, (const mDNSu8 *)v[i].key, v[i].keylen);
+		HMAC_Init(&c, &info);
+		Digest_Update(&c, v[i].data, v[i].datalen);
+		len = HMAC_Final(md, &c, &info);
+		if (!mDNSPlatformMemSame(md, v[i].digest, len))
+			{ LogMsg("DNSDigest_SelfTest: %s vector %d FAILED", name, i + 1); ok = mDNSfalse; }
+		}
+	return(ok);
+	}
+
+mDNSexport mDNSBool DNSDigest_SelfTest(void)
+	{
+	mDNSBool ok = mDNStrue;
+	if (!DNSDigest_CheckVectors("MD5", mDNSNULL, MD5Vectors, DigestVectorCount(MD5Vectors))) ok = mDNSfalse;
+	if (!DNSDigest_CheckVectors("SHA-256", sha256_block_portable, SHA256Vectors, DigestVectorCount(SHA256Vectors))) ok = mDNSfalse;
+#ifdef SHA256_SHANI
+	if (SHA256_CPUHasSHANI() && !DNSDigest_CheckVectors("SHA-256 (SHA-NI)", sha256_block_shani, SHA256Vectors, DigestVectorCount(SHA256Vectors)))
+		ok = mDNSfalse;
+#endif
+	if (!DNSDigest_CheckHMACVectors("HMAC-MD5", TSIG_HMAC_MD5, HMACMD5Vectors, DigestVectorCount(HMACMD5Vectors))) ok = mDNSfalse;
+	if (!DNSDigest_CheckHMACVectors("HMAC-SHA256", TSIG_HMAC_SHA256, HMACSHA256Vectors, DigestVectorCount(HMACSHA256Vectors))) ok = mDNSfalse;
+	return(ok);
+	}
+
 
 #ifdef __cplusplus
 }
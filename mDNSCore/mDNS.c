@@ -117,10 +117,21 @@ mDNSexport void SetNextQueryTime(mDNS *const m, const DNSQuestion *const q)
 		}
 	}
 
+mDNSexport mDNSu32 CacheHashSlot(const mDNS *const m, const mDNSu32 namehash)
+	{
+	// While resizing, a name whose old bucket has not been migrated yet is still found in rrcache_oldhash
+	if (m->rrcache_oldhashslots)
+		{
+		const mDNSu32 oldslot = namehash % m->rrcache_oldhashslots;
+		if (oldslot >= m->rrcache_rehashslot) return(m->rrcache_hashslots + oldslot);
+		}
+	return(namehash % m->rrcache_hashslots);
+	}
+
 mDNSexport CacheGroup *CacheGroupForName(const mDNS *const m, const mDNSu32 slot, const mDNSu32 namehash, const domainname *const name)
 	{
 	CacheGroup *cg;
-	for (cg = m->rrcache_hash[slot]; cg; cg=cg->next)
+	for (cg = *CacheHashBucket(m, slot); cg; cg=cg->next)
 		if (cg->namehash == namehash && SameDomainName(cg->name, name))
 			break;
 	return(cg);
@@ -173,6 +184,66 @@ mDNSexport char *InterfaceNameForID(mDNS *const m, const mDNSInterfaceID Interfa
 	return(intf ? intf->ifname : mDNSNULL);
 	}
 
+// Questions are numbered in the order they join m->Questions, and are only ever appended, so a question is "new"
+// (not yet answered from the cache by AnswerNewQuestion) if it was added at or after m->NewQuestions
+#define QuestionIsNew(m,q) ((m)->NewQuestions && (mDNSs32)((q)->SerialNumber - (m)->NewQuestions->SerialNumber) >= 0)
+
+mDNSlocal void QuestionQIDHashAdd(mDNS *const m, DNSQuestion *const q)
+	{
+	DNSQuestion **p = &m->qidhash[QuestionQIDSlot(q->TargetQID)];
+	while (*p) p = &(*p)->NextInQIDHash;
+	q->NextInQIDHash = mDNSNULL;
+	q->PrevInQIDHash = p;
+	*p = q;
+	}
+
+mDNSlocal void QuestionQIDHashRemove(DNSQuestion *const q)
+	{
+	if (q->PrevInQIDHash)
+		{
+		*q->PrevInQIDHash = q->NextInQIDHash;
+		if (q->NextInQIDHash) q->NextInQIDHash->PrevInQIDHash = q->PrevInQIDHash;
+		q->NextInQIDHash = mDNSNULL;
+		q->PrevInQIDHash = mDNSNULL;
+		}
+	}
+
+// Add q (which has just been appended to m->Questions) to the qnamehash and TargetQID indexes.
+// Questions go at the end of their buckets, so bucket walks see them in the same order as m->Questions.
+mDNSlocal void QuestionHashAdd(mDNS *const m, DNSQuestion *const q)
+	{
+	DNSQuestion **p = &m->qhash[QuestionHashSlot(q->qnamehash)];
+	while (*p) p = &(*p)->NextInQHash;
+	q->NextInQHash = mDNSNULL;
+	q->PrevInQHash = p;
+	*p = q;
+	q->SerialNumber = m->NextQuestionSerial++;
+	if (!mDNSOpaque16IsZero(q->TargetQID)) QuestionQIDHashAdd(m, q);
+	}
+
+// Remove q (which is leaving m->Questions) from the indexes, advancing any bucket walk that was about to visit it
+mDNSlocal void QuestionHashRemove(mDNS *const m, DNSQuestion *const q)
+	{
+	if (q->PrevInQHash)
+		{
+		if (m->CurrentHashQuestion == q) m->CurrentHashQuestion = q->NextInQHash;
+		*q->PrevInQHash = q->NextInQHash;
+		if (q->NextInQHash) q->NextInQHash->PrevInQHash = q->PrevInQHash;
+		q->NextInQHash = mDNSNULL;
+		q->PrevInQHash = mDNSNULL;
+		}
+	QuestionQIDHashRemove(q);
+	}
+
+// All changes to the TargetQID of a question that may be on m->Questions must go through here,
+// so that the question moves to the right m->qidhash bucket
+mDNSexport void SetQuestionTargetQID(mDNS *const m, DNSQuestion *const q, const mDNSOpaque16 id)
+	{
+	QuestionQIDHashRemove(q);
+	q->TargetQID = id;
+	if (q->PrevInQHash && !mDNSOpaque16IsZero(id)) QuestionQIDHashAdd(m, q);
+	}
+
 // For a single given DNSQuestion, deliver an add/remove result for the single given AuthRecord
 // Used by AnswerAllLocalQuestionsWithLocalAuthRecord() and AnswerNewLocalOnlyQuestion()
 mDNSlocal void AnswerLocalQuestionWithLocalAuthRecord(mDNS *const m, DNSQuestion *q, AuthRecord *rr, QC_result AddRecord)
@@ -215,21 +286,23 @@ mDNSlocal void AnswerAllLocalQuestionsWithLocalAuthRecord(mDNS *const m, AuthRec
 		if (ResourceRecordAnswersQuestion(&rr->resrec, q))
 			AnswerLocalQuestionWithLocalAuthRecord(m, q, rr, AddRecord);			// MUST NOT dereference q again
 		}
+	m->CurrentQuestion = mDNSNULL;
 
 	// If this AuthRecord is marked LocalOnly, then we want to deliver it to all local 'mDNSInterface_Any' questions
 	if (rr->resrec.InterfaceID == mDNSInterface_LocalOnly)
 		{
-		m->CurrentQuestion = m->Questions;
-		while (m->CurrentQuestion && m->CurrentQuestion != m->NewQuestions)
+		if (m->CurrentHashQuestion)
+			LogMsg("AnswerAllLocalQuestionsWithLocalAuthRecord ERROR m->CurrentHashQuestion already set: %##s (%s)",
+				m->CurrentHashQuestion->qname.c, DNSTypeName(m->CurrentHashQuestion->qtype));
+		m->CurrentHashQuestion = m->qhash[QuestionHashSlot(rr->resrec.namehash)];
+		while (m->CurrentHashQuestion)
 			{
-			DNSQuestion *q = m->CurrentQuestion;
-			m->CurrentQuestion = q->next;
-			if (ResourceRecordAnswersQuestion(&rr->resrec, q))
+			DNSQuestion *q = m->CurrentHashQuestion;
+			m->CurrentHashQuestion = q->NextInQHash;
+			if (!QuestionIsNew(m, q) && ResourceRecordAnswersQuestion(&rr->resrec, q))
 				AnswerLocalQuestionWithLocalAuthRecord(m, q, rr, AddRecord);		// MUST NOT dereference q again
 			}
 		}
-
-	m->CurrentQuestion = mDNSNULL;
 	}
 
 // ***************************************************************************
@@ -496,6 +569,59 @@ mDNSlocal void ActivateUnicastRegistration(mDNS *const m, AuthRecord *const rr)
 #define RecordIsLocalDuplicate(A,B) \
 	((A)->resrec.InterfaceID == (B)->resrec.InterfaceID && RecordLDT((A),(B)) && IdenticalResourceRecord(&(A)->resrec, &(B)->resrec))
 
+#define AuthHashSlot(H) ((H) % AUTH_HASH_SLOTS)
+
+mDNSlocal mDNSu32 AuthOwnerSlot(const mDNSEthAddr *const hmac)
+	{
+	return((mDNSu32)((hmac->b[2] << 24) | (hmac->b[3] << 16) | (hmac->b[4] << 8) | hmac->b[5]) % AUTH_OWNER_SLOTS);
+	}
+
+// Add rr (which has just joined m->ResourceRecords) to the name and owner indexes. If after is non-NULL rr is placed
+// immediately behind it, otherwise at the end of its buckets, so bucket walks see records in main-list order.
+mDNSlocal void AuthHashAddRecord(mDNS *const m, AuthRecord *const rr, AuthRecord *const after)
+	{
+	AuthRecord **p;
+
+	p = after ? &after->NextInNameHash : &m->rrauth_namehash[AuthHashSlot(rr->resrec.namehash)];
+	if (!after) while (*p) p = &(*p)->NextInNameHash;
+	rr->NextInNameHash = *p;
+	if (*p) (*p)->PrevInNameHash = &rr->NextInNameHash;
+	rr->PrevInNameHash = p;
+	*p = rr;
+
+	if (rr->WakeUp.HMAC.l[0])
+		{
+		p = (after && after->PrevInOwnerHash) ? &after->NextInOwnerHash : &m->rrauth_ownerhash[AuthOwnerSlot(&rr->WakeUp.HMAC)];
+		if (!after || !after->PrevInOwnerHash) while (*p) p = &(*p)->NextInOwnerHash;
+		rr->NextInOwnerHash = *p;
+		if (*p) (*p)->PrevInOwnerHash = &rr->NextInOwnerHash;
+		rr->PrevInOwnerHash = p;
+		*p = rr;
+		}
+	}
+
+// Remove rr (which is leaving m->ResourceRecords) from the indexes, advancing any bucket walk that was about to visit it
+// Exported so uDNS.c can call this
+mDNSexport void AuthHashRemoveRecord(mDNS *const m, AuthRecord *const rr)
+	{
+	if (rr->PrevInNameHash)
+		{
+		if (m->CurrentNameHashRecord == rr) m->CurrentNameHashRecord = rr->NextInNameHash;
+		*rr->PrevInNameHash = rr->NextInNameHash;
+		if (rr->NextInNameHash) rr->NextInNameHash->PrevInNameHash = rr->PrevInNameHash;
+		rr->NextInNameHash = mDNSNULL;
+		rr->PrevInNameHash = mDNSNULL;
+		}
+	if (rr->PrevInOwnerHash)
+		{
+		if (m->CurrentOwnerHashRecord == rr) m->CurrentOwnerHashRecord = rr->NextInOwnerHash;
+		*rr->PrevInOwnerHash = rr->NextInOwnerHash;
+		if (rr->NextInOwnerHash) rr->NextInOwnerHash->PrevInOwnerHash = rr->PrevInOwnerHash;
+		rr->NextInOwnerHash = mDNSNULL;
+		rr->PrevInOwnerHash = mDNSNULL;
+		}
+	}
+
 // Exported so uDNS.c can call this
 mDNSexport mStatus mDNS_Register_internal(mDNS *const m, AuthRecord *const rr)
 	{
@@ -609,6 +735,10 @@ mDNSexport mStatus mDNS_Register_internal(mDNS *const m, AuthRecord *const rr)
 	rr->UpdateCredits     = kMaxUpdateCredits;
 	rr->NextUpdateCredit  = 0;
 	rr->UpdateBlocked     = 0;
+	rr->NextInNameHash    = mDNSNULL;
+	rr->PrevInNameHash    = mDNSNULL;
+	rr->NextInOwnerHash   = mDNSNULL;
+	rr->PrevInOwnerHash   = mDNSNULL;
 
 	// For records we're holding as proxy (except reverse-mapping PTR records) two announcements is sufficient
 	if (rr->WakeUp.HMAC.l[0] && !rr->AddressProxy.type) rr->AnnounceCount = 2;
@@ -704,6 +834,7 @@ mDNSexport mStatus mDNS_Register_internal(mDNS *const m, AuthRecord *const rr)
 		debugf("Adding to active record list %p %s", rr, ARDisplayString(m,rr));
 		if (!m->NewLocalRecords) m->NewLocalRecords = rr;
 		*p = rr;
+		AuthHashAddRecord(m, rr, mDNSNULL);
 		}
 
 	if (!AuthRecord_uDNS(rr))
@@ -785,6 +916,7 @@ mDNSexport mStatus mDNS_Deregister_internal(mDNS *const m, AuthRecord *const rr,
 				*d        = dup->next;		// Cut replacement record from DuplicateRecords list
 				dup->next = rr->next;		// And then...
 				rr->next  = dup;			// ... splice it in right after the record we're about to delete
+				AuthHashAddRecord(m, dup, rr);
 				dup->resrec.RecordType        = rr->resrec.RecordType;
 				dup->ProbeCount      = rr->ProbeCount;
 				dup->AnnounceCount   = rr->AnnounceCount;
@@ -887,6 +1019,7 @@ mDNSexport mStatus mDNS_Deregister_internal(mDNS *const m, AuthRecord *const rr,
 		if (m->CurrentRecord   == rr) m->CurrentRecord   = rr->next;
 		if (m->NewLocalRecords == rr) m->NewLocalRecords = rr->next;
 		rr->next = mDNSNULL;
+		AuthHashRemoveRecord(m, rr);	// (a no-op if rr was on the DuplicateRecords list)
 
 		// Should we generate local remove events here?
 		// i.e. something like:
@@ -1549,6 +1682,7 @@ mDNSlocal void SendResponses(mDNS *const m)
 	// *** 2. Loop through interface list, sending records as appropriate
 	// ***
 
+	mDNSPlatformBeginSendBatch(m);	// Let the platform layer coalesce our per-interface sends
 	while (intf)
 		{
 		const int OwnerRecordSpace = (m->AnnounceOwner && intf->MAC.l[0]) ? DNSOpt_Header_Space + DNSOpt_Owner_Space(&m->PrimaryMAC, &intf->MAC) : 0;
@@ -1745,6 +1879,7 @@ mDNSlocal void SendResponses(mDNS *const m)
 			pktcount = 0;		// When we move to a new interface, reset packet count back to zero -- NSEC generation logic uses it
 			}
 		}
+	mDNSPlatformEndSendBatch(m);
 
 	// ***
 	// *** 3. Cleanup: Now that everything is sent, call client callback functions, and reset state variables
@@ -1802,6 +1937,99 @@ mDNSlocal void SendResponses(mDNS *const m)
 	((RR)->resrec.rroriginalttl > 10               ) ? (mDNSPlatformOneSecond)      : \
 	((RR)->resrec.rroriginalttl > 0                ) ? (mDNSPlatformOneSecond/10)   : 0)
 
+// The CacheGroups are kept in a binary min-heap ordered by NextCheck, so that mDNS_Execute() only has to visit the
+// groups whose time has come, instead of walking every CacheGroup in the cache each time m->NextCacheCheck fires.
+// A group's NextCheck may be earlier than strictly necessary (that just causes a harmless early visit),
+// but must never be later than the earliest event of any of its members.
+
+mDNSlocal void CacheCheckHeapPlace(mDNS *const m, CacheGroup *const cg, const mDNSu32 i)
+	{
+	m->rrcache_checkheap[i] = cg;
+	cg->CheckIndex = i;
+	}
+
+mDNSlocal void CacheCheckHeapSiftUp(mDNS *const m, mDNSu32 i)
+	{
+	CacheGroup *const cg = m->rrcache_checkheap[i];
+	while (i > 1 && m->rrcache_checkheap[i/2]->NextCheck - cg->NextCheck > 0)
+		{
+		CacheCheckHeapPlace(m, m->rrcache_checkheap[i/2], i);
+		i /= 2;
+		}
+	CacheCheckHeapPlace(m, cg, i);
+	}
+
+mDNSlocal void CacheCheckHeapSiftDown(mDNS *const m, mDNSu32 i)
+	{
+	CacheGroup *const cg = m->rrcache_checkheap[i];
+	for (;;)
+		{
+		mDNSu32 c = i * 2;
+		if (c > m->rrcache_checkcount) break;
+		if (c < m->rrcache_checkcount && m->rrcache_checkheap[c]->NextCheck - m->rrcache_checkheap[c+1]->NextCheck > 0) c++;
+		if (m->rrcache_checkheap[c]->NextCheck - cg->NextCheck >= 0) break;
+		CacheCheckHeapPlace(m, m->rrcache_checkheap[c], i);
+		i = c;
+		}
+	CacheCheckHeapPlace(m, cg, i);
+	}
+
+mDNSlocal void CacheCheckHeapRemove(mDNS *const m, CacheGroup *const cg)
+	{
+	const mDNSu32 i = cg->CheckIndex;
+	CacheGroup *const last = i ? m->rrcache_checkheap[m->rrcache_checkcount] : mDNSNULL;
+	if (!i) return;
+	cg->CheckIndex = 0;
+	m->rrcache_checkheap[m->rrcache_checkcount--] = mDNSNULL;
+	if (last != cg)		// Move the last element into the vacated position, then restore heap order around it
+		{
+		CacheCheckHeapPlace(m, last, i);
+		CacheCheckHeapSiftUp(m, i);
+		CacheCheckHeapSiftDown(m, last->CheckIndex);
+		}
+	}
+
+// Sets cg->NextCheck to the given time, adding cg to the heap if it's not already there.
+// If we can't get memory to grow the heap, we fall back to visiting every CacheGroup on the next cache check.
+mDNSlocal void SetCacheGroupCheckTime(mDNS *const m, CacheGroup *const cg, const mDNSs32 time)
+	{
+	if (m->NextCacheCheck - time > 0) m->NextCacheCheck = time;
+
+	if (!cg->CheckIndex)
+		{
+		if (m->rrcache_checkcount + 1 >= m->rrcache_checksize)
+			{
+			const mDNSu32 newsize = m->rrcache_checksize ? m->rrcache_checksize * 2 : 64;
+			CacheGroup **newheap = (CacheGroup **)mDNSPlatformMemAllocate(newsize * sizeof(CacheGroup *));
+			if (!newheap) { LogMsg("SetCacheGroupCheckTime: Failed to grow cache check heap to %lu", newsize); m->rrcache_checkall = mDNStrue; return; }
+			if (m->rrcache_checkheap)
+				{
+				mDNSPlatformMemCopy(newheap, m->rrcache_checkheap, (m->rrcache_checkcount + 1) * sizeof(CacheGroup *));
+				mDNSPlatformMemFree(m->rrcache_checkheap);
+				}
+			m->rrcache_checkheap = newheap;
+			m->rrcache_checksize = newsize;
+			}
+		cg->NextCheck = time;
+		CacheCheckHeapPlace(m, cg, ++m->rrcache_checkcount);
+		CacheCheckHeapSiftUp(m, cg->CheckIndex);
+		}
+	else
+		{
+		const mDNSs32 old = cg->NextCheck;
+		cg->NextCheck = time;
+		if (old - time > 0) CacheCheckHeapSiftUp  (m, cg->CheckIndex);
+		else                CacheCheckHeapSiftDown(m, cg->CheckIndex);
+		}
+	}
+
+// Like SetCacheGroupCheckTime, but only ever moves cg->NextCheck earlier
+mDNSlocal void ScheduleCacheGroupCheck(mDNS *const m, CacheGroup *const cg, const mDNSs32 time)
+	{
+	if (!cg->CheckIndex || cg->NextCheck - time > 0) SetCacheGroupCheckTime(m, cg, time);
+	else if (m->NextCacheCheck - time > 0) m->NextCacheCheck = time;
+	}
+
 // Note: MUST call SetNextCacheCheckTime any time we change:
 // rr->TimeRcvd
 // rr->resrec.rroriginalttl
@@ -1811,6 +2039,9 @@ mDNSlocal void SendResponses(mDNS *const m)
 // Clearing rr->DelayDelivery does not require a call to SetNextCacheCheckTime
 mDNSlocal void SetNextCacheCheckTime(mDNS *const m, CacheRecord *const rr)
 	{
+	CacheGroup *const cg = CacheGroupForName(m, CacheHashSlot(m, rr->resrec.namehash), rr->resrec.namehash, rr->resrec.name);
+	mDNSs32 event;
+
 	rr->NextRequiredQuery = RRExpireTime(rr);
 
 	// If we have an active question, then see if we want to schedule a refresher query for this record.
@@ -1824,12 +2055,11 @@ mDNSlocal void SetNextCacheCheckTime(mDNS *const m, CacheRecord *const rr)
 			(rr->NextRequiredQuery - m->timenow) / mDNSPlatformOneSecond, CacheCheckGracePeriod(rr));
 		}
 
-	if (m->NextCacheCheck - (rr->NextRequiredQuery + CacheCheckGracePeriod(rr)) > 0)
-		m->NextCacheCheck = (rr->NextRequiredQuery + CacheCheckGracePeriod(rr));
-	
-	if (rr->DelayDelivery)
-		if (m->NextCacheCheck - rr->DelayDelivery > 0)
-			m->NextCacheCheck = rr->DelayDelivery;
+	event = rr->NextRequiredQuery + CacheCheckGracePeriod(rr);
+	if (rr->DelayDelivery && event - rr->DelayDelivery > 0) event = rr->DelayDelivery;
+
+	if (cg) ScheduleCacheGroupCheck(m, cg, event);
+	else if (m->NextCacheCheck - event > 0) m->NextCacheCheck = event;
 	}
 
 #define kMinimumReconfirmTime                     ((mDNSu32)mDNSPlatformOneSecond *  5)
@@ -1866,6 +2096,10 @@ mDNSlocal mStatus mDNS_Reconfirm_internal(mDNS *const m, CacheRecord *const rr,
 // BuildQuestion puts a question into a DNS Query packet and if successful, updates the value of queryptr.
 // It also appends to the list of known answer records that need to be included,
 // and updates the forcast for the size of the known answer section.
+// The question's cache group is walked once: each record that answers the question either goes into the
+// known answer list, or (if it's too big or too close to expiry to be worth listing) has UnansweredQueries
+// bumped, since the query will solicit a fresh copy of it. Records already in the list for an earlier
+// question in this packet are left alone.
 mDNSlocal mDNSBool BuildQuestion(mDNS *const m, DNSMessage *query, mDNSu8 **queryptr, DNSQuestion *q,
 	CacheRecord ***kalistptrptr, mDNSu32 *answerforecast)
 	{
@@ -1884,49 +2118,59 @@ mDNSlocal mDNSBool BuildQuestion(mDNS *const m, DNSMessage *query, mDNSu8 **quer
 		const mDNSu32 slot = HashSlot(&q->qname);
 		const CacheGroup *const cg = CacheGroupForName(m, slot, q->qnamehash, &q->qname);
 		CacheRecord *rr;
-		CacheRecord **ka = *kalistptrptr;	// Make a working copy of the pointer we're going to update
+		CacheRecord **const kastart = *kalistptrptr;
+		CacheRecord **ka = kastart;	// Make a working copy of the pointer we're going to update
 
-		for (rr = cg ? cg->members : mDNSNULL; rr; rr=rr->next)				// If we have a resource record in our cache,
+		for (rr = cg ? cg->members : mDNSNULL; rr; rr=rr->next)				// For every resource record in our cache,
 			if (rr->resrec.InterfaceID == q->SendQNow &&					// received on this interface
 				rr->NextInKAList == mDNSNULL && ka != &rr->NextInKAList &&	// which is not already in the known answer list
-				rr->resrec.rdlength <= SmallRecordLimit &&					// which is small enough to sensibly fit in the packet
-				SameNameRecordAnswersQuestion(&rr->resrec, q) &&			// which answers our question
-				rr->TimeRcvd + TicksTTL(rr)/2 - m->timenow >				// and its half-way-to-expiry time is at least 1 second away
-												mDNSPlatformOneSecond)		// (also ensures we never include goodbye records with TTL=1)
+				SameNameRecordAnswersQuestion(&rr->resrec, q))				// which answers our question
 				{
-				*ka = rr;	// Link this record into our known answer chain
-				ka = &rr->NextInKAList;
-				// We forecast: compressed name (2) type (2) class (2) TTL (4) rdlength (2) rdata (n)
-				forecast += 12 + rr->resrec.rdestimate;
-				// If we're trying to put more than one question in this packet, and it doesn't fit
-				// then undo that last question and try again next time
-				if (query->h.numQuestions > 1 && newptr + forecast >= limit)
+				if (rr->resrec.rdlength <= SmallRecordLimit &&				// If it's small enough to sensibly fit in the packet
+					rr->TimeRcvd + TicksTTL(rr)/2 - m->timenow >			// and its half-way-to-expiry time is at least 1 second away
+												mDNSPlatformOneSecond)		// (also ensures we never include goodbye records with TTL=1)
 					{
-					debugf("BuildQuestion: Retracting question %##s (%s) new forecast total %d",
-						q->qname.c, DNSTypeName(q->qtype), newptr + forecast - query->data);
-					query->h.numQuestions--;
-					ka = *kalistptrptr;		// Go back to where we started and retract these answer records
-					while (*ka) { CacheRecord *c = *ka; *ka = mDNSNULL; ka = &c->NextInKAList; }
-					return(mDNSfalse);		// Return false, so we'll try again in the next packet
+					*ka = rr;	// Link this record into our known answer chain
+					ka = &rr->NextInKAList;
+					// We forecast: compressed name (2) type (2) class (2) TTL (4) rdlength (2) rdata (n)
+					forecast += 12 + rr->resrec.rdestimate;
+					// If we're trying to put more than one question in this packet, and it doesn't fit
+					// then undo that last question and try again next time
+					if (query->h.numQuestions > 1 && newptr + forecast >= limit)
+						{
+						CacheRecord *cr;
+						debugf("BuildQuestion: Retracting question %##s (%s) new forecast total %d",
+							q->qname.c, DNSTypeName(q->qtype), newptr + forecast - query->data);
+						query->h.numQuestions--;
+						// Un-bump the records we've passed that were left out of the list.
+						// (Records in our list have NextInKAList set, except rr, where we stop.)
+						for (cr = cg->members; cr != rr; cr=cr->next)
+							if (cr->resrec.InterfaceID == q->SendQNow &&
+								cr->NextInKAList == mDNSNULL && kastart != &cr->NextInKAList &&
+								SameNameRecordAnswersQuestion(&cr->resrec, q))
+								{
+								cr->UnansweredQueries--;
+								SetNextCacheCheckTime(m, cr);
+								}
+						ka = kastart;		// Go back to where we started and retract these answer records
+						while (*ka) { CacheRecord *c = *ka; *ka = mDNSNULL; ka = &c->NextInKAList; }
+						return(mDNSfalse);		// Return false, so we'll try again in the next packet
+						}
+					}
+				else
+					{
+					rr->UnansweredQueries++;								// indicate that we're expecting a response
+					rr->LastUnansweredTime = m->timenow;
+					SetNextCacheCheckTime(m, rr);
 					}
 				}
 
-		// Success! Update our state pointers, increment UnansweredQueries as appropriate, and return
+		// Success! Update our state pointers and return
 		*queryptr        = newptr;				// Update the packet pointer
 		*answerforecast  = forecast;			// Update the forecast
 		*kalistptrptr    = ka;					// Update the known answer list pointer
 		if (ucast) q->ExpectUnicastResp = NonZeroTime(m->timenow);
 
-		for (rr = cg ? cg->members : mDNSNULL; rr; rr=rr->next)				// For every resource record in our cache,
-			if (rr->resrec.InterfaceID == q->SendQNow &&					// received on this interface
-				rr->NextInKAList == mDNSNULL && ka != &rr->NextInKAList &&	// which is not in the known answer list
-				SameNameRecordAnswersQuestion(&rr->resrec, q))				// which answers our question
-					{
-					rr->UnansweredQueries++;								// indicate that we're expecting a response
-					rr->LastUnansweredTime = m->timenow;
-					SetNextCacheCheckTime(m, rr);
-					}
-
 		return(mDNStrue);
 		}
 	}
@@ -1943,13 +2187,13 @@ mDNSlocal mDNSBool BuildQuestion(mDNS *const m, DNSMessage *query, mDNSu8 **quer
 // Depth 3: PTR "_services._dns-sd._udp.local." refers to "_example._tcp.local."; may be stale
 // Currently depths 4 and 5 are not expected to occur; if we did get to depth 5 we'd reconfim any records we
 // found referring to the given name, but not recursively descend any further reconfirm *their* antecedents.
+// Only the m->rrcache_targethash bucket for namehash needs to be examined, since that holds every cache record
+// whose rdata target hashes to namehash. Reconfirming doesn't add or remove cache records, so the walk is safe.
 mDNSlocal void ReconfirmAntecedents(mDNS *const m, const domainname *const name, const mDNSu32 namehash, const int depth)
 	{
-	mDNSu32 slot;
-	CacheGroup *cg;
 	CacheRecord *cr;
 	debugf("ReconfirmAntecedents (depth=%d) for %##s", depth, name->c);
-	FORALL_CACHERECORDS(slot, cg, cr)
+	for (cr = m->rrcache_targethash[namehash % CACHE_TARGET_HASH_SLOTS]; cr; cr = cr->NextInTargetHash)
 		{
 		domainname *crtarget = GetRRDomainNameTarget(&cr->resrec);
 		if (crtarget && cr->resrec.rdatahash == namehash && SameDomainName(crtarget, name))
@@ -2321,6 +2565,7 @@ mDNSlocal void SendQueries(mDNS *const m)
 
 	// 3. Now we know which queries and probes we're sending,
 	// go through our interface list sending the appropriate queries on each interface
+	mDNSPlatformBeginSendBatch(m);	// Let the platform layer coalesce our per-interface sends
 	while (intf)
 		{
 		const int OwnerRecordSpace = (m->AnnounceOwner && intf->MAC.l[0]) ? DNSOpt_Header_Space + DNSOpt_Owner_Space(&m->PrimaryMAC, &intf->MAC) : 0;
@@ -2454,6 +2699,7 @@ mDNSlocal void SendQueries(mDNS *const m)
 			intf = next;
 			}
 		}
+	mDNSPlatformEndSendBatch(m);
 
 	// 4. Final housekeeping
 	
@@ -2697,16 +2943,21 @@ mDNSlocal void CacheRecordDeferredAdd(mDNS *const m, CacheRecord *rr)
 	if (m->CurrentQuestion)
 		LogMsg("CacheRecordDeferredAdd ERROR m->CurrentQuestion already set: %##s (%s)",
 			m->CurrentQuestion->qname.c, DNSTypeName(m->CurrentQuestion->qtype));
-	m->CurrentQuestion = m->Questions;
-	while (m->CurrentQuestion && m->CurrentQuestion != m->NewQuestions)
+	if (m->CurrentHashQuestion)
+		LogMsg("CacheRecordDeferredAdd ERROR m->CurrentHashQuestion already set: %##s (%s)",
+			m->CurrentHashQuestion->qname.c, DNSTypeName(m->CurrentHashQuestion->qtype));
+	m->CurrentHashQuestion = m->qhash[QuestionHashSlot(rr->resrec.namehash)];
+	while (m->CurrentHashQuestion)
 		{
-		DNSQuestion *q = m->CurrentQuestion;
-		if (ResourceRecordAnswersQuestion(&rr->resrec, q))
+		DNSQuestion *q = m->CurrentHashQuestion;
+		m->CurrentHashQuestion = q->NextInQHash;
+		if (!QuestionIsNew(m, q) && ResourceRecordAnswersQuestion(&rr->resrec, q))
+			{
+			m->CurrentQuestion = q;
 			AnswerCurrentQuestionWithResourceRecord(m, rr, QC_add);
-		if (m->CurrentQuestion == q)	// If m->CurrentQuestion was not auto-advanced, do it ourselves now
-			m->CurrentQuestion = q->next;
+			m->CurrentQuestion = mDNSNULL;
+			}
 		}
-	m->CurrentQuestion = mDNSNULL;
 	}
 
 mDNSlocal mDNSs32 CheckForSoonToExpireRecords(mDNS *const m, const domainname *const name, const mDNSu32 namehash, const mDNSu32 slot)
@@ -2736,11 +2987,11 @@ mDNSlocal void CacheRecordAdd(mDNS *const m, CacheRecord *rr)
 	{
 	DNSQuestion *q;
 
-	// We stop when we get to NewQuestions -- if we increment their CurrentAnswers/LargeAnswers/UniqueAnswers
+	// We skip NewQuestions -- if we increment their CurrentAnswers/LargeAnswers/UniqueAnswers
 	// counters here we'll end up double-incrementing them when we do it again in AnswerNewQuestion().
-	for (q = m->Questions; q && q != m->NewQuestions; q=q->next)
+	for (q = m->qhash[QuestionHashSlot(rr->resrec.namehash)]; q; q=q->NextInQHash)
 		{
-		if (ResourceRecordAnswersQuestion(&rr->resrec, q))
+		if (!QuestionIsNew(m, q) && ResourceRecordAnswersQuestion(&rr->resrec, q))
 			{
 			// If this question is one that's actively sending queries, and it's received ten answers within one
 			// second of sending the last query packet, then that indicates some radical network topology change,
@@ -2783,16 +3034,20 @@ mDNSlocal void CacheRecordAdd(mDNS *const m, CacheRecord *rr)
 		{
 		if (m->CurrentQuestion)
 			LogMsg("CacheRecordAdd ERROR m->CurrentQuestion already set: %##s (%s)", m->CurrentQuestion->qname.c, DNSTypeName(m->CurrentQuestion->qtype));
-		m->CurrentQuestion = m->Questions;
-		while (m->CurrentQuestion && m->CurrentQuestion != m->NewQuestions)
-			{
-			q = m->CurrentQuestion;
-			if (ResourceRecordAnswersQuestion(&rr->resrec, q))
+		if (m->CurrentHashQuestion)
+			LogMsg("CacheRecordAdd ERROR m->CurrentHashQuestion already set: %##s (%s)", m->CurrentHashQuestion->qname.c, DNSTypeName(m->CurrentHashQuestion->qtype));
+		m->CurrentHashQuestion = m->qhash[QuestionHashSlot(rr->resrec.namehash)];
+		while (m->CurrentHashQuestion)
+			{
+			q = m->CurrentHashQuestion;
+			m->CurrentHashQuestion = q->NextInQHash;
+			if (!QuestionIsNew(m, q) && ResourceRecordAnswersQuestion(&rr->resrec, q))
+				{
+				m->CurrentQuestion = q;
 				AnswerCurrentQuestionWithResourceRecord(m, rr, QC_add);
-			if (m->CurrentQuestion == q)	// If m->CurrentQuestion was not auto-advanced, do it ourselves now
-				m->CurrentQuestion = q->next;
+				m->CurrentQuestion = mDNSNULL;
+				}
 			}
-		m->CurrentQuestion = mDNSNULL;
 		}
 
 	SetNextCacheCheckTime(m, rr);
@@ -2813,18 +3068,22 @@ mDNSlocal void NoCacheAnswer(mDNS *const m, CacheRecord *rr)
 	LogMsg("No cache space: Delivering non-cached result for %##s", m->rec.r.resrec.name->c);
 	if (m->CurrentQuestion)
 		LogMsg("NoCacheAnswer ERROR m->CurrentQuestion already set: %##s (%s)", m->CurrentQuestion->qname.c, DNSTypeName(m->CurrentQuestion->qtype));
-	m->CurrentQuestion = m->Questions;
-	// We do this for *all* questions, not stopping when we get to m->NewQuestions,
+	if (m->CurrentHashQuestion)
+		LogMsg("NoCacheAnswer ERROR m->CurrentHashQuestion already set: %##s (%s)", m->CurrentHashQuestion->qname.c, DNSTypeName(m->CurrentHashQuestion->qtype));
+	m->CurrentHashQuestion = m->qhash[QuestionHashSlot(rr->resrec.namehash)];
+	// We do this for *all* questions, including m->NewQuestions,
 	// since we're not caching the record and we'll get no opportunity to do this later
-	while (m->CurrentQuestion)
+	while (m->CurrentHashQuestion)
 		{
-		DNSQuestion *q = m->CurrentQuestion;
+		DNSQuestion *q = m->CurrentHashQuestion;
+		m->CurrentHashQuestion = q->NextInQHash;
 		if (ResourceRecordAnswersQuestion(&rr->resrec, q))
+			{
+			m->CurrentQuestion = q;
 			AnswerCurrentQuestionWithResourceRecord(m, rr, QC_addnocache);	// QC_addnocache means "don't expect remove events for this"
-		if (m->CurrentQuestion == q)	// If m->CurrentQuestion was not auto-advanced, do it ourselves now
-			m->CurrentQuestion = q->next;
+			m->CurrentQuestion = mDNSNULL;
+			}
 		}
-	m->CurrentQuestion = mDNSNULL;
 	}
 
 // CacheRecordRmv is only called from CheckCacheExpiration, which is called from mDNS_Execute.
@@ -2841,14 +3100,18 @@ mDNSlocal void CacheRecordRmv(mDNS *const m, CacheRecord *rr)
 	if (m->CurrentQuestion)
 		LogMsg("CacheRecordRmv ERROR m->CurrentQuestion already set: %##s (%s)",
 			m->CurrentQuestion->qname.c, DNSTypeName(m->CurrentQuestion->qtype));
-	m->CurrentQuestion = m->Questions;
+	if (m->CurrentHashQuestion)
+		LogMsg("CacheRecordRmv ERROR m->CurrentHashQuestion already set: %##s (%s)",
+			m->CurrentHashQuestion->qname.c, DNSTypeName(m->CurrentHashQuestion->qtype));
+	m->CurrentHashQuestion = m->qhash[QuestionHashSlot(rr->resrec.namehash)];
 
-	// We stop when we get to NewQuestions -- for new questions their CurrentAnswers/LargeAnswers/UniqueAnswers counters
+	// We skip NewQuestions -- for new questions their CurrentAnswers/LargeAnswers/UniqueAnswers counters
 	// will all still be zero because we haven't yet gone through the cache counting how many answers we have for them.
-	while (m->CurrentQuestion && m->CurrentQuestion != m->NewQuestions)
+	while (m->CurrentHashQuestion)
 		{
-		DNSQuestion *q = m->CurrentQuestion;
-		if (ResourceRecordAnswersQuestion(&rr->resrec, q))
+		DNSQuestion *q = m->CurrentHashQuestion;
+		m->CurrentHashQuestion = q->NextInQHash;
+		if (!QuestionIsNew(m, q) && ResourceRecordAnswersQuestion(&rr->resrec, q))
 			{
 			verbosedebugf("CacheRecordRmv %p %s", rr, CRDisplayString(m, rr));
 			q->FlappingInterface1 = mDNSNULL;
@@ -2870,13 +3133,12 @@ mDNSlocal void CacheRecordRmv(mDNS *const m, CacheRecord *rr)
 						q->qname.c, DNSTypeName(q->qtype));
 					ReconfirmAntecedents(m, &q->qname, q->qnamehash, 0);
 					}
+				m->CurrentQuestion = q;
 				AnswerCurrentQuestionWithResourceRecord(m, rr, QC_rmv);
+				m->CurrentQuestion = mDNSNULL;
 				}
 			}
-		if (m->CurrentQuestion == q)	// If m->CurrentQuestion was not auto-advanced, do it ourselves now
-			m->CurrentQuestion = q->next;
 		}
-	m->CurrentQuestion = mDNSNULL;
 	}
 
 mDNSlocal void ReleaseCacheEntity(mDNS *const m, CacheEntity *e)
@@ -2900,13 +3162,41 @@ mDNSlocal void ReleaseCacheGroup(mDNS *const m, CacheGroup **cp)
 	//	LogMsg("ReleaseCacheGroup: %##s, %p %p", (*cp)->name->c, (*cp)->name, (domainname*)((*cp)->namestorage));
 	if ((*cp)->name != (domainname*)((*cp)->namestorage)) mDNSPlatformMemFree((*cp)->name);
 	(*cp)->name = mDNSNULL;
+	CacheCheckHeapRemove(m, *cp);
 	*cp = (*cp)->next;			// Cut record from list
 	ReleaseCacheEntity(m, e);
 	}
 
+// Add rr (which has just been created from m->rec.r) to m->rrcache_targethash if its rdata names another domain name
+mDNSlocal void CacheTargetHashAdd(mDNS *const m, CacheRecord *const rr)
+	{
+	rr->NextInTargetHash = mDNSNULL;
+	rr->PrevInTargetHash = mDNSNULL;
+	if (GetRRDomainNameTarget(&rr->resrec))
+		{
+		CacheRecord **p = &m->rrcache_targethash[rr->resrec.rdatahash % CACHE_TARGET_HASH_SLOTS];
+		rr->NextInTargetHash = *p;
+		if (*p) (*p)->PrevInTargetHash = &rr->NextInTargetHash;
+		rr->PrevInTargetHash = p;
+		*p = rr;
+		}
+	}
+
+mDNSlocal void CacheTargetHashRemove(CacheRecord *const rr)
+	{
+	if (rr->PrevInTargetHash)
+		{
+		*rr->PrevInTargetHash = rr->NextInTargetHash;
+		if (rr->NextInTargetHash) rr->NextInTargetHash->PrevInTargetHash = rr->PrevInTargetHash;
+		rr->NextInTargetHash = mDNSNULL;
+		rr->PrevInTargetHash = mDNSNULL;
+		}
+	}
+
 mDNSlocal void ReleaseCacheRecord(mDNS *const m, CacheRecord *r)
 	{
 	//LogMsg("ReleaseCacheRecord: Releasing %s", CRDisplayString(m, r));
+	CacheTargetHashRemove(r);
 	if (r->resrec.rdata && r->resrec.rdata != (RData*)&r->smallrdatastorage) mDNSPlatformMemFree(r->resrec.rdata);
 	r->resrec.rdata = mDNSNULL;
 	ReleaseCacheEntity(m, (CacheEntity *)r);
@@ -2918,6 +3208,7 @@ mDNSlocal void ReleaseCacheRecord(mDNS *const m, CacheRecord *r)
 mDNSlocal void CheckCacheExpiration(mDNS *const m, CacheGroup *const cg)
 	{
 	CacheRecord **rp = &cg->members;
+	mDNSs32 next = m->timenow + 0x3FFFFFFF;
 
 	if (m->lock_rrcache) { LogMsg("CheckCacheExpiration ERROR! Cache already locked!"); return; }
 	m->lock_rrcache = 1;
@@ -2975,16 +3266,26 @@ mDNSlocal void CheckCacheExpiration(mDNS *const m, CacheGroup *const cg)
 				}
 			verbosedebugf("CheckCacheExpiration:%6d %5d %s",
 				(event - m->timenow) / mDNSPlatformOneSecond, CacheCheckGracePeriod(rr), CRDisplayString(m, rr));
-			if (m->NextCacheCheck - (event + CacheCheckGracePeriod(rr)) > 0)
-				m->NextCacheCheck = (event + CacheCheckGracePeriod(rr));
+			if (next - (event + CacheCheckGracePeriod(rr)) > 0)
+				next = (event + CacheCheckGracePeriod(rr));
 			rp = &rr->next;
 			}
 		}
 	if (cg->rrcache_tail != rp) verbosedebugf("CheckCacheExpiration: Updating CacheGroup tail from %p to %p", cg->rrcache_tail, rp);
 	cg->rrcache_tail = rp;
+	if (cg->members) SetCacheGroupCheckTime(m, cg, next);
+	else CacheCheckHeapRemove(m, cg);
 	m->lock_rrcache = 0;
 	}
 
+// Returns the address of the pointer in the hash table that points to cg, as required by ReleaseCacheGroup()
+mDNSlocal CacheGroup **CacheGroupReference(mDNS *const m, const CacheGroup *const cg)
+	{
+	CacheGroup **cp = CacheHashBucket(m, CacheHashSlot(m, cg->namehash));
+	while (*cp && *cp != cg) cp = &(*cp)->next;
+	return(cp);
+	}
+
 mDNSlocal void AnswerNewQuestion(mDNS *const m)
 	{
 	mDNSBool ShouldQueryImmediately = mDNStrue;
@@ -3125,6 +3426,56 @@ mDNSlocal void AnswerNewLocalOnlyQuestion(mDNS *const m)
 	m->CurrentRecord   = mDNSNULL;
 	}
 
+// Most records CacheClockRecycle() will look at in one call before giving up
+#define CacheClockMaxVisits 256
+
+// Called from GetCacheEntity() when the free list is empty, to recycle a single record.
+// This is a second-chance clock over the cache slots: starting at rrcache_clockslot we take the first record that is
+// not answering an active question, not in the CacheFlushRecords list, and not used since the hand last wrapped around.
+// Records skipped because they were recently used get their second chance, and become eligible on the next lap.
+// The hand keeps its position between calls, and each call looks at no more than CacheClockMaxVisits records (and
+// empty slots), so a call is bounded even when nothing in the cache can be recycled. In that case we return mDNSfalse
+// and the caller goes without; the next call carries on from where this one stopped.
+mDNSlocal mDNSBool CacheClockRecycle(mDNS *const m, const CacheGroup *const PreserveCG)
+	{
+	const mDNSu32 slots = CacheHashSlots(m);
+	mDNSu32 visits = 0;
+
+	if (m->rrcache_clockslot >= slots) m->rrcache_clockslot = 0;
+
+	while (visits < CacheClockMaxVisits)
+		{
+		CacheGroup **cp = CacheHashBucket(m, m->rrcache_clockslot);
+		visits++;
+		while (*cp && visits < CacheClockMaxVisits)
+			{
+			CacheGroup *const cg = *cp;
+			CacheRecord **rp = &cg->members;
+			while (*rp && visits++ < CacheClockMaxVisits)
+				{
+				CacheRecord *const rr = *rp;
+				// Records that answer still-active questions are not candidates for recycling
+				// Records that are currently linked into the CacheFlushRecords list may not be recycled, or we'll crash
+				if (!rr->CRActiveQuestion && !rr->NextInCFList && rr->LastUsed - m->rrcache_clocklap < 0)
+					{
+					*rp = rr->next;			// Cut record from list
+					if (cg->rrcache_tail == &rr->next) cg->rrcache_tail = rp;
+					verbosedebugf("CacheClockRecycle: Recycling slot %lu %s", m->rrcache_clockslot, CRDisplayString(m, rr));
+					ReleaseCacheRecord(m, rr);
+					if (!cg->members && cg != PreserveCG) ReleaseCacheGroup(m, cp);
+					m->rrcache_evicted++;
+					return(mDNStrue);
+					}
+				rp = &rr->next;
+				}
+			cp = &cg->next;
+			}
+		// Move on even if we ran out of visits part way through this slot, so one long chain can't stall the hand
+		if (++m->rrcache_clockslot >= slots) { m->rrcache_clockslot = 0; m->rrcache_clocklap = m->timenow; }
+		}
+	return(mDNSfalse);
+	}
+
 mDNSlocal CacheEntity *GetCacheEntity(mDNS *const m, const CacheGroup *const PreserveCG)
 	{
 	CacheEntity *e = mDNSNULL;
@@ -3141,10 +3492,14 @@ mDNSlocal CacheEntity *GetCacheEntity(mDNS *const m, const CacheGroup *const Pre
 		
 		// We don't want to be vulnerable to a malicious attacker flooding us with an infinite
 		// number of bogus records so that we keep growing our cache until the machine runs out of memory.
-		// To guard against this, if our cache grows above 512kB (approx 3168 records at 164 bytes each),
-		// and we're actively using less than 1/32 of that cache, then we purge all the unused records
-		// and recycle them, instead of allocating more memory.
-		if (m->rrcache_size > 5000 && m->rrcache_size / 32 > m->rrcache_active)
+		// If the client layer has set a hard budget with mDNS_SetCacheBudget(), we never grow beyond that.
+		// Otherwise, if our cache grows above 512kB (approx 3168 records at 164 bytes each),
+		// and we're actively using less than 1/32 of that cache, then we recycle unused records
+		// instead of allocating more memory.
+		if (m->rrcache_budget && m->rrcache_size >= m->rrcache_budget)
+			debugf("GetCacheEntity: Cache at budget: m->rrcache_size %lu; m->rrcache_budget %lu",
+				m->rrcache_size, m->rrcache_budget);
+		else if (!m->rrcache_budget && m->rrcache_size > 5000 && m->rrcache_size / 32 > m->rrcache_active)
 			LogInfo("Possible denial-of-service attack in progress: m->rrcache_size %lu; m->rrcache_active %lu",
 				m->rrcache_size, m->rrcache_active);
 		else
@@ -3155,41 +3510,9 @@ mDNSlocal CacheEntity *GetCacheEntity(mDNS *const m, const CacheGroup *const Pre
 			}
 		}
 	
-	// If we still have no free records, recycle all the records we can.
-	// Enumerating the entire cache is moderately expensive, so when we do it, we reclaim all the records we can in one pass.
-	if (!m->rrcache_free)
-		{
-		mDNSu32 oldtotalused = m->rrcache_totalused;
-		mDNSu32 slot;
-		for (slot = 0; slot < CACHE_HASH_SLOTS; slot++)
-			{
-			CacheGroup **cp = &m->rrcache_hash[slot];
-			while (*cp)
-				{
-				CacheRecord **rp = &(*cp)->members;
-				while (*rp)
-					{
-					// Records that answer still-active questions are not candidates for recycling
-					// Records that are currently linked into the CacheFlushRecords list may not be recycled, or we'll crash
-					if ((*rp)->CRActiveQuestion || (*rp)->NextInCFList)
-						rp=&(*rp)->next;
-					else
-						{
-						CacheRecord *rr = *rp;
-						*rp = (*rp)->next;			// Cut record from list
-						ReleaseCacheRecord(m, rr);
-						}
-					}
-				if ((*cp)->rrcache_tail != rp)
-					verbosedebugf("GetFreeCacheRR: Updating rrcache_tail[%lu] from %p to %p", slot, (*cp)->rrcache_tail, rp);
-				(*cp)->rrcache_tail = rp;
-				if ((*cp)->members || (*cp)==PreserveCG) cp=&(*cp)->next;
-				else ReleaseCacheGroup(m, cp);
-				}
-			}
-		LogInfo("GetCacheEntity recycled %d records to reduce cache from %d to %d",
-			oldtotalused - m->rrcache_totalused, oldtotalused, m->rrcache_totalused);
-		}
+	// If we still have no free records, recycle the next eligible record after the clock hand
+	if (!m->rrcache_free && !CacheClockRecycle(m, PreserveCG))
+		LogInfo("GetCacheEntity: No recyclable record near the clock hand; cache size %lu, %lu active", m->rrcache_size, m->rrcache_active);
 
 	if (m->rrcache_free)	// If there are records in the free list, take one
 		{
@@ -3229,12 +3552,17 @@ mDNSlocal CacheRecord *GetCacheRecord(mDNS *const m, CacheGroup *cg, mDNSu16 RDL
 mDNSlocal CacheGroup *GetCacheGroup(mDNS *const m, const mDNSu32 slot, const ResourceRecord *const rr)
 	{
 	mDNSu16 namelen = DomainNameLength(rr->name);
+	CacheGroup **bucket = CacheHashBucket(m, slot);
+	const CacheGroup *c;
+	mDNSu32 chain = 0;
 	CacheGroup *cg = (CacheGroup*)GetCacheEntity(m, mDNSNULL);
 	if (!cg) { LogMsg("GetCacheGroup: Failed to allocate memory for %##s", rr->name->c); return(mDNSNULL); }
-	cg->next         = m->rrcache_hash[slot];
+	cg->next         = *bucket;
 	cg->namehash     = rr->namehash;
 	cg->members      = mDNSNULL;
 	cg->rrcache_tail = &cg->members;
+	cg->NextCheck    = m->timenow;
+	cg->CheckIndex   = 0;
 	cg->name         = (domainname*)cg->namestorage;
 	//LogMsg("GetCacheGroup: %-10s %d-byte cache name %##s",
 	//	(namelen > InlineCacheGroupNameSize) ? "Allocating" : "Inline", namelen, rr->name->c);
@@ -3248,12 +3576,80 @@ mDNSlocal CacheGroup *GetCacheGroup(mDNS *const m, const mDNSu32 slot, const Res
 	AssignDomainName(cg->name, rr->name);
 
 	if (CacheGroupForRecord(m, slot, rr)) LogMsg("GetCacheGroup: Already have CacheGroup for %##s", rr->name->c);
-	m->rrcache_hash[slot] = cg;
+	*bucket = cg;
 	if (CacheGroupForRecord(m, slot, rr) != cg) LogMsg("GetCacheGroup: Not finding CacheGroup for %##s", rr->name->c);
+
+	for (c = cg; c; c = c->next) chain++;
+	if (m->rrcache_maxchain < chain) m->rrcache_maxchain = chain;
 	
 	return(cg);
 	}
 
+// Sizes the cache hash table steps through as the cache grows and shrinks -- primes, each roughly double the previous one
+mDNSlocal const mDNSu32 CacheHashSizes[] = { CACHE_HASH_SLOTS, 1021, 2039, 4093, 8191, 16381, 32749, 65521, 131071 };
+#define NumCacheHashSizes ((mDNSu32)(sizeof(CacheHashSizes) / sizeof(CacheHashSizes[0])))
+
+// Called from mDNS_Execute() to begin resizing the cache hash table if rrcache_totalused has moved
+// outside the load band for the current size. The CacheGroups are moved later by CacheHashRehashStep().
+mDNSlocal void CacheHashCheckLoad(mDNS *const m)
+	{
+	mDNSu32 i, slot, newslots;
+	CacheGroup **newhash;
+
+	for (i = 0; i < NumCacheHashSizes-1 && CacheHashSizes[i] != m->rrcache_hashslots; i++) continue;
+	if      (i < NumCacheHashSizes-1 && m->rrcache_totalused > m->rrcache_hashslots * CACHE_HASH_GROW_LOAD)
+		newslots = CacheHashSizes[i+1];
+	else if (i > 0 && m->rrcache_totalused < CacheHashSizes[i-1] * CACHE_HASH_SHRINK_LOAD)
+		newslots = CacheHashSizes[i-1];
+	else return;
+
+	if (newslots == CACHE_HASH_SLOTS) newhash = m->rrcache_hashstorage;
+	else
+		{
+		newhash = (CacheGroup **)mDNSPlatformMemAllocate(newslots * sizeof(CacheGroup *));
+		if (!newhash) { LogMsg("CacheHashCheckLoad: Failed to allocate %lu-slot cache hash table", newslots); return; }
+		}
+	for (slot = 0; slot < newslots; slot++) newhash[slot] = mDNSNULL;
+
+	LogInfo("CacheHashCheckLoad: Resizing cache hash table from %lu to %lu slots (%lu entities, longest chain %lu)",
+		m->rrcache_hashslots, newslots, m->rrcache_totalused, m->rrcache_maxchain);
+	m->rrcache_oldhash      = m->rrcache_hash;
+	m->rrcache_oldhashslots = m->rrcache_hashslots;
+	m->rrcache_rehashslot   = 0;
+	m->rrcache_hash         = newhash;
+	m->rrcache_hashslots    = newslots;
+	m->rrcache_maxchain     = 0;
+	m->rrcache_rehashes++;
+	}
+
+// Called from mDNS_Execute() while a resize is in progress, to migrate the next CACHE_REHASH_STEP buckets
+// of rrcache_oldhash into rrcache_hash. Once the last bucket has been migrated the old table is released.
+mDNSlocal void CacheHashRehashStep(mDNS *const m)
+	{
+	mDNSu32 n;
+	for (n = 0; n < CACHE_REHASH_STEP && m->rrcache_rehashslot < m->rrcache_oldhashslots; n++)
+		{
+		CacheGroup **old = &m->rrcache_oldhash[m->rrcache_rehashslot++];
+		while (*old)
+			{
+			CacheGroup *cg = *old;
+			CacheGroup **bucket = &m->rrcache_hash[cg->namehash % m->rrcache_hashslots];
+			*old     = cg->next;
+			cg->next = *bucket;
+			*bucket  = cg;
+			}
+		}
+
+	if (m->rrcache_rehashslot >= m->rrcache_oldhashslots)
+		{
+		LogInfo("CacheHashRehashStep: Finished migrating %lu slots into %lu", m->rrcache_oldhashslots, m->rrcache_hashslots);
+		if (m->rrcache_oldhash != m->rrcache_hashstorage) mDNSPlatformMemFree(m->rrcache_oldhash);
+		m->rrcache_oldhash      = mDNSNULL;
+		m->rrcache_oldhashslots = 0;
+		m->rrcache_rehashslot   = 0;
+		}
+	}
+
 mDNSexport void mDNS_PurgeCacheResourceRecord(mDNS *const m, CacheRecord *rr)
 	{
 	if (m->mDNS_busy != m->mDNS_reentrancy+1)
@@ -3356,16 +3752,43 @@ mDNSexport mDNSs32 mDNS_Execute(mDNS *const m)
 			{
 			mDNSu32 slot;
 			m->NextCacheCheck = m->timenow + 0x3FFFFFFF;
-			for (slot = 0; slot < CACHE_HASH_SLOTS; slot++)
+			if (m->rrcache_checkall)
+				{
+				m->rrcache_checkall = mDNSfalse;
+				for (slot = 0; slot < CacheHashSlots(m); slot++)
+					{
+					CacheGroup **cp = CacheHashBucket(m, slot);
+					while (*cp)
+						{
+						CheckCacheExpiration(m, *cp);
+						if ((*cp)->members) cp=&(*cp)->next;
+						else ReleaseCacheGroup(m, cp);
+						}
+					}
+				}
+			else
 				{
-				CacheGroup **cp = &m->rrcache_hash[slot];
-				while (*cp)
+				// Visit just the CacheGroups that are due, earliest first. CheckCacheExpiration() moves each one's
+				// NextCheck into the future (or removes it from the heap), so each group is visited at most once here.
+				mDNSu32 n = m->rrcache_checkcount;
+				while (n-- && m->rrcache_checkcount && m->timenow - m->rrcache_checkheap[1]->NextCheck >= 0)
 					{
-					CheckCacheExpiration(m, *cp);
-					if ((*cp)->members) cp=&(*cp)->next;
-					else ReleaseCacheGroup(m, cp);
+					CacheGroup *const cg = m->rrcache_checkheap[1];
+					CheckCacheExpiration(m, cg);
+					if (!cg->members) ReleaseCacheGroup(m, CacheGroupReference(m, cg));
+					else if (cg->CheckIndex == 1 && m->timenow - cg->NextCheck >= 0)
+						{ LogMsg("mDNS_Execute: CacheGroup %##s still due after CheckCacheExpiration", cg->name->c); break; }
 					}
 				}
+			if (m->rrcache_checkcount && m->NextCacheCheck - m->rrcache_checkheap[1]->NextCheck > 0)
+				m->NextCacheCheck = m->rrcache_checkheap[1]->NextCheck;
+			}
+
+		// 3a. Resize the cache hash table if the cache has grown or shrunk, migrating a few buckets per pass
+		if (!m->lock_rrcache)
+			{
+			if (m->rrcache_oldhashslots) CacheHashRehashStep(m);
+			else                         CacheHashCheckLoad(m);
 			}
 	
 		if (m->timenow - m->NextScheduledSPS >= 0)
@@ -3958,7 +4381,8 @@ mDNSexport void mDNSCoreMachineSleep(mDNS *const m, mDNSBool sleep)
 		LogInfo("mDNSCoreMachineSleep waking: NextSRVUpdate in %d %d", m->NextSRVUpdate - m->timenow, m->timenow);
 
 		// 2. Re-validate our cache records
-		m->NextCacheCheck  = m->timenow;
+		m->NextCacheCheck   = m->timenow;
+		m->rrcache_checkall = mDNStrue;
 		FORALL_CACHERECORDS(slot, cg, cr)
 			mDNS_Reconfirm_internal(m, cr, kDefaultReconfirmTimeForWake);
 
@@ -4253,7 +4677,7 @@ mDNSlocal int CompareRData(const AuthRecord *const our, const CacheRecord *const
 mDNSlocal mDNSBool MatchDependentOn(const mDNS *const m, const CacheRecord *const pktrr, const AuthRecord *const master)
 	{
 	const AuthRecord *r1;
-	for (r1 = m->ResourceRecords; r1; r1=r1->next)
+	for (r1 = m->rrauth_namehash[AuthHashSlot(pktrr->resrec.namehash)]; r1; r1=r1->NextInNameHash)
 		{
 		if (IdenticalResourceRecord(&r1->resrec, &pktrr->resrec))
 			{
@@ -4281,7 +4705,7 @@ mDNSlocal mDNSBool MatchDependentOn(const mDNS *const m, const CacheRecord *cons
 mDNSlocal const AuthRecord *FindRRSet(const mDNS *const m, const CacheRecord *const pktrr)
 	{
 	const AuthRecord *rr;
-	for (rr = m->ResourceRecords; rr; rr=rr->next)
+	for (rr = m->rrauth_namehash[AuthHashSlot(pktrr->resrec.namehash)]; rr; rr=rr->NextInNameHash)
 		{
 		if (IdenticalResourceRecord(&rr->resrec, &pktrr->resrec))
 			{
@@ -4397,66 +4821,100 @@ mDNSlocal CacheRecord *FindIdenticalRecordInCache(const mDNS *const m, const Res
 
 // Called from mDNSCoreReceiveUpdate when we get a sleep proxy registration request,
 // to check our lists and discard any stale duplicates of this record we already have
-mDNSlocal void ClearIdenticalProxyRecords(mDNS *const m, const OwnerOptData *const owner, AuthRecord *const thelist)
+mDNSlocal void ClearIdenticalProxyRecord(mDNS *const m, const OwnerOptData *const owner, AuthRecord *const rr)
+	{
+	if (m->rec.r.resrec.InterfaceID == rr->resrec.InterfaceID && mDNSSameEthAddress(&owner->HMAC, &rr->WakeUp.HMAC))
+		if (IdenticalResourceRecord(&rr->resrec, &m->rec.r.resrec))
+			{
+			LogSPS("ClearIdenticalProxyRecords: Removing %3d H-MAC %.6a I-MAC %.6a %d %d %s",
+				m->ProxyRecords, &rr->WakeUp.HMAC, &rr->WakeUp.IMAC, rr->WakeUp.seq, owner->seq, ARDisplayString(m, rr));
+			rr->WakeUp.HMAC = zeroEthAddr;	// Clear HMAC so that mDNS_Deregister_internal doesn't waste packets trying to wake this host
+			rr->RequireGoodbye = mDNSfalse;	// and we don't want to send goodbye for it
+			mDNS_Deregister_internal(m, rr, mDNS_Dereg_normal);
+			SetSPSProxyListChanged(m->rec.r.resrec.InterfaceID);
+			}
+	}
+
+mDNSlocal void ClearIdenticalProxyRecords(mDNS *const m, const OwnerOptData *const owner)
 	{
 	if (m->CurrentRecord)
 		LogMsg("ClearIdenticalProxyRecords ERROR m->CurrentRecord already set %s", ARDisplayString(m, m->CurrentRecord));
-	m->CurrentRecord = thelist;
+	m->CurrentRecord = m->DuplicateRecords;
 	while (m->CurrentRecord)
 		{
 		AuthRecord *const rr = m->CurrentRecord;
-		if (m->rec.r.resrec.InterfaceID == rr->resrec.InterfaceID && mDNSSameEthAddress(&owner->HMAC, &rr->WakeUp.HMAC))
-			if (IdenticalResourceRecord(&rr->resrec, &m->rec.r.resrec))
-				{
-				LogSPS("ClearIdenticalProxyRecords: Removing %3d H-MAC %.6a I-MAC %.6a %d %d %s",
-					m->ProxyRecords, &rr->WakeUp.HMAC, &rr->WakeUp.IMAC, rr->WakeUp.seq, owner->seq, ARDisplayString(m, rr));
-				rr->WakeUp.HMAC = zeroEthAddr;	// Clear HMAC so that mDNS_Deregister_internal doesn't waste packets trying to wake this host
-				rr->RequireGoodbye = mDNSfalse;	// and we don't want to send goodbye for it
-				mDNS_Deregister_internal(m, rr, mDNS_Dereg_normal);
-				SetSPSProxyListChanged(m->rec.r.resrec.InterfaceID);
-				}
+		ClearIdenticalProxyRecord(m, owner, rr);
 		// Mustn't advance m->CurrentRecord until *after* mDNS_Deregister_internal, because
 		// new records could have been added to the end of the list as a result of that call.
 		if (m->CurrentRecord == rr) // If m->CurrentRecord was not advanced for us, do it now
 			m->CurrentRecord = rr->next;
 		}
+
+	// Identical records have the same name, so on the main list we need only look in one namehash bucket
+	if (m->CurrentNameHashRecord)
+		LogMsg("ClearIdenticalProxyRecords ERROR m->CurrentNameHashRecord already set %s", ARDisplayString(m, m->CurrentNameHashRecord));
+	m->CurrentNameHashRecord = m->rrauth_namehash[AuthHashSlot(m->rec.r.resrec.namehash)];
+	while (m->CurrentNameHashRecord)
+		{
+		AuthRecord *const rr = m->CurrentNameHashRecord;
+		ClearIdenticalProxyRecord(m, owner, rr);
+		if (m->CurrentNameHashRecord == rr) // If m->CurrentNameHashRecord was not advanced for us, do it now
+			m->CurrentNameHashRecord = rr->NextInNameHash;
+		}
 	}
 
 // Called from ProcessQuery when we get an mDNS packet with an owner record in it
-mDNSlocal void ClearProxyRecords(mDNS *const m, const OwnerOptData *const owner, AuthRecord *const thelist)
+mDNSlocal void ClearProxyRecord(mDNS *const m, const OwnerOptData *const owner, AuthRecord *const rr)
+	{
+	if (m->rec.r.resrec.InterfaceID == rr->resrec.InterfaceID && mDNSSameEthAddress(&owner->HMAC, &rr->WakeUp.HMAC))
+		if (owner->seq != rr->WakeUp.seq || m->timenow - rr->TimeRcvd > mDNSPlatformOneSecond * 60)
+			{
+			if (rr->AddressProxy.type == mDNSAddrType_IPv6)
+				{
+				#if MDNS_USE_Unsolicited_Neighbor_Advertisements
+				LogSPS("NDP Announcement -- Releasing traffic for H-MAC %.6a I-MAC %.6a %s",
+					&rr->WakeUp.HMAC, &rr->WakeUp.IMAC, ARDisplayString(m,rr));
+				// Neighbor Advertisement; Override flag
+				SendNDP(m, 0x88, 0x20, rr, &rr->AddressProxy.ip.v6, &rr->WakeUp.IMAC, &AllHosts_v6, &AllHosts_v6_Eth);
+				#endif
+				}
+			LogSPS("ClearProxyRecords: Removing %3d AC %2d %02X H-MAC %.6a I-MAC %.6a %d %d %s",
+				m->ProxyRecords, rr->AnnounceCount, rr->resrec.RecordType,
+				&rr->WakeUp.HMAC, &rr->WakeUp.IMAC, rr->WakeUp.seq, owner->seq, ARDisplayString(m, rr));
+			if (rr->resrec.RecordType == kDNSRecordTypeDeregistering) rr->resrec.RecordType = kDNSRecordTypeShared;
+			rr->WakeUp.HMAC = zeroEthAddr;	// Clear HMAC so that mDNS_Deregister_internal doesn't waste packets trying to wake this host
+			rr->RequireGoodbye = mDNSfalse;	// and we don't want to send goodbye for it, since real host is now back and functional
+			mDNS_Deregister_internal(m, rr, mDNS_Dereg_normal);
+			SetSPSProxyListChanged(m->rec.r.resrec.InterfaceID);
+			}
+	}
+
+mDNSlocal void ClearProxyRecords(mDNS *const m, const OwnerOptData *const owner)
 	{
 	if (m->CurrentRecord)
 		LogMsg("ClearProxyRecords ERROR m->CurrentRecord already set %s", ARDisplayString(m, m->CurrentRecord));
-	m->CurrentRecord = thelist;
+	m->CurrentRecord = m->DuplicateRecords;
 	while (m->CurrentRecord)
 		{
 		AuthRecord *const rr = m->CurrentRecord;
-		if (m->rec.r.resrec.InterfaceID == rr->resrec.InterfaceID && mDNSSameEthAddress(&owner->HMAC, &rr->WakeUp.HMAC))
-			if (owner->seq != rr->WakeUp.seq || m->timenow - rr->TimeRcvd > mDNSPlatformOneSecond * 60)
-				{
-				if (rr->AddressProxy.type == mDNSAddrType_IPv6)
-					{
-					#if MDNS_USE_Unsolicited_Neighbor_Advertisements
-					LogSPS("NDP Announcement -- Releasing traffic for H-MAC %.6a I-MAC %.6a %s",
-						&rr->WakeUp.HMAC, &rr->WakeUp.IMAC, ARDisplayString(m,rr));
-					// Neighbor Advertisement; Override flag
-					SendNDP(m, 0x88, 0x20, rr, &rr->AddressProxy.ip.v6, &rr->WakeUp.IMAC, &AllHosts_v6, &AllHosts_v6_Eth);
-					#endif
-					}
-				LogSPS("ClearProxyRecords: Removing %3d AC %2d %02X H-MAC %.6a I-MAC %.6a %d %d %s",
-					m->ProxyRecords, rr->AnnounceCount, rr->resrec.RecordType,
-					&rr->WakeUp.HMAC, &rr->WakeUp.IMAC, rr->WakeUp.seq, owner->seq, ARDisplayString(m, rr));
-				if (rr->resrec.RecordType == kDNSRecordTypeDeregistering) rr->resrec.RecordType = kDNSRecordTypeShared;
-				rr->WakeUp.HMAC = zeroEthAddr;	// Clear HMAC so that mDNS_Deregister_internal doesn't waste packets trying to wake this host
-				rr->RequireGoodbye = mDNSfalse;	// and we don't want to send goodbye for it, since real host is now back and functional
-				mDNS_Deregister_internal(m, rr, mDNS_Dereg_normal);
-				SetSPSProxyListChanged(m->rec.r.resrec.InterfaceID);
-				}
+		ClearProxyRecord(m, owner, rr);
 		// Mustn't advance m->CurrentRecord until *after* mDNS_Deregister_internal, because
 		// new records could have been added to the end of the list as a result of that call.
 		if (m->CurrentRecord == rr) // If m->CurrentRecord was not advanced for us, do it now
 			m->CurrentRecord = rr->next;
 		}
+
+	// On the main list, only the records in this owner's bucket can match
+	if (m->CurrentOwnerHashRecord)
+		LogMsg("ClearProxyRecords ERROR m->CurrentOwnerHashRecord already set %s", ARDisplayString(m, m->CurrentOwnerHashRecord));
+	m->CurrentOwnerHashRecord = m->rrauth_ownerhash[AuthOwnerSlot(&owner->HMAC)];
+	while (m->CurrentOwnerHashRecord)
+		{
+		AuthRecord *const rr = m->CurrentOwnerHashRecord;
+		ClearProxyRecord(m, owner, rr);
+		if (m->CurrentOwnerHashRecord == rr) // If m->CurrentOwnerHashRecord was not advanced for us, do it now
+			m->CurrentOwnerHashRecord = rr->NextInOwnerHash;
+		}
 	}
 
 // ProcessQuery examines a received query to see if we have any answers to give
@@ -4494,8 +4952,7 @@ mDNSlocal mDNSu8 *ProcessQuery(mDNS *const m, const DNSMessage *const query, con
 			for (opt = &m->rec.r.resrec.rdata->u.opt[0]; opt < e; opt++)
 				if (opt->opt == kDNSOpt_Owner && opt->u.owner.vers == 0 && opt->u.owner.HMAC.l[0])
 					{
-					ClearProxyRecords(m, &opt->u.owner, m->DuplicateRecords);
-					ClearProxyRecords(m, &opt->u.owner, m->ResourceRecords);
+					ClearProxyRecords(m, &opt->u.owner);
 					}
 			}
 		m->rec.r.resrec.RecordType = 0;		// Clear RecordType to show we're not still using it
@@ -4532,13 +4989,14 @@ mDNSlocal mDNSu8 *ProcessQuery(mDNS *const m, const DNSMessage *const query, con
 		// Also note: we just mark potential answer records here, without trying to build the
 		// "ResponseRecords" list, because we don't want to risk user callbacks deleting records
 		// from that list while we're in the middle of trying to build it.
-		if (m->CurrentRecord)
-			LogMsg("ProcessQuery ERROR m->CurrentRecord already set %s", ARDisplayString(m, m->CurrentRecord));
-		m->CurrentRecord = m->ResourceRecords;
-		while (m->CurrentRecord)
-			{
-			rr = m->CurrentRecord;
-			m->CurrentRecord = rr->next;
+		// Only records in the question's namehash bucket can answer it, so that's all we need to look at.
+		if (m->CurrentNameHashRecord)
+			LogMsg("ProcessQuery ERROR m->CurrentNameHashRecord already set %s", ARDisplayString(m, m->CurrentNameHashRecord));
+		m->CurrentNameHashRecord = m->rrauth_namehash[AuthHashSlot(pktq.qnamehash)];
+		while (m->CurrentNameHashRecord)
+			{
+			rr = m->CurrentNameHashRecord;
+			m->CurrentNameHashRecord = rr->NextInNameHash;
 			if (AnyTypeRecordAnswersQuestion(&rr->resrec, &pktq) && (QueryWasMulticast || QueryWasLocalUnicast || rr->AllowRemoteQuery))
 				{
 				if (RRTypeAnswersQuestionType(&rr->resrec, pktq.qtype))
@@ -4636,7 +5094,7 @@ mDNSlocal mDNSu8 *ProcessQuery(mDNS *const m, const DNSMessage *const query, con
 #if ENABLE_MULTI_PACKET_QUERY_SNOOPING
 			if (!(query->h.flags.b[0] & kDNSFlag0_TC))
 #endif
-				for (q = m->Questions; q; q=q->next)
+				for (q = m->qhash[QuestionHashSlot(pktq.qnamehash)]; q; q=q->NextInQHash)
 					if (!q->Target.type && ActiveQuestion(q) && m->timenow - q->LastQTxTime > mDNSPlatformOneSecond / 4)
 						if (!q->InterfaceID || q->InterfaceID == InterfaceID)
 							if (q->NextInDQList == mDNSNULL && dqp != &q->NextInDQList)
@@ -5006,7 +5464,7 @@ struct UDPSocket_struct
 mDNSlocal DNSQuestion *ExpectingUnicastResponseForQuestion(const mDNS *const m, const mDNSIPPort port, const mDNSOpaque16 id, const DNSQuestion *const question, mDNSBool tcp)
 	{
 	DNSQuestion *q;
-	for (q = m->Questions; q; q=q->next)
+	for (q = m->qidhash[QuestionQIDSlot(id)]; q; q=q->NextInQIDHash)
 		{
 		if (!tcp && !q->LocalSocket) continue;
 		if (mDNSSameIPPort(tcp ? q->tcpSrcPort : q->LocalSocket->port, port)     &&
@@ -5030,7 +5488,7 @@ mDNSlocal DNSQuestion *ExpectingUnicastResponseForRecord(mDNS *const m,
 	// Unicast records have zero as InterfaceID
 	if (rr->resrec.InterfaceID) return mDNSNULL;
 
-	for (q = m->Questions; q; q=q->next)
+	for (q = m->qhash[QuestionHashSlot(rr->resrec.namehash)]; q; q=q->NextInQHash)
 		{
 		if (!q->DuplicateOf && UnicastResourceRecordAnswersQuestion(&rr->resrec, q))
 			{
@@ -5116,6 +5574,7 @@ mDNSexport CacheRecord *CreateNewCacheEntry(mDNS *const m, const mDNSu32 slot, C
 		rr->next = mDNSNULL;					// Clear 'next' pointer
 		*(cg->rrcache_tail) = rr;				// Append this record to tail of cache slot list
 		cg->rrcache_tail = &(rr->next);			// Advance tail pointer
+		CacheTargetHashAdd(m, rr);				// Index by rdata target so ReconfirmAntecedents() can find it
 		if (rr->resrec.RecordType == kDNSRecordTypePacketNegative)
 			rr->DelayDelivery = NonZeroTime(m->timenow);
 		else if (rr->resrec.RecordType & kDNSRecordTypePacketUniqueMask &&			// If marked unique,
@@ -5191,6 +5650,36 @@ mDNSlocal mDNSu32 GetEffectiveTTL(const uDNS_LLQType LLQType, mDNSu32 ttl)		// T
 	return ttl;
 	}
 
+// Decides, before we go to the trouble of unpacking a response record, whether doing so could have any effect.
+// Answers mDNStrue whenever any of the checks in mDNSCoreReceiveResponse might use the record; mDNSfalse only
+// for records that would certainly be unpacked and then ignored, like the authority and glue records a unicast
+// DNS server adds to its replies, or a unicast reply to a query we never sent.
+// AlwaysAcceptable is set for multicast, TCP and LLQ responses, which we cache regardless of our questions.
+mDNSlocal mDNSBool PacketRRMayBeUseful(const mDNS *const m, const DNSMessage *const response, const PacketRRView *const view,
+	const mDNSInterfaceID InterfaceID, const mDNSBool AlwaysAcceptable, const CacheRecord *const CacheFlushRecords)
+	{
+	const CacheRecord *cr;
+
+	if (view->rrtype == kDNSType_TSIG) return(mDNSfalse);	// We never cache TSIG pseudo-RRs
+	if (view->rrtype == kDNSType_OPT)  return(mDNStrue);	// OPT may carry an owner option telling us to clear proxy records
+
+	// It may conflict with one of our own records, but only if we have a record in the same name hash bucket
+	if (mDNSOpaque16IsZero(response->h.id) && view->rrtype != kDNSType_NSEC && m->rrauth_namehash[AuthHashSlot(view->namehash)])
+		return(mDNStrue);
+
+	if (!m->rrcache_size) return(mDNSfalse);
+	if (AlwaysAcceptable) return(mDNStrue);
+
+	// ExpectingUnicastResponseForRecord can only find questions with the same name as the record
+	if (!InterfaceID && m->qhash[QuestionHashSlot(view->namehash)]) return(mDNStrue);
+
+	// It may be the target of a record we've already accepted from this packet (e.g. an A record following a CNAME)
+	for (cr = CacheFlushRecords; cr != (CacheRecord*)1; cr = cr->NextInCFList)
+		if (cr->resrec.rdatahash == view->namehash) return(mDNStrue);
+
+	return(mDNSfalse);
+	}
+
 // Note: mDNSCoreReceiveResponse calls mDNS_Deregister_internal which can call a user callback, which may change
 // the record list and/or question list.
 // Any code walking either list must use the CurrentQuestion and/or CurrentRecord mechanism to protect against this.
@@ -5200,7 +5689,7 @@ mDNSlocal mDNSu32 GetEffectiveTTL(const uDNS_LLQType LLQType, mDNSu32 ttl)		// T
 mDNSlocal void mDNSCoreReceiveResponse(mDNS *const m,
 	const DNSMessage *const response, const mDNSu8 *end,
 	const mDNSAddr *srcaddr, const mDNSIPPort srcport, const mDNSAddr *dstaddr, mDNSIPPort dstport,
-	const mDNSInterfaceID InterfaceID)
+	const mDNSInterfaceID InterfaceID, const PreParsedPacket *const pp)
 	{
 	int i;
 	mDNSBool ResponseMCast    = dstaddr && mDNSAddrIsDNSMulticast(dstaddr);
@@ -5324,6 +5813,22 @@ mDNSlocal void mDNSCoreReceiveResponse(mDNS *const m,
 		const mDNSu8 RecordType =
 			(i < firstauthority ) ? (mDNSu8)kDNSRecordTypePacketAns  :
 			(i < firstadditional) ? (mDNSu8)kDNSRecordTypePacketAuth : (mDNSu8)kDNSRecordTypePacketAdd;
+		PacketRRView view;
+		const mDNSu8 *next;
+		// A view pre-parsed from the same place in the same packet is exactly what PeekResourceRecord would give us
+		if (pp && i < pp->numrecords && pp->records[i].start == ptr)
+			{ view = pp->records[i]; next = view.rdata + view.rdlength; }
+		else next = PeekResourceRecord(response, ptr, end, &view);
+		if (!next) goto exit;
+
+		// Only decompress the names and rdata of records we might actually use
+		if (!PacketRRMayBeUseful(m, response, &view, InterfaceID, AcceptableResponse, CacheFlushRecords))
+			{
+			verbosedebugf("mDNSCoreReceiveResponse skipping unwanted record type %s", DNSTypeName(view.rrtype));
+			ptr = next;
+			continue;
+			}
+
 		ptr = GetLargeResourceRecord(m, response, ptr, end, InterfaceID, RecordType, &m->rec);
 		if (!ptr) goto exit;		// Break out of the loop and clean up our CacheFlushRecords list before exiting
 
@@ -5338,8 +5843,7 @@ mDNSlocal void mDNSCoreReceiveResponse(mDNS *const m,
 			for (opt = &m->rec.r.resrec.rdata->u.opt[0]; opt < e; opt++)
 				if (opt->opt == kDNSOpt_Owner && opt->u.owner.vers == 0 && opt->u.owner.HMAC.l[0])
 					{
-					ClearProxyRecords(m, &opt->u.owner, m->DuplicateRecords);
-					ClearProxyRecords(m, &opt->u.owner, m->ResourceRecords);
+					ClearProxyRecords(m, &opt->u.owner);
 					}
 			m->rec.r.resrec.RecordType = 0;
 			continue;
@@ -5419,13 +5923,14 @@ mDNSlocal void mDNSCoreReceiveResponse(mDNS *const m,
 		// 1. Check that this packet resource record does not conflict with any of ours
 		if (mDNSOpaque16IsZero(response->h.id) && m->rec.r.resrec.rrtype != kDNSType_NSEC)
 			{
-			if (m->CurrentRecord)
-				LogMsg("mDNSCoreReceiveResponse ERROR m->CurrentRecord already set %s", ARDisplayString(m, m->CurrentRecord));
-			m->CurrentRecord = m->ResourceRecords;
-			while (m->CurrentRecord)
+			// PacketRRMatchesSignature requires the names to match, so we need only look in this record's namehash bucket
+			if (m->CurrentNameHashRecord)
+				LogMsg("mDNSCoreReceiveResponse ERROR m->CurrentNameHashRecord already set %s", ARDisplayString(m, m->CurrentNameHashRecord));
+			m->CurrentNameHashRecord = m->rrauth_namehash[AuthHashSlot(m->rec.r.resrec.namehash)];
+			while (m->CurrentNameHashRecord)
 				{
-				AuthRecord *rr = m->CurrentRecord;
-				m->CurrentRecord = rr->next;
+				AuthRecord *rr = m->CurrentNameHashRecord;
+				m->CurrentNameHashRecord = rr->NextInNameHash;
 				// We accept all multicast responses, and unicast responses resulting from queries we issued
 				// For other unicast responses, this code accepts them only for responses with an
 				// (apparently) local source address that pertain to a record of our own that's in probing state
@@ -5565,7 +6070,8 @@ mDNSlocal void mDNSCoreReceiveResponse(mDNS *const m,
 						if (!(rr->resrec.RecordType & kDNSRecordTypePacketUniqueMask))
 							{
 							DNSQuestion *q;
-							for (q = m->Questions; q; q=q->next) if (ResourceRecordAnswersQuestion(&rr->resrec, q)) q->UniqueAnswers++;
+							for (q = m->qhash[QuestionHashSlot(rr->resrec.namehash)]; q; q=q->NextInQHash)
+								if (ResourceRecordAnswersQuestion(&rr->resrec, q)) q->UniqueAnswers++;
 							rr->resrec.RecordType = m->rec.r.resrec.RecordType;
 							}
 						}
@@ -5597,7 +6103,7 @@ mDNSlocal void mDNSCoreReceiveResponse(mDNS *const m,
 						// true for records like A etc. but not for PTR.
 						if (rr->resrec.RecordType & kDNSRecordTypePacketUniqueMask)
 							{
-							for (q = m->Questions; q; q=q->next)
+							for (q = m->qhash[QuestionHashSlot(rr->resrec.namehash)]; q; q=q->NextInQHash)
 								{
 								if (!q->DuplicateOf && !q->LongLived && 
 									ActiveQuestion(q) && ResourceRecordAnswersQuestion(&rr->resrec, q))
@@ -5659,7 +6165,7 @@ exit:
 		{
 		CacheRecord *r1 = CacheFlushRecords, *r2;
 		const mDNSu32 slot = HashSlot(r1->resrec.name);
-		const CacheGroup *cg = CacheGroupForRecord(m, slot, &r1->resrec);
+		CacheGroup *cg = CacheGroupForRecord(m, slot, &r1->resrec);
 		CacheFlushRecords = CacheFlushRecords->NextInCFList;
 		r1->NextInCFList = mDNSNULL;
 		
@@ -5731,7 +6237,7 @@ exit:
 						{
 						debugf("Cache flush for DE record %s", CRDisplayString(m, r2));
 						r2->resrec.rroriginalttl = 0;
-						m->NextCacheCheck = m->timenow;
+						ScheduleCacheGroupCheck(m, cg, m->timenow);
 						m->NextScheduledEvent = m->timenow;
 						}
 					else if (RRExpireTime(r2) - m->timenow > mDNSPlatformOneSecond)
@@ -6000,8 +6506,7 @@ mDNSlocal void mDNSCoreReceiveUpdate(mDNS *const m,
 					{
 					mDNSu8 RecordType = m->rec.r.resrec.RecordType & kDNSRecordTypePacketUniqueMask ? kDNSRecordTypeUnique : kDNSRecordTypeShared;
 					m->rec.r.resrec.rrclass &= ~kDNSClass_UniqueRRSet;
-					ClearIdenticalProxyRecords(m, &owner, m->DuplicateRecords);	// Make sure we don't have any old stale duplicates of this record
-					ClearIdenticalProxyRecords(m, &owner, m->ResourceRecords);
+					ClearIdenticalProxyRecords(m, &owner);	// Make sure we don't have any old stale duplicates of this record
 					mDNS_SetupResourceRecord(ar, mDNSNULL, InterfaceID, m->rec.r.resrec.rrtype, m->rec.r.resrec.rroriginalttl, RecordType, SPSRecordCallback, ar);
 					AssignDomainName(&ar->namestorage, m->rec.r.resrec.name);
 					ar->resrec.rdlength = GetRDLength(&m->rec.r.resrec, mDNSfalse);
@@ -6037,8 +6542,7 @@ mDNSlocal void mDNSCoreReceiveUpdate(mDNS *const m,
 		if (m->omsg.h.flags.b[1] & kDNSFlag1_RC_Mask)
 			{
 			LogMsg("Refusing sleep proxy registration from %#a:%d: Out of memory", srcaddr, mDNSVal16(srcport));
-			ClearProxyRecords(m, &owner, m->DuplicateRecords);
-			ClearProxyRecords(m, &owner, m->ResourceRecords);
+			ClearProxyRecords(m, &owner);
 			}
 		else
 			{
@@ -6137,9 +6641,33 @@ mDNSexport void MakeNegativeCacheRecord(mDNS *const m, CacheRecord *const cr,
 	cr->NextInCFList       = mDNSNULL;
 	}
 
-mDNSexport void mDNSCoreReceive(mDNS *const m, void *const pkt, const mDNSu8 *const end,
+// Walks the records of a received response up front, reading nothing but the packet itself, so that it can be done
+// on a receive thread without the lock. The header must still be in network byte order, as it came off the wire.
+mDNSexport void mDNSCorePreParsePacket(const DNSMessage *const msg, const mDNSu8 *const end, PreParsedPacket *const pp)
+	{
+	const mDNSu8 *const hdr = (const mDNSu8 *)&msg->h.numQuestions;
+	const mDNSu8 *ptr = msg->data;
+	int i, numQuestions, totalrecords;
+
+	pp->numrecords = 0;
+	if (end < msg->data) return;
+	if ((msg->h.flags.b[0] & kDNSFlag0_QROP_Mask) != (kDNSFlag0_QR_Response | kDNSFlag0_OP_StdQuery)) return;
+
+	numQuestions = (mDNSu16)((mDNSu16)hdr[0] << 8 | hdr[1]);
+	totalrecords = (mDNSu16)((mDNSu16)hdr[2] << 8 | hdr[3]) + (mDNSu16)((mDNSu16)hdr[4] << 8 | hdr[5]) +
+	               (mDNSu16)((mDNSu16)hdr[6] << 8 | hdr[7]);
+	for (i = 0; i < numQuestions && ptr; i++) ptr = skipQuestion(msg, ptr, end);
+
+	while (pp->numrecords < totalrecords && pp->numrecords < kMaxPreParsedRecords && ptr && ptr < end)
+		{
+		ptr = PeekResourceRecord(msg, ptr, end, &pp->records[pp->numrecords]);
+		if (ptr) pp->numrecords++;
+		}
+	}
+
+mDNSexport void mDNSCoreReceivePreParsed(mDNS *const m, void *const pkt, const mDNSu8 *const end,
 	const mDNSAddr *const srcaddr, const mDNSIPPort srcport, const mDNSAddr *dstaddr, const mDNSIPPort dstport,
-	const mDNSInterfaceID InterfaceID)
+	const mDNSInterfaceID InterfaceID, const PreParsedPacket *const pp)
 	{
 	mDNSInterfaceID ifid = InterfaceID;
 	DNSMessage  *msg  = (DNSMessage *)pkt;
@@ -6210,7 +6738,7 @@ mDNSexport void mDNSCoreReceive(mDNS *const m, void *const pkt, const mDNSu8 *co
 			}
 #endif
 	if      (QR_OP == StdQ) mDNSCoreReceiveQuery   (m, msg, end, srcaddr, srcport, dstaddr, dstport, ifid);
-	else if (QR_OP == StdR) mDNSCoreReceiveResponse(m, msg, end, srcaddr, srcport, dstaddr, dstport, ifid);
+	else if (QR_OP == StdR) mDNSCoreReceiveResponse(m, msg, end, srcaddr, srcport, dstaddr, dstport, ifid, pp);
 	else if (QR_OP == UpdQ) mDNSCoreReceiveUpdate  (m, msg, end, srcaddr, srcport, dstaddr, dstport, InterfaceID);
 	else if (QR_OP == UpdR) mDNSCoreReceiveUpdateR (m, msg, end,                                     InterfaceID);
 	else
@@ -6237,6 +6765,28 @@ mDNSexport void mDNSCoreReceive(mDNS *const m, void *const pkt, const mDNSu8 *co
 	mDNS_Unlock(m);
 	}
 
+mDNSexport void mDNSCoreReceive(mDNS *const m, void *const pkt, const mDNSu8 *const end,
+	const mDNSAddr *const srcaddr, const mDNSIPPort srcport, const mDNSAddr *dstaddr, const mDNSIPPort dstport,
+	const mDNSInterfaceID InterfaceID)
+	{
+	mDNSCoreReceivePreParsed(m, pkt, end, srcaddr, srcport, dstaddr, dstport, InterfaceID, mDNSNULL);
+	}
+
+// Takes the lock on behalf of a run of mDNSCoreReceive() calls. Each mDNSCoreReceive() still does its own
+// mDNS_Lock/mDNS_Unlock, but because we've bumped mDNS_reentrancy those are nested entries that keep our
+// m->timenow and leave the GetNextScheduledEvent() work to the final mDNS_Unlock in mDNSCoreEndReceiveBatch().
+mDNSexport void mDNSCoreBeginReceiveBatch(mDNS *const m)
+	{
+	mDNS_Lock(m);
+	mDNS_DropLockBeforeCallback();
+	}
+
+mDNSexport void mDNSCoreEndReceiveBatch(mDNS *const m)
+	{
+	mDNS_ReclaimLockAfterCallback();
+	mDNS_Unlock(m);
+	}
+
 // ***************************************************************************
 #if COMPILER_LIKES_PRAGMA_MARK
 #pragma mark -
@@ -6267,8 +6817,8 @@ mDNSlocal DNSQuestion *FindDuplicateQuestion(const mDNS *const m, const DNSQuest
 	// Note: A question can only be marked as a duplicate of one that occurs *earlier* in the list.
 	// This prevents circular references, where two questions are each marked as a duplicate of the other.
 	// Accordingly, we break out of the loop when we get to 'question', because there's no point searching
-	// further in the list.
-	for (q = m->Questions; q && q != question; q=q->next)		// Scan our list for another question
+	// further in the list. Questions with the same name are in the same qhash bucket, in list order.
+	for (q = m->qhash[QuestionHashSlot(question->qnamehash)]; q && q != question; q=q->NextInQHash)	// Scan for another question
 		if (q->InterfaceID == question->InterfaceID &&			// with the same InterfaceID,
 			SameQTarget(q, question)                &&			// and same unicast/multicast target settings
 			q->qtype      == question->qtype        &&			// type,
@@ -6285,7 +6835,7 @@ mDNSlocal DNSQuestion *FindDuplicateQuestion(const mDNS *const m, const DNSQuest
 mDNSlocal void UpdateQuestionDuplicates(mDNS *const m, DNSQuestion *const question)
 	{
 	DNSQuestion *q;
-	for (q = m->Questions; q; q=q->next)		// Scan our list of questions
+	for (q = m->qhash[QuestionHashSlot(question->qnamehash)]; q; q=q->NextInQHash)	// Scan questions with the same qnamehash
 		if (q->DuplicateOf == question)			// To see if any questions were referencing this as their duplicate
 			if ((q->DuplicateOf = FindDuplicateQuestion(m, q)) == mDNSNULL)
 				{
@@ -6305,7 +6855,7 @@ mDNSlocal void UpdateQuestionDuplicates(mDNS *const m, DNSQuestion *const questi
 				q->qDNSServer        = question->qDNSServer;
 				q->unansweredQueries = question->unansweredQueries;
 
-				q->TargetQID         = question->TargetQID;
+				SetQuestionTargetQID(m, q, question->TargetQID);
 				q->LocalSocket       = question->LocalSocket;
 
 				q->state             = question->state;
@@ -6644,6 +7194,12 @@ mDNSexport mStatus mDNS_StartQuery_internal(mDNS *const m, DNSQuestion *const qu
 		// that to go out immediately.
 		question->next              = mDNSNULL;
 		question->qnamehash         = DomainNameHashValue(&question->qname);	// MUST do this before FindDuplicateQuestion()
+		question->NextInQHash       = mDNSNULL;
+		question->PrevInQHash       = mDNSNULL;
+		question->NextInQIDHash     = mDNSNULL;
+		question->PrevInQIDHash     = mDNSNULL;
+		if (question->InterfaceID != mDNSInterface_LocalOnly)
+			QuestionHashAdd(m, question);										// MUST do this before FindDuplicateQuestion() too
 		question->DelayAnswering    = CheckForSoonToExpireRecords(m, &question->qname, question->qnamehash, HashSlot(&question->qname));
 		question->LastQTime         = m->timenow;
 		question->ThisQInterval     = InitialQuestionInterval;					// MUST be > zero for an active question
@@ -6770,7 +7326,7 @@ mDNSexport mStatus mDNS_StopQuery_internal(mDNS *const m, DNSQuestion *const que
 
 	if (question->InterfaceID == mDNSInterface_LocalOnly) qp = &m->LocalOnlyQuestions;
 	while (*qp && *qp != question) qp=&(*qp)->next;
-	if (*qp) *qp = (*qp)->next;
+	if (*qp) { *qp = (*qp)->next; QuestionHashRemove(m, question); }
 	else
 		{
 #if !ForceAlerts
@@ -6796,7 +7352,7 @@ mDNSexport mStatus mDNS_StopQuery_internal(mDNS *const m, DNSQuestion *const que
 		if (rr->CRActiveQuestion == question)
 			{
 			DNSQuestion *q;
-			for (q = m->Questions; q; q=q->next)		// Scan our list of questions
+			for (q = m->qhash[QuestionHashSlot(rr->resrec.namehash)]; q; q=q->NextInQHash)	// Scan questions with this name
 				if (ActiveQuestion(q) && ResourceRecordAnswersQuestion(&rr->resrec, q))
 					break;
 			debugf("mDNS_StopQuery_internal: Updating CRActiveQuestion to %p for cache record %s", q, CRDisplayString(m,rr));
@@ -7853,7 +8409,8 @@ mDNSexport void mDNS_DeregisterInterface(mDNS *const m, NetworkInterfaceInfo *se
 		mDNSu32 slot;
 		CacheGroup *cg;
 		CacheRecord *rr;
-		m->NextCacheCheck = m->timenow;
+		m->NextCacheCheck   = m->timenow;
+		m->rrcache_checkall = mDNStrue;
 		FORALL_CACHERECORDS(slot, cg, rr)
 			if (rr->resrec.InterfaceID == set->InterfaceID)
 				mDNS_Reconfirm_internal(m, rr, kDefaultReconfirmTimeForFlappingInterface);
@@ -8348,7 +8905,7 @@ mDNSlocal mDNSBool mDNS_IdUsedInResourceRecordsList(mDNS * const m, mDNSOpaque16
 mDNSlocal mDNSBool mDNS_IdUsedInQuestionsList(mDNS * const m, mDNSOpaque16 id)
 	{
 	DNSQuestion *q;
-	for (q = m->Questions; q; q=q->next) if (mDNSSameOpaque16(id, q->TargetQID)) return mDNStrue;
+	for (q = m->qidhash[QuestionQIDSlot(id)]; q; q=q->NextInQIDHash) if (mDNSSameOpaque16(id, q->TargetQID)) return mDNStrue;
 	return mDNSfalse;
 	}
 	
@@ -8813,6 +9370,13 @@ mDNSexport void mDNS_GrowCache(mDNS *const m, CacheEntity *storage, mDNSu32 numr
 	mDNS_Unlock(m);
 	}
 
+mDNSexport void mDNS_SetCacheBudget(mDNS *const m, mDNSu32 numrecords)
+	{
+	mDNS_Lock(m);
+	m->rrcache_budget = numrecords;
+	mDNS_Unlock(m);
+	}
+
 mDNSexport mStatus mDNS_Init(mDNS *const m, mDNS_PlatformSupport *const p,
 	CacheEntity *rrcachestorage, mDNSu32 rrcachesize,
 	mDNSBool AdvertiseLocalAddresses, mDNSCallback *Callback, void *Context)
@@ -8871,20 +9435,41 @@ mDNSexport mStatus mDNS_Init(mDNS *const m, mDNS_PlatformSupport *const p,
 	m->AnnounceOwner           = 0;
 	m->DelaySleep              = 0;
 	m->SleepLimit              = 0;
+	SetCompressionDict(&m->omsgdict, &m->omsg);
 
 	// These fields only required for mDNS Searcher...
 	m->Questions               = mDNSNULL;
 	m->NewQuestions            = mDNSNULL;
 	m->CurrentQuestion         = mDNSNULL;
+	m->CurrentHashQuestion     = mDNSNULL;
+	m->NextQuestionSerial      = 0;
+	for (slot = 0; slot < QUESTION_HASH_SLOTS; slot++) m->qhash[slot]   = mDNSNULL;
+	for (slot = 0; slot < QUESTION_QID_SLOTS;  slot++) m->qidhash[slot] = mDNSNULL;
 	m->LocalOnlyQuestions      = mDNSNULL;
 	m->NewLocalOnlyQuestions   = mDNSNULL;
 	m->rrcache_size            = 0;
 	m->rrcache_totalused       = 0;
 	m->rrcache_active          = 0;
 	m->rrcache_report          = 10;
+	m->rrcache_budget          = 0;
+	m->rrcache_evicted         = 0;
+	m->rrcache_clockslot       = 0;
+	m->rrcache_clocklap        = timenow;
 	m->rrcache_free            = mDNSNULL;
 
-	for (slot = 0; slot < CACHE_HASH_SLOTS; slot++) m->rrcache_hash[slot] = mDNSNULL;
+	for (slot = 0; slot < CACHE_HASH_SLOTS; slot++) m->rrcache_hashstorage[slot] = mDNSNULL;
+	for (slot = 0; slot < CACHE_TARGET_HASH_SLOTS; slot++) m->rrcache_targethash[slot] = mDNSNULL;
+	m->rrcache_hash            = m->rrcache_hashstorage;
+	m->rrcache_hashslots       = CACHE_HASH_SLOTS;
+	m->rrcache_oldhash         = mDNSNULL;
+	m->rrcache_oldhashslots    = 0;
+	m->rrcache_rehashslot      = 0;
+	m->rrcache_rehashes        = 0;
+	m->rrcache_maxchain        = 0;
+	m->rrcache_checkheap       = mDNSNULL;
+	m->rrcache_checkcount      = 0;
+	m->rrcache_checksize       = 0;
+	m->rrcache_checkall        = mDNSfalse;
 
 	mDNS_GrowCache_internal(m, rrcachestorage, rrcachesize);
 
@@ -8898,6 +9483,10 @@ mDNSexport mStatus mDNS_Init(mDNS *const m, mDNS_PlatformSupport *const p,
 	m->DuplicateRecords        = mDNSNULL;
 	m->NewLocalRecords         = mDNSNULL;
 	m->CurrentRecord           = mDNSNULL;
+	m->CurrentNameHashRecord   = mDNSNULL;
+	m->CurrentOwnerHashRecord  = mDNSNULL;
+	for (slot = 0; slot < AUTH_HASH_SLOTS;  slot++) m->rrauth_namehash[slot]  = mDNSNULL;
+	for (slot = 0; slot < AUTH_OWNER_SLOTS; slot++) m->rrauth_ownerhash[slot] = mDNSNULL;
 	m->HostInterfaces          = mDNSNULL;
 	m->ProbeFailTime           = 0;
 	m->NumFailedProbes         = 0;
@@ -9171,7 +9760,7 @@ mDNSexport void DNSServerChangeForQuestion(mDNS *const m, DNSQuestion *q, DNSSer
 	// from the old server is not accepted as a response from the new server but only messages
 	// from the new server are accepted as valid responses
 
-	if (new != mDNSNULL) q->TargetQID = mDNS_NewMessageID(m);
+	if (new != mDNSNULL) SetQuestionTargetQID(m, q, mDNS_NewMessageID(m));
 		
 	// 2. Move the old cache records to point them at the new DNSServer so that we can deliver the ADD/RMV events
 	// appropriately. At any point in time, we want all the cache records point only to one DNSServer for a given
@@ -9566,13 +10155,14 @@ mDNSexport void mDNS_FinalExit(mDNS *const m)
 
 	LogInfo("mDNS_FinalExit: mDNSPlatformClose");
 	mDNSPlatformClose(m);
+	SetCompressionDict(mDNSNULL, mDNSNULL);
 
 	rrcache_totalused = m->rrcache_totalused;
-	for (slot = 0; slot < CACHE_HASH_SLOTS; slot++)
+	for (slot = 0; slot < CacheHashSlots(m); slot++)
 		{
-		while (m->rrcache_hash[slot])
+		while (*CacheHashBucket(m, slot))
 			{
-			CacheGroup *cg = m->rrcache_hash[slot];
+			CacheGroup *cg = *CacheHashBucket(m, slot);
 			while (cg->members)
 				{
 				CacheRecord *cr = cg->members;
@@ -9581,9 +10171,18 @@ mDNSexport void mDNS_FinalExit(mDNS *const m)
 				ReleaseCacheRecord(m, cr);
 				}
 			cg->rrcache_tail = &cg->members;
-			ReleaseCacheGroup(m, &m->rrcache_hash[slot]);
-			}
-		}
+			ReleaseCacheGroup(m, CacheHashBucket(m, slot));
+			}
+		}
+	if (m->rrcache_oldhash && m->rrcache_oldhash != m->rrcache_hashstorage) mDNSPlatformMemFree(m->rrcache_oldhash);
+	if (m->rrcache_hash    != m->rrcache_hashstorage) mDNSPlatformMemFree(m->rrcache_hash);
+	m->rrcache_hash         = m->rrcache_hashstorage;
+	m->rrcache_hashslots    = CACHE_HASH_SLOTS;
+	m->rrcache_oldhash      = mDNSNULL;
+	m->rrcache_oldhashslots = 0;
+	if (m->rrcache_checkheap) mDNSPlatformMemFree(m->rrcache_checkheap);
+	m->rrcache_checkheap    = mDNSNULL;
+	m->rrcache_checksize    = 0;
 	debugf("mDNS_FinalExit: RR Cache was using %ld records, %lu active", rrcache_totalused, rrcache_active);
 	if (rrcache_active != m->rrcache_active)
 		LogMsg("*** ERROR *** rrcache_active %lu != m->rrcache_active %lu", rrcache_active, m->rrcache_active);
@@ -447,6 +447,41 @@ typedef packedstruct
 	mDNSu8 data[AbsoluteMaxDNSMessageData];	// 40 (IPv6) + 8 (UDP) + 12 (DNS header) + 8940 (data) = 9000
 	} DNSMessage;
 
+// A PacketRRView describes a resource record in a received packet without unpacking it, so that the caller can
+// decide from the name hash, type and class whether it's worth calling GetLargeResourceRecord() on it at all
+typedef struct
+	{
+	const mDNSu8 *start;			// Start of the record (i.e. its name) in the packet
+	const mDNSu8 *rdata;			// Start of the (still compressed) rdata in the packet
+	mDNSu32 namehash;				// Same value DomainNameHashValue() gives for the decompressed name
+	mDNSu32 rroriginalttl;
+	mDNSu16 rrtype;
+	mDNSu16 rrclass;				// With the cache flush bit masked off
+	mDNSu16 rdlength;				// Length of the rdata as it appears in the packet
+	} PacketRRView;
+
+// What mDNSCorePreParsePacket() found in a received response, for mDNSCoreReceivePreParsed() to use
+#define kMaxPreParsedRecords 32
+typedef struct
+	{
+	mDNSu16 numrecords;								// Records from the start of the answer section that parsed cleanly
+	PacketRRView records[kMaxPreParsedRecords];
+	} PreParsedPacket;
+// A DNSCompressionDict records where each domain name suffix written into a message begins, so that
+// putDomainNameAsLabels can find a compression target with a hash lookup instead of scanning the message
+#define COMPRESSION_HASH_SLOTS  256
+#define COMPRESSION_MAX_ENTRIES 1024
+typedef struct
+	{
+	const DNSMessage *msg;							// The message this dictionary describes
+	mDNSu16 count;									// Number of entries in use
+	mDNSBool overflow;								// Set if we ran out of entries, so lookups can't be trusted to find everything
+	mDNSu16 head  [COMPRESSION_HASH_SLOTS];			// Index+1 of the newest entry in each bucket, or zero if empty
+	mDNSu16 next  [COMPRESSION_MAX_ENTRIES];		// Index+1 of the next older entry in the same bucket
+	mDNSu16 offset[COMPRESSION_MAX_ENTRIES];		// Where this suffix starts, relative to the start of the message
+	mDNSu32 hash  [COMPRESSION_MAX_ENTRIES];		// Hash of this suffix's labels
+	} DNSCompressionDict;
+
 typedef struct tcpInfo_t
 	{
 	mDNS             *m;
@@ -779,13 +814,13 @@ typedef struct
 // On 64-bit, the pointers in a CacheRecord are bigger, and that creates 8 bytes more space for the name in a CacheGroup
 #if ENABLE_MULTI_PACKET_QUERY_SNOOPING
 	#if defined(_ILP64) || defined(__ILP64__) || defined(_LP64) || defined(__LP64__) || defined(_WIN64)
-	#define InlineCacheGroupNameSize 160
+	#define InlineCacheGroupNameSize 168
 	#else
 	#define InlineCacheGroupNameSize 148
 	#endif
 #else
 	#if defined(_ILP64) || defined(__ILP64__) || defined(_LP64) || defined(__LP64__) || defined(_WIN64)
-	#define InlineCacheGroupNameSize 144
+	#define InlineCacheGroupNameSize 152
 	#else
 	#define InlineCacheGroupNameSize 132
 	#endif
@@ -1129,6 +1164,10 @@ struct AuthRecord_struct
 	RData          *NewRData;			// Set if we are updating this record with new rdata
 	mDNSu16         newrdlength;		// ... and the length of the new RData
 	mDNSRecordUpdateCallback *UpdateCallback;
+	AuthRecord     *NextInNameHash;		// Next record in the same m->rrauth_namehash bucket
+	AuthRecord    **PrevInNameHash;		// Link that points to this record (NULL if not in m->ResourceRecords)
+	AuthRecord     *NextInOwnerHash;	// Next Sleep Proxy record in the same m->rrauth_ownerhash bucket
+	AuthRecord    **PrevInOwnerHash;	// Link that points to this record (NULL if not indexed by owner)
 	mDNSu32         UpdateCredits;		// Token-bucket rate limiting of excessive updates
 	mDNSs32         NextUpdateCredit;	// Time next token is added to bucket
 	mDNSs32         UpdateBlocked;		// Set if update delaying is in effect
@@ -1184,7 +1223,9 @@ struct CacheGroup_struct				// Header object for a list of CacheRecords with the
 	CacheRecord    *members;			// List of CacheRecords with this same name
 	CacheRecord   **rrcache_tail;		// Tail end of that list
 	domainname     *name;				// Common name for all CacheRecords in this list
-	// Size to here is 20 bytes when compiling 32-bit; 40 bytes when compiling 64-bit
+	mDNSs32         NextCheck;			// Earliest time any member needs attention from CheckCacheExpiration()
+	mDNSu32         CheckIndex;			// Position in m->rrcache_checkheap (1-based), or zero if not in the heap
+	// Size to here is 28 bytes when compiling 32-bit; 48 bytes when compiling 64-bit
 	mDNSu8          namestorage[InlineCacheGroupNameSize];
 	};
 
@@ -1209,7 +1250,9 @@ struct CacheRecord_struct
 	mDNSBool        MPExpectingKA;		// Multi-packet query handling: Set when we increment MPUnansweredQ; allows one KA
 #endif
 	CacheRecord    *NextInCFList;		// Set if this is in the list of records we just received with the cache flush bit set
-	// Size to here is 76 bytes when compiling 32-bit; 104 bytes when compiling 64-bit
+	CacheRecord    *NextInTargetHash;	// Next record in the same m->rrcache_targethash bucket
+	CacheRecord   **PrevInTargetHash;	// Link that points at this record, or NULL if rdata has no target name
+	// Size to here is 84 bytes when compiling 32-bit; 120 bytes when compiling 64-bit
 	RData_small     smallrdatastorage;	// Storage for small records is right here (4 bytes header + 68 bytes data = 72 bytes)
 	};
 
@@ -1363,6 +1406,10 @@ enum { NoAnswer_Normal = 0, NoAnswer_Suspended = 1, NoAnswer_Fail = 2 };
 #define HMAC_IPAD   0x36
 #define HMAC_OPAD   0x5c
 #define MD5_LEN     16
+#define SHA256_LEN  32
+
+// TSIG algorithms supported by DNSDigest.c, stored in DomainAuthInfo.algorithm
+enum { TSIG_HMAC_MD5 = 0, TSIG_HMAC_SHA256 = 1 };
 
 #define AutoTunnelUnregistered(X) (                                              \
 	(X)->AutoTunnelHostRecord.resrec.RecordType == kDNSRecordTypeUnregistered && \
@@ -1383,8 +1430,9 @@ typedef struct DomainAuthInfo
 	domainname       domain;
 	domainname       keyname;
 	char             b64keydata[32];
-	mDNSu8           keydata_ipad[HMAC_LEN];	// padded key for inner hash rounds
-	mDNSu8           keydata_opad[HMAC_LEN];	// padded key for outer hash rounds
+	mDNSu8           algorithm;				// TSIG_HMAC_MD5 or TSIG_HMAC_SHA256
+	mDNSu32          ipad_state[8];			// Hash state after digesting the inner key pad, so each message starts here
+	mDNSu32          opad_state[8];			// Hash state after digesting the outer key pad
 	} DomainAuthInfo;
 
 // Note: Within an mDNSQuestionCallback mDNS all API calls are legal except mDNS_Init(), mDNS_Exit(), mDNS_Execute()
@@ -1394,7 +1442,12 @@ struct DNSQuestion_struct
 	{
 	// Internal state fields. These are used internally by mDNSCore; the client layer needn't be concerned with them.
 	DNSQuestion          *next;
+	DNSQuestion          *NextInQHash;		// Next question in the same m->qhash bucket
+	DNSQuestion         **PrevInQHash;		// Link that points to this question (NULL if not in m->Questions)
+	DNSQuestion          *NextInQIDHash;	// Next question in the same m->qidhash bucket
+	DNSQuestion         **PrevInQIDHash;	// Link that points to this question (NULL if not indexed by TargetQID)
 	mDNSu32               qnamehash;
+	mDNSu32               SerialNumber;		// Assigned in increasing order as questions are added to m->Questions
 	mDNSs32               DelayAnswering;	// Set if we want to defer answering this question until the cache settles
 	mDNSs32               LastQTime;		// Last scheduled transmission of this Q on *all* applicable interfaces
 	mDNSs32               ThisQInterval;	// LastQTime + ThisQInterval is the next scheduled transmission of this Q
@@ -1617,7 +1670,29 @@ extern SearchListElem *SearchList;		// This really ought to be part of mDNS_stru
 
 typedef void mDNSCallback(mDNS *const m, mStatus result);
 
+// The record cache hash table starts out with CACHE_HASH_SLOTS buckets (held inline in the mDNS object),
+// and is grown or shrunk through the sizes in CacheHashSizes[] as rrcache_totalused changes.
+// Resizing is incremental: mDNS_Execute() migrates CACHE_REHASH_STEP old buckets per pass,
+// so no single pass has to move the entire cache.
 #define CACHE_HASH_SLOTS 499
+#define CACHE_HASH_GROW_LOAD   4	// Grow   when rrcache_totalused > (current size) * CACHE_HASH_GROW_LOAD
+#define CACHE_HASH_SHRINK_LOAD 1	// Shrink when rrcache_totalused < (next smaller size) * CACHE_HASH_SHRINK_LOAD
+#define CACHE_REHASH_STEP    256
+
+// Cache records whose rdata names another domain name (PTR, SRV, CNAME, etc.) are also chained into
+// CACHE_TARGET_HASH_SLOTS buckets by rdatahash, so ReconfirmAntecedents() can find the records that
+// refer to a given name without walking the whole cache
+#define CACHE_TARGET_HASH_SLOTS 499
+
+// Records on m->ResourceRecords are also chained into AUTH_HASH_SLOTS buckets by namehash, and Sleep Proxy records
+// into AUTH_OWNER_SLOTS buckets by owner H-MAC, so lookups by name or owner don't have to scan the whole list
+#define AUTH_HASH_SLOTS  499
+#define AUTH_OWNER_SLOTS 37
+
+// Likewise, questions on m->Questions are chained into QUESTION_HASH_SLOTS buckets by qnamehash, and unicast
+// questions into QUESTION_QID_SLOTS buckets by TargetQID, so we can find the questions a response is for quickly
+#define QUESTION_HASH_SLOTS 499
+#define QUESTION_QID_SLOTS  499
 
 enum
 	{
@@ -1694,14 +1769,34 @@ struct mDNS_struct
 	DNSQuestion *Questions;				// List of all registered questions, active and inactive
 	DNSQuestion *NewQuestions;			// Fresh questions not yet answered from cache
 	DNSQuestion *CurrentQuestion;		// Next question about to be examined in AnswerLocalQuestions()
+	DNSQuestion *CurrentHashQuestion;	// Next question about to be examined in a walk of a qhash bucket
+	mDNSu32      NextQuestionSerial;	// SerialNumber to give the next question added to m->Questions
+	DNSQuestion *qhash[QUESTION_HASH_SLOTS];	// The questions on m->Questions, chained by qnamehash
+	DNSQuestion *qidhash[QUESTION_QID_SLOTS];	// The unicast questions on m->Questions, chained by TargetQID
 	DNSQuestion *LocalOnlyQuestions;	// Questions with InterfaceID set to mDNSInterface_LocalOnly
 	DNSQuestion *NewLocalOnlyQuestions;	// Fresh local-only questions not yet answered
 	mDNSu32 rrcache_size;				// Total number of available cache entries
 	mDNSu32 rrcache_totalused;			// Number of cache entries currently occupied
 	mDNSu32 rrcache_active;				// Number of cache entries currently occupied by records that answer active questions
 	mDNSu32 rrcache_report;
+	mDNSu32 rrcache_budget;				// If nonzero, cache is never grown beyond this many entities (see mDNS_SetCacheBudget)
+	mDNSu32 rrcache_evicted;			// Number of records recycled to make room for new ones, for diagnostics
+	mDNSu32 rrcache_clockslot;			// Cache slot at which GetCacheEntity() next looks for a record to recycle
+	mDNSs32 rrcache_clocklap;			// Time rrcache_clockslot last wrapped; records used since then get a second chance
 	CacheEntity *rrcache_free;
-	CacheGroup *rrcache_hash[CACHE_HASH_SLOTS];
+	CacheGroup **rrcache_hash;			// Current hash table; either rrcache_hashstorage or allocated via mDNSPlatformMemAllocate
+	mDNSu32 rrcache_hashslots;			// Number of buckets in rrcache_hash
+	CacheGroup **rrcache_oldhash;		// While resizing, the table whose CacheGroups are being migrated into rrcache_hash
+	mDNSu32 rrcache_oldhashslots;		// Number of buckets in rrcache_oldhash; zero when not resizing
+	mDNSu32 rrcache_rehashslot;			// While resizing, buckets of rrcache_oldhash below this index have been migrated
+	mDNSu32 rrcache_rehashes;			// Number of resizes started, for diagnostics
+	mDNSu32 rrcache_maxchain;			// Longest CacheGroup chain seen while migrating or inserting, for diagnostics
+	CacheGroup *rrcache_hashstorage[CACHE_HASH_SLOTS];
+	CacheRecord *rrcache_targethash[CACHE_TARGET_HASH_SLOTS];	// Cache records with a target name, chained by rdatahash
+	CacheGroup **rrcache_checkheap;		// Binary min-heap of CacheGroups ordered by NextCheck; root is element [1]
+	mDNSu32 rrcache_checkcount;			// Number of CacheGroups in rrcache_checkheap
+	mDNSu32 rrcache_checksize;			// Allocated capacity of rrcache_checkheap, including unused element [0]
+	mDNSBool rrcache_checkall;			// Set when the next cache check must visit every CacheGroup, not just those due
 
 	// Fields below only required for mDNS Responder...
 	domainlabel nicelabel;				// Rich text label encoded using canonically precomposed UTF-8
@@ -1714,6 +1809,10 @@ struct mDNS_struct
 	AuthRecord *DuplicateRecords;		// Records currently 'on hold' because they are duplicates of existing records
 	AuthRecord *NewLocalRecords;		// Fresh local-only records not yet delivered to local-only questions
 	AuthRecord *CurrentRecord;			// Next AuthRecord about to be examined
+	AuthRecord *CurrentNameHashRecord;	// Next AuthRecord about to be examined in a walk of an rrauth_namehash bucket
+	AuthRecord *CurrentOwnerHashRecord;	// Next AuthRecord about to be examined in a walk of an rrauth_ownerhash bucket
+	AuthRecord *rrauth_namehash[AUTH_HASH_SLOTS];	// The records on ResourceRecords, chained by namehash
+	AuthRecord *rrauth_ownerhash[AUTH_OWNER_SLOTS];	// The Sleep Proxy records on ResourceRecords, chained by owner H-MAC
 	NetworkInterfaceInfo *HostInterfaces;
 	mDNSs32 ProbeFailTime;
 	mDNSu32 NumFailedProbes;
@@ -1793,12 +1892,19 @@ struct mDNS_struct
 	// The imsg is declared as a union with a pointer type to enforce CPU-appropriate alignment
 	union { DNSMessage m; void *p; } imsg;  // Incoming message received from wire
 	DNSMessage        omsg;                 // Outgoing message we're building
+	DNSCompressionDict omsgdict;            // Name compression dictionary for omsg
 	LargeCacheRecord  rec;                  // Resource Record extracted from received message
 	};
 
+// Cache slot numbers are indices into the concatenation of rrcache_hash and (while resizing) rrcache_oldhash.
+// A slot number is only meaningful until the next call to mDNS_Execute(), which is the only place the tables change.
+#define CacheHashSlots(M) ((M)->rrcache_hashslots + (M)->rrcache_oldhashslots)
+#define CacheHashBucket(M,SLOT) ((SLOT) < (M)->rrcache_hashslots ? \
+	&(M)->rrcache_hash[(SLOT)] : &(M)->rrcache_oldhash[(SLOT) - (M)->rrcache_hashslots])
+
 #define FORALL_CACHERECORDS(SLOT,CG,CR)                           \
-	for ((SLOT) = 0; (SLOT) < CACHE_HASH_SLOTS; (SLOT)++)         \
-		for ((CG)=m->rrcache_hash[(SLOT)]; (CG); (CG)=(CG)->next) \
+	for ((SLOT) = 0; (SLOT) < CacheHashSlots(m); (SLOT)++)        \
+		for ((CG)=*CacheHashBucket(m,(SLOT)); (CG); (CG)=(CG)->next) \
 			for ((CR) = (CG)->members; (CR); (CR)=(CR)->next)
 
 // ***************************************************************************
@@ -1917,6 +2023,8 @@ mDNSinline mDNSOpaque16 mDNSOpaque16fromIntVal(mDNSu16 v)
 // (i.e. the size of the cache memory needs to be sizeof(CacheRecord) * rrcachesize).
 // OS X 10.3 Panther uses an initial cache size of 64 entries, and then mDNSCore sends an
 // mStatus_GrowCache message if it needs more.
+// A client may call mDNS_SetCacheBudget to place a hard limit on the number of cache entities; once the cache has
+// reached that size mDNSCore stops sending mStatus_GrowCache, and instead recycles the least recently used inactive records.
 //
 // Most clients should use mDNS_Init_AdvertiseLocalAddresses. This causes mDNSCore to automatically
 // create the correct address records for all the hosts interfaces. If you plan to advertise
@@ -1972,6 +2080,7 @@ extern mStatus mDNS_Init      (mDNS *const m, mDNS_PlatformSupport *const p,
 
 extern void    mDNS_ConfigChanged(mDNS *const m);
 extern void    mDNS_GrowCache (mDNS *const m, CacheEntity *storage, mDNSu32 numrecords);
+extern void    mDNS_SetCacheBudget(mDNS *const m, mDNSu32 numrecords);
 extern void    mDNS_StartExit (mDNS *const m);
 extern void    mDNS_FinalExit (mDNS *const m);
 #define mDNS_Close(m) do { mDNS_StartExit(m); mDNS_FinalExit(m); } while(0)
@@ -2295,6 +2404,10 @@ extern void mDNS_AddSearchDomain(const domainname *const domain);
 // Convert an arbitrary base64 encoded key key into an HMAC key (stored in AuthInfo struct)
 extern mDNSs32 DNSDigest_ConstructHMACKeyfromBase64(DomainAuthInfo *info, const char *b64key);
 
+// As above, but for the named TSIG algorithm ("hmac-md5.sig-alg.reg.int." or "hmac-sha256.");
+// returns -1 if the algorithm is not supported
+extern mDNSs32 DNSDigest_ConstructHMACKeyWithAlgorithm(DomainAuthInfo *info, const domainname *alg, const char *b64key);
+
 // sign a DNS message.  The message must be complete, with all values in network byte order.  end points to the end
 // of the message, and is modified by this routine.  numAdditionals is a pointer to the number of additional
 // records in HOST byte order, which is incremented upon successful completion of this routine.  The function returns
@@ -2317,6 +2430,10 @@ extern void DNSDigest_SignMessage(DNSMessage *msg, mDNSu8 **end, DomainAuthInfo
 // of the DNS message header has already had one subtracted from it.
 extern mDNSBool DNSDigest_VerifyMessage(DNSMessage *msg, mDNSu8 *end, LargeCacheRecord *tsig, DomainAuthInfo *info, mDNSu16 *rcode, mDNSu16 *tcode);
 
+// Checks MD5, SHA-256 (with each block function this processor can use), HMAC-MD5 and HMAC-SHA256 against the
+// published test vectors; logs and returns mDNSfalse if any of them is wrong
+extern mDNSBool DNSDigest_SelfTest(void);
+
 // ***************************************************************************
 #if 0
 #pragma mark -
@@ -2331,7 +2448,8 @@ extern mDNSBool DNSDigest_VerifyMessage(DNSMessage *msg, mDNSu8 *end, LargeCache
 // Every platform support module must provide the following functions.
 // mDNSPlatformInit() typically opens a communication endpoint, and starts listening for mDNS packets.
 // When Setup is complete, the platform support layer calls mDNSCoreInitComplete().
-// mDNSPlatformSendUDP() sends one UDP packet
+// mDNSPlatformSendUDP() sends one UDP packet (or, between mDNSPlatformBeginSendBatch and mDNSPlatformEndSendBatch,
+// may queue a multicast packet to be sent later; see the note at mDNSPlatformBeginSendBatch)
 // When a packet is received, the PlatformSupport code calls mDNSCoreReceive()
 // mDNSPlatformClose() tidies up on exit
 //
@@ -2442,6 +2560,16 @@ extern void       mDNSPlatformUDPClose(UDPSocket *sock);
 extern void       mDNSPlatformReceiveBPF_fd(mDNS *const m, int fd);
 extern void       mDNSPlatformUpdateProxyList(mDNS *const m, const mDNSInterfaceID InterfaceID);
 extern void       mDNSPlatformSendRawPacket(const void *const msg, const mDNSu8 *const end, mDNSInterfaceID InterfaceID);
+
+// mDNSPlatformBeginSendBatch/mDNSPlatformEndSendBatch bracket a run of mDNSPlatformSendUDP() calls (e.g. one packet per
+// interface per address family in SendResponses). In between, the platform may queue multicast packets and send them
+// together when the batch ends, so mDNSPlatformSendUDP() may return mStatus_NoError before the packet has actually gone.
+// An error sending a queued packet is logged by the platform layer when the batch is flushed; it is never returned to
+// the caller. So only send inside a batch where the result isn't acted on (SendQueries and SendResponses ignore it).
+// Unicast sends are never queued, and report their errors as usual.
+// Platforms that don't batch can make these no-ops. Batches may nest; only the outermost mDNSPlatformEndSendBatch flushes.
+extern void       mDNSPlatformBeginSendBatch(mDNS *const m);
+extern void       mDNSPlatformEndSendBatch(mDNS *const m);
 extern void       mDNSPlatformSetLocalAddressCacheEntry(mDNS *const m, const mDNSAddr *const tpa, const mDNSEthAddr *const tha, mDNSInterfaceID InterfaceID);
 extern void       mDNSPlatformSourceAddrForDest(mDNSAddr *const src, const mDNSAddr *const dst);
 
@@ -2496,6 +2624,12 @@ extern void     LNT_ClearState(mDNS *const m);
 // (on platforms like OT that allow asynchronous initialization of the networking stack).
 //
 // mDNSCoreReceive() is called when a UDP packet is received
+// When the platform layer has several packets in hand at once (e.g. from recvmmsg), it may bracket its
+// calls to mDNSCoreReceive() with mDNSCoreBeginReceiveBatch() and mDNSCoreEndReceiveBatch(), so that the
+// packets share one m->timenow and the core only recomputes its next scheduled event once for the batch.
+// mDNSCorePreParsePacket() is safe to call on any thread, without the lock; a platform layer that receives on
+// other threads can use it there, and then pass its result to mDNSCoreReceivePreParsed() instead of calling
+// mDNSCoreReceive(), to save the core thread from walking the packet's records itself.
 //
 // mDNSCoreMachineSleep() is called when the machine sleeps or wakes
 // (This refers to heavyweight laptop-style sleep/wake that disables network access,
@@ -2510,6 +2644,13 @@ extern void     mDNSCoreInitComplete(mDNS *const m, mStatus result);
 extern void     mDNSCoreReceive(mDNS *const m, void *const msg, const mDNSu8 *const end,
 								const mDNSAddr *const srcaddr, const mDNSIPPort srcport,
 								const mDNSAddr *dstaddr, const mDNSIPPort dstport, const mDNSInterfaceID InterfaceID);
+extern void     mDNSCorePreParsePacket(const DNSMessage *const msg, const mDNSu8 *const end, PreParsedPacket *const pp);
+extern void     mDNSCoreReceivePreParsed(mDNS *const m, void *const msg, const mDNSu8 *const end,
+								const mDNSAddr *const srcaddr, const mDNSIPPort srcport,
+								const mDNSAddr *dstaddr, const mDNSIPPort dstport, const mDNSInterfaceID InterfaceID,
+								const PreParsedPacket *const pp);
+extern void     mDNSCoreBeginReceiveBatch(mDNS *const m);
+extern void     mDNSCoreEndReceiveBatch(mDNS *const m);
 extern void 	mDNSCoreRestartQueries(mDNS *const m);
 extern mDNSBool mDNSCoreHaveAdvertisedMulticastServices(mDNS *const m);
 extern void     mDNSCoreMachineSleep(mDNS *const m, mDNSBool wake);
@@ -2596,19 +2737,19 @@ struct CompileTimeAssertionChecks_mDNS
 	char sizecheck_RDataBody           [(sizeof(RDataBody)            ==   264) ? 1 : -1];
 	char sizecheck_ResourceRecord      [(sizeof(ResourceRecord)       <=    64) ? 1 : -1];
 	char sizecheck_AuthRecord          [(sizeof(AuthRecord)           <=  1000) ? 1 : -1];
-	char sizecheck_CacheRecord         [(sizeof(CacheRecord)          <=   184) ? 1 : -1];
-	char sizecheck_CacheGroup          [(sizeof(CacheGroup)           <=   184) ? 1 : -1];
-	char sizecheck_DNSQuestion         [(sizeof(DNSQuestion)          <=   736) ? 1 : -1];
-	char sizecheck_ZoneData            [(sizeof(ZoneData)             <=  1568) ? 1 : -1];
+	char sizecheck_CacheRecord         [(sizeof(CacheRecord)          <=   200) ? 1 : -1];
+	char sizecheck_CacheGroup          [(sizeof(CacheGroup)           <=   200) ? 1 : -1];
+	char sizecheck_DNSQuestion         [(sizeof(DNSQuestion)          <=   776) ? 1 : -1];
+	char sizecheck_ZoneData            [(sizeof(ZoneData)             <=  1608) ? 1 : -1];
 	char sizecheck_NATTraversalInfo    [(sizeof(NATTraversalInfo)     <=   192) ? 1 : -1];
 	char sizecheck_HostnameInfo        [(sizeof(HostnameInfo)         <=  2800) ? 1 : -1];
 	char sizecheck_DNSServer           [(sizeof(DNSServer)            <=   320) ? 1 : -1];
-	char sizecheck_NetworkInterfaceInfo[(sizeof(NetworkInterfaceInfo) <=  6000) ? 1 : -1];
+	char sizecheck_NetworkInterfaceInfo[(sizeof(NetworkInterfaceInfo) <=  6260) ? 1 : -1];
 	char sizecheck_ServiceRecordSet    [(sizeof(ServiceRecordSet)     <=  5500) ? 1 : -1];
 	char sizecheck_DomainAuthInfo      [(sizeof(DomainAuthInfo)       <=  5500) ? 1 : -1];
-	char sizecheck_ServiceInfoQuery    [(sizeof(ServiceInfoQuery)     <=  2976) ? 1 : -1];
+	char sizecheck_ServiceInfoQuery    [(sizeof(ServiceInfoQuery)     <=  3136) ? 1 : -1];
 #if APPLE_OSX_mDNSResponder
-	char sizecheck_ClientTunnel        [(sizeof(ClientTunnel)         <=  1072) ? 1 : -1];
+	char sizecheck_ClientTunnel        [(sizeof(ClientTunnel)         <=  1112) ? 1 : -1];
 #endif
 	};
 
@@ -67,7 +67,7 @@ mDNSlocal mStatus UnlinkAuthRecord(mDNS *const m, AuthRecord *const rr)
 		list = &m->DuplicateRecords;
 		while (*list && *list != rr) list = &(*list)->next;
 		}
-	if (*list) { *list = rr->next; rr->next = mDNSNULL; return(mStatus_NoError); }
+	if (*list) { *list = rr->next; rr->next = mDNSNULL; AuthHashRemoveRecord(m, rr); return(mStatus_NoError); }
 	LogMsg("ERROR: UnlinkAuthRecord - no such active record %##s", rr->resrec.name->c);
 	return(mStatus_NoSuchRecord);
 	}
@@ -874,7 +874,7 @@ mDNSexport uDNS_LLQType uDNS_recvLLQResponse(mDNS *const m, const DNSMessage *co
 		{
 		const rdataOPT *opt = GetLLQOptData(m, msg, end);
 
-		for (q = m->Questions; q; q = q->next)
+		for (q = m->qhash[QuestionHashSlot(pktQ.qnamehash)]; q; q = q->NextInQHash)
 			{
 			if (!mDNSOpaque16IsZero(q->TargetQID) && q->LongLived && q->qtype == pktQ.qtype && q->qnamehash == pktQ.qnamehash && SameDomainName(&q->qname, &pktQ.qname))
 				{
@@ -3068,7 +3068,7 @@ mDNSexport void uDNS_ReceiveMsg(mDNS *const m, DNSMessage *const msg, const mDNS
 		{
 		//if (srcaddr && recvLLQResponse(m, msg, end, srcaddr, srcport)) return;
 		if (uDNS_ReceiveTestQuestionResponse(m, msg, end, srcaddr, srcport)) return;
-		for (qptr = m->Questions; qptr; qptr = qptr->next)
+		for (qptr = m->qidhash[QuestionQIDSlot(msg->h.id)]; qptr; qptr = qptr->NextInQIDHash)
 			if (msg->h.flags.b[0] & kDNSFlag0_TC && mDNSSameOpaque16(qptr->TargetQID, msg->h.id) && m->timenow - qptr->LastQTime < RESPONSE_WINDOW)
 				{
 				if (!srcaddr) LogMsg("uDNS_ReceiveMsg: TCP DNS response had TC bit set: ignoring");
@@ -3274,7 +3274,7 @@ mDNSlocal void PrivateQueryGotZoneData(mDNS *const m, mStatus err, const ZoneDat
 		return;
 		}
 
-	q->TargetQID = mDNS_NewMessageID(m);
+	SetQuestionTargetQID(m, q, mDNS_NewMessageID(m));
 	if (q->tcp) DisposeTCPConn(q->tcp);
 	q->tcp = MakeTCPConn(m, mDNSNULL, mDNSNULL, kTCPSocketFlags_UseTLS, &zoneInfo->Addr, zoneInfo->Port, q, mDNSNULL, mDNSNULL);
 	}
@@ -4235,5 +4235,5 @@ struct CompileTimeAssertionChecks_uDNS
 	// other overly-large structures instead of having a pointer to them, can inadvertently
 	// cause structure sizes (and therefore memory usage) to balloon unreasonably.
 	char sizecheck_tcpInfo_t     [(sizeof(tcpInfo_t)      <=  9056) ? 1 : -1];
-	char sizecheck_SearchListElem[(sizeof(SearchListElem) <=  3960) ? 1 : -1];
+	char sizecheck_SearchListElem[(sizeof(SearchListElem) <=  4160) ? 1 : -1];
 	};
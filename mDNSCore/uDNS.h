@@ -68,6 +68,8 @@ extern mStatus mDNS_Register_internal(mDNS *const m, AuthRecord *const rr);
 // mDNS_Dereg_repeat is used when cleaning up, for records that may have already been forcibly deregistered
 typedef enum { mDNS_Dereg_normal, mDNS_Dereg_conflict, mDNS_Dereg_repeat } mDNS_Dereg_type;
 extern mStatus mDNS_Deregister_internal(mDNS *const m, AuthRecord *const rr, mDNS_Dereg_type drt);
+extern void AuthHashRemoveRecord(mDNS *const m, AuthRecord *const rr);
+extern void SetQuestionTargetQID(mDNS *const m, DNSQuestion *const q, const mDNSOpaque16 id);
 extern mStatus mDNS_StartQuery_internal(mDNS *const m, DNSQuestion *const question);
 extern mStatus mDNS_StopQuery_internal(mDNS *const m, DNSQuestion *const question);
 extern mStatus mDNS_StartNATOperation_internal(mDNS *const m, NATTraversalInfo *traversal);
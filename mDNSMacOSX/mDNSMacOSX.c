@@ -1414,6 +1414,10 @@ mDNSexport void mDNSPlatformUDPClose(UDPSocket *sock)
 
 #if APPLE_OSX_mDNSResponder
 
+// mDNSPlatformSendUDP sends each packet immediately on this platform, so there's nothing to batch
+mDNSexport void mDNSPlatformBeginSendBatch(mDNS *const m) { (void)m; }
+mDNSexport void mDNSPlatformEndSendBatch  (mDNS *const m) { (void)m; }
+
 mDNSexport void mDNSPlatformSendRawPacket(const void *const msg, const mDNSu8 *const end, mDNSInterfaceID InterfaceID)
 	{
 	if (!InterfaceID) { LogMsg("mDNSPlatformSendRawPacket: No InterfaceID specified"); return; }
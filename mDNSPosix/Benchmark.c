@@ -0,0 +1,657 @@
+/* -*- Mode: C; tab-width: 4 -*-
+ *
+ * Copyright (c) 2002-2004 Apple Computer, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Formatting notes:
+ * This code follows the "Whitesmiths style" C indentation rules. Plenty of discussion
+ * on C indentation can be found on the web, such as <http://www.kafejo.com/komp/1tbs.htm>,
+ * but for the sake of brevity here I will say just this: Curly braces are not syntactially
+ * part of an "if" statement; they are the beginning and ending markers of a compound statement;
+ * therefore common sense dictates that if they are part of a compound statement then they
+ * should be indented to the same level as everything else in that compound statement.
+ * Indenting curly braces at the same level as the "if" implies that curly braces are
+ * part of the "if", which is false. (This is as misleading as people who write "char* x,y;"
+ * thinking that variables x and y are both of type "char*" -- and anyone who doesn't
+ * understand why variable y is not of type "char*" just proves the point that poor code
+ * layout leads people to unfortunate misunderstandings about how the C language really works.)
+ */
+
+// Microbenchmarks and self-checks for the core's hot paths. Each benchmark times the current code and, where
+// there is one, the simpler implementation it replaced, and first checks that the two give the same answers.
+// Run "mDNSBenchmark" to run them all, or "mDNSBenchmark <name>..." to pick; it exits non-zero if a check fails.
+
+//*************************************************************************************************************
+// Incorporate mDNS.c functionality
+
+// Some benchmarks need to reach mDNSlocal routines, so like Identify.c we import mDNS.c textually
+#include "mDNS.c"
+
+//*************************************************************************************************************
+// Headers
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "mDNSEmbeddedAPI.h"// Defines the interface to the mDNS core code
+#include "mDNSPosix.h"    // Defines the specific types needed to run mDNS on this platform
+
+//*************************************************************************************************************
+// Globals
+
+mDNSexport const char ProgramName[] = "mDNSBenchmark";
+
+static int Failures;
+
+static mDNS mDNSStorage;       // mDNS core uses this to store its globals
+static mDNS_PlatformSupport PlatformStorage;  // Stores this platform's globals
+#define RR_CACHE_SIZE 32768							// Room for a record and a CacheGroup for each of 10,000 names
+static CacheEntity gRRCache[RR_CACHE_SIZE];
+static mDNSBool CoreRunning;
+
+//*************************************************************************************************************
+// Utilities
+
+mDNSlocal double Now(void)
+	{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return(tv.tv_sec + tv.tv_usec / 1e6);
+	}
+
+mDNSlocal void Check(mDNSBool ok, const char *what)
+	{
+	if (!ok) { fprintf(stderr, "FAILED: %s\n", what); Failures++; }
+	}
+
+mDNSlocal void Report(const char *what, long count, double seconds)
+	{
+	printf("  %-44s %10.1f ns each\n", what, seconds * 1e9 / count);
+	}
+
+// Benchmarks that need a running core share one, with no local address records so it stays quiet on the network
+mDNSlocal mDNS *StartCore(void)
+	{
+	if (!CoreRunning)
+		{
+		mStatus status = mDNS_Init(&mDNSStorage, &PlatformStorage, gRRCache, RR_CACHE_SIZE,
+			mDNS_Init_DontAdvertiseLocalAddresses, mDNS_Init_NoInitCallback, mDNS_Init_NoInitCallbackContext);
+		if (status) { fprintf(stderr, "mDNS_Init failed %d\n", (int)status); exit(1); }
+		CoreRunning = mDNStrue;
+		}
+	return(&mDNSStorage);
+	}
+
+// Converts the header counts that PutResourceRecord etc. leave in host order to the order they have on the wire
+mDNSlocal void SwapHeaderCounts(DNSMessage *const msg)
+	{
+	mDNSu8 *ptr = (mDNSu8 *)&msg->h.numQuestions;
+	const mDNSu16 counts[4] = { msg->h.numQuestions, msg->h.numAnswers, msg->h.numAuthorities, msg->h.numAdditionals };
+	int i;
+	for (i = 0; i < 4; i++) { ptr[i*2] = (mDNSu8)(counts[i] >> 8); ptr[i*2+1] = (mDNSu8)(counts[i] & 0xFF); }
+	}
+
+//*************************************************************************************************************
+// Domain name compare and hash
+
+// The byte-at-a-time versions SameDomainName and DomainNameHashValue replaced
+mDNSlocal mDNSBool RefSameDomainLabel(const mDNSu8 *a, const mDNSu8 *b)
+	{
+	int i;
+	const int len = *a++;
+	if (len > MAX_DOMAIN_LABEL) return(mDNSfalse);
+	if (len != *b++) return(mDNSfalse);
+	for (i=0; i<len; i++)
+		{
+		mDNSu8 ac = *a++;
+		mDNSu8 bc = *b++;
+		if (mDNSIsUpperCase(ac)) ac += 'a' - 'A';
+		if (mDNSIsUpperCase(bc)) bc += 'a' - 'A';
+		if (ac != bc) return(mDNSfalse);
+		}
+	return(mDNStrue);
+	}
+
+mDNSlocal mDNSBool RefSameDomainName(const domainname *const d1, const domainname *const d2)
+	{
+	const mDNSu8 *      a   = d1->c;
+	const mDNSu8 *      b   = d2->c;
+	const mDNSu8 *const max = d1->c + MAX_DOMAIN_NAME;
+	while (*a || *b)
+		{
+		if (a + 1 + *a >= max) return(mDNSfalse);
+		if (!RefSameDomainLabel(a, b)) return(mDNSfalse);
+		a += 1 + *a;
+		b += 1 + *b;
+		}
+	return(mDNStrue);
+	}
+
+mDNSlocal mDNSu32 RefDomainNameHashValue(const domainname *const name)
+	{
+	mDNSu32 sum = 0;
+	const mDNSu8 *c;
+	for (c = name->c; c[0] != 0 && c[1] != 0; c += 2)
+		{
+		sum += ((mDNSIsUpperCase(c[0]) ? c[0] + 'a' - 'A' : c[0]) << 8) |
+				(mDNSIsUpperCase(c[1]) ? c[1] + 'a' - 'A' : c[1]);
+		sum = (sum<<3) | (sum>>29);
+		}
+	if (c[0]) sum += ((mDNSIsUpperCase(c[0]) ? c[0] + 'a' - 'A' : c[0]) << 8);
+	return(sum);
+	}
+
+// Names of the kind the core compares all day: service types, instances, and host names
+static const char *const BenchNames[] =
+	{
+	"_services._dns-sd._udp.local.", "_http._tcp.local.", "_ipp._tcp.local.", "_afpovertcp._tcp.local.",
+	"_airplay._tcp.local.", "_raop._tcp.local.", "_device-info._tcp.local.", "_sleep-proxy._udp.local.",
+	"Living Room._airplay._tcp.local.", "Office Printer (HP LaserJet 4250)._ipp._tcp.local.",
+	"Joe's MacBook Pro._afpovertcp._tcp.local.", "macbook-pro.local.", "host-1234.local.", "local.",
+	"b._dns-sd._udp.local.", "lb._dns-sd._udp.local.", "1.0.168.192.in-addr.arpa.", "ns1.example.com."
+	};
+#define NumBenchNames ((int)(sizeof(BenchNames)/sizeof(BenchNames[0])))
+
+// Flips the case of roughly one letter in four
+mDNSlocal void RandomiseCase(domainname *const d)
+	{
+	mDNSu8 *p;
+	for (p = d->c; *p; p += 1 + *p)
+		{
+		int i;
+		for (i = 1; i <= *p; i++)
+			if (mDNSIsLetter(p[i]) && (random() & 3) == 0) p[i] ^= 0x20;
+		}
+	}
+
+mDNSlocal void BenchmarkNames(void)
+	{
+	enum { NumPairs = 4096, Rounds = 500 };
+	static domainname a[NumPairs], b[NumPairs];
+	mDNSu32 sink = 0;
+	double t;
+	int i, r, mismatches = 0;
+
+	printf("names: SameDomainName and DomainNameHashValue on typical service and host names\n");
+	for (i = 0; i < NumPairs; i++)
+		{
+		MakeDomainNameFromDNSNameString(&a[i], BenchNames[random() % NumBenchNames]);
+		switch (random() % 4)
+			{
+			case 0:  MakeDomainNameFromDNSNameString(&b[i], BenchNames[random() % NumBenchNames]); break;	// Usually different
+			case 1:  AssignDomainName(&b[i], &a[i]); break;													// Identical
+			default: AssignDomainName(&b[i], &a[i]); RandomiseCase(&b[i]); break;							// Same but for case
+			}
+		if (random() % 8 == 0)		// Change one byte somewhere, sometimes only its case
+			{
+			mDNSu16 len = DomainNameLength(&b[i]);
+			int k = 1 + random() % (len - 1);
+			if (b[i].c[k] && mDNSIsLetter(b[i].c[k]) && (b[i].c[k] ^ 0x20) != 0) b[i].c[k] ^= (random() & 1) ? 0x20 : 0x01;
+			}
+		}
+
+	for (i = 0; i < NumPairs; i++)
+		{
+		if (SameDomainName(&a[i], &b[i]) != RefSameDomainName(&a[i], &b[i])) mismatches++;
+		if (DomainNameHashValue(&b[i]) != RefDomainNameHashValue(&b[i])) mismatches++;
+		}
+	Check(mismatches == 0, "SameDomainName/DomainNameHashValue give the same results as the reference versions");
+
+	t = Now();
+	for (r = 0; r < Rounds; r++) for (i = 0; i < NumPairs; i++) sink += RefSameDomainName(&a[i], &b[i]);
+	Report("SameDomainName, byte at a time", (long)Rounds * NumPairs, Now() - t);
+	t = Now();
+	for (r = 0; r < Rounds; r++) for (i = 0; i < NumPairs; i++) sink += SameDomainName(&a[i], &b[i]);
+	Report("SameDomainName", (long)Rounds * NumPairs, Now() - t);
+	t = Now();
+	for (r = 0; r < Rounds; r++) for (i = 0; i < NumPairs; i++) sink += RefDomainNameHashValue(&b[i]);
+	Report("DomainNameHashValue, byte at a time", (long)Rounds * NumPairs, Now() - t);
+	t = Now();
+	for (r = 0; r < Rounds; r++) for (i = 0; i < NumPairs; i++) sink += DomainNameHashValue(&b[i]);
+	Report("DomainNameHashValue", (long)Rounds * NumPairs, Now() - t);
+	if (sink == 0x12345678) printf("\n");		// Keep the compiler from discarding the work
+	}
+
+//*************************************************************************************************************
+// Question index
+
+static long QuestionAnswers;
+
+mDNSlocal void BenchQuestionCallback(mDNS *const m, DNSQuestion *question, const ResourceRecord *const answer, QC_result AddRecord)
+	{
+	(void)m; (void)question; (void)answer; (void)AddRecord;
+	QuestionAnswers++;
+	}
+
+// Builds a multicast response carrying one PTR record for name
+mDNSlocal const mDNSu8 *BuildPTRResponse(DNSMessage *const msg, const domainname *const name)
+	{
+	AuthRecord rr;
+	mDNSu16 numAnswers = 0;
+	mDNSu8 *ptr;
+	mDNS_SetupResourceRecord(&rr, mDNSNULL, mDNSInterface_Any, kDNSType_PTR, 4500, kDNSRecordTypeShared, mDNSNULL, mDNSNULL);
+	AssignDomainName(&rr.namestorage, name);
+	AssignDomainName(&rr.resrec.rdata->u.name, name);
+	rr.resrec.rdata->u.name.c[1] = 'x';			// Any target will do, as long as it's not the name itself
+	SetNewRData(&rr.resrec, mDNSNULL, 0);
+	InitializeDNSMessage(&msg->h, zeroID, ResponseFlags);
+	ptr = PutResourceRecordTTL(msg, msg->data, &numAnswers, &rr.resrec, 4500);
+	msg->h.numAnswers = numAnswers;
+	SwapHeaderCounts(msg);
+	return(ptr);
+	}
+
+// Times starting questions, receiving responses and finding the questions a record answers, with 100 to 10,000
+// questions active. With the qname index the per-operation costs should stay roughly flat as the count grows;
+// a walk of the whole m->Questions list, as the code used to do for every record, is timed alongside for comparison.
+mDNSlocal void BenchmarkQuestions(void)
+	{
+	static const int Sizes[] = { 100, 1000, 10000 };
+	enum { Packets = 20000, Lookups = 20000 };
+	mDNS *const m = StartCore();
+	const NetworkInterfaceInfo *intf;
+	static DNSMessage packet, copy;
+	int s;
+
+	printf("questions: question index with 100 to 10000 active questions\n");
+	for (intf = m->HostInterfaces; intf && intf->ip.type != mDNSAddrType_IPv4; intf = intf->next) continue;
+	if (!intf) { printf("  skipped: no IPv4 interface to receive on\n"); return; }
+
+	for (s = 0; s < (int)(sizeof(Sizes)/sizeof(Sizes[0])); s++)
+		{
+		const int n = Sizes[s];
+		DNSQuestion *const q = (DNSQuestion *) calloc(n, sizeof(DNSQuestion));
+		domainname *const names = (domainname *) calloc(n, sizeof(domainname));
+		mDNSAddr src = intf->ip;
+		long found = 0, linear = 0;
+		double t;
+		int i;
+		char what[64];
+
+		if (!q || !names) { fprintf(stderr, "calloc failed\n"); exit(1); }
+		src.ip.v4.b[3] ^= 1;
+		for (i = 0; i < n; i++)
+			{
+			char buffer[MAX_ESCAPED_DOMAIN_NAME];
+			mDNS_snprintf(buffer, sizeof(buffer), "bench-%d-%d._http._tcp.local.", n, i);
+			MakeDomainNameFromDNSNameString(&names[i], buffer);
+			}
+
+		t = Now();
+		for (i = 0; i < n; i++)
+			{
+			mDNS_SetupQuestion(&q[i], mDNSInterface_Any, &names[i], kDNSType_PTR, BenchQuestionCallback, mDNSNULL);
+			mDNS_StartQuery(m, &q[i]);
+			}
+		mDNS_snprintf(what, sizeof(what), "mDNS_StartQuery, %d questions", n);
+		Report(what, n, Now() - t);
+
+		// Do what mDNS_Execute() would do with the new questions, without sending any queries
+		mDNS_Lock(m);
+		while (m->NewQuestions) AnswerNewQuestion(m);
+		mDNS_Unlock(m);
+
+		QuestionAnswers = 0;
+		t = Now();
+		for (i = 0; i < Packets; i++)
+			{
+			const mDNSu8 *end = BuildPTRResponse(&packet, &names[random() % n]);
+			mDNSPlatformMemCopy(&copy, &packet, end - (mDNSu8 *)&packet);		// mDNSCoreReceive byte-swaps the header in place
+			mDNSCoreReceive(m, &copy, (mDNSu8 *)&copy + (end - (mDNSu8 *)&packet), &src, MulticastDNSPort,
+				&AllDNSLinkGroup_v4, MulticastDNSPort, intf->InterfaceID);
+			}
+		mDNS_snprintf(what, sizeof(what), "mDNSCoreReceive, %d questions", n);
+		Report(what, Packets, Now() - t);
+		Check(QuestionAnswers > 0, "responses answer their questions");
+
+		mDNS_Lock(m);
+		t = Now();
+		for (i = 0; i < Lookups; i++)
+			{
+			const domainname *const name = &names[(i * 7919) % n];
+			const mDNSu32 namehash = DomainNameHashValue(name);
+			DNSQuestion *qp;
+			for (qp = m->qhash[QuestionHashSlot(namehash)]; qp; qp = qp->NextInQHash)
+				if (qp->qnamehash == namehash && SameDomainName(&qp->qname, name)) found++;
+			}
+		mDNS_snprintf(what, sizeof(what), "Find questions by name, %d, index", n);
+		Report(what, Lookups, Now() - t);
+		t = Now();
+		for (i = 0; i < Lookups; i++)
+			{
+			const domainname *const name = &names[(i * 7919) % n];
+			const mDNSu32 namehash = DomainNameHashValue(name);
+			DNSQuestion *qp;
+			for (qp = m->Questions; qp; qp = qp->next)
+				if (qp->qnamehash == namehash && SameDomainName(&qp->qname, name)) linear++;
+			}
+		mDNS_snprintf(what, sizeof(what), "Find questions by name, %d, whole list", n);
+		Report(what, Lookups, Now() - t);
+		mDNS_Unlock(m);
+		Check(found == Lookups && linear == Lookups, "the qname index finds the same questions as a walk of the whole list");
+
+		t = Now();
+		for (i = 0; i < n; i++) mDNS_StopQuery(m, &q[i]);
+		mDNS_snprintf(what, sizeof(what), "mDNS_StopQuery, %d questions", n);
+		Report(what, n, Now() - t);
+		free(q);
+		free(names);
+		}
+	}
+
+//*************************************************************************************************************
+// Cache check scheduling
+
+// Times an mDNS_Execute() pass with one CacheGroup due for its expiration check, with 100 to 10,000 groups in
+// the cache. With the check heap only the due group is visited, so the cost per pass should stay roughly flat;
+// the same pass with rrcache_checkall set walks every group, as step 3 of mDNS_Execute() used to, for comparison.
+// This covers only the cache: the question and auth record scans in SendQueries() and SendResponses() are linear.
+mDNSlocal void BenchmarkSchedule(void)
+	{
+	static const int Sizes[] = { 100, 1000, 10000 };
+	enum { Ticks = 2000 };
+	mDNS *const m = StartCore();
+	const NetworkInterfaceInfo *intf;
+	static DNSMessage packet;
+	mDNSAddr src;
+	mDNSu32 slot;
+	CacheGroup *cg;
+	CacheRecord *cr;
+	int s, added = 0;
+
+	printf("schedule: mDNS_Execute cache checks with 100 to 10000 CacheGroups\n");
+	for (intf = m->HostInterfaces; intf && intf->ip.type != mDNSAddrType_IPv4; intf = intf->next) continue;
+	if (!intf) { printf("  skipped: no IPv4 interface to receive on\n"); return; }
+	src = intf->ip;
+	src.ip.v4.b[3] ^= 1;
+
+	// Start from an empty cache, whatever earlier benchmarks left in it
+	mDNS_Lock(m);
+	FORALL_CACHERECORDS(slot, cg, cr) mDNS_PurgeCacheResourceRecord(m, cr);
+	m->rrcache_checkall = mDNStrue;
+	mDNS_Unlock(m);
+	mDNS_Execute(m);
+	Check(m->rrcache_totalused == 0, "purged records are released");
+
+	for (s = 0; s < (int)(sizeof(Sizes)/sizeof(Sizes[0])); s++)
+		{
+		const int n = Sizes[s];
+		int i, pass;
+		char what[64];
+
+		for (; added < n; added++)
+			{
+			char buffer[MAX_ESCAPED_DOMAIN_NAME];
+			domainname name;
+			const mDNSu8 *end;
+			mDNS_snprintf(buffer, sizeof(buffer), "sched-%d._http._tcp.local.", added);
+			MakeDomainNameFromDNSNameString(&name, buffer);
+			end = BuildPTRResponse(&packet, &name);
+			mDNSCoreReceive(m, &packet, end, &src, MulticastDNSPort, &AllDNSLinkGroup_v4, MulticastDNSPort, intf->InterfaceID);
+			}
+		mDNS_Execute(m);
+		Check(m->rrcache_checkcount == (mDNSu32)n, "every CacheGroup is in the check heap");
+
+		for (pass = 0; pass < 2; pass++)
+			{
+			double t = 0;
+			for (i = 0; i < Ticks; i++)
+				{
+				double start;
+				mDNS_Lock(m);
+				SetCacheGroupCheckTime(m, m->rrcache_checkheap[1 + random() % m->rrcache_checkcount], m->timenow);
+				m->NextCacheCheck = m->timenow;
+				if (pass) m->rrcache_checkall = mDNStrue;
+				mDNS_Unlock(m);
+				start = Now();
+				mDNS_Execute(m);
+				t += Now() - start;
+				}
+			mDNS_snprintf(what, sizeof(what), "mDNS_Execute, %d CacheGroups, %s", n, pass ? "full walk" : "check heap");
+			Report(what, Ticks, t);
+			}
+		mDNS_Lock(m);
+		Check(m->rrcache_checkcount == (mDNSu32)n && m->rrcache_checkheap[1]->NextCheck - m->timenow > 0,
+			"no CacheGroup is left due after mDNS_Execute");
+		mDNS_Unlock(m);
+		}
+	}
+
+//*************************************************************************************************************
+// Name compression
+
+// One browse result: the PTR answer, and the SRV, TXT and address records sent alongside it as additionals
+typedef struct { AuthRecord ptr, srv, txt, a; } BenchService;
+
+mDNSlocal void SetupBenchService(BenchService *const s, int i)
+	{
+	static const mDNSu8 txt[] = "\x0Dtxtvers=1.0.0\x0Cpath=/index\x0Bnote=Floor 2";
+	char buffer[MAX_ESCAPED_DOMAIN_NAME];
+	domainname type;
+
+	MakeDomainNameFromDNSNameString(&type, "_http._tcp.local.");
+	mDNS_SetupResourceRecord(&s->ptr, mDNSNULL, mDNSInterface_Any, kDNSType_PTR, 4500, kDNSRecordTypeShared, mDNSNULL, mDNSNULL);
+	mDNS_SetupResourceRecord(&s->srv, mDNSNULL, mDNSInterface_Any, kDNSType_SRV, 120, kDNSRecordTypeUnique, mDNSNULL, mDNSNULL);
+	mDNS_SetupResourceRecord(&s->txt, mDNSNULL, mDNSInterface_Any, kDNSType_TXT, 4500, kDNSRecordTypeUnique, mDNSNULL, mDNSNULL);
+	mDNS_SetupResourceRecord(&s->a,   mDNSNULL, mDNSInterface_Any, kDNSType_A,   120, kDNSRecordTypeUnique, mDNSNULL, mDNSNULL);
+
+	mDNS_snprintf(buffer, sizeof(buffer), "Web Server %d (Building %d)._http._tcp.local.", i, i % 7);
+	AssignDomainName(&s->ptr.namestorage, &type);
+	MakeDomainNameFromDNSNameString(&s->ptr.resrec.rdata->u.name, buffer);
+	MakeDomainNameFromDNSNameString(&s->srv.namestorage, buffer);
+	MakeDomainNameFromDNSNameString(&s->txt.namestorage, buffer);
+	mDNS_snprintf(buffer, sizeof(buffer), "host-%d.local.", i);
+	MakeDomainNameFromDNSNameString(&s->srv.resrec.rdata->u.srv.target, buffer);
+	MakeDomainNameFromDNSNameString(&s->a.namestorage, buffer);
+
+	s->srv.resrec.rdata->u.srv.priority = 0;
+	s->srv.resrec.rdata->u.srv.weight   = 0;
+	s->srv.resrec.rdata->u.srv.port     = mDNSOpaque16fromIntVal(8080);
+	mDNSPlatformMemCopy(s->txt.resrec.rdata->u.txt.c, txt, sizeof(txt) - 1);
+	s->txt.resrec.rdlength = sizeof(txt) - 1;
+	s->a.resrec.rdata->u.ipv4.b[0] = 10;
+	s->a.resrec.rdata->u.ipv4.b[1] = 0;
+	s->a.resrec.rdata->u.ipv4.b[2] = (mDNSu8)(i >> 8);
+	s->a.resrec.rdata->u.ipv4.b[3] = (mDNSu8)i;
+	SetNewRData(&s->ptr.resrec, mDNSNULL, 0);
+	SetNewRData(&s->srv.resrec, mDNSNULL, 0);
+	SetNewRData(&s->a.resrec,   mDNSNULL, 0);
+	}
+
+// Builds a browse response the way SendResponses() lays one out: the PTR answers first, then the additionals,
+// stopping at the first record that doesn't fit in a normal-sized packet (eight services all fit).
+// Returns the end of the message, and the number of records via *count.
+mDNSlocal mDNSu8 *BuildBrowseResponse(DNSMessage *const msg, BenchService *const s, int n, int *const count)
+	{
+	mDNSu8 *ptr = msg->data, *next = ptr;
+	mDNSu16 numAnswers = 0, numAdditionals = 0;
+	int i;
+
+	// The counts live in locals until the end, so apply the size limit AllowedRRSpace() would from them
+	#define BenchPut(C, RR) PutResourceRecordTTLWithLimit(msg, ptr, (C), (RR), (RR)->rroriginalttl, \
+		msg->data + ((numAnswers || numAdditionals) ? NormalMaxDNSMessageData : AbsoluteMaxDNSMessageData))
+	InitializeDNSMessage(&msg->h, zeroID, ResponseFlags);
+	for (i = 0; i < n && (next = BenchPut(&numAnswers, &s[i].ptr.resrec)) != mDNSNULL; i++) ptr = next;
+	for (i = 0; i < n && next; i++)
+		{
+		if ((next = BenchPut(&numAdditionals, &s[i].srv.resrec)) != mDNSNULL) ptr = next; else break;
+		if ((next = BenchPut(&numAdditionals, &s[i].txt.resrec)) != mDNSNULL) ptr = next; else break;
+		if ((next = BenchPut(&numAdditionals, &s[i].a.resrec))   != mDNSNULL) ptr = next; else break;
+		}
+	#undef BenchPut
+	msg->h.numAnswers     = numAnswers;
+	msg->h.numAdditionals = numAdditionals;
+	*count = numAnswers + numAdditionals;
+	return(ptr);
+	}
+
+// Builds the same browse responses into a buffer registered with SetCompressionDict() and into one that isn't,
+// so one uses the compression dictionary and the other the FindCompressionPointer() scan the core used to do for
+// every name, checks that the two messages are byte-for-byte identical, and times both.
+mDNSlocal void BenchmarkEncode(void)
+	{
+	static const int Sizes[] = { 1, 2, 4, 8 };
+	enum { MaxServices = 8, Rounds = 10000 };
+	static BenchService services[MaxServices];
+	static DNSMessage dictmsg, scanmsg;
+	static DNSCompressionDict dict;
+	int i, s;
+
+	printf("encode: browse responses with the name compression dictionary and with the old scan\n");
+	for (i = 0; i < MaxServices; i++) SetupBenchService(&services[i], i);
+	SetCompressionDict(&dict, &dictmsg);
+
+	for (s = 0; s < (int)(sizeof(Sizes)/sizeof(Sizes[0])); s++)
+		{
+		const int n = Sizes[s];
+		const mDNSu8 *dictend, *scanend;
+		int dictcount, scancount, r;
+		char what[64];
+		double t;
+
+		dictend = BuildBrowseResponse(&dictmsg, services, n, &dictcount);
+		scanend = BuildBrowseResponse(&scanmsg, services, n, &scancount);
+		mDNS_snprintf(what, sizeof(what), "%d services: the same %d records in %d bytes", n, scancount, (int)(scanend - (mDNSu8 *)&scanmsg));
+		Check(dictcount == scancount && dictend - (mDNSu8 *)&dictmsg == scanend - (mDNSu8 *)&scanmsg &&
+			mDNSPlatformMemSame(&dictmsg, &scanmsg, dictend - (mDNSu8 *)&dictmsg), what);
+
+		t = Now();
+		for (r = 0; r < Rounds; r++) BuildBrowseResponse(&scanmsg, services, n, &scancount);
+		mDNS_snprintf(what, sizeof(what), "%d services (%d records), scan", n, scancount);
+		Report(what, Rounds, Now() - t);
+		t = Now();
+		for (r = 0; r < Rounds; r++) BuildBrowseResponse(&dictmsg, services, n, &dictcount);
+		mDNS_snprintf(what, sizeof(what), "%d services (%d records), dictionary", n, dictcount);
+		Report(what, Rounds, Now() - t);
+		}
+
+	// Give the core its own dictionary back
+	SetCompressionDict(CoreRunning ? &mDNSStorage.omsgdict : mDNSNULL, CoreRunning ? &mDNSStorage.omsg : mDNSNULL);
+	}
+
+//*************************************************************************************************************
+// TSIG
+
+// Checks the digests against the published vectors, then times signing and verifying a short message with each
+// TSIG algorithm. On a processor with the SHA extensions hmac-sha256 uses them; build with -DSHA256_NO_SHANI
+// to time the portable SHA-256 block function instead.
+mDNSlocal void BenchmarkDigest(void)
+	{
+	static const struct { const char *alg, *what; } Algorithms[] =
+		{
+		{ "hmac-md5.sig-alg.reg.int.", "hmac-md5"    },
+		{ "hmac-sha256.",              "hmac-sha256" },
+		};
+	enum { Rounds = 100000 };
+	mDNS *const m = StartCore();
+	static BenchService service;
+	static DNSMessage msg;
+	static DomainAuthInfo info;
+	static LargeCacheRecord lcr;
+	mDNSu8 *start, *end;
+	mDNSu16 numAdditionals;
+	int a, count, r;
+
+	printf("digest: MD5 and SHA-256 test vectors, and TSIG sign and verify\n");
+	Check(DNSDigest_SelfTest(), "MD5, SHA-256, HMAC-MD5 and HMAC-SHA256 match the RFC 1321, FIPS 180-2, RFC 2202 and RFC 4231 vectors");
+
+	SetupBenchService(&service, 1);
+	start = BuildBrowseResponse(&msg, &service, 1, &count);
+	numAdditionals = msg.h.numAdditionals;
+	MakeDomainNameFromDNSNameString(&info.keyname, "bench-key.example.com.");
+
+	for (a = 0; a < (int)(sizeof(Algorithms)/sizeof(Algorithms[0])); a++)
+		{
+		domainname alg;
+		mDNSu16 rcode = 0, tcode = 0;
+		mDNSBool ok = mDNStrue;
+		char what[64];
+		double t;
+
+		MakeDomainNameFromDNSNameString(&alg, Algorithms[a].alg);
+		Check(DNSDigest_ConstructHMACKeyWithAlgorithm(&info, &alg, "c2VjcmV0LWtleS1mb3ItYmVuY2htYXJr") > 0, "TSIG key set up");
+
+		// Sign the message afresh each time, as mDNSSendDNSMessage() does
+		t = Now();
+		for (r = 0; r < Rounds; r++)
+			{
+			msg.h.numAdditionals = numAdditionals;
+			SwapHeaderCounts(&msg);
+			end = start;
+			DNSDigest_SignMessage(&msg, &end, &info, 0);
+			SwapDNSHeaderBytes(&msg);
+			}
+		mDNS_snprintf(what, sizeof(what), "Sign %d-byte message, %s", (int)(start - msg.data), Algorithms[a].what);
+		Report(what, Rounds, Now() - t);
+		Check(end != mDNSNULL, "DNSDigest_SignMessage succeeds");
+		if (!end) continue;
+
+		// Verify it the way dnsextd does: TSIG record parsed, and not counted in the header
+		GetLargeResourceRecord(m, &msg, start, end, mDNSInterface_Any, kDNSRecordTypePacketAdd, &lcr);
+		msg.h.numAdditionals = numAdditionals;
+		SwapHeaderCounts(&msg);
+		t = Now();
+		for (r = 0; r < Rounds; r++) ok &= DNSDigest_VerifyMessage(&msg, start, &lcr, &info, &rcode, &tcode);
+		mDNS_snprintf(what, sizeof(what), "Verify %d-byte message, %s", (int)(start - msg.data), Algorithms[a].what);
+		Report(what, Rounds, Now() - t);
+		Check(ok, "DNSDigest_VerifyMessage accepts what DNSDigest_SignMessage signed");
+
+		msg.data[0] ^= 1;
+		Check(!DNSDigest_VerifyMessage(&msg, start, &lcr, &info, &rcode, &tcode), "DNSDigest_VerifyMessage rejects a modified message");
+		msg.data[0] ^= 1;
+		SwapDNSHeaderBytes(&msg);
+		}
+	}
+
+//*************************************************************************************************************
+// Main
+
+typedef struct { const char *name; void (*run)(void); } Benchmark;
+
+static const Benchmark Benchmarks[] =
+	{
+	{ "names",     BenchmarkNames     },
+	{ "questions", BenchmarkQuestions },
+	{ "schedule",  BenchmarkSchedule  },
+	{ "encode",    BenchmarkEncode    },
+	{ "digest",    BenchmarkDigest    },
+	};
+#define NumBenchmarks ((int)(sizeof(Benchmarks)/sizeof(Benchmarks[0])))
+
+int main(int argc, char **argv)
+	{
+	int i, j;
+
+	srandom(1);
+	if (argc < 2)
+		for (j = 0; j < NumBenchmarks; j++) Benchmarks[j].run();
+	for (i = 1; i < argc; i++)
+		{
+		for (j = 0; j < NumBenchmarks && strcmp(argv[i], Benchmarks[j].name); j++) continue;
+		if (j == NumBenchmarks)
+			{
+			fprintf(stderr, "Usage: %s [", argv[0]);
+			for (j = 0; j < NumBenchmarks; j++) fprintf(stderr, "%s%s", j ? " | " : "", Benchmarks[j].name);
+			fprintf(stderr, "]...\n");
+			return(2);
+			}
+		Benchmarks[j].run();
+		}
+
+	if (CoreRunning) mDNS_Close(&mDNSStorage);
+	if (Failures) fprintf(stderr, "%d check%s FAILED\n", Failures, Failures == 1 ? "" : "s");
+	return(Failures ? 1 : 0);
+	}
@@ -43,6 +43,7 @@ static domainname DynDNSHostname;
 #define RR_CACHE_SIZE 500
 static CacheEntity gRRCache[RR_CACHE_SIZE];
 static mDNS_PlatformSupport PlatformStorage;
+static mDNSu32 CacheBudget = 0;              // Maximum cache entities (-cachebudget); zero means no hard limit
 
 mDNSlocal void mDNS_StatusCallback(mDNS *const m, mStatus result)
 	{
@@ -85,13 +86,24 @@ static void Reconfigure(mDNS *m)
 	mDNS_ConfigChanged(m);
 	}
 
+#if HAVE_RECV_THREADS
+#define RecvThreadsUsage " [-recvthreads count]"
+#else
+#define RecvThreadsUsage ""
+#endif
+
 // Do appropriate things at startup with command line arguments. Calls exit() if unhappy.
 mDNSlocal void ParseCmdLinArgs(int argc, char **argv)
 	{
-	if (argc > 1)
+	int i;
+	for (i = 1; i < argc; i++)
 		{
-		if (0 == strcmp(argv[1], "-debug")) mDNS_DebugMode = mDNStrue;
-		else printf("Usage: %s [-debug]\n", argv[0]);
+		if      (0 == strcmp(argv[i], "-debug")) mDNS_DebugMode = mDNStrue;
+		else if (0 == strcmp(argv[i], "-cachebudget") && i+1 < argc) CacheBudget = (mDNSu32)strtoul(argv[++i], NULL, 10);
+#if HAVE_RECV_THREADS
+		else if (0 == strcmp(argv[i], "-recvthreads") && i+1 < argc && mDNSPosixSetReceiveThreads(atoi(argv[i+1])) == mStatus_NoError) i++;
+#endif
+		else printf("Usage: %s [-debug] [-cachebudget entities]" RecvThreadsUsage "\n", argv[0]);
 		}
 
 	if (!mDNS_DebugMode)
@@ -110,6 +122,7 @@ mDNSlocal void DumpStateLog(mDNS *const m)
 	{
 	LogMsg("---- BEGIN STATE LOG ----");
 	udsserver_info(m);
+	LogPoolStatistics();
 	LogMsg("----  END STATE LOG  ----");
 	}
 
@@ -166,6 +179,9 @@ int main(int argc, char **argv)
 	err = mDNS_Init(&mDNSStorage, &PlatformStorage, gRRCache, RR_CACHE_SIZE, mDNS_Init_AdvertiseLocalAddresses, 
 					mDNS_StatusCallback, mDNS_Init_NoInitCallbackContext); 
 
+	if (mStatus_NoError == err && CacheBudget)
+		mDNS_SetCacheBudget(&mDNSStorage, CacheBudget);
+
 	if (mStatus_NoError == err)
 		err = udsserver_init(mDNSNULL, 0);
 		
@@ -51,6 +51,18 @@
 #include <arpa/inet.h>
 #include <time.h>                   // platform support for UTC time
 
+#if HAVE_EPOLL
+#include <sys/epoll.h>
+#endif // HAVE_EPOLL
+
+#if HAVE_RECV_THREADS
+#if !HAVE_EPOLL
+#error HAVE_RECV_THREADS requires HAVE_EPOLL
+#endif
+#include <pthread.h>
+#include <signal.h>
+#endif // HAVE_RECV_THREADS
+
 #if USES_NETLINK
 #include <asm/types.h>
 #include <linux/netlink.h>
@@ -62,17 +74,27 @@
 
 #include "mDNSUNP.h"
 #include "GenLinkedList.h"
+#include "PlatformCommon.h"
 
 // ***************************************************************************
 // Structures
 
+#if HAVE_RECV_THREADS
+typedef struct PosixRecvThread PosixRecvThread;
+#endif
+
 // We keep a list of client-supplied event sources in PosixEventSource records 
+// When using epoll we also keep one for each of our own sockets, with a NULL Callback
+// and the owning PosixNetworkInterface (or NULL for the unicast sockets) as its Context.
 struct PosixEventSource
 	{
 	mDNSPosixEventCallback		Callback;
 	void						*Context;
 	int							fd;
 	struct  PosixEventSource	*Next;
+#if HAVE_RECV_THREADS
+	PosixRecvThread				*Thread;	// For our own sockets, the receive thread reading it (NULL if none)
+#endif
 	};
 typedef struct PosixEventSource	PosixEventSource;
 
@@ -91,6 +113,15 @@ static GenLinkedList	gEventSources;			// linked list of PosixEventSource's
 static sigset_t			gEventSignalSet;		// Signals which event loop listens for
 static sigset_t			gEventSignals;			// Signals which were received while inside loop
 
+#if HAVE_EPOLL
+#define kMaxEpollEvents 64							// Events collected per call to epoll_wait()
+#define kMaxReadsPerEvent 8							// SocketDataReady() calls per event before we give other sources a turn
+static int				gEpollFD = -1;			// -1 until first used; -2 if epoll is unavailable and we use select()
+static GenLinkedList	gWireSources;			// PosixEventSource's for our own multicast and unicast sockets
+static GenLinkedList	gDeadSources;			// PosixEventSource's removed while dispatching, freed afterwards
+static mDNSBool			gDispatching;			// True while mDNSPosixRunEventLoopOnce() is walking the epoll results
+#endif // HAVE_EPOLL
+
 // ***************************************************************************
 // Globals (for debugging)
 
@@ -144,7 +175,94 @@ mDNSlocal void SockAddrTomDNSAddr(const struct sockaddr *const sa, mDNSAddr *ipA
 #pragma mark ***** Send and Receive
 #endif
 
+// Logs a failed send, whether mDNSPlatformSendUDP was sending the packet itself or flushing a queued batch
+mDNSlocal void LogSendError(int error, const mDNSAddr *dst, const PosixNetworkInterface *thisIntf)
+	{
+	static int MessageCount = 0;
+	if (MessageCount < 1000)
+		{
+		MessageCount++;
+		if (thisIntf)
+			LogMsg("mDNSPlatformSendUDP got error %d (%s) sending packet to %#a on interface %#a/%s/%d",
+						  error, strerror(error), dst, &thisIntf->coreIntf.ip, thisIntf->intfName, thisIntf->index);
+		else
+			LogMsg("mDNSPlatformSendUDP got error %d (%s) sending packet to %#a", error, strerror(error), dst);
+		}
+	}
+
 // mDNS core calls this routine when it needs to send a packet.
+#if HAVE_SENDMMSG
+
+// Between mDNSPlatformBeginSendBatch() and mDNSPlatformEndSendBatch() multicast packets are copied into
+// gSendQueue instead of being sent immediately. When the batch ends (or the queue fills) we send all the
+// queued packets of each address family with one sendmmsg() call on a single socket, using IP_PKTINFO
+// to pick each packet's interface, rather than one sendto() per interface per address family.
+// mDNSPlatformSendUDP has already returned mStatus_NoError for a queued packet, so if it can't be sent the error
+// is logged here just as mDNSPlatformSendUDP would have logged it; the core doesn't act on multicast send errors.
+#define kSendQueueSize SENDMMSG_MAX
+typedef struct
+	{
+	int			skt;		// The socket mDNSPlatformSendUDP would have used; we fall back to it if sendmmsg fails
+	const PosixNetworkInterface *intf;	// For logging; interfaces can't go away while the core is sending a batch
+	mDNSAddr	dst;
+	DNSMessage	msg;
+	struct my_send_batch item;
+	} PosixQueuedPacket;
+static PosixQueuedPacket	gSendQueue[kSendQueueSize];
+static int					gSendQueued;
+static int					gSendBatchDepth;
+
+mDNSlocal void FlushSendQueueFamily(int family)
+	{
+	struct my_send_batch batch[kSendQueueSize];
+	const PosixQueuedPacket *queued[kSendQueueSize];
+	int i, n = 0, sent;
+
+	for (i = 0; i < gSendQueued; i++)
+		if (((struct sockaddr *)&gSendQueue[i].item.to)->sa_family == family)
+			{
+			batch[n]  = gSendQueue[i].item;
+			batch[n].ptr = &gSendQueue[i].msg;
+			queued[n++] = &gSendQueue[i];
+			}
+	if (!n) return;
+
+	// Send the lot on the first packet's socket. Anything sendmmsg() couldn't take goes out the old way.
+	sent = sendmmsg_pktinfo(queued[0]->skt, batch, n);
+	if (sent < 0) { LogInfo("FlushSendQueue: sendmmsg failed %d (%s)", errno, strerror(errno)); sent = 0; }
+	for (i = sent; i < n; i++)
+		if (sendto(queued[i]->skt, batch[i].ptr, batch[i].nbytes, 0, (struct sockaddr *)&batch[i].to, batch[i].tolen) < 0)
+			LogSendError(errno, &queued[i]->dst, queued[i]->intf);
+	}
+
+mDNSlocal void FlushSendQueue(void)
+	{
+	FlushSendQueueFamily(AF_INET);
+#if HAVE_IPV6
+	FlushSendQueueFamily(AF_INET6);
+#endif
+	gSendQueued = 0;
+	}
+
+mDNSexport void mDNSPlatformBeginSendBatch(mDNS *const m)
+	{
+	(void)m;	// Unused
+	gSendBatchDepth++;
+	}
+
+mDNSexport void mDNSPlatformEndSendBatch(mDNS *const m)
+	{
+	(void)m;	// Unused
+	if (gSendBatchDepth > 0 && --gSendBatchDepth == 0) FlushSendQueue();
+	}
+
+#else
+
+mDNSexport void mDNSPlatformBeginSendBatch(mDNS *const m) { (void)m; }
+mDNSexport void mDNSPlatformEndSendBatch  (mDNS *const m) { (void)m; }
+
+#endif // HAVE_SENDMMSG
+
 mDNSexport mStatus mDNSPlatformSendUDP(const mDNS *const m, const void *const msg, const mDNSu8 *const end,
 	mDNSInterfaceID InterfaceID, UDPSocket *src, const mDNSAddr *dst, mDNSIPPort dstPort)
 	{
@@ -188,36 +306,178 @@ mDNSexport mStatus mDNSPlatformSendUDP(const mDNS *const m, const void *const ms
 		}
 #endif
 
+#if HAVE_SENDMMSG
+	// Queue multicasts on our interface sockets if we're batching; everything else goes out right away
+	if (gSendBatchDepth && thisIntf && sendingsocket >= 0 && mDNSAddrIsDNSMulticast(dst) && (char*)end - (char*)msg <= (int)sizeof(DNSMessage))
+		{
+		PosixQueuedPacket *q;
+		if (gSendQueued == kSendQueueSize) FlushSendQueue();
+		q = &gSendQueue[gSendQueued++];
+		q->skt  = sendingsocket;
+		q->intf = thisIntf;
+		q->dst  = *dst;
+		mDNSPlatformMemCopy(&q->msg, msg, (char*)end - (char*)msg);
+		mDNSPlatformMemZero(&q->item, sizeof(q->item));
+		q->item.nbytes  = (char*)end - (char*)msg;
+		q->item.to      = to;
+		q->item.tolen   = GET_SA_LEN(to);
+		q->item.ifindex = thisIntf->index;
+		if (thisIntf->coreIntf.ip.type == mDNSAddrType_IPv4 && dst->type == mDNSAddrType_IPv4)
+			q->item.src4.s_addr = thisIntf->coreIntf.ip.ip.v4.NotAnInteger;
+		return mStatus_NoError;
+		}
+#endif // HAVE_SENDMMSG
+
 	if (sendingsocket >= 0)
 		err = sendto(sendingsocket, msg, (char*)end - (char*)msg, 0, (struct sockaddr *)&to, GET_SA_LEN(to));
 
 	if      (err > 0) err = 0;
 	else if (err < 0)
 		{
-		static int MessageCount = 0;
         // Don't report EHOSTDOWN (i.e. ARP failure), ENETDOWN, or no route to host for unicast destinations
 		if (!mDNSAddressIsAllDNSLinkGroup(dst))
 			if (errno == EHOSTDOWN || errno == ENETDOWN || errno == EHOSTUNREACH || errno == ENETUNREACH) return(mStatus_TransientErr);
 
-		if (MessageCount < 1000)
+		LogSendError(errno, dst, thisIntf);
+		}
+
+	return PosixErrorToStatus(err);
+	}
+
+// Works out the sender and destination of a datagram read from skt, and checks that it arrived on the interface
+// we expect. Returns mDNSfalse if the packet should be ignored. *accepted and *rejected count interface matches
+// and mismatches for the warning below; receive threads keep their own counts.
+mDNSlocal mDNSBool ClassifyPacket(PosixNetworkInterface *intf, int skt, int flags,
+	const struct sockaddr_storage *from, const struct my_in_pktinfo *packetInfo,
+	mDNSAddr *senderAddr, mDNSIPPort *senderPort, mDNSAddr *destAddr, int *accepted, int *rejected)
+	{
+	mDNSBool reject;
+
+	(void) flags;	// Unused on platforms with working IP_PKTINFO or IP_RECVDSTADDR
+	(void) skt;		// Unused unless verbose debugging is enabled
+
+	SockAddrTomDNSAddr((struct sockaddr*)from, senderAddr, senderPort);
+	SockAddrTomDNSAddr((struct sockaddr*)&packetInfo->ipi_addr, destAddr, NULL);
+
+	// If we have broken IP_RECVDSTADDR functionality (so far
+	// I've only seen this on OpenBSD) then apply a hack to
+	// convince mDNS Core that this isn't a spoof packet.
+	// Basically what we do is check to see whether the
+	// packet arrived as a multicast and, if so, set its
+	// destAddr to the mDNS address.
+	//
+	// I must admit that I could just be doing something
+	// wrong on OpenBSD and hence triggering this problem
+	// but I'm at a loss as to how.
+	//
+	// If this platform doesn't have IP_PKTINFO or IP_RECVDSTADDR, then we have
+	// no way to tell the destination address or interface this packet arrived on,
+	// so all we can do is just assume it's a multicast
+
+	#if HAVE_BROKEN_RECVDSTADDR || (!defined(IP_PKTINFO) && !defined(IP_RECVDSTADDR))
+		if ((destAddr->NotAnInteger == 0) && (flags & MSG_MCAST))
 			{
-			MessageCount++;
-			if (thisIntf)
-				LogMsg("mDNSPlatformSendUDP got error %d (%s) sending packet to %#a on interface %#a/%s/%d",
-							  errno, strerror(errno), dst, &thisIntf->coreIntf.ip, thisIntf->intfName, thisIntf->index);
-			else
-				LogMsg("mDNSPlatformSendUDP got error %d (%s) sending packet to %#a", errno, strerror(errno), dst);
+			destAddr->type = senderAddr->type;
+			if      (senderAddr->type == mDNSAddrType_IPv4) destAddr->ip.v4 = AllDNSLinkGroup_v4.ip.v4;
+			else if (senderAddr->type == mDNSAddrType_IPv6) destAddr->ip.v6 = AllDNSLinkGroup_v6.ip.v6;
+			}
+	#endif
+
+	// We only accept the packet if the interface on which it came
+	// in matches the interface associated with this socket.
+	// We do this match by name or by index, depending on which
+	// information is available.  recvfrom_flags sets the name
+	// to "" if the name isn't available, or the index to -1
+	// if the index is available.  This accomodates the various
+	// different capabilities of our target platforms.
+
+	if (!intf)
+		{
+		// Ignore multicasts accidentally delivered to our unicast receiving socket
+		return(!mDNSAddrIsDNSMulticast(destAddr));
+		}
+
+	reject = mDNSfalse;
+	if      (packetInfo->ipi_ifname[0] != 0) reject = (strcmp(packetInfo->ipi_ifname, intf->intfName) != 0);
+	else if (packetInfo->ipi_ifindex != -1)  reject = (packetInfo->ipi_ifindex != intf->index);
+
+	if (reject)
+		{
+		verbosedebugf("SocketDataReady ignored a packet from %#a to %#a on interface %s/%d expecting %#a/%s/%d/%d",
+			senderAddr, destAddr, packetInfo->ipi_ifname, packetInfo->ipi_ifindex,
+			&intf->coreIntf.ip, intf->intfName, intf->index, skt);
+		(*rejected)++;
+		if (*rejected > (*accepted + 1) * (num_registered_interfaces + 1) * 2)
+			{
+			fprintf(stderr,
+				"*** WARNING: Received %d packets; Accepted %d packets; Rejected %d packets because of interface mismatch\n",
+				*accepted + *rejected, *accepted, *rejected);
+			*accepted = 0;
+			*rejected = 0;
 			}
+		return(mDNSfalse);
 		}
 
-	return PosixErrorToStatus(err);
+	verbosedebugf("SocketDataReady got a packet from %#a to %#a on interface %#a/%s/%d/%d",
+		senderAddr, destAddr, &intf->coreIntf.ip, intf->intfName, intf->index, skt);
+	(*accepted)++;
+	return(mDNStrue);
 	}
 
-// This routine is called when the main loop detects that data is available on a socket.
-mDNSlocal void SocketDataReady(mDNS *const m, PosixNetworkInterface *intf, int skt)
+// Checks that a datagram read from skt arrived on the interface we expect, and if so hands it to mDNSCoreReceive()
+mDNSlocal void SocketPacketReceived(mDNS *const m, PosixNetworkInterface *intf, int skt, DNSMessage *packet, ssize_t packetLen,
+	int flags, const struct sockaddr_storage *from, const struct my_in_pktinfo *packetInfo)
 	{
 	mDNSAddr   senderAddr, destAddr;
 	mDNSIPPort senderPort;
+	const mDNSInterfaceID InterfaceID = intf ? intf->coreIntf.InterfaceID : NULL;
+
+	if (packetLen >= 0 && ClassifyPacket(intf, skt, flags, from, packetInfo, &senderAddr, &senderPort, &destAddr,
+		&num_pkts_accepted, &num_pkts_rejected))
+		mDNSCoreReceive(m, packet, (mDNSu8 *)packet + packetLen,
+			&senderAddr, senderPort, &destAddr, MulticastDNSPort, InterfaceID);
+	}
+
+#if HAVE_RECVMMSG
+
+// Batch size for SocketDataReady(). The buffers are static because we're only ever called from the event loop thread.
+#define kRecvBatchSize 16
+static DNSMessage			gRecvPackets[kRecvBatchSize];
+static struct my_recv_batch	gRecvBatch[kRecvBatchSize];
+
+// This routine is called when the main loop detects that data is available on a socket.
+// It reads up to kRecvBatchSize datagrams with one recvmmsg() call and delivers them to the core
+// under a single lock, so the core's scheduling work is done once per batch rather than once per packet.
+// Returns mDNStrue if any datagrams were read, so callers can drain the socket until it returns mDNSfalse.
+mDNSlocal mDNSBool SocketDataReady(mDNS *const m, PosixNetworkInterface *intf, int skt)
+	{
+	int i, n;
+
+	assert(m    != NULL);
+	assert(skt  >= 0);
+
+	for (i = 0; i < kRecvBatchSize; i++)
+		{
+		gRecvBatch[i].ptr    = &gRecvPackets[i];
+		gRecvBatch[i].nbytes = sizeof(gRecvPackets[i]);
+		}
+	n = recvmmsg_flags(skt, gRecvBatch, kRecvBatchSize);
+	if (n <= 0) return(mDNSfalse);
+
+	if (n > 1) mDNSCoreBeginReceiveBatch(m);
+	for (i = 0; i < n; i++)
+		SocketPacketReceived(m, intf, skt, &gRecvPackets[i], gRecvBatch[i].n, gRecvBatch[i].flags, &gRecvBatch[i].from, &gRecvBatch[i].pktinfo);
+	if (n > 1) mDNSCoreEndReceiveBatch(m);
+
+	return(mDNStrue);
+	}
+
+#else
+
+// This routine is called when the main loop detects that data is available on a socket.
+// Returns mDNStrue if a datagram was read, so callers can drain the socket until it returns mDNSfalse.
+mDNSlocal mDNSBool SocketDataReady(mDNS *const m, PosixNetworkInterface *intf, int skt)
+	{
 	ssize_t                 packetLen;
 	DNSMessage              packet;
 	struct my_in_pktinfo    packetInfo;
@@ -225,8 +485,6 @@ mDNSlocal void SocketDataReady(mDNS *const m, PosixNetworkInterface *intf, int s
 	socklen_t               fromLen;
 	int                     flags;
 	mDNSu8					ttl;
-	mDNSBool                reject;
-	const mDNSInterfaceID InterfaceID = intf ? intf->coreIntf.InterfaceID : NULL;
 
 	assert(m    != NULL);
 	assert(skt  >= 0);
@@ -234,85 +492,14 @@ mDNSlocal void SocketDataReady(mDNS *const m, PosixNetworkInterface *intf, int s
 	fromLen = sizeof(from);
 	flags   = 0;
 	packetLen = recvfrom_flags(skt, &packet, sizeof(packet), &flags, (struct sockaddr *) &from, &fromLen, &packetInfo, &ttl);
+	if (packetLen < 0) return(mDNSfalse);
 
-	if (packetLen >= 0)
-		{
-		SockAddrTomDNSAddr((struct sockaddr*)&from, &senderAddr, &senderPort);
-		SockAddrTomDNSAddr((struct sockaddr*)&packetInfo.ipi_addr, &destAddr, NULL);
-
-		// If we have broken IP_RECVDSTADDR functionality (so far
-		// I've only seen this on OpenBSD) then apply a hack to
-		// convince mDNS Core that this isn't a spoof packet.
-		// Basically what we do is check to see whether the
-		// packet arrived as a multicast and, if so, set its
-		// destAddr to the mDNS address.
-		//
-		// I must admit that I could just be doing something
-		// wrong on OpenBSD and hence triggering this problem
-		// but I'm at a loss as to how.
-		//
-		// If this platform doesn't have IP_PKTINFO or IP_RECVDSTADDR, then we have
-		// no way to tell the destination address or interface this packet arrived on,
-		// so all we can do is just assume it's a multicast
-
-		#if HAVE_BROKEN_RECVDSTADDR || (!defined(IP_PKTINFO) && !defined(IP_RECVDSTADDR))
-			if ((destAddr.NotAnInteger == 0) && (flags & MSG_MCAST))
-				{
-				destAddr.type = senderAddr.type;
-				if      (senderAddr.type == mDNSAddrType_IPv4) destAddr.ip.v4 = AllDNSLinkGroup_v4.ip.v4;
-				else if (senderAddr.type == mDNSAddrType_IPv6) destAddr.ip.v6 = AllDNSLinkGroup_v6.ip.v6;
-				}
-		#endif
-
-		// We only accept the packet if the interface on which it came
-		// in matches the interface associated with this socket.
-		// We do this match by name or by index, depending on which
-		// information is available.  recvfrom_flags sets the name
-		// to "" if the name isn't available, or the index to -1
-		// if the index is available.  This accomodates the various
-		// different capabilities of our target platforms.
-
-		reject = mDNSfalse;
-		if (!intf)
-			{
-			// Ignore multicasts accidentally delivered to our unicast receiving socket
-			if (mDNSAddrIsDNSMulticast(&destAddr)) packetLen = -1;
-			}
-		else
-			{
-			if      (packetInfo.ipi_ifname[0] != 0) reject = (strcmp(packetInfo.ipi_ifname, intf->intfName) != 0);
-			else if (packetInfo.ipi_ifindex != -1)  reject = (packetInfo.ipi_ifindex != intf->index);
-	
-			if (reject)
-				{
-				verbosedebugf("SocketDataReady ignored a packet from %#a to %#a on interface %s/%d expecting %#a/%s/%d/%d",
-					&senderAddr, &destAddr, packetInfo.ipi_ifname, packetInfo.ipi_ifindex,
-					&intf->coreIntf.ip, intf->intfName, intf->index, skt);
-				packetLen = -1;
-				num_pkts_rejected++;
-				if (num_pkts_rejected > (num_pkts_accepted + 1) * (num_registered_interfaces + 1) * 2)
-					{
-					fprintf(stderr,
-						"*** WARNING: Received %d packets; Accepted %d packets; Rejected %d packets because of interface mismatch\n",
-						num_pkts_accepted + num_pkts_rejected, num_pkts_accepted, num_pkts_rejected);
-					num_pkts_accepted = 0;
-					num_pkts_rejected = 0;
-					}
-				}
-			else
-				{
-				verbosedebugf("SocketDataReady got a packet from %#a to %#a on interface %#a/%s/%d/%d",
-					&senderAddr, &destAddr, &intf->coreIntf.ip, intf->intfName, intf->index, skt);
-				num_pkts_accepted++;
-				}
-			}
-		}
-
-	if (packetLen >= 0)
-		mDNSCoreReceive(m, &packet, (mDNSu8 *)&packet + packetLen,
-			&senderAddr, senderPort, &destAddr, MulticastDNSPort, InterfaceID);
+	SocketPacketReceived(m, intf, skt, &packet, packetLen, flags, &from, &packetInfo);
+	return(mDNStrue);
 	}
 
+#endif // HAVE_RECVMMSG
+
 mDNSexport TCPSocket *mDNSPlatformTCPSocket(mDNS * const m, TCPSocketFlags flags, mDNSIPPort * port)
 	{
 	(void)m;			// Unused
@@ -535,15 +722,473 @@ mDNSexport mDNSu32 mDNSPlatformInterfaceIndexfromInterfaceID(mDNS *const m, mDNS
 	return intf ? intf->index : 0;
 	}
 
+#if HAVE_EPOLL
+// Returns our epoll descriptor, creating it on first use. Returns -1 if the kernel doesn't support
+// epoll, in which case mDNSPosixRunEventLoopOnce() falls back to select() with gEventFDs.
+mDNSlocal int GetEpollFD(void)
+	{
+	if (gEpollFD == -1)
+		{
+		InitLinkedList(&gWireSources, offsetof(PosixEventSource, Next));
+		InitLinkedList(&gDeadSources, offsetof(PosixEventSource, Next));
+		gEpollFD = epoll_create(kMaxEpollEvents);
+		if (gEpollFD < 0)
+			{
+			LogMsg("GetEpollFD: epoll_create failed %d (%s); using select() instead", errno, strerror(errno));
+			gEpollFD = -2;
+			}
+		else (void) fcntl(gEpollFD, F_SETFD, FD_CLOEXEC);
+		}
+	return (gEpollFD < 0) ? -1 : gEpollFD;
+	}
+
+// Registers source with the epoll set epfd. Our own sockets are non-blocking and drained completely on
+// each event, so they're edge-triggered; client callbacks only promise to make some progress,
+// so their descriptors stay level-triggered.
+mDNSlocal mStatus EpollAddSource(int epfd, PosixEventSource *source)
+	{
+	struct epoll_event ev;
+	mDNSPlatformMemZero(&ev, sizeof ev);
+	ev.events   = source->Callback ? EPOLLIN : (EPOLLIN | EPOLLET);
+	ev.data.ptr = source;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, source->fd, &ev) < 0)
+		{
+		LogMsg("EpollAddSource: epoll_ctl ADD %d failed %d (%s)", source->fd, errno, strerror(errno));
+		return mStatus_UnknownErr;
+		}
+	return mStatus_NoError;
+	}
+
+// Unregisters source from epoll, unlinks it from list and frees it. If we're part way through dispatching
+// a batch of epoll events the batch may still refer to source, so it's parked on gDeadSources instead.
+mDNSlocal void EpollRemoveSource(GenLinkedList *list, PosixEventSource *source)
+	{
+	struct epoll_event ev;		// Kernels before 2.6.9 require a non-NULL event pointer even for EPOLL_CTL_DEL
+	mDNSPlatformMemZero(&ev, sizeof ev);
+	(void) epoll_ctl(gEpollFD, EPOLL_CTL_DEL, source->fd, &ev);
+	RemoveFromList(list, source);
+	source->fd = -1;
+	if (gDispatching) AddToTail(&gDeadSources, source);
+	else free(source);
+	}
+
+// Our edge-triggered sockets won't report again until more data arrives, so if we stop reading one
+// before it's empty we re-arm it, which makes epoll report it again on the next pass if it's still readable
+mDNSlocal void EpollRearmSource(int epfd, PosixEventSource *source)
+	{
+	struct epoll_event ev;
+	mDNSPlatformMemZero(&ev, sizeof ev);
+	ev.events   = EPOLLIN | EPOLLET;
+	ev.data.ptr = source;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, source->fd, &ev) < 0)
+		LogMsg("EpollRearmSource: epoll_ctl MOD %d failed %d (%s)", source->fd, errno, strerror(errno));
+	}
+
+#if HAVE_RECV_THREADS
+// When mDNSPosixSetReceiveThreads() asks for them, our wire sockets are read by a small pool of threads instead
+// of by the event loop. Each thread has its own epoll set; it reads datagrams straight into a single-producer,
+// single-consumer ring, and does the address conversion and interface checks there, along with walking the
+// records of each response with mDNSCorePreParsePacket(). The event loop thread, which is still the only thread
+// that ever takes the mDNS lock, is woken through a pipe and hands the queued packets and their pre-parsed
+// records to mDNSCoreReceivePreParsed(). Our sockets are only ever added and retired on the event loop thread.
+#define kMaxRecvThreads 8
+#define kRecvQueueSize  128							// Packets each thread can have waiting; must be a power of two
+#if HAVE_RECVMMSG
+#define kRecvThreadBatch kRecvBatchSize
+#else
+#define kRecvThreadBatch 1
+#endif
+
+typedef struct
+	{
+	PosixEventSource *source;		// Socket this came from; NULL if that socket was retired before we got to it
+	mDNSInterfaceID   InterfaceID;
+	mDNSAddr          srcaddr;
+	mDNSIPPort        srcport;
+	mDNSAddr          dstaddr;
+	ssize_t           len;			// -1 if the receive thread rejected this packet
+	PreParsedPacket   parsed;		// The response's records, walked on the receive thread
+	DNSMessage        msg;
+	} PosixReceivedPacket;
+
+struct PosixRecvThread
+	{
+	pthread_t              thread;
+	int                    epfd;			// Epoll set of the wire sockets this thread reads
+	pthread_mutex_t        lock;			// Held while reading; taken by the event loop thread to retire a socket
+	GenLinkedList          dead;			// Retired sources, freed by this thread once it can't be looking at them
+	int                    accepted;		// ClassifyPacket() counters for this thread
+	int                    rejected;
+	mDNSu32                overflows;		// Packets dropped because the event loop thread fell behind
+	mDNSu32                head;			// Next slot to fill; written only by this thread
+	mDNSu32                tail;			// Next slot to consume; written only by the event loop thread
+#if HAVE_RECVMMSG
+	struct my_recv_batch   batch[kRecvThreadBatch];
+#endif
+	DNSMessage             discard;			// Where packets go when the queue is full
+	PosixReceivedPacket queue[kRecvQueueSize];
+	};
+
+static int				gNumRecvThreads;		// Number requested with mDNSPosixSetReceiveThreads()
+static int				gRecvThreadsRunning;	// Number actually started; 0 means the event loop reads our sockets
+static PosixRecvThread	*gRecvThreads[kMaxRecvThreads];
+static int				gNextRecvThread;		// New sockets are handed out to the threads round-robin
+static int				gRecvWakePipe[2] = { -1, -1 };
+static int				gRecvWakePending;		// Set when a receive thread has written to gRecvWakePipe
+static int				gRecvStopPipe[2] = { -1, -1 };	// Readable once the receive threads are to exit
+
+// Reads what's waiting on source's socket into t's queue. Returns mDNStrue if it read anything, in which case
+// the socket may have more. Called with t->lock held.
+mDNSlocal mDNSBool RecvThreadRead(PosixRecvThread *t, PosixEventSource *source)
+	{
+	PosixNetworkInterface *intf = (PosixNetworkInterface *)source->Context;
+	const mDNSu32 head = t->head;
+	const mDNSu32 room = kRecvQueueSize - (head - __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE));
+	mDNSu32 want = kRecvQueueSize - (head & (kRecvQueueSize-1));	// Contiguous slots before we wrap
+	int i, n;
+
+	if (want > room) want = room;
+	if (want > kRecvThreadBatch) want = kRecvThreadBatch;
+
+	if (want == 0)
+		{
+		// Queue full; drain the socket anyway (the kernel would be dropping these shortly) so edge-triggering still works
+		int flags = 0;
+		struct sockaddr_storage from;
+		socklen_t fromLen = sizeof(from);
+		struct my_in_pktinfo packetInfo;
+		mDNSu8 ttl;
+		if (recvfrom_flags(source->fd, &t->discard, sizeof(t->discard), &flags, (struct sockaddr *)&from, &fromLen, &packetInfo, &ttl) < 0)
+			return(mDNSfalse);
+		if (t->overflows++ % 1000 == 0) LogMsg("RecvThreadRead: receive queue full; %u packets dropped", t->overflows);
+		return(mDNStrue);
+		}
+
+#if HAVE_RECVMMSG
+	for (i = 0; i < (int)want; i++)
+		{
+		t->batch[i].ptr    = &t->queue[(head + i) & (kRecvQueueSize-1)].msg;
+		t->batch[i].nbytes = sizeof(DNSMessage);
+		}
+	n = recvmmsg_flags(source->fd, t->batch, want);
+	if (n <= 0) return(mDNSfalse);
+	for (i = 0; i < n; i++)
+		{
+		PosixReceivedPacket *const p = &t->queue[(head + i) & (kRecvQueueSize-1)];
+		p->source      = source;
+		p->InterfaceID = intf ? intf->coreIntf.InterfaceID : NULL;
+		p->len         = ClassifyPacket(intf, source->fd, t->batch[i].flags, &t->batch[i].from, &t->batch[i].pktinfo,
+			&p->srcaddr, &p->srcport, &p->dstaddr, &t->accepted, &t->rejected) ? t->batch[i].n : -1;
+		if (p->len >= 0) mDNSCorePreParsePacket(&p->msg, (mDNSu8 *)&p->msg + p->len, &p->parsed);
+		}
+#else
+	{
+	PosixReceivedPacket *const p = &t->queue[head & (kRecvQueueSize-1)];
+	int flags = 0;
+	struct sockaddr_storage from;
+	socklen_t fromLen = sizeof(from);
+	struct my_in_pktinfo packetInfo;
+	mDNSu8 ttl;
+	ssize_t len = recvfrom_flags(source->fd, &p->msg, sizeof(p->msg), &flags, (struct sockaddr *)&from, &fromLen, &packetInfo, &ttl);
+	if (len < 0) return(mDNSfalse);
+	p->source      = source;
+	p->InterfaceID = intf ? intf->coreIntf.InterfaceID : NULL;
+	p->len         = ClassifyPacket(intf, source->fd, flags, &from, &packetInfo,
+		&p->srcaddr, &p->srcport, &p->dstaddr, &t->accepted, &t->rejected) ? len : -1;
+	if (p->len >= 0) mDNSCorePreParsePacket(&p->msg, (mDNSu8 *)&p->msg + p->len, &p->parsed);
+	n = 1;
+	}
+	(void) i;
+#endif
+
+	// Publish the new packets to the event loop thread. This is a full barrier (like the exchange on
+	// gRecvWakePending below) so that RecvQueueCallback() can't miss packets published just as it goes idle.
+	__atomic_store_n(&t->head, head + n, __ATOMIC_SEQ_CST);
+	return(mDNStrue);
+	}
+
+mDNSlocal void *RecvThreadMain(void *context)
+	{
+	PosixRecvThread *const t = (PosixRecvThread *)context;
+	struct epoll_event events[kMaxEpollEvents];
+	PosixEventSource *source;
+	int numReady, i, reads;
+	mDNSBool stop = mDNSfalse;
+
+	while (!stop)
+		{
+		mDNSu32 before;
+		numReady = epoll_wait(t->epfd, events, kMaxEpollEvents, -1);
+		if (numReady < 0 && errno != EINTR)
+			{ LogMsg("RecvThreadMain: epoll_wait failed %d (%s)", errno, strerror(errno)); return(NULL); }
+
+		pthread_mutex_lock(&t->lock);
+		before = t->head;
+		for (i = 0; i < numReady; i++)
+			{
+			source = (PosixEventSource*) events[i].data.ptr;
+			if (source == NULL) { stop = mDNStrue; continue; }		// gRecvStopPipe; see StopRecvThreads()
+			for (reads = 0; source->fd >= 0 && RecvThreadRead(t, source); reads++)
+				if (reads + 1 >= kMaxReadsPerEvent) { EpollRearmSource(t->epfd, source); break; }
+			}
+		// Sources retired by the event loop thread were removed from our epoll set before being put on
+		// t->dead, so once we've finished with this batch of events nothing can refer to them any more
+		while ((source = (PosixEventSource*) t->dead.Head) != NULL)
+			{
+			RemoveFromList(&t->dead, source);
+			free(source);
+			}
+		pthread_mutex_unlock(&t->lock);
+
+		if (t->head != before && !__atomic_exchange_n(&gRecvWakePending, 1, __ATOMIC_SEQ_CST))
+			{
+			ssize_t result = write(gRecvWakePipe[1], "", 1);
+			(void) result;	// If the pipe is full, the event loop thread already has a wakeup waiting
+			}
+		}
+	return(NULL);
+	}
+
+// Runs on the event loop thread when a receive thread has queued packets for us
+mDNSlocal void RecvQueueCallback(int fd, short filter, void *context)
+	{
+	mDNS *const m = (mDNS *)context;
+	char buf[64];
+	int i;
+
+	(void) filter;	// Unused
+
+	// Empty the pipe, then clear the flag, then look at the queues. A thread that publishes after we've looked
+	// sees the flag clear and writes again; clearing it before draining could eat that byte and leave the flag set.
+	while (read(fd, buf, sizeof(buf)) > 0) continue;
+	__atomic_store_n(&gRecvWakePending, 0, __ATOMIC_SEQ_CST);
+
+	mDNSCoreBeginReceiveBatch(m);
+	for (i = 0; i < gRecvThreadsRunning; i++)
+		{
+		PosixRecvThread *const t = gRecvThreads[i];
+		const mDNSu32 head = __atomic_load_n(&t->head, __ATOMIC_SEQ_CST);
+		mDNSu32 tail;
+		for (tail = t->tail; tail != head; tail++)
+			{
+			PosixReceivedPacket *const p = &t->queue[tail & (kRecvQueueSize-1)];
+			if (p->source && p->len >= 0)
+				mDNSCoreReceivePreParsed(m, &p->msg, (mDNSu8 *)&p->msg + p->len,
+					&p->srcaddr, p->srcport, &p->dstaddr, MulticastDNSPort, p->InterfaceID, &p->parsed);
+			}
+		__atomic_store_n(&t->tail, tail, __ATOMIC_RELEASE);
+		}
+	mDNSCoreEndReceiveBatch(m);
+	}
+
+// Hands a new wire socket to one of the receive threads
+mDNSlocal mStatus AddRecvThreadSource(PosixEventSource *source)
+	{
+	PosixRecvThread *const t = gRecvThreads[gNextRecvThread++ % gRecvThreadsRunning];
+	source->Thread = t;
+	return(EpollAddSource(t->epfd, source));
+	}
+
+// Takes a wire socket away from its receive thread, before the socket is closed. Once we've held the thread's
+// lock it can't be reading the socket, or queueing more packets from it; packets it has already queued are
+// marked so RecvQueueCallback() ignores them, since their PosixNetworkInterface is about to go away.
+mDNSlocal void RetireRecvThreadSource(PosixEventSource *source)
+	{
+	PosixRecvThread *const t = source->Thread;
+	struct epoll_event ev;
+	mDNSu32 head, tail;
+
+	// Take the lock first, so the thread can't be part way through reading source and re-arm it after we've removed it
+	pthread_mutex_lock(&t->lock);
+	mDNSPlatformMemZero(&ev, sizeof ev);
+	(void) epoll_ctl(t->epfd, EPOLL_CTL_DEL, source->fd, &ev);
+	source->fd = -1;
+	AddToTail(&t->dead, source);
+	pthread_mutex_unlock(&t->lock);
+
+	head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+	for (tail = t->tail; tail != head; tail++)
+		if (t->queue[tail & (kRecvQueueSize-1)].source == source)
+			t->queue[tail & (kRecvQueueSize-1)].source = NULL;
+	}
+
+mDNSlocal void StartRecvThreads(mDNS *const m)
+	{
+	sigset_t allSignals, savedSignals;
+	int i;
+
+	if (!gNumRecvThreads || GetEpollFD() < 0) return;
+
+	if (pipe(gRecvWakePipe) < 0) { LogMsg("StartRecvThreads: pipe failed %d (%s)", errno, strerror(errno)); return; }
+	if (pipe(gRecvStopPipe) < 0)
+		{
+		LogMsg("StartRecvThreads: pipe failed %d (%s)", errno, strerror(errno));
+		close(gRecvWakePipe[0]);
+		close(gRecvWakePipe[1]);
+		gRecvWakePipe[0] = gRecvWakePipe[1] = -1;
+		return;
+		}
+	for (i = 0; i < 2; i++)
+		{
+		(void) fcntl(gRecvWakePipe[i], F_SETFL, fcntl(gRecvWakePipe[i], F_GETFL) | O_NONBLOCK);
+		(void) fcntl(gRecvWakePipe[i], F_SETFD, FD_CLOEXEC);
+		(void) fcntl(gRecvStopPipe[i], F_SETFD, FD_CLOEXEC);
+		}
+	if (mDNSPosixAddFDToEventLoop(gRecvWakePipe[0], RecvQueueCallback, m) != mStatus_NoError)
+		{
+		LogMsg("StartRecvThreads: Couldn't watch wakeup pipe");
+		for (i = 0; i < 2; i++)
+			{
+			close(gRecvWakePipe[i]);
+			close(gRecvStopPipe[i]);
+			gRecvWakePipe[i] = gRecvStopPipe[i] = -1;
+			}
+		return;
+		}
+
+	// Signals are for the event loop thread, so start the receive threads with them all blocked
+	sigfillset(&allSignals);
+	pthread_sigmask(SIG_SETMASK, &allSignals, &savedSignals);
+	while (gRecvThreadsRunning < gNumRecvThreads)
+		{
+		PosixRecvThread *t = (PosixRecvThread *) calloc(1, sizeof(*t));
+		struct epoll_event ev;
+		if (!t) break;
+		t->epfd = epoll_create(kMaxEpollEvents);
+		if (t->epfd < 0) { free(t); break; }
+		(void) fcntl(t->epfd, F_SETFD, FD_CLOEXEC);
+		// Level-triggered, so every thread sees the one byte StopRecvThreads() writes
+		mDNSPlatformMemZero(&ev, sizeof ev);
+		ev.events   = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, gRecvStopPipe[0], &ev) < 0) { close(t->epfd); free(t); break; }
+		pthread_mutex_init(&t->lock, NULL);
+		InitLinkedList(&t->dead, offsetof(PosixEventSource, Next));
+		if (pthread_create(&t->thread, NULL, RecvThreadMain, t) != 0)
+			{
+			pthread_mutex_destroy(&t->lock);
+			close(t->epfd);
+			free(t);
+			break;
+			}
+		gRecvThreads[gRecvThreadsRunning++] = t;
+		}
+	pthread_sigmask(SIG_SETMASK, &savedSignals, NULL);
+
+	if (gRecvThreadsRunning < gNumRecvThreads)
+		LogMsg("StartRecvThreads: Only started %d of %d receive threads", gRecvThreadsRunning, gNumRecvThreads);
+	}
+
+// Stops and joins the receive threads, and frees everything they owned. Must be called before the wire
+// sockets are closed; afterwards UnwatchWireSocket() finds nothing to retire, and the sockets just get closed.
+mDNSlocal void StopRecvThreads(void)
+	{
+	PosixEventSource *source, *next;
+	int i;
+
+	if (gRecvWakePipe[0] < 0) return;		// StartRecvThreads() didn't get as far as starting any
+
+	if (write(gRecvStopPipe[1], "", 1) != 1)
+		LogMsg("StopRecvThreads: write failed %d (%s)", errno, strerror(errno));
+	for (i = 0; i < gRecvThreadsRunning; i++)
+		pthread_join(gRecvThreads[i]->thread, NULL);
+
+	// With the threads gone their sources can simply be freed; any packets still queued are dropped
+	for (source = (PosixEventSource*)gWireSources.Head; source; source = next)
+		{
+		next = source->Next;
+		if (source->Thread) { RemoveFromList(&gWireSources, source); free(source); }
+		}
+	for (i = 0; i < gRecvThreadsRunning; i++)
+		{
+		PosixRecvThread *const t = gRecvThreads[i];
+		while ((source = (PosixEventSource*) t->dead.Head) != NULL)
+			{
+			RemoveFromList(&t->dead, source);
+			free(source);
+			}
+		pthread_mutex_destroy(&t->lock);
+		close(t->epfd);
+		free(t);
+		gRecvThreads[i] = NULL;
+		}
+	gRecvThreadsRunning = 0;
+	gNextRecvThread = 0;
+
+	(void) mDNSPosixRemoveFDFromEventLoop(gRecvWakePipe[0]);
+	for (i = 0; i < 2; i++)
+		{
+		close(gRecvWakePipe[i]);
+		close(gRecvStopPipe[i]);
+		gRecvWakePipe[i] = gRecvStopPipe[i] = -1;
+		}
+	gRecvWakePending = 0;
+	}
+
+mDNSexport mStatus mDNSPosixSetReceiveThreads(int count)
+	{
+	if (count < 0 || count > kMaxRecvThreads) return mStatus_BadParamErr;
+	gNumRecvThreads = count;
+	return mStatus_NoError;
+	}
+#endif // HAVE_RECV_THREADS
+
+// Adds one of our own multicast or unicast sockets to the epoll set (or to a receive thread's), so
+// that mDNSPosixRunEventLoopOnce() doesn't have to walk the interface list to find it.
+mDNSlocal void WatchWireSocket(PosixNetworkInterface *intf, int skt)
+	{
+	PosixEventSource *newSource;
+	mStatus err;
+	if (skt < 0 || GetEpollFD() < 0) return;
+	newSource = (PosixEventSource*) malloc(sizeof *newSource);
+	if (NULL == newSource) { LogMsg("WatchWireSocket: malloc failed"); return; }
+	newSource->Callback = NULL;
+	newSource->Context  = intf;
+	newSource->fd       = skt;
+#if HAVE_RECV_THREADS
+	newSource->Thread   = NULL;
+	if (gRecvThreadsRunning) err = AddRecvThreadSource(newSource);
+	else
+#endif
+	err = EpollAddSource(gEpollFD, newSource);
+	if (err != mStatus_NoError) { free(newSource); return; }
+	AddToTail(&gWireSources, newSource);
+	}
+
+// Must be called before skt is closed
+mDNSlocal void UnwatchWireSocket(int skt)
+	{
+	PosixEventSource *iSource;
+	if (skt < 0 || GetEpollFD() < 0) return;
+	for (iSource=(PosixEventSource*)gWireSources.Head; iSource; iSource = iSource->Next)
+		if (iSource->fd == skt)
+			{
+#if HAVE_RECV_THREADS
+			if (iSource->Thread)
+				{
+				RemoveFromList(&gWireSources, iSource);
+				RetireRecvThreadSource(iSource);		// The receive thread will free iSource
+				return;
+				}
+#endif
+			EpollRemoveSource(&gWireSources, iSource);
+			return;
+			}
+	}
+#else
+#define WatchWireSocket(INTF, SKT)
+#define UnwatchWireSocket(SKT)
+#endif // HAVE_EPOLL
+
 // Frees the specified PosixNetworkInterface structure. The underlying
 // interface must have already been deregistered with the mDNS core.
 mDNSlocal void FreePosixNetworkInterface(PosixNetworkInterface *intf)
 	{
 	assert(intf != NULL);
 	if (intf->intfName != NULL)        free((void *)intf->intfName);
-	if (intf->multicastSocket4 != -1) assert(close(intf->multicastSocket4) == 0);
+	if (intf->multicastSocket4 != -1) { UnwatchWireSocket(intf->multicastSocket4); assert(close(intf->multicastSocket4) == 0); }
 #if HAVE_IPV6
-	if (intf->multicastSocket6 != -1) assert(close(intf->multicastSocket6) == 0);
+	if (intf->multicastSocket6 != -1) { UnwatchWireSocket(intf->multicastSocket6); assert(close(intf->multicastSocket6) == 0); }
 #endif
 	free(intf);
 	}
@@ -841,10 +1486,16 @@ mDNSlocal int SetupOneInterface(mDNS *const m, struct sockaddr *intfAddr, struct
 	if (err == 0)
 		{
 		if (alias->multicastSocket4 == -1 && intfAddr->sa_family == AF_INET)
+			{
 			err = SetupSocket(intfAddr, MulticastDNSPort, intf->index, &alias->multicastSocket4);
+			if (err == 0) WatchWireSocket(alias, alias->multicastSocket4);
+			}
 #if HAVE_IPV6
 		else if (alias->multicastSocket6 == -1 && intfAddr->sa_family == AF_INET6)
+			{
 			err = SetupSocket(intfAddr, MulticastDNSPort, intf->index, &alias->multicastSocket6);
+			if (err == 0) WatchWireSocket(alias, alias->multicastSocket6);
+			}
 #endif
 		}
 
@@ -1186,6 +1837,11 @@ mDNSexport mStatus mDNSPlatformInit(mDNS *const m)
 
 	if (mDNSPlatformInit_CanReceiveUnicast()) m->CanReceiveUnicastOn5353 = mDNStrue;
 
+#if HAVE_RECV_THREADS
+	// Must be done before we create any sockets, so that they all go to the receive threads
+	StartRecvThreads(m);
+#endif
+
 	// Tell mDNS core the names of this machine.
 
 	// Set up the nice label
@@ -1203,10 +1859,12 @@ mDNSexport mStatus mDNSPlatformInit(mDNS *const m)
 	sa.sa_family = AF_INET;
 	m->p->unicastSocket4 = -1;
 	if (err == mStatus_NoError) err = SetupSocket(&sa, zeroIPPort, 0, &m->p->unicastSocket4);
+	if (err == mStatus_NoError) WatchWireSocket(NULL, m->p->unicastSocket4);
 #if HAVE_IPV6
 	sa.sa_family = AF_INET6;
 	m->p->unicastSocket6 = -1;
 	if (err == mStatus_NoError) err = SetupSocket(&sa, zeroIPPort, 0, &m->p->unicastSocket6);
+	if (err == mStatus_NoError) WatchWireSocket(NULL, m->p->unicastSocket6);
 #endif
 
 	// Tell mDNS core about the network interfaces on this machine.
@@ -1242,10 +1900,13 @@ mDNSexport mStatus mDNSPlatformInit(mDNS *const m)
 mDNSexport void mDNSPlatformClose(mDNS *const m)
 	{
 	assert(m != NULL);
+#if HAVE_RECV_THREADS
+	StopRecvThreads();
+#endif
 	ClearInterfaceList(m);
-	if (m->p->unicastSocket4 != -1) assert(close(m->p->unicastSocket4) == 0);
+	if (m->p->unicastSocket4 != -1) { UnwatchWireSocket(m->p->unicastSocket4); assert(close(m->p->unicastSocket4) == 0); }
 #if HAVE_IPV6
-	if (m->p->unicastSocket6 != -1) assert(close(m->p->unicastSocket6) == 0);
+	if (m->p->unicastSocket6 != -1) { UnwatchWireSocket(m->p->unicastSocket6); assert(close(m->p->unicastSocket6) == 0); }
 #endif
 	}
 
@@ -1317,8 +1978,9 @@ mDNSexport void    mDNSPlatformMemZero(void *dst, mDNSu32 len)
 	memset(dst, 0, len);
 	}
 
-mDNSexport void *  mDNSPlatformMemAllocate(mDNSu32 len) { return(malloc(len)); }
-mDNSexport void    mDNSPlatformMemFree    (void *mem)   { free(mem); }
+// Served from the size-classed pools in PlatformCommon.c; large allocations fall through to malloc()
+mDNSexport void *  mDNSPlatformMemAllocate(mDNSu32 len) { return(PoolAllocate(len)); }
+mDNSexport void    mDNSPlatformMemFree    (void *mem)   { PoolFree(mem); }
 
 mDNSexport mDNSu32 mDNSPlatformRandomSeed(void)
 	{
@@ -1361,7 +2023,8 @@ mDNSlocal void mDNSPosixAddToFDSet(int *nfds, fd_set *readfds, int s)
 	FD_SET(s, readfds);
 	}
 
-mDNSexport void mDNSPosixGetFDSet(mDNS *m, int *nfds, fd_set *readfds, struct timeval *timeout)
+// Calls mDNS_Execute() and reduces *timeout if the next scheduled event is sooner than that
+mDNSlocal void mDNSPosixExecute(mDNS *m, struct timeval *timeout)
 	{
 	mDNSs32 ticks;
 	struct timeval interval;
@@ -1369,8 +2032,31 @@ mDNSexport void mDNSPosixGetFDSet(mDNS *m, int *nfds, fd_set *readfds, struct ti
 	// 1. Call mDNS_Execute() to let mDNSCore do what it needs to do
 	mDNSs32 nextevent = mDNS_Execute(m);
 
+	// 2. Calculate the time remaining to the next scheduled event (in struct timeval format)
+	ticks = nextevent - mDNS_TimeNow(m);
+	if (ticks < 1) ticks = 1;
+	interval.tv_sec  = ticks >> 10;						// The high 22 bits are seconds
+	interval.tv_usec = ((ticks & 0x3FF) * 15625) / 16;	// The low 10 bits are 1024ths
+
+	// 3. If client's proposed timeout is more than what we want, then reduce it
+	if (timeout->tv_sec > interval.tv_sec ||
+		(timeout->tv_sec == interval.tv_sec && timeout->tv_usec > interval.tv_usec))
+		*timeout = interval;
+	}
+
+mDNSexport void mDNSPosixGetFDSet(mDNS *m, int *nfds, fd_set *readfds, struct timeval *timeout)
+	{
+	PosixNetworkInterface *info;
+
+	// 1. Call mDNS_Execute() to let mDNSCore do what it needs to do, and work out how long we can sleep
+	mDNSPosixExecute(m, timeout);
+
+#if HAVE_RECV_THREADS
+	if (gRecvThreadsRunning) return;	// Our sockets belong to the receive threads
+#endif
+
 	// 2. Build our list of active file descriptors
-	PosixNetworkInterface *info = (PosixNetworkInterface *)(m->HostInterfaces);
+	info = (PosixNetworkInterface *)(m->HostInterfaces);
 	if (m->p->unicastSocket4 != -1) mDNSPosixAddToFDSet(nfds, readfds, m->p->unicastSocket4);
 #if HAVE_IPV6
 	if (m->p->unicastSocket6 != -1) mDNSPosixAddToFDSet(nfds, readfds, m->p->unicastSocket6);
@@ -1383,17 +2069,6 @@ mDNSexport void mDNSPosixGetFDSet(mDNS *m, int *nfds, fd_set *readfds, struct ti
 #endif
 		info = (PosixNetworkInterface *)(info->coreIntf.next);
 		}
-
-	// 3. Calculate the time remaining to the next scheduled event (in struct timeval format)
-	ticks = nextevent - mDNS_TimeNow(m);
-	if (ticks < 1) ticks = 1;
-	interval.tv_sec  = ticks >> 10;						// The high 22 bits are seconds
-	interval.tv_usec = ((ticks & 0x3FF) * 15625) / 16;	// The low 10 bits are 1024ths
-
-	// 4. If client's proposed timeout is more than what we want, then reduce it
-	if (timeout->tv_sec > interval.tv_sec ||
-		(timeout->tv_sec == interval.tv_sec && timeout->tv_usec > interval.tv_usec))
-		*timeout = interval;
 	}
 
 mDNSexport void mDNSPosixProcessFDSet(mDNS *const m, fd_set *readfds)
@@ -1453,8 +2128,14 @@ mStatus mDNSPosixAddFDToEventLoop(int fd, mDNSPosixEventCallback callback, void
 	if (gEventSources.LinkOffset == 0)
 		InitLinkedList(&gEventSources, offsetof(PosixEventSource, Next));
 
+#if HAVE_EPOLL
+	// With epoll there's no FD_SETSIZE limit on the descriptors we can watch
+	if (fd < 0 || (fd >= (int) FD_SETSIZE && GetEpollFD() < 0))
+		return mStatus_UnsupportedErr;
+#else
 	if (fd >= (int) FD_SETSIZE || fd < 0)
 		return mStatus_UnsupportedErr;
+#endif
 	if (callback == NULL)
 		return mStatus_BadParamErr;
 
@@ -1465,6 +2146,18 @@ mStatus mDNSPosixAddFDToEventLoop(int fd, mDNSPosixEventCallback callback, void
 	newSource->Callback = callback;
 	newSource->Context = context;
 	newSource->fd = fd;
+#if HAVE_RECV_THREADS
+	newSource->Thread = NULL;
+#endif
+
+#if HAVE_EPOLL
+	if (GetEpollFD() >= 0)
+		{
+		if (EpollAddSource(gEpollFD, newSource) != mStatus_NoError) { free(newSource); return mStatus_UnknownErr; }
+		AddToTail(&gEventSources, newSource);
+		return mStatus_NoError;
+		}
+#endif
 
 	AddToTail(&gEventSources, newSource);
 	FD_SET(fd, &gEventFDs);
@@ -1483,6 +2176,9 @@ mStatus mDNSPosixRemoveFDFromEventLoop(int fd)
 		{
 		if (fd == iSource->fd)
 			{
+#if HAVE_EPOLL
+			if (GetEpollFD() >= 0) { EpollRemoveSource(&gEventSources, iSource); return mStatus_NoError; }
+#endif
 			FD_CLR(fd, &gEventFDs);
 			RemoveFromList(&gEventSources, iSource);
 			free(iSource);
@@ -1529,41 +2225,91 @@ mStatus mDNSPosixIgnoreSignalInEventLoop(int signum)
 	return err;
 	}
 
+#if HAVE_EPOLL
+// Waits for and dispatches a batch of epoll events. Our sockets and the client's descriptors are
+// registered once when they're created, so unlike the select() path there's no per-call set to build.
+mDNSlocal mDNSBool EpollEventLoopOnce(mDNS *m, struct timeval *timeout)
+	{
+	struct epoll_event	events[kMaxEpollEvents];
+	PosixEventSource	*source;
+	int					numReady, i, ms, reads;
+
+	mDNSPosixExecute(m, timeout);	// timeout may get modified
+	if (timeout->tv_sec >= 86400) ms = 86400 * 1000;
+	else ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+
+	numReady = epoll_wait(gEpollFD, events, kMaxEpollEvents, ms);
+
+	// Callbacks may remove sources, including ones later in this batch, so until we're done
+	// EpollRemoveSource() just sets their fd to -1 and leaves them on gDeadSources for us to free
+	gDispatching = mDNStrue;
+	for (i = 0; i < numReady; i++)
+		{
+		source = (PosixEventSource*) events[i].data.ptr;
+		if (source->fd < 0) continue;
+		if (source->Callback) source->Callback(source->fd, 0, source->Context);
+		else
+			{
+			// Drain the socket, but don't let one busy interface starve everything else
+			for (reads = 0; source->fd >= 0 && SocketDataReady(m, (PosixNetworkInterface*) source->Context, source->fd); reads++)
+				if (reads + 1 >= kMaxReadsPerEvent) { EpollRearmSource(gEpollFD, source); break; }
+			}
+		}
+	gDispatching = mDNSfalse;
+
+	while ((source = (PosixEventSource*) gDeadSources.Head) != NULL)
+		{
+		RemoveFromList(&gDeadSources, source);
+		free(source);
+		}
+
+	return (numReady > 0);
+	}
+#endif // HAVE_EPOLL
+
 // Do a single pass through the attendent event sources and dispatch any found to their callbacks.
 // Return as soon as internal timeout expires, or a signal we're listening for is received.
 mStatus mDNSPosixRunEventLoopOnce(mDNS *m, const struct timeval *pTimeout, 
 									sigset_t *pSignalsReceived, mDNSBool *pDataDispatched)
 	{
-	fd_set			listenFDs = gEventFDs;
+	fd_set			listenFDs;
 	int				fdMax = 0, numReady;
 	struct timeval	timeout = *pTimeout;
-	
-	// Include the sockets that are listening to the wire in our select() set
-	mDNSPosixGetFDSet(m, &fdMax, &listenFDs, &timeout);	// timeout may get modified
-	if (fdMax < gMaxFD)
-		fdMax = gMaxFD;
-
-	numReady = select(fdMax + 1, &listenFDs, (fd_set*) NULL, (fd_set*) NULL, &timeout);
 
-	// If any data appeared, invoke its callback
-	if (numReady > 0)
+#if HAVE_EPOLL
+	if (GetEpollFD() >= 0) *pDataDispatched = EpollEventLoopOnce(m, &timeout);
+	else
+#endif
 		{
-		PosixEventSource	*iSource;
+		listenFDs = gEventFDs;
+
+		// Include the sockets that are listening to the wire in our select() set
+		mDNSPosixGetFDSet(m, &fdMax, &listenFDs, &timeout);	// timeout may get modified
+		if (fdMax < gMaxFD)
+			fdMax = gMaxFD;
 
-		(void) mDNSPosixProcessFDSet(m, &listenFDs);	// call this first to process wire data for clients
+		numReady = select(fdMax + 1, &listenFDs, (fd_set*) NULL, (fd_set*) NULL, &timeout);
 
-		for (iSource=(PosixEventSource*)gEventSources.Head; iSource; iSource = iSource->Next)
+		// If any data appeared, invoke its callback
+		if (numReady > 0)
 			{
-			if (FD_ISSET(iSource->fd, &listenFDs))
+			PosixEventSource	*iSource;
+
+			(void) mDNSPosixProcessFDSet(m, &listenFDs);	// call this first to process wire data for clients
+
+			for (iSource=(PosixEventSource*)gEventSources.Head; iSource; iSource = iSource->Next)
 				{
-				iSource->Callback(iSource->fd, 0, iSource->Context);
-				break;	// in case callback removed elements from gEventSources
+				if (FD_ISSET(iSource->fd, &listenFDs))
+					{
+					iSource->Callback(iSource->fd, 0, iSource->Context);
+					break;	// in case callback removed elements from gEventSources
+					}
 				}
+			*pDataDispatched = mDNStrue;
 			}
-		*pDataDispatched = mDNStrue;
+		else
+			*pDataDispatched = mDNSfalse;
 		}
-	else
-		*pDataDispatched = mDNSfalse;
 
 	(void) sigprocmask(SIG_BLOCK, &gEventSignalSet, (sigset_t*) NULL);
 	*pSignalsReceived = gEventSignals;
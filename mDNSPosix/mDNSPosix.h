@@ -72,12 +72,22 @@ extern void mDNSPosixProcessFDSet(mDNS *const m, fd_set *readfds);
 
 typedef	void (*mDNSPosixEventCallback)(int fd, short filter, void *context);
 
+// The event loop below uses epoll when built with HAVE_EPOLL (and the kernel supports it), in which case
+// descriptors are registered once and there's no FD_SETSIZE limit; otherwise it uses select().
+// Programs that drive their own select() loop should keep using mDNSPosixGetFDSet/mDNSPosixProcessFDSet above.
+
 extern mStatus mDNSPosixAddFDToEventLoop( int fd, mDNSPosixEventCallback callback, void *context);
 extern mStatus mDNSPosixRemoveFDFromEventLoop( int fd);
 extern mStatus mDNSPosixListenForSignalInEventLoop( int signum);
 extern mStatus mDNSPosixIgnoreSignalInEventLoop( int signum);
 extern mStatus mDNSPosixRunEventLoopOnce( mDNS *m, const struct timeval *pTimeout, sigset_t *pSignalsReceived, mDNSBool *pDataDispatched);
 
+#if HAVE_RECV_THREADS
+// Asks for count threads (at most 8) to read our sockets, leaving the event loop thread free to run mDNSCore.
+// Must be called before mDNS_Init(). Zero, the default, reads the sockets on the event loop thread as usual.
+extern mStatus mDNSPosixSetReceiveThreads(int count);
+#endif
+
 #ifdef  __cplusplus
     }
 #endif
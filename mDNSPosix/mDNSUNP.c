@@ -15,6 +15,10 @@
  * limitations under the License.
  */
 
+#if HAVE_RECVMMSG || HAVE_SENDMMSG
+#define _GNU_SOURCE                 // For recvmmsg(), sendmmsg() and struct mmsghdr
+#endif
+
 #include "mDNSUNP.h"
 
 #include <errno.h>
@@ -445,68 +449,15 @@ free_ifi_info(struct ifi_info *ifihead)
 }
 /* end free_ifi_info */
 
-ssize_t 
-recvfrom_flags(int fd, void *ptr, size_t nbytes, int *flagsp,
-               struct sockaddr *sa, socklen_t *salenptr, struct my_in_pktinfo *pktp, u_char *ttl)
-{
-    struct msghdr   msg;
-    struct iovec    iov[1];
-    ssize_t         n;
-
 #ifdef CMSG_FIRSTHDR
+/* Fills in *pktp and *ttl from the ancillary data that came with a datagram */
+static void
+recv_ancillary(struct msghdr *msg, struct my_in_pktinfo *pktp, u_char *ttl)
+{
     struct cmsghdr  *cmptr;
-    union {
-      struct cmsghdr    cm;
-      char              control[1024];
-    } control_un;
-
-	*ttl = 255;			// If kernel fails to provide TTL data then assume the TTL was 255 as it should be
-
-    msg.msg_control = control_un.control;
-    msg.msg_controllen = sizeof(control_un.control);
-    msg.msg_flags = 0;
-#else
-    memset(&msg, 0, sizeof(msg));   /* make certain msg_accrightslen = 0 */
-#endif /* CMSG_FIRSTHDR */
-
-    msg.msg_name = (char *) sa;
-    msg.msg_namelen = *salenptr;
-    iov[0].iov_base = (char *)ptr;
-    iov[0].iov_len = nbytes;
-    msg.msg_iov = iov;
-    msg.msg_iovlen = 1;
-
-    if ( (n = recvmsg(fd, &msg, *flagsp)) < 0)
-        return(n);
-
-    *salenptr = msg.msg_namelen;    /* pass back results */
-    if (pktp) {
-        /* 0.0.0.0, i/f = -1 */
-        /* We set the interface to -1 so that the caller can 
-           tell whether we returned a meaningful value or 
-           just some default.  Previously this code just 
-           set the value to 0, but I'm concerned that 0 
-           might be a valid interface value.
-        */
-        memset(pktp, 0, sizeof(struct my_in_pktinfo));
-        pktp->ipi_ifindex = -1;
-    }
-/* end recvfrom_flags1 */
-
-/* include recvfrom_flags2 */
-#ifndef CMSG_FIRSTHDR
-	#warning CMSG_FIRSTHDR not defined. Will not be able to determine destination address, received interface, etc.
-    *flagsp = 0;                    /* pass back results */
-    return(n);
-#else
 
-    *flagsp = msg.msg_flags;        /* pass back results */
-    if (msg.msg_controllen < (socklen_t)sizeof(struct cmsghdr) ||
-        (msg.msg_flags & MSG_CTRUNC) || pktp == NULL)
-        return(n);
-
-    for (cmptr = CMSG_FIRSTHDR(&msg); cmptr != NULL;
-         cmptr = CMSG_NXTHDR(&msg, cmptr)) {
+    for (cmptr = CMSG_FIRSTHDR(msg); cmptr != NULL;
+         cmptr = CMSG_NXTHDR(msg, cmptr)) {
 
 #ifdef  IP_PKTINFO
 #if in_pktinfo_definition_is_missing
@@ -604,10 +555,187 @@ struct in_pktinfo
 #endif
         assert(0);  // unknown ancillary data
     }
+}
+#endif /* CMSG_FIRSTHDR */
+
+ssize_t 
+recvfrom_flags(int fd, void *ptr, size_t nbytes, int *flagsp,
+               struct sockaddr *sa, socklen_t *salenptr, struct my_in_pktinfo *pktp, u_char *ttl)
+{
+    struct msghdr   msg;
+    struct iovec    iov[1];
+    ssize_t         n;
+
+#ifdef CMSG_FIRSTHDR
+    union {
+      struct cmsghdr    cm;
+      char              control[1024];
+    } control_un;
+
+	*ttl = 255;			// If kernel fails to provide TTL data then assume the TTL was 255 as it should be
+
+    msg.msg_control = control_un.control;
+    msg.msg_controllen = sizeof(control_un.control);
+    msg.msg_flags = 0;
+#else
+    memset(&msg, 0, sizeof(msg));   /* make certain msg_accrightslen = 0 */
+#endif /* CMSG_FIRSTHDR */
+
+    msg.msg_name = (char *) sa;
+    msg.msg_namelen = *salenptr;
+    iov[0].iov_base = (char *)ptr;
+    iov[0].iov_len = nbytes;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+
+    if ( (n = recvmsg(fd, &msg, *flagsp)) < 0)
+        return(n);
+
+    *salenptr = msg.msg_namelen;    /* pass back results */
+    if (pktp) {
+        /* 0.0.0.0, i/f = -1 */
+        /* We set the interface to -1 so that the caller can 
+           tell whether we returned a meaningful value or 
+           just some default.  Previously this code just 
+           set the value to 0, but I'm concerned that 0 
+           might be a valid interface value.
+        */
+        memset(pktp, 0, sizeof(struct my_in_pktinfo));
+        pktp->ipi_ifindex = -1;
+    }
+/* end recvfrom_flags1 */
+
+/* include recvfrom_flags2 */
+#ifndef CMSG_FIRSTHDR
+	#warning CMSG_FIRSTHDR not defined. Will not be able to determine destination address, received interface, etc.
+    *flagsp = 0;                    /* pass back results */
+    return(n);
+#else
+
+    *flagsp = msg.msg_flags;        /* pass back results */
+    if (msg.msg_controllen < (socklen_t)sizeof(struct cmsghdr) ||
+        (msg.msg_flags & MSG_CTRUNC) || pktp == NULL)
+        return(n);
+
+    recv_ancillary(&msg, pktp, ttl);
     return(n);
 #endif /* CMSG_FIRSTHDR */
 }
 
+#if HAVE_RECVMMSG && defined(CMSG_FIRSTHDR)
+/* Like recvfrom_flags, but receives up to count datagrams with a single recvmmsg()
+   call. Each batch[i].ptr and batch[i].nbytes must be set by the caller; the
+   other fields are filled in for each datagram received. Never blocks.
+   Returns the number of datagrams received, or -1 with errno set. */
+int
+recvmmsg_flags(int fd, struct my_recv_batch *batch, unsigned int count)
+{
+    struct mmsghdr  msgs[RECVMMSG_MAX];
+    struct iovec    iov[RECVMMSG_MAX];
+    unsigned int    i;
+    int             n;
+
+    if (count > RECVMMSG_MAX)
+        count = RECVMMSG_MAX;
+
+    memset(msgs, 0, count * sizeof(msgs[0]));
+    for (i = 0; i < count; i++) {
+        iov[i].iov_base = batch[i].ptr;
+        iov[i].iov_len  = batch[i].nbytes;
+        msgs[i].msg_hdr.msg_name       = (char *) &batch[i].from;
+        msgs[i].msg_hdr.msg_namelen    = sizeof(batch[i].from);
+        msgs[i].msg_hdr.msg_iov        = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen     = 1;
+        msgs[i].msg_hdr.msg_control    = batch[i].control.buf;
+        msgs[i].msg_hdr.msg_controllen = sizeof(batch[i].control.buf);
+    }
+
+    if ( (n = recvmmsg(fd, msgs, count, MSG_DONTWAIT, NULL)) < 0)
+        return(n);
+
+    for (i = 0; i < (unsigned int) n; i++) {
+        struct msghdr *msg = &msgs[i].msg_hdr;
+
+        batch[i].n       = msgs[i].msg_len;
+        batch[i].fromlen = msg->msg_namelen;
+        batch[i].flags   = msg->msg_flags;
+        batch[i].ttl     = 255;      /* As in recvfrom_flags, assume 255 if the kernel doesn't tell us */
+        memset(&batch[i].pktinfo, 0, sizeof(batch[i].pktinfo));
+        batch[i].pktinfo.ipi_ifindex = -1;
+        if (msg->msg_controllen >= (socklen_t)sizeof(struct cmsghdr) && !(msg->msg_flags & MSG_CTRUNC))
+            recv_ancillary(msg, &batch[i].pktinfo, &batch[i].ttl);
+    }
+    return(n);
+}
+#endif /* HAVE_RECVMMSG && CMSG_FIRSTHDR */
+
+#if HAVE_SENDMMSG && defined(IP_PKTINFO)
+/* Sends up to count datagrams with a single sendmmsg() call. Never blocks.
+   Returns the number of datagrams sent (which may be fewer than count),
+   or -1 with errno set if the first one couldn't be sent. */
+int
+sendmmsg_pktinfo(int fd, const struct my_send_batch *batch, unsigned int count)
+{
+    struct mmsghdr  msgs[SENDMMSG_MAX];
+    struct iovec    iov[SENDMMSG_MAX];
+    union {
+      struct cmsghdr    cm;
+      char              buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];     /* the larger of the two */
+    } control[SENDMMSG_MAX];
+    unsigned int    i;
+
+    if (count > SENDMMSG_MAX)
+        count = SENDMMSG_MAX;
+
+    memset(msgs, 0, count * sizeof(msgs[0]));
+    memset(control, 0, count * sizeof(control[0]));
+    for (i = 0; i < count; i++) {
+        struct msghdr  *msg = &msgs[i].msg_hdr;
+        struct cmsghdr *cmptr;
+
+        iov[i].iov_base = (void *) batch[i].ptr;
+        iov[i].iov_len  = batch[i].nbytes;
+        msg->msg_name    = (void *) &batch[i].to;
+        msg->msg_namelen = batch[i].tolen;
+        msg->msg_iov     = &iov[i];
+        msg->msg_iovlen  = 1;
+        if (batch[i].ifindex == 0)
+            continue;
+
+        msg->msg_control    = control[i].buf;
+        msg->msg_controllen = sizeof(control[i].buf);
+        cmptr = CMSG_FIRSTHDR(msg);
+        if (((const struct sockaddr *)&batch[i].to)->sa_family == AF_INET) {
+            struct in_pktinfo *pi;
+            cmptr->cmsg_level = IPPROTO_IP;
+            cmptr->cmsg_type  = IP_PKTINFO;
+            cmptr->cmsg_len   = CMSG_LEN(sizeof(struct in_pktinfo));
+            pi = (struct in_pktinfo *) CMSG_DATA(cmptr);
+            pi->ipi_ifindex   = batch[i].ifindex;
+            pi->ipi_spec_dst  = batch[i].src4;
+            msg->msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
+        }
+#if defined(IPV6_PKTINFO) && HAVE_IPV6
+        else if (((const struct sockaddr *)&batch[i].to)->sa_family == AF_INET6) {
+            struct in6_pktinfo *pi6;
+            cmptr->cmsg_level = IPPROTO_IPV6;
+            cmptr->cmsg_type  = IPV6_PKTINFO;
+            cmptr->cmsg_len   = CMSG_LEN(sizeof(struct in6_pktinfo));
+            pi6 = (struct in6_pktinfo *) CMSG_DATA(cmptr);
+            pi6->ipi6_ifindex = batch[i].ifindex;
+            msg->msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
+        }
+#endif
+        else {
+            msg->msg_control    = NULL;
+            msg->msg_controllen = 0;
+        }
+    }
+
+    return(sendmmsg(fd, msgs, count, MSG_DONTWAIT));
+}
+#endif /* HAVE_SENDMMSG && IP_PKTINFO */
+
 // **********************************************************************************************
 
 // daemonize the process. Adapted from "Unix Network Programming" vol 1 by Stevens, section 12.4.
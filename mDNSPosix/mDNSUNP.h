@@ -73,6 +73,45 @@ struct my_in_pktinfo {
 extern ssize_t recvfrom_flags(int fd, void *ptr, size_t nbytes, int *flagsp,
                struct sockaddr *sa, socklen_t *salenptr, struct my_in_pktinfo *pktp, u_char *ttl);
 
+#if HAVE_RECVMMSG
+/* recvmmsg_flags is the batched form of recvfrom_flags: one entry per datagram. */
+#define RECVMMSG_MAX 32
+
+struct my_recv_batch {
+    void                    *ptr;       /* set by caller: buffer for the datagram */
+    size_t                  nbytes;     /* set by caller: size of that buffer */
+    ssize_t                 n;          /* length of the datagram received */
+    int                     flags;
+    struct sockaddr_storage from;
+    socklen_t               fromlen;
+    struct my_in_pktinfo    pktinfo;
+    u_char                  ttl;
+    union {
+        struct cmsghdr      cm;         /* for alignment */
+        char                buf[256];
+    } control;
+};
+
+extern int recvmmsg_flags(int fd, struct my_recv_batch *batch, unsigned int count);
+#endif
+
+#if HAVE_SENDMMSG
+/* sendmmsg_pktinfo sends several datagrams with one sendmmsg() call, each on its own
+   interface, by attaching IP_PKTINFO/IPV6_PKTINFO to each message. */
+#define SENDMMSG_MAX 32
+
+struct my_send_batch {
+    const void              *ptr;
+    size_t                  nbytes;
+    struct sockaddr_storage to;         /* all entries in one call must be the same family as the socket */
+    socklen_t               tolen;
+    int                     ifindex;    /* outgoing interface, or 0 to let the socket decide */
+    struct in_addr          src4;       /* IPv4 source address, or INADDR_ANY to let the kernel choose */
+};
+
+extern int sendmmsg_pktinfo(int fd, const struct my_send_batch *batch, unsigned int count);
+#endif
+
 struct ifi_info {
   char    ifi_name[IFI_NAME];   /* interface name, null terminated */
   u_char  ifi_haddr[IFI_HADDR]; /* hardware address */
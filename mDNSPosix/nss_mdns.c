@@ -76,6 +76,9 @@ b. in the case of services:
 #include <syslog.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/time.h>
@@ -479,6 +482,37 @@ _nss_mdns_gethostbyaddr_r (
 );
 
 
+/*
+gethostbyname4 implementation, used by getaddrinfo to look up IPv4 and
+IPv6 addresses at once
+
+	name:
+		name to look up
+	pat:
+		resulting address list
+	buf:
+		auxillary buffer
+	buflen:
+		length of auxillary buffer
+	errnop:
+		pointer to errno
+	h_errnop:
+		pointer to h_errno
+	ttlp:
+		pointer to TTL of the result, may be NULL
+ */
+nss_status
+_nss_mdns_gethostbyname4_r (
+	const char *name,
+	struct gaih_addrtuple ** pat,
+	char *buf,
+	size_t buflen,
+	int *errnop,
+	int *h_errnop,
+	int32_t *ttlp
+);
+
+
 //----------
 // Types and Constants
 
@@ -498,6 +532,16 @@ typedef struct buf_header
 	char * addrs [k_addrs_max + 1];
 } buf_header_t;
 
+typedef struct record_log
+{
+	char * data;
+	int len;
+	int overflow;
+		// Set if a record did not fit, so the log is incomplete
+	uint32_t ttl;
+		// Smallest TTL of the records appended
+} record_log_t;
+
 typedef struct result_map
 {
 	int done;
@@ -515,11 +559,64 @@ typedef struct result_map
 		// Index points to lowest entry
 	int r_errno;
 	int r_h_errno;
+	record_log_t * records;
+		// If non-NULL, records received are also appended here for the cache
+	int conn_failed;
+		// Set if DNSServiceProcessResult failed, so the connection is unusable
+	int settling;
+		// Set once an answer is in hand but more may follow shortly;
+		// handle_events then waits k_settle_time rather than k_select_time
 } result_map_t;
 
+typedef struct addrinfo_result
+{
+	result_map_t map;
+		// Status and connection state.  The hostent fields are unused.
+	struct gaih_addrtuple * first;
+	struct gaih_addrtuple ** next;
+		// Where to link the next address
+	char * buffer;
+	size_t buflen;
+	size_t used;
+	char * hostname;
+		// Copied into buffer with the first address
+	int answered;
+		// kDNSServiceProtocol_IPv4/IPv6 bits for the families heard from
+	int32_t ttl;
+	record_log_t * records [2];
+		// Cache logs for the A and AAAA records received
+} addrinfo_result_t;
+
 static const struct timeval
 	k_select_time = { 0, 500000 };
 		// 0 seconds, 500 milliseconds
+static const struct timeval
+	k_settle_time = { 0, 100000 };
+		// 0 seconds, 100 milliseconds
+
+#define k_cache_entries 32
+	// Number of recent lookups remembered per process
+#define k_cache_data_max 2048
+	// Most record data (names and rdata) kept for one lookup
+#define k_cache_max_ttl 60
+	// Positive results are reused for at most this many seconds,
+	// even if the record TTLs are longer
+#define k_cache_negative_ttl 5
+	// A lookup that timed out is answered as not found for this many seconds
+
+typedef struct cache_entry
+{
+	char name [k_hostname_maxlen + 1];
+	ns_type_t rrtype;
+	time_t stored;
+	time_t expires;
+	time_t last_used;
+	int data_len;
+		// Zero for a negative entry
+	char data [k_cache_data_max];
+		// Records from the original lookup, replayed through
+		// mdns_lookup_callback on a hit
+} cache_entry_t;
 
 //----------
 // Local prototypes
@@ -559,6 +656,46 @@ mdns_lookup_addr (
 );
 
 
+/*
+	Lookup IPv4 and IPv6 addresses for a name at once
+ */
+static nss_status
+mdns_lookup_addrinfo (const char * fullname, addrinfo_result_t * ai);
+
+
+/*
+	Query the mDNS server for records of rrtype at str, using the shared
+	connection if we can, and the cache if it has a current answer
+ */
+static nss_status
+mdns_query (const char * str, ns_type_t rrtype, result_map_t * result);
+
+/*
+	Start a request of some kind on sdref, with result as its context
+ */
+typedef DNSServiceErrorType
+start_request_t (
+	DNSServiceRef * sdref,
+	DNSServiceFlags flags,
+	const char * str,
+	ns_type_t rrtype,
+	result_map_t * result
+);
+
+static start_request_t start_query_record;
+static start_request_t start_addrinfo;
+
+/*
+	Run a request to completion, on the shared connection if we can
+ */
+static nss_status
+mdns_run (
+	start_request_t * start,
+	const char * str,
+	ns_type_t rrtype,
+	result_map_t * result
+);
+
 /*
 	Handle incoming MDNS events
  */
@@ -566,6 +703,32 @@ static nss_status
 handle_events (DNSServiceRef sdref, result_map_t * result, const char * str);
 
 
+/*
+	Shared connection to the mDNS server
+ */
+static DNSServiceRef
+shared_connection_acquire (void);
+static void
+shared_connection_release (int failed);
+
+
+/*
+	Result cache
+ */
+static void
+init_record_log (record_log_t * records, char * data);
+static void
+record_rr (
+	record_log_t * records,
+	const char * fullname,
+	uint16_t rrtype,
+	uint16_t rdlen,
+	const void * rdata,
+	uint32_t ttl,
+	uint32_t interface_index
+);
+
+
 // Callback for mdns_lookup operations
 //DNSServiceQueryRecordReply mdns_lookup_callback;
 typedef void
@@ -587,6 +750,71 @@ mdns_lookup_callback_t
 mdns_lookup_callback_t mdns_lookup_callback;
 
 
+static int
+cache_lookup (
+	const char * name,
+	ns_type_t rrtype,
+	mdns_lookup_callback_t * replay,
+	void * context,
+	const int * done
+);
+static void
+cache_store (
+	const char * name,
+	ns_type_t rrtype,
+	nss_status status,
+	const record_log_t * records
+);
+
+
+// Callback for mdns_lookup_addrinfo
+static void
+mdns_addrinfo_callback (
+	DNSServiceRef sdref,
+	DNSServiceFlags flags,
+	uint32_t interface_index,
+	DNSServiceErrorType error_code,
+	const char * hostname,
+	const struct sockaddr * address,
+	uint32_t ttl,
+	void * context
+);
+
+// Replays cached A and AAAA records into an addrinfo_result_t
+static void
+addrinfo_replay_callback (
+	DNSServiceRef sdref,
+	DNSServiceFlags flags,
+	uint32_t interface_index,
+	DNSServiceErrorType error_code,
+	const char * fullname,
+	uint16_t rrtype,
+	uint16_t rrclass,
+	uint16_t rdlen,
+	const void * rdata,
+	uint32_t ttl,
+	void * context
+);
+
+static void
+init_addrinfo_result (
+	addrinfo_result_t * ai,
+	char * buf,
+	size_t buflen
+);
+
+static void
+add_addrinfo (
+	addrinfo_result_t * ai,
+	const char * hostname,
+	uint16_t rrtype,
+	const void * rdata,
+	uint16_t rdlen,
+	uint32_t interface_index,
+	uint32_t ttl
+);
+
+
 static int
 init_result (
 	result_map_t * result,
@@ -651,6 +879,17 @@ static nss_status set_err_success (result_map_t * result);
 //----------
 // Global variables
 
+static DNSServiceRef g_connection = NULL;
+	// Connection shared by lookups, created on first use
+static pid_t g_connection_pid = 0;
+	// Process that created g_connection; a forked child must not use it
+static pthread_mutex_t g_connection_mutex = PTHREAD_MUTEX_INITIALIZER;
+	// Held for the duration of a lookup on g_connection
+
+static cache_entry_t g_cache [k_cache_entries];
+static pthread_mutex_t g_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_atfork_once = PTHREAD_ONCE_INIT;
+
 
 //----------
 // NSS functions
@@ -775,6 +1014,53 @@ _nss_mdns_gethostbyaddr_r (
 }
 
 
+nss_status
+_nss_mdns_gethostbyname4_r (
+	const char *name,
+	struct gaih_addrtuple ** pat,
+	char *buf,
+	size_t buflen,
+	int *errnop,
+	int *h_errnop,
+	int32_t *ttlp
+)
+{
+	addrinfo_result_t ai;
+	
+	if (MDNS_VERBOSE)
+		syslog (LOG_DEBUG,
+			"mdns: Called nss_mdns_gethostbyname4 with %s",
+			name
+		);
+	
+	init_addrinfo_result (&ai, buf, buflen);
+	
+	if (is_applicable_name (&ai.map, name, NULL))
+	{
+		nss_status rv;
+		
+		rv = mdns_lookup_addrinfo (name, &ai);
+		if (rv == NSS_STATUS_SUCCESS)
+		{
+			if (*pat)
+				**pat = *ai.first;
+					// Caller supplied storage for the first entry
+			else
+				*pat = ai.first;
+			if (ttlp)
+				*ttlp = ai.ttl;
+			return rv;
+		}
+	}
+	
+	// Return current error status (defaults to NOT_FOUND)
+	
+	*errnop = ai.map.r_errno;
+	*h_errnop = ai.map.r_h_errno;
+	return ai.map.status;
+}
+
+
 //----------
 // Local functions
 
@@ -849,10 +1135,7 @@ mdns_lookup_name (
 )
 {
 	// Lookup using mDNS.
-	DNSServiceErrorType errcode;
-	DNSServiceRef sdref;
 	ns_type_t rrtype;
-	nss_status status;
 	
 	if (MDNS_VERBOSE)
 		syslog (LOG_DEBUG,
@@ -883,30 +1166,7 @@ mdns_lookup_name (
 	}
 	result->hostent->h_addrtype = af;
 	
-	errcode =
-		DNSServiceQueryRecord (
-			&sdref,
-			kDNSServiceFlagsForceMulticast,		// force multicast query
-			kDNSServiceInterfaceIndexAny,	// all interfaces
-			fullname,	// full name to query for
-			rrtype,		// resource record type
-			kDNSServiceClass_IN,	// internet class records
-			mdns_lookup_callback,	// callback
-			result		// Context - result buffer
-		);
-	
-	if (errcode)
-	{
-		syslog (LOG_WARNING,
-			"mdns: Failed to initialise lookup, error %d",
-			errcode
-		);
-		return set_err_mdns_failed (result);
-	}
-
-	status = handle_events (sdref, result, fullname);
-	DNSServiceRefDeallocate (sdref);
-	return status;
+	return mdns_query (fullname, rrtype, result);
 }
 
 
@@ -937,10 +1197,6 @@ mdns_lookup_addr (
 	result_map_t * result
 )
 {
-	DNSServiceErrorType errcode;
-	DNSServiceRef sdref;
-	nss_status status;
-	
 	if (MDNS_VERBOSE)
 		syslog (LOG_DEBUG,
 			"mdns: Attempting lookup of %s",
@@ -958,29 +1214,84 @@ mdns_lookup_addr (
 	
 	result->hostent->h_name [0] = 0;
 	
-	errcode =
-		DNSServiceQueryRecord (
-			&sdref,
-			kDNSServiceFlagsForceMulticast,		// force multicast query
-			kDNSServiceInterfaceIndexAny,	// all interfaces
-			addr_str,	// address string to query for
-			kDNSServiceType_PTR,	// pointer RRs
-			kDNSServiceClass_IN,	// internet class records
-			mdns_lookup_callback,	// callback
-			result		// Context - result buffer
+	return mdns_query (addr_str, kDNSServiceType_PTR, result);
+}
+
+
+/*
+	Lookup the IPv4 and IPv6 addresses of a fully qualified hostname.
+	
+	Both families are requested at once.  The lookup completes as soon
+	as both have answered, or shortly after the first answer if the
+	other stays silent, so a host with only one kind of address costs no
+	more than a single family lookup.
+	
+	Parameters
+		fullname
+			Fully qualified hostname.
+		ai
+			Initialised 'addrinfo result' data structure.
+ */
+static nss_status
+mdns_lookup_addrinfo (const char * fullname, addrinfo_result_t * ai)
+{
+	static const ns_type_t rrtypes [2] =
+		{ kDNSServiceType_A, kDNSServiceType_AAAA };
+	char record_buf [2] [k_cache_data_max];
+	record_log_t records [2];
+	nss_status status;
+	int i;
+	
+	if (MDNS_VERBOSE)
+		syslog (LOG_DEBUG,
+			"mdns: Attempting addrinfo lookup of %s",
+			fullname
 		);
 	
-	if (errcode)
+	// Both families must be cached to answer from the cache
+	for (i = 0; i < 2; i++)
 	{
-		syslog (LOG_WARNING,
-			"mdns: Failed to initialise mdns lookup, error %d",
-			errcode
-		);
-		return set_err_mdns_failed (result);
+		if (
+			! cache_lookup (
+				fullname,
+				rrtypes [i],
+				addrinfo_replay_callback,
+				ai,
+				&ai->map.done
+			)
+		)
+			break;
 	}
-
-	status = handle_events (sdref, result, addr_str);
-	DNSServiceRefDeallocate (sdref);
+	if (i == 2 || ai->map.done)
+		return ai->map.status;
+	
+	// Start again, in case one family was replayed
+	init_addrinfo_result (ai, ai->buffer, ai->buflen);
+	
+	for (i = 0; i < 2; i++)
+	{
+		init_record_log (&records [i], record_buf [i]);
+		ai->records [i] = &records [i];
+	}
+	status = mdns_run (start_addrinfo, fullname, 0, &ai->map);
+	ai->records [0] = ai->records [1] = NULL;
+	
+	if (
+		! ai->map.conn_failed &&
+		(status == NSS_STATUS_SUCCESS || status == NSS_STATUS_NOTFOUND)
+	)
+	{
+		// A family that gave no answer is remembered as not found
+		for (i = 0; i < 2; i++)
+			cache_store (
+				fullname,
+				rrtypes [i],
+				records [i].len ?
+					NSS_STATUS_SUCCESS : NSS_STATUS_NOTFOUND,
+				&records [i]
+			);
+	}
+	
 	return status;
 }
 
@@ -1010,7 +1321,7 @@ handle_events (DNSServiceRef sdref, result_map_t * result, const char * str)
 		FD_ZERO(&readfds);
 		FD_SET(dns_sd_fd, &readfds);
 
-		tv = k_select_time;
+		tv = result->settling ? k_settle_time : k_select_time;
 		
 		select_result =
 			select (nfds, &readfds, (fd_set*)NULL, (fd_set*)NULL, &tv);
@@ -1023,7 +1334,16 @@ handle_events (DNSServiceRef sdref, result_map_t * result, const char * str)
 						"mdns: Reply received for %s",
 						str
 					);
-				DNSServiceProcessResult(sdref);
+				if (DNSServiceProcessResult(sdref) != kDNSServiceErr_NoError)
+				{
+					syslog (LOG_WARNING,
+						"mdns: Lost connection to mDNS server during lookup of %s",
+						str
+					);
+					result->conn_failed = 1;
+					set_err_mdns_failed (result);
+					break;
+				}
 			}
 			else
 			{
@@ -1033,6 +1353,11 @@ handle_events (DNSServiceRef sdref, result_map_t * result, const char * str)
 				);
 			}
 		}
+		else if (result->settling)
+		{
+			// Nothing more arrived; keep what we have
+			break;
+		}
 		else
 		{
 			// Terminate loop due to timer expiry
@@ -1051,48 +1376,594 @@ handle_events (DNSServiceRef sdref, result_map_t * result, const char * str)
 
 
 /*
-	Examine incoming data and add to relevant fields in result structure.
-	This routine is called from DNSServiceProcessResult where appropriate.
+	Run a query for rrtype records at str, delivering the records to
+	mdns_lookup_callback with result as context.
+	
+	A recent answer for the same question is replayed from the cache
+	without contacting the server.
+	
+	Parameters
+		str
+			Name to query for.
+		rrtype
+			Resource record type to query for.
+		result
+			Initialised 'result' data structure.
  */
-void
-mdns_lookup_callback
-(
-	DNSServiceRef		sdref,
-	DNSServiceFlags		flags,
-	uint32_t			interface_index,
-	DNSServiceErrorType	error_code,
-	const char			*fullname,	  
-	uint16_t			rrtype,
-	uint16_t			rrclass,
-	uint16_t			rdlen,
-	const void			*rdata,
-	uint32_t			ttl,
-	void				*context
+static nss_status
+mdns_query (const char * str, ns_type_t rrtype, result_map_t * result)
+{
+	char record_buf [k_cache_data_max];
+	record_log_t records;
+	nss_status status;
+	
+	switch (
+		cache_lookup (str, rrtype, mdns_lookup_callback, result, &result->done)
+	)
+	{
+	  case 1:
+		return result->status;
+	  case -1:
+		return set_err_notfound (result);
+	}
+	
+	init_record_log (&records, record_buf);
+	result->records = &records;
+	status = mdns_run (start_query_record, str, rrtype, result);
+	result->records = NULL;
+	
+	if (! result->conn_failed)
+		cache_store (str, rrtype, status, &records);
+	
+	return status;
+}
+
+
+static DNSServiceErrorType
+start_query_record (
+	DNSServiceRef * sdref,
+	DNSServiceFlags flags,
+	const char * str,
+	ns_type_t rrtype,
+	result_map_t * result
 )
 {
-	// A single record is received
+	return
+		DNSServiceQueryRecord (
+			sdref,
+			flags,
+			kDNSServiceInterfaceIndexAny,	// all interfaces
+			str,		// name to query for
+			rrtype,		// resource record type
+			kDNSServiceClass_IN,	// internet class records
+			mdns_lookup_callback,	// callback
+			result		// Context - result buffer
+		);
+}
 
-	result_map_t * result = (result_map_t *) context;
 
-	(void)sdref; // Unused
-	(void)interface_index; // Unused
-	(void)ttl; // Unused
+static DNSServiceErrorType
+start_addrinfo (
+	DNSServiceRef * sdref,
+	DNSServiceFlags flags,
+	const char * str,
+	ns_type_t rrtype,
+	result_map_t * result
+)
+{
+	(void)rrtype; // Unused
 	
-	if (! (flags & kDNSServiceFlagsMoreComing) )
-	{
-		result->done = 1;
-	}
+	return
+		DNSServiceGetAddrInfo (
+			sdref,
+			flags | kDNSServiceFlagsReturnIntermediates,
+				// deliver negative answers, so a family with no
+				// address can finish the request without the wait
+			kDNSServiceInterfaceIndexAny,	// all interfaces
+			kDNSServiceProtocol_IPv4 | kDNSServiceProtocol_IPv6,
+				// A and AAAA queries at once
+			str,		// name to query for
+			mdns_addrinfo_callback,	// callback
+			result		// Context - the addrinfo_result_t
+		);
+}
 
-	if (error_code == kDNSServiceErr_NoError)
-	{
-		ns_type_t expected_rr_type =
-			af_to_rr (result->hostent->h_addrtype);
 
-		// Idiot check class
-		if (rrclass != C_IN)
-		{
-			syslog (LOG_WARNING,
-				"mdns: Received bad RR class: expected %d (%s),"
+/*
+	Start a request with start and handle events until it completes.
+	
+	The request runs over the shared connection, unless another thread
+	is using it, in which case it gets a connection of its own rather
+	than waiting.
+	
+	Parameters
+		start
+			Function that issues the request.
+		str
+			Name to query for.
+		rrtype
+			Passed through to start.
+		result
+			Initialised 'result' data structure, passed to start as the
+			request context.
+ */
+static nss_status
+mdns_run (
+	start_request_t * start,
+	const char * str,
+	ns_type_t rrtype,
+	result_map_t * result
+)
+{
+	DNSServiceErrorType errcode;
+	DNSServiceRef primary;
+	DNSServiceRef sdref;
+	DNSServiceFlags flags = kDNSServiceFlagsForceMulticast;
+		// force multicast query
+	nss_status status;
+	int attempt;
+	
+	primary = shared_connection_acquire ();
+	for (attempt = 0; ; attempt++)
+	{
+		sdref = primary;
+		errcode =
+			start (
+				&sdref,
+				primary ? flags | kDNSServiceFlagsShareConnection : flags,
+				str,
+				rrtype,
+				result
+			);
+		if (! errcode || ! primary)
+			break;
+		
+		// The shared connection is dead, most likely because the server
+		// has restarted since it was made
+		shared_connection_release (1);
+		if (attempt > 0)
+		{
+			primary = NULL;
+			break;
+		}
+		primary = shared_connection_acquire ();
+	}
+	
+	if (errcode)
+	{
+		syslog (LOG_WARNING,
+			"mdns: Failed to initialise lookup, error %d",
+			errcode
+		);
+		return set_err_mdns_failed (result);
+	}
+	
+	status = handle_events (primary ? primary : sdref, result, str);
+	
+	if (primary)
+	{
+		if (! result->conn_failed)
+			DNSServiceRefDeallocate (sdref);
+				// Cancels the request, leaving the connection open
+		shared_connection_release (result->conn_failed);
+	}
+	else
+	{
+		DNSServiceRefDeallocate (sdref);
+	}
+	
+	return status;
+}
+
+
+/*
+	Fork handlers.  The child must not inherit a locked cache, nor a
+	connection lock held by a thread that no longer exists.
+ */
+static void
+atfork_prepare (void)
+{
+	pthread_mutex_lock (&g_cache_mutex);
+}
+
+static void
+atfork_parent (void)
+{
+	pthread_mutex_unlock (&g_cache_mutex);
+}
+
+static void
+atfork_child (void)
+{
+	pthread_mutex_unlock (&g_cache_mutex);
+	pthread_mutex_init (&g_connection_mutex, NULL);
+		// Another thread may have been mid-lookup when we forked
+}
+
+static void
+register_atfork (void)
+{
+	pthread_atfork (atfork_prepare, atfork_parent, atfork_child);
+}
+
+/*
+	Lock and return the shared connection to the mDNS server, creating
+	it if necessary.
+	
+	Returns
+		The shared connection, which must be handed back with
+		shared_connection_release, or NULL if it is in use by another
+		thread or cannot be created.
+ */
+static DNSServiceRef
+shared_connection_acquire (void)
+{
+	int flags;
+	
+	pthread_once (&g_atfork_once, register_atfork);
+	
+	if (pthread_mutex_trylock (&g_connection_mutex) != 0)
+		return NULL;
+	
+	if (g_connection && g_connection_pid != getpid ())
+	{
+		// Inherited across fork.  The socket is shared with the parent,
+		// so just close our copy.
+		DNSServiceRefDeallocate (g_connection);
+		g_connection = NULL;
+	}
+	
+	if (! g_connection)
+	{
+		if (DNSServiceCreateConnection (&g_connection) != kDNSServiceErr_NoError)
+		{
+			g_connection = NULL;
+			pthread_mutex_unlock (&g_connection_mutex);
+			return NULL;
+		}
+		g_connection_pid = getpid ();
+		
+		flags = fcntl (DNSServiceRefSockFD (g_connection), F_GETFD);
+		if (flags >= 0)
+			fcntl (
+				DNSServiceRefSockFD (g_connection),
+				F_SETFD,
+				flags | FD_CLOEXEC
+			);
+			// Don't leak the connection into programs we exec
+	}
+	
+	return g_connection;
+}
+
+
+/*
+	Unlock the shared connection.  If the lookup found it unusable,
+	close it so the next lookup makes a new one.
+ */
+static void
+shared_connection_release (int failed)
+{
+	if (failed && g_connection)
+	{
+		DNSServiceRefDeallocate (g_connection);
+		g_connection = NULL;
+	}
+	pthread_mutex_unlock (&g_connection_mutex);
+}
+
+
+static void
+init_record_log (record_log_t * records, char * data)
+{
+	records->data = data;
+	records->len = 0;
+	records->overflow = 0;
+	records->ttl = k_cache_max_ttl;
+}
+
+
+/*
+	Append a received record to a record log, so the whole reply can be
+	cached.  Each record is stored as rrtype, rdata length and name length
+	(16 bits each), interface index (32 bits), then the nul terminated
+	name, then the rdata.
+ */
+static void
+record_rr (
+	record_log_t * records,
+	const char * fullname,
+	uint16_t rrtype,
+	uint16_t rdlen,
+	const void * rdata,
+	uint32_t ttl,
+	uint32_t interface_index
+)
+{
+	uint16_t namelen = strlen (fullname) + 1;
+	int len =
+		3 * sizeof (uint16_t) + sizeof (uint32_t) + namelen + rdlen;
+	char * p;
+	
+	if (records->len + len > k_cache_data_max)
+	{
+		records->overflow = 1;
+		return;
+	}
+	
+	p = records->data + records->len;
+	memcpy (p, &rrtype, sizeof (uint16_t));
+	p += sizeof (uint16_t);
+	memcpy (p, &rdlen, sizeof (uint16_t));
+	p += sizeof (uint16_t);
+	memcpy (p, &namelen, sizeof (uint16_t));
+	p += sizeof (uint16_t);
+	memcpy (p, &interface_index, sizeof (uint32_t));
+	p += sizeof (uint32_t);
+	memcpy (p, fullname, namelen);
+	p += namelen;
+	memcpy (p, rdata, rdlen);
+	
+	records->len += len;
+	if (ttl < records->ttl)
+		records->ttl = ttl;
+}
+
+
+/*
+	Answer a question from the cache.
+	
+	Parameters
+		name, rrtype
+			The question.
+		replay
+			Called for each stored record, with the time left before the
+			entry expires as the TTL.  The last record is passed without
+			kDNSServiceFlagsMoreComing.
+		context
+			Passed to replay.
+		done
+			Replay stops early once this becomes non-zero.
+	
+	Returns
+		1 if the cache held a current answer, which has been replayed;
+		-1 if it held a current negative entry;
+		0 if the question is not cached.
+ */
+static int
+cache_lookup (
+	const char * name,
+	ns_type_t rrtype,
+	mdns_lookup_callback_t * replay,
+	void * context,
+	const int * done
+)
+{
+	char data [k_cache_data_max];
+	int data_len = -1;
+	uint32_t ttl = 0;
+	time_t now = time (NULL);
+	int i;
+	
+	pthread_mutex_lock (&g_cache_mutex);
+	for (i = 0; i < k_cache_entries; i++)
+	{
+		cache_entry_t * entry = &g_cache [i];
+		
+		if (entry->expires == 0 || entry->rrtype != rrtype)
+			continue;
+		if (strcasecmp (entry->name, name) != 0)
+			continue;
+		
+		if (now < entry->stored || now >= entry->expires)
+		{
+			// Stale, or the clock has gone backwards
+			entry->expires = 0;
+			break;
+		}
+		
+		entry->last_used = now;
+		ttl = entry->expires - now;
+		data_len = entry->data_len;
+		memcpy (data, entry->data, data_len);
+		break;
+	}
+	pthread_mutex_unlock (&g_cache_mutex);
+	
+	if (data_len < 0)
+		return 0;
+	
+	if (MDNS_VERBOSE)
+		syslog (LOG_DEBUG,
+			"mdns: %s answered from cache",
+			name
+		);
+	
+	if (data_len == 0)
+		return -1;
+	
+	// Replay the stored records, outside the lock since the callback
+	// writes into the caller's buffer
+	{
+		const char * p = data;
+		const char * end = data + data_len;
+		int rdata_aligned [k_cache_data_max / sizeof (int)];
+			// add_address_to_buffer requires int aligned data
+		
+		while (p < end && ! *done)
+		{
+			uint16_t rr_type, rdlen, namelen;
+			uint32_t interface_index;
+			const char * rr_name;
+			DNSServiceFlags flags = kDNSServiceFlagsMoreComing;
+			
+			memcpy (&rr_type, p, sizeof (uint16_t));
+			p += sizeof (uint16_t);
+			memcpy (&rdlen, p, sizeof (uint16_t));
+			p += sizeof (uint16_t);
+			memcpy (&namelen, p, sizeof (uint16_t));
+			p += sizeof (uint16_t);
+			memcpy (&interface_index, p, sizeof (uint32_t));
+			p += sizeof (uint32_t);
+			rr_name = p;
+			p += namelen;
+			memcpy (rdata_aligned, p, rdlen);
+			p += rdlen;
+			
+			if (p >= end)
+				flags = 0;
+			
+			replay (
+				NULL,
+				flags,
+				interface_index,
+				kDNSServiceErr_NoError,
+				rr_name,
+				rr_type,
+				kDNSServiceClass_IN,
+				rdlen,
+				rdata_aligned,
+				ttl,
+				context
+			);
+		}
+	}
+	
+	return 1;
+}
+
+
+/*
+	Remember the outcome of a completed question.
+	
+	Successful lookups are kept for the smallest TTL of the records
+	received, up to k_cache_max_ttl.  Lookups that got no answer are kept
+	for k_cache_negative_ttl.  Anything else (errors, or records that did
+	not fit the log) is not cached.
+ */
+static void
+cache_store (
+	const char * name,
+	ns_type_t rrtype,
+	nss_status status,
+	const record_log_t * records
+)
+{
+	cache_entry_t * entry = NULL;
+	time_t now = time (NULL);
+	time_t ttl;
+	int i;
+	
+	if (status == NSS_STATUS_SUCCESS)
+	{
+		if (records->overflow || records->len == 0)
+			return;
+		ttl = records->ttl;
+	}
+	else if (status == NSS_STATUS_NOTFOUND)
+	{
+		ttl = k_cache_negative_ttl;
+	}
+	else
+	{
+		return;
+	}
+	
+	if (ttl <= 0 || strlen (name) > k_hostname_maxlen)
+		return;
+	
+	pthread_mutex_lock (&g_cache_mutex);
+	for (i = 0; i < k_cache_entries; i++)
+	{
+		cache_entry_t * candidate = &g_cache [i];
+		
+		if (
+			candidate->expires != 0 &&
+			candidate->rrtype == rrtype &&
+			strcasecmp (candidate->name, name) == 0
+		)
+		{
+			entry = candidate;
+			break;
+		}
+		
+		// Otherwise prefer an expired entry, then the least recently used
+		if (
+			! entry ||
+			(entry->expires > now && candidate->expires <= now) ||
+			(
+				(entry->expires > now) == (candidate->expires > now) &&
+				candidate->last_used < entry->last_used
+			)
+		)
+		{
+			entry = candidate;
+		}
+	}
+	
+	strcpy (entry->name, name);
+	entry->rrtype = rrtype;
+	entry->stored = now;
+	entry->expires = now + ttl;
+	entry->last_used = now;
+	entry->data_len = (status == NSS_STATUS_SUCCESS) ? records->len : 0;
+	memcpy (entry->data, records->data, entry->data_len);
+	pthread_mutex_unlock (&g_cache_mutex);
+}
+
+
+/*
+	Examine incoming data and add to relevant fields in result structure.
+	This routine is called from DNSServiceProcessResult where appropriate.
+ */
+void
+mdns_lookup_callback
+(
+	DNSServiceRef		sdref,
+	DNSServiceFlags		flags,
+	uint32_t			interface_index,
+	DNSServiceErrorType	error_code,
+	const char			*fullname,	  
+	uint16_t			rrtype,
+	uint16_t			rrclass,
+	uint16_t			rdlen,
+	const void			*rdata,
+	uint32_t			ttl,
+	void				*context
+)
+{
+	// A single record is received
+
+	result_map_t * result = (result_map_t *) context;
+
+	(void)sdref; // Unused
+	
+	if (! (flags & kDNSServiceFlagsMoreComing) )
+	{
+		result->done = 1;
+	}
+
+	if (error_code == kDNSServiceErr_NoError)
+	{
+		ns_type_t expected_rr_type =
+			af_to_rr (result->hostent->h_addrtype);
+
+		if (result->records)
+			record_rr (
+				result->records,
+				fullname,
+				rrtype,
+				rdlen,
+				rdata,
+				ttl,
+				interface_index
+			);
+
+		// Idiot check class
+		if (rrclass != C_IN)
+		{
+			syslog (LOG_WARNING,
+				"mdns: Received bad RR class: expected %d (%s),"
 				" got %d (%s), RR type %d (%s)",
 				C_IN,
 				ns_class_to_str (C_IN),
@@ -1158,6 +2029,247 @@ mdns_lookup_callback
 	}
 }
 
+/*
+	Examine an address from DNSServiceGetAddrInfo and add it to the
+	result.  The request is done when both families have answered,
+	either with an address or with kDNSServiceErr_NoSuchRecord (sent
+	because start_addrinfo asks for kDNSServiceFlagsReturnIntermediates,
+	e.g. when the responder asserts by NSEC that it has no record of
+	that family).  If only one has answered by the end of a batch of
+	replies (no kDNSServiceFlagsMoreComing), handle_events waits only a
+	short time for the other.
+ */
+static void
+mdns_addrinfo_callback (
+	DNSServiceRef sdref,
+	DNSServiceFlags flags,
+	uint32_t interface_index,
+	DNSServiceErrorType error_code,
+	const char * hostname,
+	const struct sockaddr * address,
+	uint32_t ttl,
+	void * context
+)
+{
+	addrinfo_result_t * ai = (addrinfo_result_t *) context;
+	uint16_t rrtype;
+	const void * rdata;
+	uint16_t rdlen;
+	int family;
+	int idx;
+
+	(void)sdref; // Unused
+	
+	if (address->sa_family == AF_INET)
+	{
+		rrtype = kDNSServiceType_A;
+		rdata = &((const struct sockaddr_in *) address)->sin_addr;
+		rdlen = sizeof (struct in_addr);
+		family = kDNSServiceProtocol_IPv4;
+		idx = 0;
+	}
+	else
+	{
+		rrtype = kDNSServiceType_AAAA;
+		rdata = &((const struct sockaddr_in6 *) address)->sin6_addr;
+		rdlen = sizeof (struct in6_addr);
+		family = kDNSServiceProtocol_IPv6;
+		idx = 1;
+	}
+	
+	if (error_code == kDNSServiceErr_NoError)
+	{
+		if (ai->records [idx])
+			record_rr (
+				ai->records [idx],
+				hostname,
+				rrtype,
+				rdlen,
+				rdata,
+				ttl,
+				interface_index
+			);
+		add_addrinfo (
+			ai, hostname, rrtype, rdata, rdlen, interface_index, ttl
+		);
+		ai->answered |= family;
+	}
+	else if (error_code == kDNSServiceErr_NoSuchRecord)
+	{
+		ai->answered |= family;
+	}
+	else
+	{
+		// For now, dump message to syslog and continue
+		syslog (LOG_WARNING,
+			"mdns: callback returned error %d",
+			error_code
+		);
+	}
+	
+	if (! (flags & kDNSServiceFlagsMoreComing) )
+	{
+		if (ai->answered == (kDNSServiceProtocol_IPv4 | kDNSServiceProtocol_IPv6))
+			ai->map.done = 1;
+		else if (ai->map.status == NSS_STATUS_SUCCESS)
+			ai->map.settling = 1;
+	}
+}
+
+
+static void
+addrinfo_replay_callback (
+	DNSServiceRef sdref,
+	DNSServiceFlags flags,
+	uint32_t interface_index,
+	DNSServiceErrorType error_code,
+	const char * fullname,
+	uint16_t rrtype,
+	uint16_t rrclass,
+	uint16_t rdlen,
+	const void * rdata,
+	uint32_t ttl,
+	void * context
+)
+{
+	(void)sdref; // Unused
+	(void)flags; // Unused
+	(void)error_code; // Unused
+	(void)rrclass; // Unused
+	
+	add_addrinfo (
+		(addrinfo_result_t *) context,
+		fullname,
+		rrtype,
+		rdata,
+		rdlen,
+		interface_index,
+		ttl
+	);
+}
+
+
+static void
+init_addrinfo_result (
+	addrinfo_result_t * ai,
+	char * buf,
+	size_t buflen
+)
+{
+	memset (ai, 0, sizeof (*ai));
+	ai->next = &ai->first;
+	ai->buffer = buf;
+	ai->buflen = buflen;
+	ai->ttl = k_cache_max_ttl;
+	set_err_notfound (&ai->map);
+}
+
+
+/*
+	Carve len bytes aligned for a pointer from the caller's buffer.
+	
+	Returns
+		Pointer to the space, or NULL if the buffer is full.
+ */
+static void *
+addrinfo_alloc (addrinfo_result_t * ai, size_t len)
+{
+	size_t pad =
+		(sizeof (void *) -
+			(unsigned long) (ai->buffer + ai->used) % sizeof (void *)
+		) % sizeof (void *);
+	void * p;
+	
+	if (ai->used + pad + len > ai->buflen)
+		return NULL;
+	
+	p = ai->buffer + ai->used + pad;
+	ai->used += pad + len;
+	return p;
+}
+
+
+/*
+	Add an address to the end of the result list, unless it is already
+	there.  On running out of buffer the lookup is stopped with ERANGE,
+	so the caller can retry with a larger one.
+ */
+static void
+add_addrinfo (
+	addrinfo_result_t * ai,
+	const char * hostname,
+	uint16_t rrtype,
+	const void * rdata,
+	uint16_t rdlen,
+	uint32_t interface_index,
+	uint32_t ttl
+)
+{
+	struct gaih_addrtuple * tuple;
+	int family;
+	
+	if (
+		ai->map.status != NSS_STATUS_SUCCESS &&
+		ai->map.status != NSS_STATUS_NOTFOUND
+	)
+		return;
+			// Already failed
+	
+	if (rrtype == kDNSServiceType_A && rdlen == sizeof (struct in_addr))
+		family = AF_INET;
+	else if (rrtype == kDNSServiceType_AAAA && rdlen == sizeof (struct in6_addr))
+		family = AF_INET6;
+	else
+		return;
+	
+	for (tuple = ai->first; tuple; tuple = tuple->next)
+	{
+		if (tuple->family == family && memcmp (tuple->addr, rdata, rdlen) == 0)
+			return;
+	}
+	
+	if (! ai->hostname)
+	{
+		int len = strlen (hostname) + 1;
+		
+		ai->hostname = addrinfo_alloc (ai, len);
+		if (! ai->hostname)
+		{
+			set_err_buf_too_small (&ai->map);
+			ai->map.done = 1;
+			return;
+		}
+		memcpy (ai->hostname, hostname, len);
+	}
+	
+	tuple = addrinfo_alloc (ai, sizeof (struct gaih_addrtuple));
+	if (! tuple)
+	{
+		set_err_buf_too_small (&ai->map);
+		ai->map.done = 1;
+		return;
+	}
+	
+	memset (tuple, 0, sizeof (*tuple));
+	tuple->name = ai->hostname;
+	tuple->family = family;
+	memcpy (tuple->addr, rdata, rdlen);
+	if (
+		family == AF_INET6 &&
+		IN6_IS_ADDR_LINKLOCAL ((const struct in6_addr *) tuple->addr)
+	)
+		tuple->scopeid = interface_index;
+	
+	*ai->next = tuple;
+	ai->next = &tuple->next;
+	
+	if ((int32_t) ttl < ai->ttl)
+		ai->ttl = ttl;
+	
+	set_err_success (&ai->map);
+}
+
+
 static int
 callback_body_ptr (
 	const char * fullname,
@@ -1517,6 +2629,9 @@ init_result (
 	result->addr_idx = 0;
 	result->alias_idx = buflen - sizeof (buf_header_t);
 	result->done = 0;
+	result->records = NULL;
+	result->conn_failed = 0;
+	result->settling = 0;
 	set_err_notfound (result);
 
 	// Point hostent to the right buffers
@@ -22,6 +22,9 @@
 #include <sys/socket.h>			// Needed for socket() etc.
 #include <netinet/in.h>			// Needed for sockaddr_in
 #include <syslog.h>
+#include <stdlib.h>				// Needed for malloc() and free()
+#include <stdint.h>				// Needed for uintptr_t
+#include <sys/mman.h>			// Needed for mmap() and munmap()
 
 #include "mDNSEmbeddedAPI.h"	// Defines the interface provided to the client layer above
 #include "DNSCommon.h"
@@ -194,3 +197,211 @@ mDNSexport void mDNSPlatformWriteLogMsg(const char *ident, const char *buffer, m
 			syslog(syslog_level, "%s", buffer);
 		}
 	}
+
+// ***************************************************************************
+#if COMPILER_LIKES_PRAGMA_MARK
+#pragma mark -
+#pragma mark - Memory Pools
+#endif
+
+// A long-running daemon allocates and frees the same few kinds of object over and over: request and reply state
+// in uds_daemon, oversized rdata in the cache, packets and lease table entries in dnsextd. PoolAllocate() serves
+// these from size-classed pools of fixed-size slabs instead of the general heap. Each slab is its own mmap()
+// region, so when a slab empties we can give it straight back to the operating system with munmap().
+//
+// Slabs are aligned on their own size, so PoolFree() finds the slab a block came from by rounding the pointer down
+// and looking the result up in SlabHash. Anything not found there came from malloc(), so PoolFree() is safe to
+// call on memory from either source -- that's what lets mDNSPlatformMemFree() be built on it.
+
+#ifndef MAP_ANON
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+
+#define POOL_SLAB_SIZE  0x10000			// Each slab is 64kB, aligned on a 64kB boundary
+#define POOL_SLAB_HASH  256
+
+typedef struct PoolSlab_struct PoolSlab;
+
+typedef struct
+	{
+	mDNSu32   blocksize;				// Size of every block in this pool
+	PoolSlab *partial;					// Slabs with some blocks in use and at least one available
+	PoolSlab *spare;					// One completely empty slab, kept back so we don't thrash mmap()/munmap()
+	PoolStatistics stats;
+	} MemPool;
+
+struct PoolSlab_struct
+	{
+	PoolSlab *next;						// Next slab on its pool's partial list
+	PoolSlab *prev;
+	PoolSlab *nextinhash;				// Next slab in the same SlabHash bucket
+	MemPool  *pool;
+	void     *freelist;					// Freed blocks, linked through their first word
+	mDNSu8   *unused;					// Start of the blocks that have never been handed out
+	mDNSu32   inuse;					// Number of blocks currently allocated from this slab
+	};
+
+// Slab header rounded up so that blocks start 16-byte aligned (all block sizes are multiples of 16)
+#define POOL_SLAB_HEADER ((sizeof(PoolSlab) + 15) & ~(size_t)15)
+
+mDNSlocal const mDNSu32 PoolBlockSizes[] =
+	{
+	  32,   48,   64,   96,  128,  192,  256,  384,  512,
+	 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192,
+	9216	// Big enough for a dnsextd PktMsg holding a maximum-sized UDP message
+	};
+#define NumPools ((int)(sizeof(PoolBlockSizes) / sizeof(PoolBlockSizes[0])))
+
+mDNSlocal MemPool Pools[NumPools];
+
+mDNSlocal PoolSlab *SlabHash[POOL_SLAB_HASH];
+mDNSlocal mDNSu32   PoolOversized;		// Allocations too big for any pool, passed through to malloc()
+mDNSlocal void    (*PoolLockFn)(void);
+mDNSlocal void    (*PoolUnlockFn)(void);
+
+#define PoolLock()   do { if (PoolLockFn)   PoolLockFn();   } while (0)
+#define PoolUnlock() do { if (PoolUnlockFn) PoolUnlockFn(); } while (0)
+#define SlabHashSlot(BASE) (((uintptr_t)(BASE) / POOL_SLAB_SIZE) % POOL_SLAB_HASH)
+
+mDNSexport void SetPoolLockFunctions(void (*lock)(void), void (*unlock)(void))
+	{
+	PoolLockFn   = lock;
+	PoolUnlockFn = unlock;
+	}
+
+mDNSlocal mDNSBool SlabIsFull(const PoolSlab *const slab)
+	{
+	return(!slab->freelist && slab->unused + slab->pool->blocksize > (const mDNSu8 *)slab + POOL_SLAB_SIZE);
+	}
+
+mDNSlocal void SlabListAdd(MemPool *const pool, PoolSlab *const slab)
+	{
+	slab->prev = mDNSNULL;
+	slab->next = pool->partial;
+	if (pool->partial) pool->partial->prev = slab;
+	pool->partial = slab;
+	}
+
+mDNSlocal void SlabListRemove(MemPool *const pool, PoolSlab *const slab)
+	{
+	if (slab->prev) slab->prev->next = slab->next; else pool->partial = slab->next;
+	if (slab->next) slab->next->prev = slab->prev;
+	slab->next = slab->prev = mDNSNULL;
+	}
+
+mDNSlocal PoolSlab *NewSlab(MemPool *const pool)
+	{
+	// Map twice the size we need so that we can trim it to a correctly aligned slab
+	mDNSu8 *const region = mmap(mDNSNULL, 2 * POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	mDNSu8 *base;
+	PoolSlab *slab;
+
+	if (region == (mDNSu8 *)MAP_FAILED) { LogMsg("NewSlab: mmap failed errno %d (%s)", errno, strerror(errno)); return(mDNSNULL); }
+	base = (mDNSu8 *)(((uintptr_t)region + POOL_SLAB_SIZE - 1) & ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+	if (base > region) munmap(region, base - region);
+	if (base + POOL_SLAB_SIZE < region + 2 * POOL_SLAB_SIZE)
+		munmap(base + POOL_SLAB_SIZE, region + 2 * POOL_SLAB_SIZE - (base + POOL_SLAB_SIZE));
+
+	slab             = (PoolSlab *)base;
+	slab->pool       = pool;
+	slab->freelist   = mDNSNULL;
+	slab->unused     = base + POOL_SLAB_HEADER;
+	slab->inuse      = 0;
+	slab->nextinhash = SlabHash[SlabHashSlot(base)];
+	SlabHash[SlabHashSlot(base)] = slab;
+	pool->stats.slabs++;
+	return(slab);
+	}
+
+mDNSlocal void ReleaseSlab(MemPool *const pool, PoolSlab *const slab)
+	{
+	PoolSlab **p = &SlabHash[SlabHashSlot(slab)];
+	while (*p != slab) p = &(*p)->nextinhash;
+	*p = slab->nextinhash;
+	pool->stats.slabs--;
+	pool->stats.released++;
+	munmap(slab, POOL_SLAB_SIZE);
+	}
+
+mDNSexport void *PoolAllocate(mDNSu32 size)
+	{
+	MemPool *pool = mDNSNULL;
+	PoolSlab *slab;
+	void *block;
+	int i;
+
+	for (i = 0; i < NumPools; i++) if (size <= PoolBlockSizes[i]) { pool = &Pools[i]; break; }
+	if (!pool)
+		{
+		PoolLock();
+		PoolOversized++;
+		PoolUnlock();
+		return(malloc(size));
+		}
+
+	PoolLock();
+	pool->blocksize = PoolBlockSizes[i];
+	slab = pool->partial;
+	if (!slab)
+		{
+		if (pool->spare) { slab = pool->spare; pool->spare = mDNSNULL; }
+		else if ((slab = NewSlab(pool)) == mDNSNULL) { PoolUnlock(); return(mDNSNULL); }
+		SlabListAdd(pool, slab);
+		}
+
+	if (slab->freelist) { block = slab->freelist; slab->freelist = *(void **)block; }
+	else                { block = slab->unused;   slab->unused  += pool->blocksize;  }
+	slab->inuse++;
+	if (SlabIsFull(slab)) SlabListRemove(pool, slab);
+
+	pool->stats.allocs++;
+	if (++pool->stats.inuse > pool->stats.peak) pool->stats.peak = pool->stats.inuse;
+	PoolUnlock();
+	return(block);
+	}
+
+mDNSexport void PoolFree(void *ptr)
+	{
+	PoolSlab *slab;
+	MemPool *pool;
+	mDNSu8 *const base = (mDNSu8 *)((uintptr_t)ptr & ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+
+	if (!ptr) return;
+
+	PoolLock();
+	for (slab = SlabHash[SlabHashSlot(base)]; slab && (mDNSu8 *)slab != base; slab = slab->nextinhash) continue;
+	if (!slab) { PoolUnlock(); free(ptr); return; }
+
+	pool = slab->pool;
+	if (SlabIsFull(slab)) SlabListAdd(pool, slab);
+	*(void **)ptr  = slab->freelist;
+	slab->freelist = ptr;
+	pool->stats.frees++;
+	pool->stats.inuse--;
+
+	// Keep one empty slab per pool so that a single object being allocated and freed repeatedly
+	// doesn't cost us an mmap() and munmap() every time; any more than that go back to the OS
+	if (--slab->inuse == 0)
+		{
+		SlabListRemove(pool, slab);
+		if (pool->spare) ReleaseSlab(pool, slab);
+		else pool->spare = slab;
+		}
+	PoolUnlock();
+	}
+
+mDNSexport void LogPoolStatistics(void)
+	{
+	int i;
+	PoolLock();
+	LogMsgNoIdent("Memory pools (%lu oversized allocations passed to malloc):", (unsigned long)PoolOversized);
+	for (i = 0; i < NumPools; i++)
+		{
+		const PoolStatistics *const s = &Pools[i].stats;
+		if (s->allocs)
+			LogMsgNoIdent("%5lu-byte blocks: %6lu in use %6lu peak %9lu allocated %9lu freed %4lu slabs %6lu slabs released",
+				(unsigned long)PoolBlockSizes[i], (unsigned long)s->inuse, (unsigned long)s->peak,
+				(unsigned long)s->allocs, (unsigned long)s->frees, (unsigned long)s->slabs, (unsigned long)s->released);
+		}
+	PoolUnlock();
+	}
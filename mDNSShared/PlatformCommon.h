@@ -16,3 +16,22 @@
  */
 
 extern void ReadDDNSSettingsFromConfFile(mDNS *const m, const char *const filename, domainname *const hostname, domainname *const domain, mDNSBool *DomainDiscoveryDisabled);
+
+// Per-pool counters reported by LogPoolStatistics()
+typedef struct
+	{
+	mDNSu32 allocs;			// Total blocks ever allocated
+	mDNSu32 frees;			// Total blocks ever freed
+	mDNSu32 inuse;			// Blocks allocated now
+	mDNSu32 peak;			// Most blocks ever allocated at once
+	mDNSu32 slabs;			// Slabs mapped now
+	mDNSu32 released;		// Slabs returned to the OS
+	} PoolStatistics;
+
+// Size-classed slab allocator for small objects that are allocated and freed frequently.
+// PoolFree() also accepts memory from malloc(), and frees it with free().
+// Programs that allocate from more than one thread must call SetPoolLockFunctions() before starting them.
+extern void *PoolAllocate(mDNSu32 size);
+extern void  PoolFree(void *ptr);
+extern void  SetPoolLockFunctions(void (*lock)(void), void (*unlock)(void));
+extern void  LogPoolStatistics(void);
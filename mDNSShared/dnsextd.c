@@ -19,6 +19,7 @@
 #include "../mDNSShared/uds_daemon.h"
 #include "../mDNSShared/dnssd_ipc.h"
 #include "../mDNSCore/uDNS.h"
+#include "../mDNSShared/PlatformCommon.h"
 #include "../mDNSShared/DebugServices.h"
 #include <signal.h>
 #include <pthread.h>
@@ -56,8 +57,10 @@ mDNSexport const char ProgramName[] = "dnsextd";
 #	define LISTENQ					128					// tcp connection backlog
 #endif
 #define RECV_BUFLEN					9000                
-#define LEASETABLE_INIT_NBUCKETS	256					// initial hashtable size (doubles as table fills)
+#define LEASETABLE_INIT_NBUCKETS	256					// initial hashtable size, split across shards (each doubles as it fills)
 #define EXPIRATION_INTERVAL			300					// check for expired records every 5 minutes
+#define WORKER_THREADS				8					// default size of the request handling thread pool
+#define QUEUE_LENGTH				256					// default number of requests that may wait for a worker
 #define SRV_TTL						7200				// TTL For _dns-update SRV records
 #define CONFIG_FILE					"/etc/dnsextd.conf"
 #define TCP_SOCKET_FLAGS   			kTCPSocketFlags_UseTLS
@@ -83,7 +86,7 @@ mDNSexport const char ProgramName[] = "dnsextd";
 // Structs/fields that must be locked for thread safety are explicitly commented
 //
 
-// args passed to UDP request handler thread as void*
+// args passed to UDP request handler as void*
 
 typedef struct
 	{
@@ -93,7 +96,7 @@ typedef struct
 	int sd;
 	} UDPContext;
 
-// args passed to TCP request handler thread as void*
+// args passed to TCP request handler as void*
 typedef struct
 	{
 	PktMsg	pkt;
@@ -102,11 +105,12 @@ typedef struct
     DaemonInfo *d;
 	} TCPContext;
 
-// args passed to UpdateAnswerList thread as void*
+// args passed to UpdateAnswerList as void*
 typedef struct
 	{
     DaemonInfo *d;
     AnswerListElem *a;
+    int *pending;               // GenLLQEvents' count of outstanding updates (locked via queuelock)
 	} UpdateAnswerListArgs;
 
 //
@@ -439,7 +443,7 @@ RecvPacket
 			allocsize = sizeof(PktMsg);
 			}
 
-		pkt = malloc(allocsize);
+		pkt = PoolAllocate(allocsize);
 		require_action_quiet( pkt, exit, err = mStatus_NoMemoryErr; LogErr( "RecvPacket", "malloc" ) );
 		mDNSPlatformMemZero( pkt, sizeof( *pkt ) );
 		}
@@ -464,7 +468,7 @@ exit:
 		{
 		if ( pkt != storage )
 			{
-			free(pkt);
+			PoolFree(pkt);
 			}
 
 		pkt = NULL;
@@ -473,6 +477,199 @@ exit:
 	return pkt;
 	}
 
+//
+// Upstream Connection Routines
+// Requests to the real nameserver share a small set of persistent TCP connections.  Each request on a
+// connection gets its own message ID, so several can be outstanding at once; whichever waiting thread isn't
+// beaten to it reads replies off the socket and hands each to the request with the matching ID.
+//
+
+// caller must lock connection
+mDNSlocal void UpstreamCompleteRequest(UpstreamConn *c, UpstreamRequest *r, PktMsg *reply)
+	{
+	UpstreamRequest **p = &c->pending;
+	while (*p && *p != r) p = &(*p)->next;
+	if (*p) *p = r->next;
+	r->reply = reply;
+	r->done = mDNStrue;
+	}
+
+// fail every pending request and drop the socket (or have the current reader do so)
+// caller must lock connection
+mDNSlocal void UpstreamFail(UpstreamConn *c)
+	{
+	while (c->pending) UpstreamCompleteRequest(c, c->pending, NULL);
+	if (c->reading)
+		{
+		// wake the reader; it closes the socket once it is done with it
+		c->broken = mDNStrue;
+		shutdown(mDNSPlatformTCPGetFD(c->sock), SHUT_RDWR);
+		}
+	else if (c->sock)
+		{
+		mDNSPlatformTCPCloseConnection(c->sock);
+		c->sock = NULL;
+		}
+	pthread_cond_broadcast(&c->changed);
+	}
+
+// caller must lock connection
+mDNSlocal mDNSOpaque16 UpstreamNextID(UpstreamConn *c)
+	{
+	UpstreamRequest *r;
+	mDNSOpaque16 id;
+	do	{
+		id = mDNSOpaque16fromIntVal(c->nextid++);
+		for (r = c->pending; r && !mDNSSameOpaque16(r->id, id); r = r->next) continue;
+		} while (r);
+	return id;
+	}
+
+// read one reply and deliver it, called with the connection locked (and returns with it locked)
+// if the oldest pending request's deadline passes first, the server has lost or dropped something, and since
+// everything else on the connection would be stuck behind us we fail the connection rather than wait forever
+mDNSlocal void UpstreamReadReply(UpstreamConn *c)
+	{
+	TCPSocket *sock = c->sock;
+	int fd = mDNSPlatformTCPGetFD(sock);
+	UpstreamRequest *r;
+	PktMsg *reply = NULL;
+	mDNSBool closed = mDNSfalse;
+	time_t deadline = c->pending ? c->pending->deadline : 0;
+	struct timeval now, timeout;
+	fd_set rset;
+	int selectval;
+
+	for (r = c->pending; r; r = r->next) if (r->deadline < deadline) deadline = r->deadline;
+
+	c->reading = mDNStrue;
+	pthread_mutex_unlock(&c->lock);
+	gettimeofday(&now, NULL);
+	timeout.tv_sec  = deadline > now.tv_sec ? deadline - now.tv_sec : 0;
+	timeout.tv_usec = 0;
+	FD_ZERO(&rset);
+	FD_SET(fd, &rset);
+	selectval = select(fd+1, &rset, NULL, NULL, &timeout);
+	if (selectval < 0) LogErr("UpstreamReadReply", "select");
+	else if (!selectval) Log("UpstreamReadReply: no reply from server within %d seconds", UPSTREAM_TIMEOUT);
+	else reply = RecvPacket(sock, NULL, &closed);
+	pthread_mutex_lock(&c->lock);
+	c->reading = mDNSfalse;
+
+	if (!reply || c->broken)
+		{
+		if (reply) PoolFree(reply);
+		c->broken = mDNSfalse;
+		UpstreamFail(c);
+		return;
+		}
+
+	for (r = c->pending; r && !mDNSSameOpaque16(r->id, reply->msg.h.id); r = r->next) continue;
+	if (!r) { VLog("UpstreamReadReply: discarding reply with unknown id %d", mDNSVal16(reply->msg.h.id)); PoolFree(reply); }
+	else if (!r->storage) UpstreamCompleteRequest(c, r, reply);
+	else
+		{
+		if (reply->len <= sizeof(r->storage->msg)) { memcpy(r->storage, reply, sizeof(PktMsg)); UpstreamCompleteRequest(c, r, r->storage); }
+		else { Log("UpstreamReadReply: reply too large for caller's buffer"); UpstreamCompleteRequest(c, r, NULL); }
+		PoolFree(reply);
+		}
+	pthread_cond_broadcast(&c->changed);
+	}
+
+// Send request (in network byte order) to the nameserver and wait for its reply.  Returns the reply in
+// network byte order, placed in storage if non-null and otherwise allocated with malloc, or NULL on failure.
+mDNSlocal PktMsg *UpstreamTransaction(DaemonInfo *d, PktMsg *request, PktMsg *storage)
+	{
+	UpstreamConn *c;
+	UpstreamRequest r;
+	mDNSOpaque16 origid = request->msg.h.id;
+	mDNSBool isquery = (request->msg.h.flags.b[0] & kDNSFlag0_QROP_Mask) == (mDNSu8)(kDNSFlag0_QR_Query | kDNSFlag0_OP_StdQuery);
+	int attempt;
+
+	pthread_mutex_lock(&d->upstreamlock);
+	c = &d->upstream[d->upstreamnext++ % UPSTREAM_CONNECTIONS];
+	pthread_mutex_unlock(&d->upstreamlock);
+
+	// the server may have closed an idle connection, so a request on a reused connection gets one retry -- but
+	// an UPDATE that may have reached the server isn't resent, since applying it twice isn't necessarily harmless
+	for (attempt = 0; attempt < 2; attempt++)
+		{
+		mDNSBool fresh = mDNSfalse, waited = mDNSfalse, sent = mDNStrue;
+		struct timeval now;
+
+		mDNSPlatformMemZero(&r, sizeof(r));
+		r.storage = storage;
+
+		pthread_mutex_lock(&c->lock);
+		while (c->connecting || (c->reading && c->broken))
+			{
+			if (c->connecting) waited = mDNStrue;
+			pthread_cond_wait(&c->changed, &c->lock);
+			}
+		if (!c->sock)
+			{
+			TCPSocket *sock;
+			// someone else's connect just failed, and ours would only fail the same (slow) way
+			if (waited) { pthread_mutex_unlock(&c->lock); Log("UpstreamTransaction: no connection to server"); break; }
+
+			// ConnectToServer retries with backoff, so don't hold up the other users of this connection meanwhile
+			c->connecting = mDNStrue;
+			pthread_mutex_unlock(&c->lock);
+			sock = ConnectToServer(d);
+			pthread_mutex_lock(&c->lock);
+			c->connecting = mDNSfalse;
+			c->sock = sock;
+			pthread_cond_broadcast(&c->changed);
+			if (!c->sock) { pthread_mutex_unlock(&c->lock); Log("UpstreamTransaction: ConnectToServer failed"); break; }
+			fresh = mDNStrue;
+			}
+
+		gettimeofday(&now, NULL);
+		r.deadline = now.tv_sec + UPSTREAM_TIMEOUT;
+		r.id = UpstreamNextID(c);
+		r.next = c->pending;
+		c->pending = &r;
+
+		request->msg.h.id = r.id;
+		if (SendPacket(c->sock, request) < 0) { Log("UpstreamTransaction: SendPacket failed"); UpstreamFail(c); sent = mDNSfalse; }
+		request->msg.h.id = origid;
+
+		while (!r.done)
+			{
+			if (c->reading) pthread_cond_wait(&c->changed, &c->lock);
+			else UpstreamReadReply(c);
+			}
+		pthread_mutex_unlock(&c->lock);
+
+		if (r.reply) { r.reply->msg.h.id = origid; return r.reply; }
+		if (fresh || (sent && !isquery)) break;
+		}
+	return NULL;
+	}
+
+mDNSlocal int InitUpstream(DaemonInfo *d)
+	{
+	int i;
+	if (pthread_mutex_init(&d->upstreamlock, NULL)) { LogErr("InitUpstream", "pthread_mutex_init"); return -1; }
+	for (i = 0; i < UPSTREAM_CONNECTIONS; i++)
+		{
+		UpstreamConn *c = &d->upstream[i];
+		mDNSPlatformMemZero(c, sizeof(*c));
+		if (pthread_mutex_init(&c->lock, NULL)) { LogErr("InitUpstream", "pthread_mutex_init"); return -1; }
+		if (pthread_cond_init(&c->changed, NULL)) { LogErr("InitUpstream", "pthread_cond_init"); return -1; }
+		c->nextid = (mDNSu16)random();
+		}
+	return 0;
+	}
+
+// called once all worker threads have exited
+mDNSlocal void CloseUpstream(DaemonInfo *d)
+	{
+	int i;
+	for (i = 0; i < UPSTREAM_CONNECTIONS; i++)
+		if (d->upstream[i].sock) { mDNSPlatformTCPCloseConnection(d->upstream[i].sock); d->upstream[i].sock = NULL; }
+	}
+
 
 mDNSlocal DNSZone*
 FindZone
@@ -787,60 +984,143 @@ mDNSlocal CacheRecord *CopyCacheRecord(const CacheRecord *orig, domainname *name
 // Lease Hashtable Utility Routines
 //
 
+mDNSlocal LeaseShard *ShardForName(DaemonInfo *d, mDNSu32 namehash)
+	{
+	return &d->shards[namehash % LEASETABLE_NSHARDS];
+	}
+
+// the low bits of the hash picked the shard, so use the rest to pick the bucket
+mDNSlocal int BucketForName(const LeaseShard *s, mDNSu32 namehash)
+	{
+	return (namehash / LEASETABLE_NSHARDS) % s->nbuckets;
+	}
+
 // double hash table size
-// caller must lock table prior to invocation
-mDNSlocal void RehashTable(DaemonInfo *d)
+// caller must lock shard prior to invocation
+mDNSlocal void RehashTable(LeaseShard *s)
 	{
 	RRTableElem *ptr, *tmp, **new;
-	int i, bucket, newnbuckets = d->nbuckets * 2;
+	int i, bucket, oldnbuckets = s->nbuckets;
 
-	VLog("Rehashing lease table (new size %d buckets)", newnbuckets);
-	new = malloc(sizeof(RRTableElem *) * newnbuckets);
+	VLog("Rehashing lease table shard (new size %d buckets)", oldnbuckets * 2);
+	new = malloc(sizeof(RRTableElem *) * oldnbuckets * 2);
 	if (!new) { LogErr("RehashTable", "malloc");  return; }
-	mDNSPlatformMemZero(new, newnbuckets * sizeof(RRTableElem *));
+	mDNSPlatformMemZero(new, oldnbuckets * 2 * sizeof(RRTableElem *));
 
-	for (i = 0; i < d->nbuckets; i++)
+	s->nbuckets = oldnbuckets * 2;
+	for (i = 0; i < oldnbuckets; i++)
 		{
-		ptr = d->table[i];
+		ptr = s->table[i];
 		while (ptr)
 			{
-			bucket = ptr->rr.resrec.namehash % newnbuckets;
+			bucket = BucketForName(s, ptr->rr.resrec.namehash);
 			tmp = ptr;
 			ptr = ptr->next;
 			tmp->next = new[bucket];
 			new[bucket] = tmp;
 			}
 		}
-	d->nbuckets = newnbuckets;
-	free(d->table);
-	d->table = new;
+	free(s->table);
+	s->table = new;
+	}
+
+//
+// Lease Expiry Heap Utility Routines
+// Each shard keeps its records in a min-heap keyed on expire, so finding expired leases costs
+// O(expired * log n) rather than a walk of the whole table.  Caller must lock shard.
+//
+
+mDNSlocal void HeapSet(LeaseShard *s, mDNSs32 i, RRTableElem *e)
+	{
+	s->expiry[i] = e;
+	e->heapindex = i;
+	}
+
+mDNSlocal void HeapSiftUp(LeaseShard *s, mDNSs32 i)
+	{
+	RRTableElem *e = s->expiry[i];
+	while (i > 1 && s->expiry[i/2]->expire > e->expire) { HeapSet(s, i, s->expiry[i/2]); i /= 2; }
+	HeapSet(s, i, e);
+	}
+
+mDNSlocal void HeapSiftDown(LeaseShard *s, mDNSs32 i)
+	{
+	RRTableElem *e = s->expiry[i];
+	while (i * 2 <= s->nelems)
+		{
+		mDNSs32 c = i * 2;
+		if (c < s->nelems && s->expiry[c+1]->expire < s->expiry[c]->expire) c++;
+		if (s->expiry[c]->expire >= e->expire) break;
+		HeapSet(s, i, s->expiry[c]);
+		i = c;
+		}
+	HeapSet(s, i, e);
+	}
+
+// called after e->expire has changed
+mDNSlocal void HeapUpdate(LeaseShard *s, RRTableElem *e)
+	{
+	HeapSiftUp(s, e->heapindex);
+	HeapSiftDown(s, e->heapindex);
+	}
+
+// adds e to the heap and counts it in nelems; caller links it into the hashtable
+mDNSlocal mDNSBool HeapInsert(LeaseShard *s, RRTableElem *e)
+	{
+	if (s->nelems + 1 >= s->heapsize)
+		{
+		mDNSs32 newsize = s->heapsize * 2;
+		RRTableElem **newheap = realloc(s->expiry, sizeof(RRTableElem *) * newsize);
+		if (!newheap) { LogErr("HeapInsert", "realloc"); return mDNSfalse; }
+		s->expiry = newheap;
+		s->heapsize = newsize;
+		}
+	s->nelems++;
+	HeapSet(s, s->nelems, e);
+	HeapSiftUp(s, s->nelems);
+	return mDNStrue;
+	}
+
+// removes e from the heap and the nelems count; caller unlinks it from the hashtable
+mDNSlocal void HeapRemove(LeaseShard *s, RRTableElem *e)
+	{
+	mDNSs32 i = e->heapindex;
+	RRTableElem *last = s->expiry[s->nelems--];
+	if (last != e) { HeapSet(s, i, last); HeapUpdate(s, last); }
+	e->heapindex = 0;
 	}
 
 // print entire contents of hashtable, invoked via SIGINFO
 mDNSlocal void PrintLeaseTable(DaemonInfo *d)
 	{
-	int i;
+	int i, n;
 	RRTableElem *ptr;
 	char rrbuf[MaxMsg], addrbuf[16];
 	struct timeval now;
 	int hr, min, sec;
+	mDNSs32 nelems = 0;
 
 	if (gettimeofday(&now, NULL)) { LogErr("PrintTable", "gettimeofday"); return; }
-	if (pthread_mutex_lock(&d->tablelock)) { LogErr("PrintTable", "pthread_mutex_lock"); return; }
-	
-	Log("Dumping Lease Table Contents (table contains %d resource records)", d->nelems);
-	for (i = 0; i < d->nbuckets; i++)
+	for (n = 0; n < LEASETABLE_NSHARDS; n++) nelems += d->shards[n].nelems;  // unlocked read, just for the banner
+
+	Log("Dumping Lease Table Contents (table contains %d resource records)", nelems);
+	for (n = 0; n < LEASETABLE_NSHARDS; n++)
 		{
-		for (ptr = d->table[i]; ptr; ptr = ptr->next)
+		LeaseShard *s = &d->shards[n];
+		if (pthread_mutex_lock(&s->lock)) { LogErr("PrintTable", "pthread_mutex_lock"); return; }
+		for (i = 0; i < s->nbuckets; i++)
 			{
-			hr = ((ptr->expire - now.tv_sec) / 60) / 60;
-			min = ((ptr->expire - now.tv_sec) / 60) % 60;
-			sec = (ptr->expire - now.tv_sec) % 60;
-			Log("Update from %s, Expires in %d:%d:%d\n\t%s", inet_ntop(AF_INET, &ptr->cli.sin_addr, addrbuf, 16), hr, min, sec,
-				GetRRDisplayString_rdb(&ptr->rr.resrec, &ptr->rr.resrec.rdata->u, rrbuf));
+			for (ptr = s->table[i]; ptr; ptr = ptr->next)
+				{
+				hr = ((ptr->expire - now.tv_sec) / 60) / 60;
+				min = ((ptr->expire - now.tv_sec) / 60) % 60;
+				sec = (ptr->expire - now.tv_sec) % 60;
+				Log("Update from %s, Expires in %d:%d:%d\n\t%s", inet_ntop(AF_INET, &ptr->cli.sin_addr, addrbuf, 16), hr, min, sec,
+					GetRRDisplayString_rdb(&ptr->rr.resrec, &ptr->rr.resrec.rdata->u, rrbuf));
+				}
 			}
+		pthread_mutex_unlock(&s->lock);
 		}
-	pthread_mutex_unlock(&d->tablelock);
 	}
 
 //
@@ -893,20 +1173,15 @@ mDNSlocal mDNSu8 *PutUpdateSRV(DaemonInfo *d, DNSZone * zone, PktMsg *pkt, mDNSu
 // specify deletion by passing false for the register parameter, otherwise register the records.
 mDNSlocal int UpdateSRV(DaemonInfo *d, mDNSBool registration)
 	{
-	TCPSocket *sock = NULL;
 	DNSZone * zone;
 	int err = mStatus_NoError;
 
-	sock = ConnectToServer( d );
-	require_action( sock, exit, err = mStatus_UnknownErr; Log( "UpdateSRV: ConnectToServer failed" ) );
-
 	for ( zone = d->zones; zone; zone = zone->next )
 		{
 		PktMsg pkt;
 		mDNSu8 *ptr = pkt.msg.data;
 		mDNSu8 *end = (mDNSu8 *)&pkt.msg + sizeof(DNSMessage);
 		PktMsg *reply = NULL;
-		mDNSBool closed;
 		mDNSBool ok;
 
 		// Initialize message
@@ -965,11 +1240,8 @@ mDNSlocal int UpdateSRV(DaemonInfo *d, mDNSBool registration)
 	
 		// send message, receive reply
 
-		err = SendPacket( sock, &pkt );
-		require_action( !err, exit, Log( "UpdateSRV: SendPacket failed" ) );
-
-		reply = RecvPacket( sock, NULL, &closed );
-		require_action( reply, exit, err = mStatus_UnknownErr; Log( "UpdateSRV: RecvPacket returned NULL" ) );
+		reply = UpstreamTransaction( d, &pkt, NULL );
+		require_action( reply, exit, err = mStatus_UnknownErr; Log( "UpdateSRV: UpstreamTransaction failed" ) );
 
 		ok = SuccessfulUpdateTransaction( &pkt, reply );
 
@@ -978,16 +1250,11 @@ mDNSlocal int UpdateSRV(DaemonInfo *d, mDNSBool registration)
 			Log("SRV record registration failed with rcode %d", reply->msg.h.flags.b[1] & kDNSFlag1_RC_Mask);
 			}
 
-		free( reply );
+		PoolFree( reply );
 		}
 	
 exit:
 
-	if ( sock )
-		{
-		mDNSPlatformTCPCloseConnection( sock );
-		}
-
 	return err;
 	}
 
@@ -1081,6 +1348,11 @@ mDNSlocal int ProcessArgs(int argc, char *argv[], DaemonInfo *d)
 	d->private_port = PrivateDNSPort;
 	d->llq_port     = DNSEXTPort;
 
+	// setup our worker pool
+
+	d->worker_threads = WORKER_THREADS;
+	d->queue_length   = QUEUE_LENGTH;
+
 	while ((opt = getopt(argc, argv, "f:hdv")) != -1)
 		{
 		switch(opt)
@@ -1126,15 +1398,136 @@ arg_error:
 // Allocate memory, initialize locks and bookkeeping variables
 mDNSlocal int InitLeaseTable(DaemonInfo *d)
 	{
-	if (pthread_mutex_init(&d->tablelock, NULL)) { LogErr("InitLeaseTable", "pthread_mutex_init"); return -1; }
-	d->nbuckets = LEASETABLE_INIT_NBUCKETS;
-	d->nelems = 0;
-	d->table = malloc(sizeof(RRTableElem *) * LEASETABLE_INIT_NBUCKETS);
-	if (!d->table) { LogErr("InitLeaseTable", "malloc"); return -1; }
-	mDNSPlatformMemZero(d->table, sizeof(RRTableElem *) * LEASETABLE_INIT_NBUCKETS);
+	int n;
+	if (pthread_mutex_init(&d->changelock, NULL)) { LogErr("InitLeaseTable", "pthread_mutex_init"); return -1; }
+	for (n = 0; n < LEASETABLE_NSHARDS; n++)
+		{
+		LeaseShard *s = &d->shards[n];
+		if (pthread_mutex_init(&s->lock, NULL)) { LogErr("InitLeaseTable", "pthread_mutex_init"); return -1; }
+		s->nbuckets = LEASETABLE_INIT_NBUCKETS / LEASETABLE_NSHARDS;
+		s->nelems = 0;
+		s->table = malloc(sizeof(RRTableElem *) * s->nbuckets);
+		if (!s->table) { LogErr("InitLeaseTable", "malloc"); return -1; }
+		mDNSPlatformMemZero(s->table, sizeof(RRTableElem *) * s->nbuckets);
+		s->heapsize = s->nbuckets;
+		s->expiry = malloc(sizeof(RRTableElem *) * s->heapsize);
+		if (!s->expiry) { LogErr("InitLeaseTable", "malloc"); return -1; }
+		}
+	return 0;
+	}
+
+//
+// Worker Pool Routines
+// Requests are handed to a fixed set of threads through a bounded circular queue.  The main thread is
+// the only producer; when the queue is full the caller decides whether to refuse the request or run it itself.
+//
+
+mDNSlocal void *WorkerThread(void *arg)
+	{
+	DaemonInfo *d = (DaemonInfo *)arg;
+	WorkItem item;
+
+	pthread_mutex_lock(&d->queuelock);
+	while (1)
+		{
+		while (!d->queuecount && !d->queueshutdown) pthread_cond_wait(&d->queuenotempty, &d->queuelock);
+		if (!d->queuecount) break;  // shutting down and nothing left to do
+
+		item = d->queue[d->queuehead];
+		d->queuehead = (d->queuehead + 1) % d->queuecapacity;
+		d->queuecount--;
+		pthread_mutex_unlock(&d->queuelock);
+
+		item.callback(item.context);
+
+		pthread_mutex_lock(&d->queuelock);
+		d->processed++;
+		}
+	pthread_mutex_unlock(&d->queuelock);
+	return NULL;
+	}
+
+// Returns mDNSfalse if the queue is full, in which case ownership of context stays with the caller
+mDNSlocal mDNSBool QueueWork(DaemonInfo *d, WorkCallback callback, void *context)
+	{
+	mDNSBool queued = mDNSfalse;
+
+	pthread_mutex_lock(&d->queuelock);
+	if (d->nworkers && d->queuecount < d->queuecapacity)
+		{
+		WorkItem *item = &d->queue[(d->queuehead + d->queuecount) % d->queuecapacity];
+		item->callback = callback;
+		item->context  = context;
+		d->queuecount++;
+		d->queued++;
+		if (d->queuecount > d->queuehighwater) d->queuehighwater = d->queuecount;
+		pthread_cond_signal(&d->queuenotempty);
+		queued = mDNStrue;
+		}
+	pthread_mutex_unlock(&d->queuelock);
+	return queued;
+	}
+
+mDNSlocal int StartWorkerPool(DaemonInfo *d)
+	{
+	int i;
+
+	if (d->worker_threads < 1) d->worker_threads = 1;
+	if (d->queue_length   < 1) d->queue_length   = 1;
+
+	if (pthread_mutex_init(&d->queuelock, NULL))    { LogErr("StartWorkerPool", "pthread_mutex_init"); return -1; }
+	if (pthread_cond_init(&d->queuenotempty, NULL)) { LogErr("StartWorkerPool", "pthread_cond_init");  return -1; }
+	if (pthread_cond_init(&d->queueidle, NULL))     { LogErr("StartWorkerPool", "pthread_cond_init");  return -1; }
+
+	d->queuecapacity = d->queue_length;
+	d->queue = malloc(sizeof(WorkItem) * d->queuecapacity);
+	if (!d->queue) { LogErr("StartWorkerPool", "malloc"); return -1; }
+	d->workers = malloc(sizeof(pthread_t) * d->worker_threads);
+	if (!d->workers) { LogErr("StartWorkerPool", "malloc"); return -1; }
+
+	for (i = 0; i < d->worker_threads; i++)
+		{
+		if (pthread_create(&d->workers[i], NULL, WorkerThread, d)) { LogErr("StartWorkerPool", "pthread_create"); break; }
+		d->nworkers++;
+		}
+	if (!d->nworkers) return -1;
+
+	VLog("Started %d worker threads, queue length %d", d->nworkers, d->queuecapacity);
 	return 0;
 	}
 
+// Lets the workers finish whatever is already queued, then waits for them to exit
+mDNSlocal void StopWorkerPool(DaemonInfo *d)
+	{
+	int i, n;
+
+	if (!d->workers) return;
+
+	pthread_mutex_lock(&d->queuelock);
+	d->queueshutdown = mDNStrue;
+	n = d->nworkers;
+	pthread_cond_broadcast(&d->queuenotempty);
+	pthread_mutex_unlock(&d->queuelock);
+
+	for (i = 0; i < n; i++)
+		if (pthread_join(d->workers[i], NULL)) LogErr("StopWorkerPool", "pthread_join");
+
+	d->nworkers = 0;
+	free(d->workers);
+	free(d->queue);
+	d->workers = NULL;
+	d->queue = NULL;
+	}
+
+mDNSlocal void PrintWorkerStats(DaemonInfo *d)
+	{
+	pthread_mutex_lock(&d->queuelock);
+	Log("Worker pool: %d threads, %d of %d queued (high water %d)", d->nworkers, d->queuecount, d->queuecapacity, d->queuehighwater);
+	Log("Worker pool: %u requests queued, %u processed, %u refused with SERVFAIL, %u dropped",
+		d->queued, d->processed, d->servfail, d->dropped);
+	pthread_mutex_unlock(&d->queuelock);
+	}
+
 
 mDNSlocal int
 SetupSockets
@@ -1261,20 +1654,92 @@ exit:
 	return err;
 	}
 
+//
+// Zone Change Tracking
+// The rrsets touched by each update we forward are remembered, so that GenLLQEvents only has to
+// re-query the answer lists those changes could affect
+//
+
+// wake the main thread so it generates LLQ events
+mDNSlocal void SignalLLQEvents(DaemonInfo *d)
+	{
+	char pingmsg[4] = { 0, 0, 0, 0 };
+
+	if ( send( d->LLQEventNotifySock, pingmsg, sizeof( pingmsg ), 0 ) != sizeof( pingmsg ) )
+		{
+		LogErr("SignalLLQEvents", "send");
+		}
+	}
+
+// caller must lock changelock
+mDNSlocal void FreeChangeTable(DaemonInfo *d)
+	{
+	int i;
+	for (i = 0; i < LLQ_TABLESIZE; i++)
+		{
+		while (d->ChangeTable[i])
+			{
+			ChangedRRSet *c = d->ChangeTable[i];
+			d->ChangeTable[i] = c->next;
+			free(c);
+			}
+		}
+	d->ChangeCount = 0;
+	}
+
+// record that the rrset (name, type) has changed.  type kDNSQType_ANY means all rrsets at name.
+mDNSlocal void NoteChangedRRSet(DaemonInfo *d, const domainname *name, mDNSu16 type)
+	{
+	int bucket = DomainNameHashValue(name) % LLQ_TABLESIZE;
+	ChangedRRSet *c;
+
+	pthread_mutex_lock(&d->changelock);
+	if (d->ChangeAll) goto exit;
+
+	for (c = d->ChangeTable[bucket]; c; c = c->next)
+		if (SameDomainName(&c->name, name) && (c->type == type || c->type == kDNSQType_ANY)) goto exit;
+
+	if (d->ChangeCount >= MAX_CHANGED_RRSETS) { d->ChangeAll = mDNStrue; FreeChangeTable(d); goto exit; }
+	c = malloc(sizeof(*c));
+	if (!c) { LogErr("NoteChangedRRSet", "malloc"); d->ChangeAll = mDNStrue; FreeChangeTable(d); goto exit; }
+	AssignDomainName(&c->name, name);
+	c->type = type;
+	c->next = d->ChangeTable[bucket];
+	d->ChangeTable[bucket] = c;
+	d->ChangeCount++;
+
+	exit:
+	pthread_mutex_unlock(&d->changelock);
+	}
+
+// a change of unknown extent, e.g. a NOTIFY for an update made directly on the server
+mDNSlocal void NoteZoneChanged(DaemonInfo *d)
+	{
+	pthread_mutex_lock(&d->changelock);
+	d->ChangeAll = mDNStrue;
+	FreeChangeTable(d);
+	pthread_mutex_unlock(&d->changelock);
+	}
+
+// could a change to the rrset (name, type) alter the answers to question a?
+mDNSlocal mDNSBool ChangeAffectsAnswers(const ChangedRRSet *c, const AnswerListElem *a)
+	{
+	if (!SameDomainName(&c->name, &a->name)) return mDNSfalse;
+	return (c->type == a->type || c->type == kDNSQType_ANY || a->type == kDNSQType_ANY || c->type == kDNSType_CNAME);
+	}
+
 //
 // periodic table updates
 //
 
 // Delete a resource record from the nameserver via a dynamic update
-// sd is a socket already connected to the server
-mDNSlocal void DeleteOneRecord(DaemonInfo *d, CacheRecord *rr, domainname *zname, TCPSocket *sock)
+mDNSlocal void DeleteOneRecord(DaemonInfo *d, CacheRecord *rr, domainname *zname)
 	{
 	DNSZone	*	zone;
 	PktMsg pkt;
 	mDNSu8 *ptr = pkt.msg.data;
 	mDNSu8 *end = (mDNSu8 *)&pkt.msg + sizeof(DNSMessage);
 	char buf[MaxMsg];
-	mDNSBool closed;
 	PktMsg *reply = NULL;
 
 	VLog("Expiring record %s", GetRRDisplayString_rdb(&rr->resrec, &rr->resrec.rdata->u, buf));
@@ -1299,49 +1764,56 @@ mDNSlocal void DeleteOneRecord(DaemonInfo *d, CacheRecord *rr, domainname *zname
 	pkt.len = ptr - (mDNSu8 *)&pkt.msg;
 	pkt.src.sin_addr.s_addr = zerov4Addr.NotAnInteger; // address field set solely for verbose logging in subroutines
 	pkt.src.sin_family = AF_INET;
-	if (SendPacket( sock, &pkt)) { Log("DeleteOneRecord: SendPacket failed"); }
-	reply = RecvPacket( sock, NULL, &closed );
+	reply = UpstreamTransaction( d, &pkt, NULL );
 	if (reply) HdrNToH(reply);
-	require_action( reply, end, Log( "DeleteOneRecord: RecvPacket returned NULL" ) );
+	require_action( reply, end, Log( "DeleteOneRecord: UpstreamTransaction failed" ) );
 
 	if (!SuccessfulUpdateTransaction(&pkt, reply))
 		Log("Expiration update failed with rcode %d", reply ? reply->msg.h.flags.b[1] & kDNSFlag1_RC_Mask : -1);
 					  
 	end:
 	if (!ptr) { Log("DeleteOneRecord: Error constructing lease expiration update"); }
-	if (reply) free(reply);
+	if (reply) PoolFree(reply);
 	}
 
-// iterate over table, deleting expired records (or all records if DeleteAll is true)
+// remove expired records (or all records if DeleteAll is true) from the table and the server
 mDNSlocal void DeleteRecords(DaemonInfo *d, mDNSBool DeleteAll)
 	{
 	struct timeval now;
-	int i;
-	TCPSocket *sock = ConnectToServer(d);
-	if (!sock) { Log("DeleteRecords: ConnectToServer failed"); return; }
+	int n;
+	mDNSBool deleted = mDNSfalse;
 	if (gettimeofday(&now, NULL)) { LogErr("DeleteRecords ", "gettimeofday"); return; }
-	if (pthread_mutex_lock(&d->tablelock)) { LogErr("DeleteRecords", "pthread_mutex_lock"); return; }
 
-	for (i = 0; i < d->nbuckets; i++)
+	for (n = 0; n < LEASETABLE_NSHARDS; n++)
 		{
-		RRTableElem **ptr = &d->table[i];
-		while (*ptr)
+		LeaseShard *s = &d->shards[n];
+		RRTableElem *expired = NULL, *fptr, **ptr;
+		if (pthread_mutex_lock(&s->lock)) { LogErr("DeleteRecords", "pthread_mutex_lock"); return; }
+		while (s->nelems && (DeleteAll || s->expiry[1]->expire - now.tv_sec < 0))
 			{
-			if (DeleteAll || (*ptr)->expire - now.tv_sec < 0)
-				{
-				RRTableElem *fptr;
-				// delete record from server
-				DeleteOneRecord(d, &(*ptr)->rr, &(*ptr)->zone, sock);
-				fptr = *ptr;
-				*ptr = (*ptr)->next;
-				free(fptr);
-				d->nelems--;
-				}
-			else ptr = &(*ptr)->next;
+			fptr = s->expiry[1];
+			HeapRemove(s, fptr);
+			for (ptr = &s->table[BucketForName(s, fptr->rr.resrec.namehash)]; *ptr != fptr; ptr = &(*ptr)->next) continue;
+			*ptr = fptr->next;
+			fptr->next = expired;
+			expired = fptr;
+			}
+		pthread_mutex_unlock(&s->lock);
+
+		// delete records from server only after releasing the shard, so updates to its names don't wait on the network
+		while (expired)
+			{
+			fptr = expired;
+			expired = fptr->next;
+			DeleteOneRecord(d, &fptr->rr, &fptr->zone);
+			NoteChangedRRSet(d, fptr->rr.resrec.name, fptr->rr.resrec.rrtype);
+			deleted = mDNStrue;
+			PoolFree(fptr);
 			}
 		}
-	pthread_mutex_unlock(&d->tablelock);
-	mDNSPlatformTCPCloseConnection( sock );
+
+	// LLQ clients see expired records go away
+	if (deleted && !DeleteAll) SignalLLQEvents(d);
 	}
 
 //
@@ -1352,15 +1824,17 @@ mDNSlocal void DeleteRecords(DaemonInfo *d, mDNSBool DeleteAll)
 mDNSlocal void UpdateLeaseTable(PktMsg *pkt, DaemonInfo *d, mDNSs32 lease)
 	{
 	RRTableElem **rptr, *tmp;
-	int i, allocsize, bucket;
+	int i, n, allocsize;
 	LargeCacheRecord lcr;
 	ResourceRecord *rr = &lcr.r.resrec;
-	const mDNSu8 *ptr, *end;
+	const mDNSu8 *ptr, *end, *updates;
 	struct timeval tv;
 	DNSQuestion zone;
 	char buf[MaxMsg];
+	LeaseShard *s;
+	mDNSBool locked[LEASETABLE_NSHARDS];
 	
-	if (pthread_mutex_lock(&d->tablelock)) { LogErr("UpdateLeaseTable", "pthread_mutex_lock"); return; }
+	mDNSPlatformMemZero(locked, sizeof(locked));
 	HdrNToH(pkt);
 	ptr = pkt->msg.data;
 	end = (mDNSu8 *)&pkt->msg + pkt->len;
@@ -1368,15 +1842,34 @@ mDNSlocal void UpdateLeaseTable(PktMsg *pkt, DaemonInfo *d, mDNSs32 lease)
 	if (!ptr) { Log("UpdateLeaseTable: cannot read zone");  goto cleanup; }
 	ptr = LocateAuthorities(&pkt->msg, end);
 	if (!ptr) { Log("UpdateLeaseTable: Format error");  goto cleanup; }
-	
+	updates = ptr;
+
+	// lock every shard holding a name in this update, in shard order, so the whole update is applied at once
+	// (and two updates can't deadlock); updates for names in other shards still proceed in parallel
+	for (i = 0; i < pkt->msg.h.mDNS_numUpdates; i++)
+		{
+		ptr = GetLargeResourceRecord(NULL, &pkt->msg, ptr, end, 0, kDNSRecordTypePacketAns, &lcr);
+		if (!ptr) { Log("UpdateLeaseTable: GetLargeResourceRecord returned NULL"); goto cleanup; }
+		locked[ShardForName(d, rr->namehash) - d->shards] = mDNStrue;
+		}
+	for (n = 0; n < LEASETABLE_NSHARDS; n++)
+		if (locked[n] && pthread_mutex_lock(&d->shards[n].lock))
+			{
+			LogErr("UpdateLeaseTable", "pthread_mutex_lock");
+			while (n < LEASETABLE_NSHARDS) locked[n++] = mDNSfalse;
+			goto cleanup;
+			}
+
+	ptr = updates;
 	for (i = 0; i < pkt->msg.h.mDNS_numUpdates; i++)
 		{
 		mDNSBool DeleteAllRRSets = mDNSfalse, DeleteOneRRSet = mDNSfalse, DeleteOneRR = mDNSfalse;
 		
 		ptr = GetLargeResourceRecord(NULL, &pkt->msg, ptr, end, 0, kDNSRecordTypePacketAns, &lcr);
 		if (!ptr) { Log("UpdateLeaseTable: GetLargeResourceRecord returned NULL"); goto cleanup; }
-		bucket = rr->namehash % d->nbuckets;
-		rptr = &d->table[bucket];
+
+		s = ShardForName(d, rr->namehash);
+		rptr = &s->table[BucketForName(s, rr->namehash)];
 
 		// handle deletions		
 		if (rr->rrtype == kDNSQType_ANY && !rr->rroriginalttl && rr->rrclass == kDNSQClass_ANY && !rr->rdlength)
@@ -1386,6 +1879,8 @@ mDNSlocal void UpdateLeaseTable(PktMsg *pkt, DaemonInfo *d, mDNSs32 lease)
 		else if (!rr->rroriginalttl && rr->rrclass == kDNSClass_NONE)
 			DeleteOneRR = mDNStrue;
 
+		NoteChangedRRSet(d, rr->name, DeleteAllRRSets ? kDNSQType_ANY : rr->rrtype);
+
 		if (DeleteAllRRSets || DeleteOneRRSet || DeleteOneRR)
 			{
 			while (*rptr)
@@ -1398,8 +1893,8 @@ mDNSlocal void UpdateLeaseTable(PktMsg *pkt, DaemonInfo *d, mDNSs32 lease)
 				  tmp = *rptr;
 				  VLog("Received deletion update for %s", GetRRDisplayString_rdb(&tmp->rr.resrec, &tmp->rr.resrec.rdata->u, buf));
 				  *rptr = (*rptr)->next;
-				  free(tmp);
-				  d->nelems--;
+				  HeapRemove(s, tmp);
+				  PoolFree(tmp);
 				  }
 			  else rptr = &(*rptr)->next;
 			  }
@@ -1413,21 +1908,17 @@ mDNSlocal void UpdateLeaseTable(PktMsg *pkt, DaemonInfo *d, mDNSs32 lease)
 				// refresh
 				if (gettimeofday(&tv, NULL)) { LogErr("UpdateLeaseTable", "gettimeofday"); goto cleanup; }
 				(*rptr)->expire = tv.tv_sec + (unsigned)lease;
+				HeapUpdate(s, *rptr);
 				VLog("Refreshing lease for %s", GetRRDisplayString_rdb(&lcr.r.resrec, &lcr.r.resrec.rdata->u, buf));
 				}
 			else
 				{
 				// New record - add to table
-				if (d->nelems > d->nbuckets)
-					{
-					RehashTable(d);
-					bucket = rr->namehash % d->nbuckets;
-					rptr = &d->table[bucket];
-					}
+				if (s->nelems > s->nbuckets) RehashTable(s);
 				if (gettimeofday(&tv, NULL)) { LogErr("UpdateLeaseTable", "gettimeofday"); goto cleanup; }
 				allocsize = sizeof(RRTableElem);
 				if (rr->rdlength > InlineCacheRDSize) allocsize += (rr->rdlength - InlineCacheRDSize);
-				tmp = malloc(allocsize);
+				tmp = PoolAllocate(allocsize);
 				if (!tmp) { LogErr("UpdateLeaseTable", "malloc"); goto cleanup; }
 				memcpy(&tmp->rr, &lcr.r, sizeof(CacheRecord) + rr->rdlength - InlineCacheRDSize);
 				tmp->rr.resrec.rdata = (RData *)&tmp->rr.smallrdatastorage;
@@ -1436,16 +1927,17 @@ mDNSlocal void UpdateLeaseTable(PktMsg *pkt, DaemonInfo *d, mDNSs32 lease)
 				tmp->expire = tv.tv_sec + (unsigned)lease;
 				tmp->cli.sin_addr = pkt->src.sin_addr;
 				AssignDomainName(&tmp->zone, &zone.qname);
-				tmp->next = d->table[bucket];
-				d->table[bucket] = tmp;
-				d->nelems++;
+				if (!HeapInsert(s, tmp)) { PoolFree(tmp); goto cleanup; }
+				rptr = &s->table[BucketForName(s, rr->namehash)];
+				tmp->next = *rptr;
+				*rptr = tmp;
 				VLog("Adding update for %s to lease table", GetRRDisplayString_rdb(&lcr.r.resrec, &lcr.r.resrec.rdata->u, buf));
 				}
 			}
 		}
 					
 	cleanup:
-	pthread_mutex_unlock(&d->tablelock);
+	for (n = LEASETABLE_NSHARDS - 1; n >= 0; n--) if (locked[n]) pthread_mutex_unlock(&d->shards[n].lock);
 	HdrHToN(pkt);
 	}
 
@@ -1458,7 +1950,7 @@ mDNSlocal PktMsg *FormatLeaseReply(DaemonInfo *d, PktMsg *orig, mDNSu32 lease)
 	mDNSOpaque16 flags;
 
 	(void)d;  //unused
-	reply = malloc(sizeof(*reply));
+	reply = PoolAllocate(sizeof(*reply));
 	if (!reply) { LogErr("FormatLeaseReply", "malloc"); return NULL; }
 	flags.b[0] = kDNSFlag0_QR_Response | kDNSFlag0_OP_Update;
 	flags.b[1] = 0;
@@ -1469,7 +1961,7 @@ mDNSlocal PktMsg *FormatLeaseReply(DaemonInfo *d, PktMsg *orig, mDNSu32 lease)
 	ptr = reply->msg.data;
 	end = (mDNSu8 *)&reply->msg + sizeof(DNSMessage);
 	ptr = putUpdateLease(&reply->msg, ptr, lease);
-	if (!ptr) { Log("FormatLeaseReply: putUpdateLease failed"); free(reply); return NULL; }
+	if (!ptr) { Log("FormatLeaseReply: putUpdateLease failed"); PoolFree(reply); return NULL; }
 	reply->len = ptr - (mDNSu8 *)&reply->msg;
 	HdrHToN(reply);
 	return reply;
@@ -1489,7 +1981,6 @@ HandleRequest
 	PktMsg		*	leaseReply;
 	PktMsg	 		buf;
 	char			addrbuf[32];
-	TCPSocket *	sock = NULL;
 	mStatus			err;
 	mDNSs32		lease = 0;
 	if ((request->msg.h.flags.b[0] & kDNSFlag0_QROP_Mask) == kDNSFlag0_OP_Update)
@@ -1510,7 +2001,7 @@ HandleRequest
 			{
 			static const mDNSOpaque16 UpdateRefused = { { kDNSFlag0_QR_Response | kDNSFlag0_OP_Update, kDNSFlag1_RC_Refused } };
 			Log("Rejecting Update Request with %d additions but no lease", adds);
-			reply = malloc(sizeof(*reply));
+			reply = PoolAllocate(sizeof(*reply));
 			mDNSPlatformMemZero(&reply->src, sizeof(reply->src));
 			reply->len = sizeof(DNSMessageHeader);
 			reply->zone = NULL;
@@ -1543,16 +2034,8 @@ HandleRequest
 	
 	if ( !reply )
 		{
-		mDNSBool closed;
-		int res;
-
-		sock = ConnectToServer( self );
-		require_action_quiet( sock, exit, err = mStatus_UnknownErr ; Log( "Discarding request from %s due to connection errors", inet_ntop( AF_INET, &request->src.sin_addr, addrbuf, 32 ) ) );
-
-		res = SendPacket( sock, request );
-		require_action_quiet( res >= 0, exit, err = mStatus_UnknownErr ; Log( "Couldn't relay message from %s to server.  Discarding.", inet_ntop(AF_INET, &request->src.sin_addr, addrbuf, 32 ) ) );
-
-		reply = RecvPacket( sock, &buf, &closed );
+		reply = UpstreamTransaction( self, request, &buf );
+		require_action_quiet( reply, exit, err = mStatus_UnknownErr ; Log( "Couldn't relay message from %s to server.  Discarding.", inet_ntop(AF_INET, &request->src.sin_addr, addrbuf, 32 ) ) );
 		}
 	
 	// IMPORTANT: reply is in network byte order at this point in the code
@@ -1562,7 +2045,6 @@ HandleRequest
 
 	if ( reply && ( ( reply->msg.h.flags.b[0] & kDNSFlag0_QROP_Mask ) == ( kDNSFlag0_OP_Update | kDNSFlag0_QR_Response ) ) )
 		{
-		char 		pingmsg[4];
 		mDNSBool	ok = SuccessfulUpdateTransaction( request, reply );
 		require_action( ok, exit, err = mStatus_UnknownErr; VLog( "Message from %s not a successful update.", inet_ntop(AF_INET, &request->src.sin_addr, addrbuf, 32 ) ) );
 
@@ -1583,22 +2065,14 @@ HandleRequest
 
 		// tell the main thread there was an update so it can send LLQs
 
-		if ( send( self->LLQEventNotifySock, pingmsg, sizeof( pingmsg ), 0 ) != sizeof( pingmsg ) )
-			{
-			LogErr("HandleRequest", "send");
-			}
+		SignalLLQEvents( self );
 		}
 
 exit:
 
-	if ( sock )
-		{
-		mDNSPlatformTCPCloseConnection( sock );
-		}
-
 	if ( reply == &buf )
 		{
-		reply = malloc( sizeof( *reply ) );
+		reply = PoolAllocate( sizeof( *reply ) );
 
 		if ( reply )
 			{
@@ -1717,7 +2191,6 @@ mDNSlocal CacheRecord *AnswerQuestion(DaemonInfo *d, AnswerListElem *e)
 	{
 	PktMsg q;
 	int i;
-	TCPSocket *sock = NULL;
 	const mDNSu8 *ansptr;
 	mDNSu8 *end = q.msg.data;
 	PktMsg buf, *reply = NULL;
@@ -1748,14 +2221,8 @@ mDNSlocal CacheRecord *AnswerQuestion(DaemonInfo *d, AnswerListElem *e)
 	
 	if (!reply)
 		{
-		mDNSBool closed;
-
-		sock = ConnectToServer(d);
-		if (!sock) { Log("AnswerQuestion: ConnectToServer failed"); goto end; }
-		if (SendPacket( sock, &q)) { Log("AnswerQuestion: SendPacket failed"); mDNSPlatformTCPCloseConnection( sock ); goto end; }
-		reply = RecvPacket( sock, NULL, &closed );
-		mDNSPlatformTCPCloseConnection( sock );
-		require_action( reply, end, Log( "AnswerQuestion: RecvPacket returned NULL" ) );
+		reply = UpstreamTransaction(d, &q, NULL);
+		require_action( reply, end, Log( "AnswerQuestion: UpstreamTransaction failed" ) );
 		}
 
 	HdrNToH(&q);
@@ -1789,16 +2256,17 @@ mDNSlocal CacheRecord *AnswerQuestion(DaemonInfo *d, AnswerListElem *e)
 		}
 	
 	end:
-	if (reply && reply != &buf) free(reply);
+	if (reply && reply != &buf) PoolFree(reply);
 	return AnswerList;
 	}
 
-// Routine forks a thread to set EventList to contain Add/Remove events, and deletes any removes from the KnownAnswer list
-mDNSlocal void *UpdateAnswerList(void *args)
+// Routine runs on a worker thread to set EventList to contain Add/Remove events, and deletes any removes from the KnownAnswer list
+mDNSlocal void UpdateAnswerList(void *args)
 	{
 	CacheRecord *cr, *NewAnswers, **na, **ka; // "new answer", "known answer"
 	DaemonInfo *d = ((UpdateAnswerListArgs *)args)->d;
 	AnswerListElem *a = ((UpdateAnswerListArgs *)args)->a;
+	int *pending = ((UpdateAnswerListArgs *)args)->pending;
 
 	free(args);
 	args = NULL;
@@ -1859,8 +2327,11 @@ mDNSlocal void *UpdateAnswerList(void *args)
 		NewAnswers = NewAnswers->next;
 		free(cr);
 		}
-	
-	return NULL;
+
+	// tell GenLLQEvents this list is up to date
+	pthread_mutex_lock(&d->queuelock);
+	if (--(*pending) == 0) pthread_cond_signal(&d->queueidle);
+	pthread_mutex_unlock(&d->queuelock);
 	}
 
 mDNSlocal void SendEvents(DaemonInfo *d, LLQEntry *e)
@@ -1956,36 +2427,60 @@ mDNSlocal void GenLLQEvents(DaemonInfo *d)
 	int i;
 	struct timeval t;
 	UpdateAnswerListArgs *args;
+	int pending = 1;  // held by this routine until every list has been handed out
+	static ChangedRRSet *changes[LLQ_TABLESIZE];
+	mDNSBool all;
+	int nchanges;
 	
-	VLog("Generating LLQ Events");
-
 	gettimeofday(&t, NULL);
 
-	// get all answers up to date
+	// take the set of changes since the last run, leaving an empty one for the update handlers
+	pthread_mutex_lock(&d->changelock);
+	memcpy(changes, d->ChangeTable, sizeof(changes));
+	mDNSPlatformMemZero(d->ChangeTable, sizeof(d->ChangeTable));
+	all = d->ChangeAll;
+	nchanges = d->ChangeCount;
+	d->ChangeAll = mDNSfalse;
+	d->ChangeCount = 0;
+	pthread_mutex_unlock(&d->changelock);
+
+	if (all) VLog("Generating LLQ Events for all questions");
+	else VLog("Generating LLQ Events for %d changed rrsets", nchanges);
+
+	// bring the affected answer lists up to date, in parallel on the worker pool.  If the pool is backed up
+	// with requests we do the update ourselves rather than drop it.  Changes and answer lists are hashed
+	// alike, so only the buckets that saw changes need looking at.
 	for (i = 0; i < LLQ_TABLESIZE; i++)
 		{
-		AnswerListElem *a = d->AnswerTable[i];
-		while(a)
+		AnswerListElem *a = (all || changes[i]) ? d->AnswerTable[i] : NULL;
+		for (; a; a = a->next)
 			{
+			ChangedRRSet *c;
+			for (c = changes[i]; c && !ChangeAffectsAnswers(c, a); c = c->next) continue;
+			if (!all && !c) continue;
+
 			args = malloc(sizeof(*args));
-			if (!args) { LogErr("GenLLQEvents", "malloc"); return; }
+			if (!args) { LogErr("GenLLQEvents", "malloc"); break; }
 			args->d = d;
 			args->a = a;
-			if (pthread_create(&a->tid, NULL, UpdateAnswerList, args) < 0) { LogErr("GenLLQEvents", "pthread_create"); return; }
-			usleep(1);
-			a = a->next;
+			args->pending = &pending;
+			pthread_mutex_lock(&d->queuelock);
+			pending++;
+			pthread_mutex_unlock(&d->queuelock);
+			if (!QueueWork(d, UpdateAnswerList, args)) UpdateAnswerList(args);
 			}
-		}
-
-	for (i = 0; i < LLQ_TABLESIZE; i++)
-		{
-		AnswerListElem *a = d->AnswerTable[i];
-		while(a)
+		while (changes[i])
 			{
-			if (pthread_join(a->tid, NULL)) LogErr("GenLLQEvents", "pthread_join");
-			a = a->next;
+			ChangedRRSet *c = changes[i];
+			changes[i] = c->next;
+			free(c);
 			}
 		}
+
+	pthread_mutex_lock(&d->queuelock);
+	pending--;
+	while (pending) pthread_cond_wait(&d->queueidle, &d->queuelock);
+	pthread_mutex_unlock(&d->queuelock);
 	
     // for each established LLQ, send events
 	for (i = 0; i < LLQ_TABLESIZE; i++)
@@ -2287,6 +2782,11 @@ RecvNotify
 	res = sendto( d->udpsd, &pkt->msg, pkt->len, 0, ( struct sockaddr* ) &pkt->src, sizeof( pkt->src ) );
 	require_action( res == ( int ) pkt->len, exit, err = mStatus_UnknownErr; LogErr( "RecvNotify", "sendto" ) );
 
+	// The zone was changed behind our back, so we don't know which rrsets to check
+
+	NoteZoneChanged( d );
+	SignalLLQEvents( d );
+
 exit:
 
 	return err;
@@ -2495,9 +2995,9 @@ exit:
 	}
 
 // request handler wrappers for TCP and UDP requests
-// (read message off socket, fork thread that invokes main processing routine and handles cleanup)
+// (read message off socket, queue work item that invokes main processing routine and handles cleanup)
 
-mDNSlocal void*
+mDNSlocal void
 UDPMessageHandler
 	(
 	void * vptr
@@ -2521,14 +3021,10 @@ exit:
 
 	if ( reply )
 		{
-		free( reply );
+		PoolFree( reply );
 		}
 
 	free( context );
-
-	pthread_exit( NULL );
-
-	return NULL;
 	}
 
 
@@ -2540,7 +3036,6 @@ RecvUDPMessage
 	)
 	{
 	UDPContext		*	context = NULL;
-	pthread_t			tid;
 	mDNSu16				rcode;
 	mDNSu16				tcode;
 	DomainAuthInfo	*	key;
@@ -2592,10 +3087,27 @@ RecvUDPMessage
 			return 0;
 			}
 	
-		err = pthread_create( &tid, NULL, UDPMessageHandler, context );
-		require_action( !err, exit, LogErr( "RecvUDPMessage", "pthread_create" ) );
+		if ( !QueueWork( self, UDPMessageHandler, context ) )
+			{
+			// Overloaded.  Tell the client to try again rather than leave it waiting for a timeout
 
-		pthread_detach(tid);
+			PktMsg reply;
+			int    e;
+
+			memcpy( &reply, &context->pkt, sizeof( PktMsg ) );
+
+			reply.msg.h.flags.b[0]  =  kDNSFlag0_QR_Response | kDNSFlag0_RD;
+			reply.msg.h.flags.b[1]  =  kDNSFlag1_RA | kDNSFlag1_RC_ServFail;
+
+			e = sendto( sd, &reply.msg, reply.len, 0, ( struct sockaddr* ) &context->pkt.src, sizeof( context->pkt.src ) );
+
+			pthread_mutex_lock( &self->queuelock );
+			if ( e == ( int ) reply.len ) self->servfail++;
+			else self->dropped++;
+			pthread_mutex_unlock( &self->queuelock );
+
+			err = mStatus_NoMemoryErr;
+			}
 		}
 	else
 		{
@@ -2642,7 +3154,7 @@ FreeTCPContext
 	}
 
 
-mDNSlocal void*
+mDNSlocal void
 TCPMessageHandler
 	(
 	void * vptr
@@ -2670,10 +3182,8 @@ exit:
 
 	if ( reply )
 		{
-		free( reply );
+		PoolFree( reply );
 		}
-
-	pthread_exit(NULL);
 	}
 
 
@@ -2686,7 +3196,6 @@ RecvTCPMessage
 	TCPContext		*	context = ( TCPContext* ) param;
 	mDNSu16				rcode;
 	mDNSu16				tcode;
-	pthread_t			tid;
 	DomainAuthInfo	*	key;
 	PktMsg			*	pkt;
 	mDNSBool			closed;
@@ -2723,22 +3232,30 @@ RecvTCPMessage
 				// LLQ messages handled by main thread
 				RecvLLQ( context->d, &context->pkt, context->sock);
 				}
+			else if ( QueueWork( context->d, TCPMessageHandler, context ) )
+				{
+				// Let the worker free the context
+
+				freeContext = mDNSfalse;
+				}
 			else
 				{
-				err = pthread_create( &tid, NULL, TCPMessageHandler, context );
+				// Overloaded.  Refuse the request and close the connection
 
-				if ( err )
-					{
-					LogErr( "RecvTCPMessage", "pthread_create" );
-					err = mStatus_NoError;
-					goto exit;
-					}
+				PktMsg	reply;
+				int		e;
 
-				// Let the thread free the context
+				memcpy( &reply, &context->pkt, sizeof( PktMsg ) );
 
-				freeContext = mDNSfalse;
-					
-				pthread_detach(tid);
+				reply.msg.h.flags.b[0]  =  kDNSFlag0_QR_Response | kDNSFlag0_RD;
+				reply.msg.h.flags.b[1]  =  kDNSFlag1_RA | kDNSFlag1_RC_ServFail;
+
+				e = SendPacket( context->sock, &reply );
+
+				pthread_mutex_lock( &context->d->queuelock );
+				if ( e >= 0 ) context->d->servfail++;
+				else context->d->dropped++;
+				pthread_mutex_unlock( &context->d->queuelock );
 				}
 			}
 		else
@@ -2900,6 +3417,8 @@ mDNSlocal int Run(DaemonInfo *d)
 					PrintLeaseTable(d);
 					PrintLLQTable(d);
 					PrintLLQAnswers(d);
+					PrintWorkerStats(d);
+					LogPoolStatistics();
 					dumptable = 0;
 					}
 				else if (hangup)
@@ -2997,6 +3516,11 @@ exit:
 	}
 
 
+// Worker threads allocate packets and lease table entries from the shared memory pools
+mDNSlocal pthread_mutex_t PoolMutex = PTHREAD_MUTEX_INITIALIZER;
+mDNSlocal void PoolMutexLock(void)   { pthread_mutex_lock(&PoolMutex);   }
+mDNSlocal void PoolMutexUnlock(void) { pthread_mutex_unlock(&PoolMutex); }
+
 int main(int argc, char *argv[])
 	{
 	int started_via_launchd = 0;
@@ -3052,7 +3576,10 @@ int main(int argc, char *argv[])
 			}
 		}
 
+	SetPoolLockFunctions(PoolMutexLock, PoolMutexUnlock);
 	if (InitLeaseTable(d) < 0) { LogErr("main", "InitLeaseTable"); exit(1); }
+	if (InitUpstream(d) < 0) { LogErr("main", "InitUpstream"); exit(1); }
+	if (StartWorkerPool(d) < 0) { LogErr("main", "StartWorkerPool"); exit(1); }
 	if (SetupSockets(d) < 0) { LogErr("main", "SetupSockets"); exit(1); }
 	if (SetUpdateSRV(d) < 0) { LogErr("main", "SetUpdateSRV"); exit(1); }
 
@@ -3060,7 +3587,10 @@ int main(int argc, char *argv[])
 
 	Log("dnsextd stopping");
 
+	StopWorkerPool(d);
+
 	if (ClearUpdateSRV(d) < 0) { LogErr("main", "ClearUpdateSRV"); exit(1); }  // clear update srv's even if Run or pthread_create returns an error
+	CloseUpstream(d);
 	free(d);
 	exit(0);
 	}
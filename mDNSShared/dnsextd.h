@@ -29,6 +29,10 @@
 
 
 #define LLQ_TABLESIZE	1024	// !!!KRS make this dynamically growable
+#define LEASETABLE_NSHARDS	16	// lease table is split by name hash so updates to different names don't contend
+#define UPSTREAM_CONNECTIONS	4	// persistent TCP connections kept open to the real nameserver
+#define UPSTREAM_TIMEOUT		10	// seconds to wait for the nameserver's reply before failing the connection
+#define MAX_CHANGED_RRSETS	4096	// beyond this many changes between LLQ event runs, refresh every answer list
 
 
 typedef enum DNSZoneSpecType
@@ -64,11 +68,23 @@ typedef struct RRTableElem
     struct RRTableElem *next;
     struct sockaddr_in cli;   // client's source address
     long expire;              // expiration time, in seconds since epoch
+    mDNSs32 heapindex;        // position in the shard's expiry heap
     domainname zone;          // from zone field of update message
     domainname name;          // name of the record
     CacheRecord rr;           // last field in struct allows for allocation of oversized RRs
 	} RRTableElem;
 
+// one slice of the lease table
+typedef struct LeaseShard
+	{
+    pthread_mutex_t lock;     // mutex for this shard's hashtable and heap
+    RRTableElem **table;      // hashtable for records with leases
+    mDNSs32 nbuckets;         // buckets allocated
+    mDNSs32 nelems;           // elements in table
+    RRTableElem **expiry;     // 1-based min-heap of the same records, ordered by expire
+    mDNSs32 heapsize;         // slots allocated in expiry
+	} LeaseShard;
+
 typedef enum
 	{
 	RequestReceived = 0,
@@ -85,9 +101,16 @@ typedef struct AnswerListElem
     CacheRecord *EventList;     // New answers (adds/removes) to be sent to client
     int refcount;
     mDNSBool UseTCP;            // Use TCP if UDP would cause truncation
-    pthread_t tid;              // Allow parallel list updates
 	} AnswerListElem;
 
+// an rrset changed by an update since LLQ events were last generated
+typedef struct ChangedRRSet
+	{
+    struct ChangedRRSet *next;
+    domainname name;
+    mDNSu16 type;               // kDNSQType_ANY if every rrset at name may have changed
+	} ChangedRRSet;
+
 // llq table entry
 typedef struct LLQEntry
 	{
@@ -116,6 +139,42 @@ typedef struct EventSource
 	} EventSource;
 
 
+// unit of work handed to the worker pool
+
+typedef	void (*WorkCallback)( void * context );
+
+typedef struct WorkItem
+	{
+	WorkCallback			callback;
+	void				*	context;
+	} WorkItem;
+
+
+// a request waiting for its reply on an UpstreamConn
+typedef struct UpstreamRequest
+	{
+	struct UpstreamRequest	*	next;
+	mDNSOpaque16				id;			// message ID used on the wire, unique among the connection's pending requests
+	PktMsg					*	storage;	// where the caller wants the reply, or NULL to have one allocated
+	PktMsg					*	reply;		// set when answered; stays NULL if the connection failed
+	time_t						deadline;	// give up on the connection if we're not answered by then
+	mDNSBool					done;
+	} UpstreamRequest;
+
+// persistent, pipelined TCP connection to the real nameserver
+typedef struct UpstreamConn
+	{
+	pthread_mutex_t			lock;		// guards everything below; held while sending
+	pthread_cond_t			changed;	// broadcast when a reply is delivered, the reader gives up, or a connect finishes
+	TCPSocket			*	sock;		// NULL until first use, and after a failure
+	UpstreamRequest		*	pending;	// sent and not yet answered
+	mDNSu16					nextid;
+	mDNSBool				reading;	// a waiting thread is currently reading replies off sock
+	mDNSBool				broken;		// sock failed while being read; the reader will close it
+	mDNSBool				connecting;	// a thread is opening sock, without holding lock
+	} UpstreamConn;
+
+
 // daemon-wide information
 typedef struct 
 	{
@@ -134,12 +193,11 @@ typedef struct
     // daemon variables - read only after initialization (no locking)
     mDNSIPPort private_port;           // listening port for private messages
     mDNSIPPort llq_port;           // listening port for llq
+    int worker_threads;            // number of threads in the request handling pool
+    int queue_length;              // maximum number of requests waiting for a worker
 
-    // lease table variables (locked via mutex after initialization)
-    RRTableElem **table;       // hashtable for records with leases
-    pthread_mutex_t tablelock; // mutex for lease table
-    mDNSs32 nbuckets;          // buckets allocated
-    mDNSs32 nelems;            // elements in table
+    // lease table variables (each shard locked via its own mutex after initialization)
+    LeaseShard shards[LEASETABLE_NSHARDS];
 
     // LLQ table variables
     LLQEntry *LLQTable[LLQ_TABLESIZE];  // !!!KRS change this and RRTable to use a common data structure
@@ -148,7 +206,35 @@ typedef struct
     int LLQEventNotifySock;          // Unix domain socket pair - update handling thread writes to EventNotifySock, which wakes
     int LLQEventListenSock;          // the main thread listening on EventListenSock, indicating that the zone has changed
 
+    // zone changes not yet turned into LLQ events (locked via changelock after initialization)
+    pthread_mutex_t changelock;
+    ChangedRRSet *ChangeTable[LLQ_TABLESIZE];  // hashed like AnswerTable, so changes map straight to answer lists
+    int ChangeCount;
+    mDNSBool ChangeAll;              // change we can't attribute to particular rrsets (NOTIFY, overflow)
+
 	GenLinkedList	eventSources;	// linked list of EventSource's
+
+    // upstream connection variables (each connection locked via its own mutex after initialization)
+    UpstreamConn upstream[UPSTREAM_CONNECTIONS];
+    pthread_mutex_t upstreamlock;    // protects upstreamnext
+    unsigned int upstreamnext;       // round robin index into upstream
+
+    // worker pool variables (locked via queuelock after initialization)
+    pthread_t *workers;              // worker_threads threads, started by StartWorkerPool
+    int nworkers;                    // workers actually running
+    WorkItem *queue;                 // circular buffer of pending items
+    int queuecapacity;               // queue_length at startup; a SIGHUP doesn't resize the pool
+    int queuehead;                   // index of oldest pending item
+    int queuecount;                  // number of pending items
+    mDNSBool queueshutdown;          // set to make workers exit once the queue drains
+    pthread_mutex_t queuelock;
+    pthread_cond_t queuenotempty;    // signalled when work is queued or on shutdown
+    pthread_cond_t queueidle;        // signalled when a GenLLQEvents batch item completes
+    mDNSu32 queued;                  // requests handed to the pool
+    mDNSu32 processed;               // requests completed by the pool
+    mDNSu32 servfail;                // requests refused with SERVFAIL because the queue was full
+    mDNSu32 dropped;                 // requests discarded because the queue was full and no reply could be sent
+    int queuehighwater;              // largest queuecount seen
 	} DaemonInfo;
 
 
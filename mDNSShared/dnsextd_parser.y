@@ -104,6 +104,8 @@ SetupOptions
 %token	PORT 
 %token	ADDRESS 
 %token	LLQ 
+%token	WORKER_THREADS
+%token	QUEUE_LENGTH
 %token	PUBLIC
 %token  PRIVATE
 %token  ALLOWUPDATE
@@ -192,6 +194,16 @@ optionsstatement:
 		{
 			( ( DaemonInfo* ) context )->llq_port = mDNSOpaque16fromIntVal( NUMBER );
 		}
+		|
+		WORKER_THREADS NUMBER
+		{
+			( ( DaemonInfo* ) context )->worker_threads = $2;
+		}
+		|
+		QUEUE_LENGTH NUMBER
+		{
+			( ( DaemonInfo* ) context )->queue_length = $2;
+		}
 		;
 
 key_set:
@@ -208,11 +220,32 @@ key_set:
 				}
 
 			strncpy( keySpec->name, $2, sizeof( keySpec->name ) );
+			strncpy( keySpec->algorithm, "hmac-md5.sig-alg.reg.int.", sizeof( keySpec->algorithm ) );
 			strncpy( keySpec->secret, $5, sizeof( keySpec->secret ) );
 
 			keySpec->next	= g_keys;
 			g_keys			= keySpec;
         }
+        |
+        KEY QUOTEDSTRING OBRACE ALGORITHM QUOTEDSTRING SEMICOLON SECRET QUOTEDSTRING SEMICOLON EBRACE
+        {
+			KeySpec	* keySpec;
+
+			keySpec = ( KeySpec* ) malloc( sizeof( KeySpec ) );
+
+			if ( !keySpec )
+				{
+				LogMsg("ERROR: memory allocation failure");
+				YYABORT;
+				}
+
+			strncpy( keySpec->name, $2, sizeof( keySpec->name ) );
+			strncpy( keySpec->algorithm, $5, sizeof( keySpec->algorithm ) );
+			strncpy( keySpec->secret, $8, sizeof( keySpec->secret ) );
+
+			keySpec->next	= g_keys;
+			g_keys			= keySpec;
+        }
         ;
 
 zone_set:
@@ -480,6 +513,7 @@ ParseConfig
 				if ( strcmp( elem->string, keySpec->name ) == 0 )
 					{
 					DomainAuthInfo	*	authInfo = malloc( sizeof( DomainAuthInfo ) );
+					domainname			algorithm;
 					mDNSs32				keylen;
 					require_action( authInfo, exit, err = 1 );
 					memset( authInfo, 0, sizeof( DomainAuthInfo ) );
@@ -487,7 +521,10 @@ ParseConfig
 					ok = MakeDomainNameFromDNSNameString( &authInfo->keyname, keySpec->name );
 					if (!ok) { free(authInfo); err = 1; goto exit; }
 
-					keylen = DNSDigest_ConstructHMACKeyfromBase64( authInfo, keySpec->secret );
+					ok = MakeDomainNameFromDNSNameString( &algorithm, keySpec->algorithm );
+					if (!ok) { free(authInfo); err = 1; goto exit; }
+
+					keylen = DNSDigest_ConstructHMACKeyWithAlgorithm( authInfo, &algorithm, keySpec->secret );
 					if (keylen < 0) { free(authInfo); err = 1; goto exit; }
 
 					authInfo->next = zone->updateKeys;
@@ -514,6 +551,7 @@ ParseConfig
 				if ( strcmp( elem->string, keySpec->name ) == 0 )
 					{
 					DomainAuthInfo	*	authInfo = malloc( sizeof( DomainAuthInfo ) );
+					domainname			algorithm;
 					mDNSs32				keylen;
 					require_action( authInfo, exit, err = 1 );
 					memset( authInfo, 0, sizeof( DomainAuthInfo ) );
@@ -521,7 +559,10 @@ ParseConfig
 					ok = MakeDomainNameFromDNSNameString( &authInfo->keyname, keySpec->name );
 					if (!ok) { free(authInfo); err = 1; goto exit; }
 
-					keylen = DNSDigest_ConstructHMACKeyfromBase64( authInfo, keySpec->secret );
+					ok = MakeDomainNameFromDNSNameString( &algorithm, keySpec->algorithm );
+					if (!ok) { free(authInfo); err = 1; goto exit; }
+
+					keylen = DNSDigest_ConstructHMACKeyWithAlgorithm( authInfo, &algorithm, keySpec->secret );
 					if (keylen < 0) { free(authInfo); err = 1; goto exit; }
 
 					authInfo->next = zone->queryKeys;
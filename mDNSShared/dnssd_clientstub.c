@@ -92,6 +92,12 @@
 #define CTL_PATH_PREFIX "/var/tmp/dnssd_result_socket."
 #endif
 
+// Where SO_NOSIGPIPE is not available (e.g. Linux), ask for the same per-send, so that writing to
+// a connection the daemon has dropped fails with EPIPE instead of killing a long-lived client
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 typedef struct
 	{
 	ipc_msg_hdr         ipc_hdr;
@@ -127,8 +133,16 @@ struct _DNSServiceRef_t
 	ProcessReplyFn   ProcessReply;		// Function pointer to the code to handle received messages
 	void            *AppCallback;		// Client callback function and context
 	void            *AppContext;
+	char            *rbuf;				// Receive buffer (primary only); messages are parsed in place from here
+	uint32_t         rbufsize;			// Bytes allocated for rbuf
+	uint32_t         rbufstart;			// Offset of first unconsumed byte in rbuf
+	uint32_t         rbufend;			// Offset just past last byte received into rbuf
+	char            *rbufbusy;			// Buffer the message being delivered to the client lives in, or NULL
 	};
 
+// Initial size of a DNSServiceRef's receive buffer; it is grown if a single message won't fit
+#define DNSSD_RECV_BUF_SIZE 16384
+
 struct _DNSRecordRef_t
 	{
 	void *AppContext;
@@ -145,7 +159,7 @@ static int write_all(dnssd_sock_t sd, char *buf, size_t len)
 	//if (send(sd, buf, len, MSG_WAITALL) != len) return -1;
 	while (len)
 		{
-		ssize_t num_written = send(sd, buf, (long)len, 0);
+		ssize_t num_written = send(sd, buf, (long)len, MSG_NOSIGNAL);
 		if (num_written < 0 || (size_t)num_written > len)
 			{
 			// Should never happen. If it does, it indicates some OS bug,
@@ -204,6 +218,54 @@ static int more_bytes(dnssd_sock_t sd)
 	return(select((int)sd+1, &readfds, (fd_set*)NULL, (fd_set*)NULL, &tv) > 0);
 	}
 
+// Make sure sdr's receive buffer holds at least len unconsumed bytes, reading from the socket as necessary.
+// Each recv() asks for as much as will fit in the buffer, so a burst of replies from the daemon is
+// normally picked up with a single system call. Returns the same codes as read_all().
+static int read_buffered(DNSServiceOp *sdr, uint32_t len)
+	{
+	if (sdr->rbufstart == sdr->rbufend) sdr->rbufstart = sdr->rbufend = 0;
+
+	while (sdr->rbufend - sdr->rbufstart < len)
+		{
+		ssize_t num_read;
+		if (sdr->rbufsize - sdr->rbufstart < len)	// Not enough room to finish this message where it is
+			{
+			if (sdr->rbufstart)
+				{
+				memmove(sdr->rbuf, sdr->rbuf + sdr->rbufstart, sdr->rbufend - sdr->rbufstart);
+				sdr->rbufend  -= sdr->rbufstart;
+				sdr->rbufstart = 0;
+				}
+			if (sdr->rbufsize < len)
+				{
+				uint32_t newsize = len > DNSSD_RECV_BUF_SIZE ? len : DNSSD_RECV_BUF_SIZE;
+				char *newbuf = realloc(sdr->rbuf, newsize);
+				if (!newbuf) { syslog(LOG_WARNING, "dnssd_clientstub read_buffered: realloc(%u) failed", newsize); return read_all_fail; }
+				sdr->rbuf     = newbuf;
+				sdr->rbufsize = newsize;
+				}
+			}
+		num_read = recv(sdr->sockfd, sdr->rbuf + sdr->rbufend, (int)(sdr->rbufsize - sdr->rbufend), 0);
+		if (num_read <= 0)
+			{
+			// Should never happen. If it does, it indicates some OS bug,
+			// or that the mDNSResponder daemon crashed (which should never happen).
+#if defined(WIN32)
+			// <rdar://problem/7481776> Suppress logs for "A non-blocking socket operation
+			//                          could not be completed immediately"
+			if (WSAGetLastError() != WSAEWOULDBLOCK)
+#endif
+			syslog(LOG_WARNING, "dnssd_clientstub read_buffered(%d) failed %ld/%ld %d %s", sdr->sockfd,
+				(long)num_read, (long)(len - (sdr->rbufend - sdr->rbufstart)),
+				(num_read < 0) ? dnssd_errno                 : 0,
+				(num_read < 0) ? dnssd_strerror(dnssd_errno) : "");
+			return (num_read < 0 && dnssd_errno == dnssd_EWOULDBLOCK) ? read_all_wouldblock : read_all_fail;
+			}
+		sdr->rbufend += (uint32_t)num_read;
+		}
+	return read_all_success;
+	}
+
 /* create_hdr
  *
  * allocate and initialize an ipc message header. Value of len should initially be the
@@ -280,10 +342,15 @@ static void FreeDNSServiceOp(DNSServiceOp *x)
 		x->op           = request_op_none;
 		x->max_index    = 0;
 		x->logcounter   = 0;
+		// If DNSServiceProcessResult is in the middle of a callback for this DNSServiceRef, the message being
+		// delivered lives in rbufbusy, which DNSServiceProcessResult frees once the callback has returned
+		if (x->rbuf != x->rbufbusy) free(x->rbuf);
+		x->rbufbusy     = NULL;
 		x->moreptr      = NULL;
 		x->ProcessReply = NULL;
 		x->AppCallback  = NULL;
 		x->AppContext   = NULL;
+		x->rbuf         = NULL;
 		free(x);
 		}
 	}
@@ -344,6 +411,11 @@ static DNSServiceErrorType ConnectToServer(DNSServiceRef *ref, DNSServiceFlags f
 	sdr->ProcessReply  = ProcessReply;
 	sdr->AppCallback   = AppCallback;
 	sdr->AppContext    = AppContext;
+	sdr->rbuf          = NULL;
+	sdr->rbufsize      = 0;
+	sdr->rbufstart     = 0;
+	sdr->rbufend       = 0;
+	sdr->rbufbusy      = NULL;
 
 	if (flags & kDNSServiceFlagsShareConnection)
 		{
@@ -589,7 +661,7 @@ static DNSServiceErrorType deliver_request(ipc_msg_hdr *hdr, DNSServiceOp *sdr)
 			(long)((char*)CMSG_DATA(cmsg) + 4 - cbuf));
 #endif // DEBUG_64BIT_SCM_RIGHTS
 
-		if (sendmsg(sdr->sockfd, &msg, 0) < 0)
+		if (sendmsg(sdr->sockfd, &msg, MSG_NOSIGNAL) < 0)
 			{
 			syslog(LOG_WARNING, "dnssd_clientstub deliver_request ERROR: sendmsg failed read sd=%d write sd=%d errno %d (%s)",
 				errsd, listenfd, dnssd_errno, dnssd_strerror(dnssd_errno));
@@ -662,6 +734,8 @@ int DNSSD_API DNSServiceRefSockFD(DNSServiceRef sdRef)
 DNSServiceErrorType DNSSD_API DNSServiceProcessResult(DNSServiceRef sdRef)
 	{
 	int morebytes = 0;
+	int *outermore;
+	char *outerbusy;
 
 	if (!sdRef) { syslog(LOG_WARNING, "dnssd_clientstub DNSServiceProcessResult called with NULL DNSServiceRef"); return kDNSServiceErr_BadParam; }
 
@@ -685,16 +759,42 @@ DNSServiceErrorType DNSSD_API DNSServiceProcessResult(DNSServiceRef sdRef)
 		return kDNSServiceErr_BadReference;
 		}
 
+	// If we've been called from inside a callback, the caller's message is still in use in rbuf, so we mustn't
+	// move, reuse or free it. Leave it to the outer DNSServiceProcessResult, and move whatever hasn't been
+	// consumed yet to a buffer of our own.
+	outermore = sdRef->moreptr;
+	outerbusy = sdRef->rbufbusy;
+	if (outermore && sdRef->rbuf == outerbusy)
+		{
+		uint32_t len = sdRef->rbufend - sdRef->rbufstart;
+		char *newbuf = NULL;
+		if (len)
+			{
+			newbuf = malloc(len);
+			if (!newbuf) return kDNSServiceErr_NoMemory;
+			memcpy(newbuf, sdRef->rbuf + sdRef->rbufstart, len);
+			}
+		sdRef->rbuf      = newbuf;
+		sdRef->rbufsize  = len;
+		sdRef->rbufstart = 0;
+		sdRef->rbufend   = len;
+		}
+
+	// Replies are read into the DNSServiceRef's receive buffer as many at a time as the socket will give us,
+	// and each one is handed to ProcessReply straight from the buffer. We keep going until we've delivered
+	// every complete message we've received, since the application's select() can't tell us about those.
 	do
 		{
 		CallbackHeader cbh;
-		char *data;
+		const char *data, *end;
+		char *rbuf;
+		int more;
 	
 		// return NoError on EWOULDBLOCK. This will handle the case
 		// where a non-blocking socket is told there is data, but it was a false positive.
-		// On error, read_all will write a message to syslog for us, so don't need to duplicate that here
+		// On error, read_buffered will write a message to syslog for us, so don't need to duplicate that here
 		// Note: If we want to properly support using non-blocking sockets in the future 
-		int result = read_all(sdRef->sockfd, (void *)&cbh.ipc_hdr, sizeof(cbh.ipc_hdr));
+		int result = read_buffered(sdRef, sizeof(cbh.ipc_hdr));
 		if (result == read_all_fail)
 			{
 			sdRef->ProcessReply = NULL;
@@ -710,6 +810,7 @@ DNSServiceErrorType DNSSD_API DNSServiceProcessResult(DNSServiceRef sdRef)
 			return kDNSServiceErr_NoError;
 			}
 	
+		memcpy(&cbh.ipc_hdr, sdRef->rbuf + sdRef->rbufstart, sizeof(cbh.ipc_hdr));
 		ConvertHeaderBytes(&cbh.ipc_hdr);
 		if (cbh.ipc_hdr.version != VERSION)
 			{
@@ -717,43 +818,54 @@ DNSServiceErrorType DNSSD_API DNSServiceProcessResult(DNSServiceRef sdRef)
 			sdRef->ProcessReply = NULL;
 			return kDNSServiceErr_Incompatible;
 			}
+		if (cbh.ipc_hdr.datalen > 0x7FFFFFFF - sizeof(cbh.ipc_hdr))
+			{
+			sdRef->ProcessReply = NULL;
+			return kDNSServiceErr_NoMemory;
+			}
 	
-		data = malloc(cbh.ipc_hdr.datalen);
-		if (!data) return kDNSServiceErr_NoMemory;
-		if (read_all(sdRef->sockfd, data, cbh.ipc_hdr.datalen) < 0) // On error, read_all will write a message to syslog for us
+		// On error, read_buffered will write a message to syslog for us
+		if (read_buffered(sdRef, sizeof(cbh.ipc_hdr) + cbh.ipc_hdr.datalen) < 0)
 			{
-			free(data);
 			sdRef->ProcessReply = NULL;
 			return kDNSServiceErr_ServiceNotRunning;
 			}
-		else
+
+		// Consume the message before making the callback, in case the client calls DNSServiceProcessResult again from inside it
+		rbuf = sdRef->rbuf;
+		data = rbuf + sdRef->rbufstart + sizeof(cbh.ipc_hdr);
+		end  = data + cbh.ipc_hdr.datalen;
+		sdRef->rbufstart += sizeof(cbh.ipc_hdr) + cbh.ipc_hdr.datalen;
+
+		cbh.cb_flags     = get_flags     (&data, end);
+		cbh.cb_interface = get_uint32    (&data, end);
+		cbh.cb_err       = get_error_code(&data, end);
+
+		// There's more coming if we still have buffered bytes, or if our last recv() filled the
+		// buffer right up, in which case we check the socket to see whether there's more waiting
+		more = (sdRef->rbufstart != sdRef->rbufend) || (sdRef->rbufend == sdRef->rbufsize && more_bytes(sdRef->sockfd));
+		if (more) cbh.cb_flags |= kDNSServiceFlagsMoreComing;
+
+		// CAUTION: We have to handle the case where the client calls DNSServiceRefDeallocate from within the callback function.
+		// To do this we set moreptr to point to morebytes. If the client does call DNSServiceRefDeallocate(),
+		// then that routine will clear morebytes for us, and cause us to exit our loop. In that case the
+		// DNSServiceRef is gone, but the buffer data points into has been left for us to free, and if we're
+		// nested inside another DNSServiceProcessResult we have to tell that one too.
+		morebytes = 1;
+		sdRef->moreptr  = &morebytes;
+		sdRef->rbufbusy = rbuf;
+		if (data) sdRef->ProcessReply(sdRef, &cbh, data, end);
+		if (!morebytes) { free(rbuf); if (outermore) *outermore = 0; break; }
+		sdRef->moreptr  = outermore;
+		sdRef->rbufbusy = outerbusy;
+
+		// If the callback called us again, that call took over the rest of what we'd buffered, and may have used it up
+		if (sdRef->rbuf != rbuf)
 			{
-			const char *ptr = data;
-			cbh.cb_flags     = get_flags     (&ptr, data + cbh.ipc_hdr.datalen);
-			cbh.cb_interface = get_uint32    (&ptr, data + cbh.ipc_hdr.datalen);
-			cbh.cb_err       = get_error_code(&ptr, data + cbh.ipc_hdr.datalen);
-
-			// CAUTION: We have to handle the case where the client calls DNSServiceRefDeallocate from within the callback function.
-			// To do this we set moreptr to point to morebytes. If the client does call DNSServiceRefDeallocate(),
-			// then that routine will clear morebytes for us, and cause us to exit our loop.
-			morebytes = more_bytes(sdRef->sockfd);
-			if (morebytes)
-				{
-				cbh.cb_flags |= kDNSServiceFlagsMoreComing;
-				sdRef->moreptr = &morebytes;
-				}
-			if (ptr) sdRef->ProcessReply(sdRef, &cbh, ptr, data + cbh.ipc_hdr.datalen);
-			// Careful code here:
-			// If morebytes is non-zero, that means we set sdRef->moreptr above, and the operation was not
-			// cancelled out from under us, so now we need to clear sdRef->moreptr so we don't leave a stray
-			// dangling pointer pointing to a long-gone stack variable.
-			// If morebytes is zero, then one of two thing happened:
-			// (a) morebytes was 0 above, so we didn't set sdRef->moreptr, so we don't need to clear it
-			// (b) morebytes was 1 above, and we set sdRef->moreptr, but the operation was cancelled (with DNSServiceRefDeallocate()),
-			//     so we MUST NOT try to dereference our stale sdRef pointer.
-			if (morebytes) sdRef->moreptr = NULL;
+			free(rbuf);
+			more = (sdRef->rbufstart != sdRef->rbufend) || more_bytes(sdRef->sockfd);
 			}
-		free(data);
+		morebytes = more;
 		} while (morebytes);
 
 	return kDNSServiceErr_NoError;
@@ -25,6 +25,8 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/uio.h>
+#include <limits.h>
 #endif
 
 #include <stdlib.h>
@@ -124,8 +126,15 @@ struct request_state
 	mDNSs32 time_blocked;			// record time of a blocked client
 	int unresponsiveness_reports;
 	struct reply_state *replies;	// corresponding (active) reply list
+	struct reply_state *lastreply;	// tail of replies list; only meaningful when replies is non-NULL
 	req_termination_fn terminate;
 
+	// Event bookkeeping, so udsserver_idle only has to look at requests that actually need attention
+	request_state *nextdirty;		// link in dirty_requests or blocked_requests list
+	mDNSBool       dirty;			// true when this request is on one of those lists
+	request_state *nexttimer;		// link in timed_requests list
+	mDNSs32        timerdue;		// time udsserver_idle next needs to look at this request (0 if none)
+
 	union
 		{
 		registered_record_entry *reg_recs;  // list of registrations for a connection-oriented request
@@ -204,7 +213,7 @@ typedef struct reply_state
 	struct reply_state *next;		// If there are multiple unsent replies
 	mDNSu32 totallen;
 	mDNSu32 nwriten;
-	ipc_msg_hdr mhdr[1];
+	ipc_msg_hdr mhdr[1];			// Note: Converted to NETWORK byte order by append_reply()
 	reply_hdr rhdr[1];
 	} reply_state;
 
@@ -220,6 +229,10 @@ mDNSexport const char ProgramName[] = "mDNSResponder";
 
 static dnssd_sock_t listenfd = dnssd_InvalidSocket;
 static request_state *all_requests = NULL;
+static request_state *dirty_requests = NULL;		// Requests with queued replies or an expired timer, waiting for udsserver_idle
+static request_state *blocked_requests = NULL;		// Requests udsserver_idle couldn't finish; moved back to dirty_requests afterwards
+static request_state *timed_requests = NULL;		// Requests with a non-zero timerdue
+static mDNSs32 NextRequestTimer;					// Earliest timerdue in timed_requests
 
 static DNameListElem *SCPrefBrowseDomains;			// List of automatic browsing domains read from SCPreferences for "empty string" browsing
 static ARListElem    *LocalDomainEnumRecords;		// List of locally-generated PTR records to augment those we learn from the network
@@ -263,11 +276,53 @@ mDNSlocal void my_perror(char *errmsg)
 	LogMsg("%s: %d (%s)", errmsg, dnssd_errno, dnssd_strerror(dnssd_errno));
 	}
 
+// Puts a request on the list of requests udsserver_idle() needs to service
+mDNSlocal void MarkRequestDirty(request_state *req)
+	{
+	if (req->dirty) return;
+	req->dirty     = mDNStrue;
+	req->nextdirty = dirty_requests;
+	dirty_requests = req;
+	}
+
+// Asks udsserver_idle() to service this request at (or shortly after) the given time
+mDNSlocal void SetRequestTimer(request_state *req, mDNSs32 when)
+	{
+	when = NonZeroTime(when);
+	if (!req->timerdue) { req->nexttimer = timed_requests; timed_requests = req; }
+	req->timerdue = when;
+	if (timed_requests == req && !req->nexttimer) NextRequestTimer = when;
+	else if (NextRequestTimer - when > 0)          NextRequestTimer = when;
+	}
+
+// Removes a request from the dirty and timer lists, so nothing refers to it once it's freed
+mDNSlocal void CancelRequestEvents(request_state *req)
+	{
+	if (req->dirty)
+		{
+		request_state **p = &dirty_requests;
+		while (*p && *p != req) p = &(*p)->nextdirty;
+		if (!*p) { p = &blocked_requests; while (*p && *p != req) p = &(*p)->nextdirty; }
+		if (*p) *p = req->nextdirty;
+		else LogMsg("CancelRequestEvents: ERROR: %p marked dirty but not in list", req);
+		req->dirty = mDNSfalse;
+		}
+	if (req->timerdue)
+		{
+		request_state **p = &timed_requests;
+		while (*p && *p != req) p = &(*p)->nexttimer;
+		if (*p) *p = req->nexttimer;
+		req->timerdue = 0;		// NextRequestTimer may now be early; udsserver_idle will just recompute it
+		}
+	}
+
 mDNSlocal void abort_request(request_state *req)
 	{
 	if (req->terminate == (req_termination_fn)~0)
 		{ LogMsg("abort_request: ERROR: Attempt to abort operation %p with req->terminate %p", req, req->terminate); return; }
 	
+	CancelRequestEvents(req);
+
 	// First stop whatever mDNSCore operation we were doing
 	if (req->terminate) req->terminate(req);
 
@@ -286,7 +341,7 @@ mDNSlocal void abort_request(request_state *req)
 			{
 			reply_state *ptr = req->replies;
 			req->replies = req->replies->next;
-			freeL("reply_state (abort)", ptr);
+			mDNSPlatformMemFree(ptr);
 			}
 		}
 
@@ -307,7 +362,7 @@ mDNSlocal void AbortUnlinkAndFree(request_state *req)
 	request_state **p = &all_requests;
 	abort_request(req);
 	while (*p && *p != req) p=&(*p)->next;
-	if (*p) { *p = req->next; freeL("request_state/AbortUnlinkAndFree", req); }
+	if (*p) { *p = req->next; mDNSPlatformMemFree(req); }
 	else LogMsg("AbortUnlinkAndFree: ERROR: Attempt to abort operation %p not in list", req);
 	}
 
@@ -321,7 +376,7 @@ mDNSlocal reply_state *create_reply(const reply_op_t op, const size_t datalen, r
 		return NULL;
 		}
 
-	reply = mallocL("reply_state", sizeof(reply_state) + datalen - sizeof(reply_hdr));
+	reply = mDNSPlatformMemAllocate(sizeof(reply_state) + datalen - sizeof(reply_hdr));
 	if (!reply) FatalError("ERROR: malloc");
 	
 	reply->next     = mDNSNULL;
@@ -340,13 +395,17 @@ mDNSlocal reply_state *create_reply(const reply_op_t op, const size_t datalen, r
 
 // Append a reply to the list in a request object
 // If our request is sharing a connection, then we append our reply_state onto the primary's list
+// The message header is put into network byte order here, once, so that from now on the reply
+// is a ready-to-send byte image and send_msg() can hand it straight to the kernel
 mDNSlocal void append_reply(request_state *req, reply_state *rep)
 	{
 	request_state *r = req->primary ? req->primary : req;
-	reply_state **ptr = &r->replies;
-	while (*ptr) ptr = &(*ptr)->next;
-	*ptr = rep;
+	ConvertHeaderBytes(rep->mhdr);
 	rep->next = NULL;
+	if (r->replies) r->lastreply->next = rep;
+	else            r->replies         = rep;
+	r->lastreply = rep;
+	MarkRequestDirty(r);
 	}
 
 // Generates a response message giving name, type, domain, plus interface index,
@@ -783,7 +842,7 @@ mDNSlocal void connection_termination(request_state *request)
 			if (tmp->replies)        LogMsg("connection_termination ERROR How can subordinate req %p %d have replies queued?", tmp, tmp->sd);
 			abort_request(tmp);
 			*req = tmp->next;
-			freeL("request_state/connection_termination", tmp);
+			mDNSPlatformMemFree(tmp);
 			}
 		else
 			req = &(*req)->next;
@@ -813,7 +872,7 @@ mDNSlocal void handle_cancel_request(request_state *request)
 			request_state *tmp = *req;
 			abort_request(tmp);
 			*req = tmp->next;
-			freeL("request_state/handle_cancel_request", tmp);
+			mDNSPlatformMemFree(tmp);
 			}
 		else
 			req = &(*req)->next;
@@ -2008,6 +2067,7 @@ mDNSlocal mStatus handle_resolve_request(request_state *request)
 	request->u.resolve.qtxt.QuestionContext  = request;
 
 	request->u.resolve.ReportTime            = NonZeroTime(mDNS_TimeNow(&mDNSStorage) + 130 * mDNSPlatformOneSecond);
+	SetRequestTimer(request, request->u.resolve.ReportTime);
 
 #if 0
 	if (!AuthorizedDomain(request, &fqdn, AutoBrowseDomains))	return(mStatus_NoError);
@@ -2628,7 +2688,7 @@ mDNSlocal request_state *NewRequest(void)
 	{
 	request_state **p = &all_requests;
 	while (*p) p=&(*p)->next;
-	*p = mallocL("request_state", sizeof(request_state));
+	*p = mDNSPlatformMemAllocate(sizeof(request_state));
 	if (!*p) FatalError("ERROR: malloc");
 	mDNSPlatformMemZero(*p, sizeof(request_state));
 	return(*p);
@@ -2677,7 +2737,7 @@ mDNSlocal void read_msg(request_state *req)
 			// for other overhead, this means any message above 70kB is definitely bogus.
 			if (req->hdr.datalen > 70000)
 				{ LogMsg("%3d: ERROR: read_msg - hdr.datalen %lu (%X) > 70000", req->sd, req->hdr.datalen, req->hdr.datalen); req->ts = t_error; return; }
-			req->msgbuf = mallocL("request_state msgbuf", req->hdr.datalen + MSG_PAD_BYTES);
+			req->msgbuf = mDNSPlatformMemAllocate(req->hdr.datalen + MSG_PAD_BYTES);
 			if (!req->msgbuf) { my_perror("ERROR: malloc"); req->ts = t_error; return; }
 			req->msgptr = req->msgbuf;
 			req->msgend = req->msgbuf + req->hdr.datalen;
@@ -2720,8 +2780,10 @@ mDNSlocal void read_msg(request_state *req)
 		LogMsg("%3d: Expecting %d %d %d %d", req->sd, sizeof(cbuf),       sizeof(cbuf),   SOL_SOCKET,       SCM_RIGHTS);
 		LogMsg("%3d: Got       %d %d %d %d", req->sd, msg.msg_controllen, cmsg->cmsg_len, cmsg->cmsg_level, cmsg->cmsg_type);
 #endif // DEBUG_64BIT_SCM_RIGHTS
+		// The client sends a cmsg_len of CMSG_LEN, which is smaller than CMSG_SPACE
+		// on platforms that pad the cmsghdr (e.g. 64-bit Linux)
 		if (msg.msg_controllen == sizeof(cbuf) &&
-			cmsg->cmsg_len     == sizeof(cbuf) &&
+			cmsg->cmsg_len     == CMSG_LEN(sizeof(dnssd_sock_t)) &&
 			cmsg->cmsg_level   == SOL_SOCKET   &&
 			cmsg->cmsg_type    == SCM_RIGHTS)
 			{
@@ -2935,7 +2997,7 @@ mDNSlocal void request_callback(int fd, short filter, void *info)
 		}
 
 	// req->msgbuf may be NULL, e.g. for connection_request or remove_record_request
-	if (req->msgbuf) freeL("request_state msgbuf", req->msgbuf);
+	if (req->msgbuf) mDNSPlatformMemFree(req->msgbuf);
 
 	// There's no return data for a cancel request (DNSServiceRefDeallocate returns no result)
 	// For a DNSServiceGetProperty call, the handler already generated the response, so no need to do it again here
@@ -3286,7 +3348,7 @@ mDNSlocal void LogAuthRecords(mDNS *const m, const mDNSs32 now, AuthRecord *Reso
 mDNSexport void udsserver_info(mDNS *const m)
 	{
 	const mDNSs32 now = mDNS_TimeNow(m);
-	mDNSu32 CacheUsed = 0, CacheActive = 0, slot;
+	mDNSu32 CacheUsed = 0, CacheActive = 0, CacheGroups = 0, LongestChain = 0, slot;
 	int ProxyA = 0, ProxyD = 0;
 	const CacheGroup *cg;
 	const CacheRecord *cr;
@@ -3297,9 +3359,13 @@ mDNSexport void udsserver_info(mDNS *const m)
 	LogMsgNoIdent("------------ Cache -------------");
 
 	LogMsgNoIdent("Slt Q     TTL if     U Type rdlen");
-	for (slot = 0; slot < CACHE_HASH_SLOTS; slot++)
-		for (cg = m->rrcache_hash[slot]; cg; cg=cg->next)
+	for (slot = 0; slot < CacheHashSlots(m); slot++)
+		{
+		mDNSu32 chain = 0;
+		for (cg = *CacheHashBucket(m, slot); cg; cg=cg->next)
 			{
+			chain++;
+			CacheGroups++;
 			CacheUsed++;	// Count one cache entity for the CacheGroup object
 			for (cr = cg->members; cr; cr=cr->next)
 				{
@@ -3323,12 +3389,22 @@ mDNSexport void udsserver_info(mDNS *const m)
 				usleep((m->KnownBugs & mDNS_KnownBug_LossySyslog) ? 3333 : 1000);
 				}
 			}
+		if (LongestChain < chain) LongestChain = chain;
+		}
 
 	if (m->rrcache_totalused != CacheUsed)
 		LogMsgNoIdent("Cache use mismatch: rrcache_totalused is %lu, true count %lu", m->rrcache_totalused, CacheUsed);
 	if (m->rrcache_active != CacheActive)
 		LogMsgNoIdent("Cache use mismatch: rrcache_active is %lu, true count %lu", m->rrcache_active, CacheActive);
 	LogMsgNoIdent("Cache currently contains %lu entities; %lu referenced by active questions", CacheUsed, CacheActive);
+	LogMsgNoIdent("Cache hash has %lu slots; %lu names; longest chain %lu; %lu resizes",
+		m->rrcache_hashslots, CacheGroups, LongestChain, m->rrcache_rehashes);
+	if (m->rrcache_budget)
+		LogMsgNoIdent("Cache budget %lu entities; %lu records recycled", m->rrcache_budget, m->rrcache_evicted);
+	else
+		LogMsgNoIdent("Cache has no budget; %lu records recycled", m->rrcache_evicted);
+	if (m->rrcache_oldhashslots)
+		LogMsgNoIdent("Cache hash resize in progress: %lu of %lu old slots migrated", m->rrcache_rehashslot, m->rrcache_oldhashslots);
 
 	LogMsgNoIdent("--------- Auth Records ---------");
 	LogAuthRecords(m, now, m->ResourceRecords, &ProxyA);
@@ -3531,15 +3607,56 @@ mDNSexport void uds_validatelists(void)
 	}
 #endif // APPLE_OSX_mDNSResponder && MACOSX_MDNS_MALLOC_DEBUGGING
 
+// Upper limit on the number of queued replies we coalesce into a single sendmsg() call
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define MAX_REPLY_BATCH IOV_MAX
+#else
+#define MAX_REPLY_BATCH 64
+#endif
+
+// Sends as much of the reply queue as the socket will accept, gathering up to MAX_REPLY_BATCH
+// waiting replies into one sendmsg() call. Replies that were written completely are freed;
+// a partially-written reply stays at the head of the list with its nwriten count advanced.
+// Returns t_complete if everything we offered was written (there may still be more queued),
+// t_morecoming if the socket buffer filled up, or t_terminated/t_error on failure.
 mDNSlocal int send_msg(request_state *const req)
 	{
-	reply_state *const rep = req->replies;		// Send the first waiting reply
+	reply_state *rep;
+	mDNSu32 offered = 0, written;
 	ssize_t nwriten;
-	if (req->no_reply) return(t_complete);
 
-	ConvertHeaderBytes(rep->mhdr);
-	nwriten = send(req->sd, (char *)&rep->mhdr + rep->nwriten, rep->totallen - rep->nwriten, 0);
-	ConvertHeaderBytes(rep->mhdr);
+	if (req->no_reply)
+		{
+		while (req->replies) { rep = req->replies; req->replies = rep->next; mDNSPlatformMemFree(rep); }
+		return(t_complete);
+		}
+
+#if defined(_WIN32)
+	rep = req->replies;
+	if (rep->next) rep->rhdr->flags |= dnssd_htonl(kDNSServiceFlagsMoreComing);
+	offered = rep->totallen - rep->nwriten;
+	nwriten = send(req->sd, (char *)rep->mhdr + rep->nwriten, offered, 0);
+#else
+	{
+	struct iovec iov[MAX_REPLY_BATCH];
+	struct msghdr msg;
+	int n = 0;
+	for (rep = req->replies; rep && n < MAX_REPLY_BATCH; rep = rep->next)
+		{
+		// Every reply that has a successor on the queue tells the client there's more coming;
+		// this holds across batch boundaries because we look at the whole list, not just this batch
+		if (rep->next) rep->rhdr->flags |= dnssd_htonl(kDNSServiceFlagsMoreComing);
+		iov[n].iov_base = (char *)rep->mhdr + rep->nwriten;
+		iov[n].iov_len  = rep->totallen - rep->nwriten;
+		offered += rep->totallen - rep->nwriten;
+		n++;
+		}
+	mDNSPlatformMemZero(&msg, sizeof(msg));
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = n;
+	nwriten = sendmsg(req->sd, &msg, 0);
+	}
+#endif
 
 	if (nwriten < 0)
 		{
@@ -3552,24 +3669,66 @@ mDNSlocal int send_msg(request_state *const req)
 			else
 #endif
 				{
-				LogMsg("send_msg ERROR: failed to write %d of %d bytes to fd %d errno %d (%s)",
-					rep->totallen - rep->nwriten, rep->totallen, req->sd, dnssd_errno, dnssd_strerror(dnssd_errno));
+				LogMsg("send_msg ERROR: failed to write %d bytes to fd %d errno %d (%s)",
+					offered, req->sd, dnssd_errno, dnssd_strerror(dnssd_errno));
 				return(t_error);
 				}
 			}
 		}
-	rep->nwriten += nwriten;
-	return (rep->nwriten == rep->totallen) ? t_complete : t_morecoming;
+
+	// Retire the replies the kernel took in full, and note how far we got into the next one
+	written = (mDNSu32)nwriten;
+	while (written)
+		{
+		mDNSu32 remaining;
+		rep = req->replies;
+		remaining = rep->totallen - rep->nwriten;
+		if (written < remaining) { rep->nwriten += written; break; }
+		written -= remaining;
+		req->replies = rep->next;
+		mDNSPlatformMemFree(rep);
+		req->time_blocked = 0; // reset failure counter after successful send
+		req->unresponsiveness_reports = 0;
+		}
+
+	return((mDNSu32)nwriten == offered ? t_complete : t_morecoming);
 	}
 
+// Only requests on the dirty_requests list are examined here: those that have gained replies, whose
+// timer has fired, or which still have unsent replies from last time because the client isn't reading.
 mDNSexport mDNSs32 udsserver_idle(mDNSs32 nextevent)
 	{
 	mDNSs32 now = mDNS_TimeNow(&mDNSStorage);
-	request_state **req = &all_requests;
 
-	while (*req)
+	if (timed_requests && now - NextRequestTimer >= 0)
 		{
-		request_state *const r = *req;
+		request_state **p = &timed_requests;
+		NextRequestTimer = now + 0x3FFFFFFF;
+		while (*p)
+			{
+			request_state *const r = *p;
+			if (now - r->timerdue >= 0)
+				{
+				*p = r->nexttimer;
+				r->timerdue = 0;
+				MarkRequestDirty(r);
+				}
+			else
+				{
+				if (NextRequestTimer - r->timerdue > 0) NextRequestTimer = r->timerdue;
+				p = &r->nexttimer;
+				}
+			}
+		}
+	if (timed_requests && nextevent - NextRequestTimer > 0) nextevent = NextRequestTimer;
+
+	// We always take the request off the head of dirty_requests before working on it, because
+	// aborting a request may also abort (and unlink) any of its subordinates that are on the list
+	while (dirty_requests)
+		{
+		request_state *const r = dirty_requests;
+		dirty_requests = r->nextdirty;
+		r->dirty = mDNSfalse;
 
 		if (r->terminate == resolve_termination_callback)
 			if (r->u.resolve.ReportTime && now - r->u.resolve.ReportTime >= 0)
@@ -3582,18 +3741,8 @@ mDNSexport mDNSs32 udsserver_idle(mDNSs32 nextevent)
 		// Note: Only primary req's have reply lists, not subordinate req's.
 		while (r->replies)		// Send queued replies
 			{
-			transfer_state result;
-			if (r->replies->next) r->replies->rhdr->flags |= dnssd_htonl(kDNSServiceFlagsMoreComing);
-			result = send_msg(r);	// Returns t_morecoming if buffer full because client is not reading
-			if (result == t_complete)
-				{
-				reply_state *fptr = r->replies;
-				r->replies = r->replies->next;
-				freeL("reply_state/udsserver_idle", fptr);
-				r->time_blocked = 0; // reset failure counter after successful send
-				r->unresponsiveness_reports = 0;
-				continue;
-				}
+			transfer_state result = send_msg(r);	// Returns t_morecoming if buffer full because client is not reading
+			if (result == t_complete) continue;
 			else if (result == t_terminated || result == t_error)
 				{
 				LogMsg("%3d: Could not write data to client because of error - aborting connection", r->sd);
@@ -3627,13 +3776,21 @@ mDNSexport mDNSs32 udsserver_idle(mDNSs32 nextevent)
 
 		if (!dnssd_SocketValid(r->sd)) // If this request is finished, unlink it from the list and free the memory
 			{
-			// Since we're already doing a list traversal, we unlink the request directly instead of using AbortUnlinkAndFree()
-			*req = r->next;
-			freeL("request_state/udsserver_idle", r);
+			request_state **p = &all_requests;
+			while (*p && *p != r) p = &(*p)->next;
+			if (*p) { *p = r->next; mDNSPlatformMemFree(r); }
+			else LogMsg("udsserver_idle: ERROR: Attempt to free operation %p not in list", r);
+			}
+		else if (r->replies && !r->dirty)	// Still blocked; look at it again next time around
+			{
+			r->dirty = mDNStrue;
+			r->nextdirty = blocked_requests;
+			blocked_requests = r;
 			}
-		else
-			req = &r->next;
 		}
+
+	dirty_requests   = blocked_requests;
+	blocked_requests = mDNSNULL;
 	return nextevent;
 	}
 
@@ -3645,7 +3802,7 @@ struct CompileTimeAssertionChecks_uds_daemon
 	char sizecheck_request_state          [(sizeof(request_state)           <= 2000) ? 1 : -1];
 	char sizecheck_registered_record_entry[(sizeof(registered_record_entry) <=   40) ? 1 : -1];
 	char sizecheck_service_instance       [(sizeof(service_instance)        <= 6552) ? 1 : -1];
-	char sizecheck_browser_t              [(sizeof(browser_t)               <=  1000) ? 1 : -1];
+	char sizecheck_browser_t              [(sizeof(browser_t)               <=  1040) ? 1 : -1];
 	char sizecheck_reply_hdr              [(sizeof(reply_hdr)               <=   12) ? 1 : -1];
 	char sizecheck_reply_state            [(sizeof(reply_state)             <=   64) ? 1 : -1];
 	};
@@ -1500,6 +1500,16 @@ mDNSexport void mDNSPlatformUpdateProxyList(mDNS *const m, const mDNSInterfaceID
 //	mDNSPlatformSendRawPacket
 //===========================================================================================================================
 	
+mDNSexport void mDNSPlatformBeginSendBatch(mDNS *const m)
+	{
+	DEBUG_UNUSED( m );
+	}
+
+mDNSexport void mDNSPlatformEndSendBatch(mDNS *const m)
+	{
+	DEBUG_UNUSED( m );
+	}
+
 mDNSexport void mDNSPlatformSendRawPacket(const void *const msg, const mDNSu8 *const end, mDNSInterfaceID InterfaceID)
 	{
 	DEBUG_UNUSED( msg );